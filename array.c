@@ -1027,7 +1027,7 @@ int array_dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int read
 			goto newly_connected;
 		}
 
-		vpninfo->delay_tunnel_reason = "DTLS establishing";
+		/* Traffic goes over TLS in the meantime */
 		return 0;
 	}
 
@@ -0,0 +1,306 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UCONTEXT
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/* Authentication and connection are written as straight-line code which
+ * blocks whenever it waits for the server, and there is a lot of it, for
+ * every protocol. Rather than turn all of that inside out, run it on a
+ * stack of its own. Every wait goes through vpn_select(), which comes
+ * here to switch back to the application with the fds it was waiting for.
+ * When openconnect_process() finds them ready, we switch back again and
+ * the select() returns as if nothing had happened.
+ *
+ * The stack is only address space until it's used; nearly all of it
+ * never is. The lowest page is left inaccessible, to catch overflow. */
+
+#define ASYNC_STACK	(1024 * 1024)
+#define ASYNC_CANCEL_TRIES	16
+
+struct oc_async {
+	ucontext_t caller;
+	ucontext_t co;
+	void *stack;
+	size_t stack_len;
+
+	int (*fn)(struct openconnect_info *);
+	int ret;
+	int running;		/* On our own stack, right now */
+	int finished;
+
+	/* What it's waiting for, and what happened */
+	struct oc_pollfd wait[ASYNC_MAX_WAIT];
+	int revents[ASYNC_MAX_WAIT];
+	int nr_wait;
+	long long deadline;	/* -1 for none */
+};
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* makecontext() passes only ints */
+static void async_trampoline(unsigned int hi, unsigned int lo)
+{
+	struct openconnect_info *vpninfo =
+		(void *)(uintptr_t)(((uint64_t)hi << 32) | lo);
+	struct oc_async *a = vpninfo->async;
+
+	a->ret = a->fn(vpninfo);
+	a->finished = 1;
+	/* Back to the caller through uc_link */
+}
+
+int async_running(struct openconnect_info *vpninfo)
+{
+	return vpninfo->async && vpninfo->async->running;
+}
+
+int async_select(struct openconnect_info *vpninfo, int nfds, fd_set *rd_set,
+		 fd_set *wr_set, fd_set *ex_set, struct timeval *tv)
+{
+	struct oc_async *a = vpninfo->async;
+	int fd, i, ret = 0;
+
+	a->nr_wait = 0;
+	for (fd = 0; fd < nfds; fd++) {
+		int events = 0;
+
+		if (rd_set && FD_ISSET(fd, rd_set))
+			events |= OC_FD_READ;
+		if (wr_set && FD_ISSET(fd, wr_set))
+			events |= OC_FD_WRITE;
+		if (!events)
+			continue;
+
+		if (a->nr_wait == ASYNC_MAX_WAIT) {
+			errno = EINVAL;
+			return -1;
+		}
+		a->wait[a->nr_wait].fd = fd;
+		a->wait[a->nr_wait].events = events;
+		a->revents[a->nr_wait] = 0;
+		a->nr_wait++;
+	}
+	a->deadline = tv ? now_ms() + tv->tv_sec * 1000 + tv->tv_usec / 1000 : -1;
+
+	a->running = 0;
+	swapcontext(&a->co, &a->caller);
+	a->running = 1;
+
+	if (rd_set)
+		FD_ZERO(rd_set);
+	if (wr_set)
+		FD_ZERO(wr_set);
+	if (ex_set)
+		FD_ZERO(ex_set);
+
+	for (i = 0; i < a->nr_wait; i++) {
+		if (a->revents[i] & OC_FD_READ)
+			FD_SET(a->wait[i].fd, rd_set);
+		if (a->revents[i] & OC_FD_WRITE)
+			FD_SET(a->wait[i].fd, wr_set);
+		if (a->revents[i])
+			ret++;
+	}
+	a->nr_wait = 0;
+	return ret;
+}
+
+static void async_release(struct openconnect_info *vpninfo)
+{
+	struct oc_async *a = vpninfo->async;
+
+	munmap(a->stack, a->stack_len);
+	free(a);
+	vpninfo->async = NULL;
+}
+
+/* Run until it waits, or finishes */
+static int async_resume(struct openconnect_info *vpninfo)
+{
+	struct oc_async *a = vpninfo->async;
+	int ret;
+
+	a->running = 1;
+	swapcontext(&a->caller, &a->co);
+	a->running = 0;
+
+	if (!a->finished)
+		return -EINPROGRESS;
+
+	ret = a->ret;
+	async_release(vpninfo);
+	return ret;
+}
+
+int async_start(struct openconnect_info *vpninfo,
+		int (*fn)(struct openconnect_info *))
+{
+	uint64_t p = (uintptr_t)vpninfo;
+	struct oc_async *a;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (vpninfo->async || vpninfo->ext_running)
+		return -EBUSY;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return -ENOMEM;
+
+	a->stack_len = ASYNC_STACK;
+	a->stack = mmap(NULL, a->stack_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (a->stack == MAP_FAILED) {
+		free(a);
+		return -ENOMEM;
+	}
+	mprotect(a->stack, pagesize, PROT_NONE);
+
+	if (getcontext(&a->co)) {
+		munmap(a->stack, a->stack_len);
+		free(a);
+		return -EIO;
+	}
+	a->co.uc_stack.ss_sp = a->stack;
+	a->co.uc_stack.ss_size = a->stack_len;
+	a->co.uc_link = &a->caller;
+	makecontext(&a->co, (void (*)(void))async_trampoline, 2,
+		    (unsigned int)(p >> 32), (unsigned int)p);
+
+	a->fn = fn;
+	a->deadline = -1;
+	vpninfo->async = a;
+
+	return async_resume(vpninfo);
+}
+
+int async_get_fds(struct openconnect_info *vpninfo, struct oc_pollfd *fds, int nr)
+{
+	struct oc_async *a = vpninfo->async;
+	int i;
+
+	for (i = 0; i < a->nr_wait && i < nr; i++)
+		fds[i] = a->wait[i];
+	return a->nr_wait;
+}
+
+int async_get_timeout(struct openconnect_info *vpninfo)
+{
+	long long left;
+
+	if (vpninfo->async->deadline < 0)
+		return -1;
+
+	left = vpninfo->async->deadline - now_ms();
+	return left > 0 ? (int)left : 0;
+}
+
+int async_process(struct openconnect_info *vpninfo,
+		  const int *readable, int nr_readable,
+		  const int *writable, int nr_writable)
+{
+	struct oc_async *a = vpninfo->async;
+	int i, j, ready = 0;
+
+	for (i = 0; i < a->nr_wait; i++) {
+		for (j = 0; j < nr_readable; j++) {
+			if (readable[j] == a->wait[i].fd)
+				a->revents[i] |= a->wait[i].events & OC_FD_READ;
+		}
+		for (j = 0; j < nr_writable; j++) {
+			if (writable[j] == a->wait[i].fd)
+				a->revents[i] |= a->wait[i].events & OC_FD_WRITE;
+		}
+		if (a->revents[i])
+			ready = 1;
+	}
+
+	if (!ready && (a->deadline < 0 || now_ms() < a->deadline))
+		return -EINPROGRESS;
+
+	return async_resume(vpninfo);
+}
+
+/* Unwind it as if the user had cancelled it through the cmd_fd, so that
+ * it closes its sockets and frees what it allocated on the way out. Each
+ * wait sees the cancel as soon as it returns. If it still doesn't finish,
+ * it has to be abandoned, but not with a connection to the server open. */
+void async_free(struct openconnect_info *vpninfo)
+{
+	int got_cancel = vpninfo->got_cancel_cmd;
+	char cancel_type = vpninfo->cancel_type;
+	int tries;
+
+	if (!vpninfo->async || vpninfo->async->running)
+		return;
+
+	for (tries = 0; vpninfo->async && tries < ASYNC_CANCEL_TRIES; tries++) {
+		vpninfo->got_cancel_cmd = 1;
+		vpninfo->cancel_type = OC_CMD_CANCEL;
+		async_resume(vpninfo);
+	}
+	vpninfo->got_cancel_cmd = got_cancel;
+	vpninfo->cancel_type = cancel_type;
+
+	if (vpninfo->async) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Abandoning operation which didn't cancel\n"));
+		openconnect_close_https(vpninfo, 0);
+		async_release(vpninfo);
+	}
+}
+
+int openconnect_obtain_cookie_start(struct openconnect_info *vpninfo)
+{
+	return async_start(vpninfo, openconnect_obtain_cookie);
+}
+
+int openconnect_make_cstp_connection_start(struct openconnect_info *vpninfo)
+{
+	return async_start(vpninfo, openconnect_make_cstp_connection);
+}
+
+#else /* !HAVE_UCONTEXT */
+
+int openconnect_obtain_cookie_start(struct openconnect_info *vpninfo)
+{
+	return -EOPNOTSUPP;
+}
+
+int openconnect_make_cstp_connection_start(struct openconnect_info *vpninfo)
+{
+	return -EOPNOTSUPP;
+}
+#endif
@@ -24,6 +24,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 
 struct login_context {
 	char *username;				/* Username that has already succeeded in some form */
@@ -390,11 +391,61 @@ err_out:
 	return -EINVAL;
 }
 
+/* Each entry has a priority, either directly or per source region:
+ *   <priority>1</priority>
+ *   <priority-rule><entry name="Any"><priority>1</priority></entry></priority-rule>
+ * We can't know which region the portal thinks we're in, so take the
+ * best of them. Lower is better; a gateway which doesn't say comes last.
+ */
+static int gateway_priority(xmlNode *xml_node)
+{
+	xmlNode *x, *x2, *x3;
+	char *s = NULL;
+	int prio = INT_MAX;
+
+	for (x = xml_node->children; x; x = x->next) {
+		if (!xmlnode_get_val(x, "priority", &s)) {
+			if (atoi(s) < prio)
+				prio = atoi(s);
+		} else if (xmlnode_is_named(x, "priority-rule")) {
+			for (x2 = x->children; x2; x2 = x2->next)
+				if (xmlnode_is_named(x2, "entry"))
+					for (x3 = x2->children; x3; x3 = x3->next)
+						if (!xmlnode_get_val(x3, "priority", &s) &&
+						    atoi(s) < prio)
+							prio = atoi(s);
+		}
+	}
+	free(s);
+	return prio;
+}
+
+static void probe_portal_gateways(struct openconnect_info *vpninfo,
+				  struct oc_form_opt_select *opt, const int *prio)
+{
+	struct gw_candidate *gws = calloc(opt->nr_choices, sizeof(*gws));
+	int i;
+
+	if (!gws)
+		return;
+
+	for (i = 0; i < opt->nr_choices; i++) {
+		gws[i].url = opt->choices[i]->name;
+		gws[i].tier = prio[i];
+	}
+
+	i = openconnect_probe_gateways(vpninfo, gws, opt->nr_choices);
+	if (i >= 0)
+		vpninfo->authgroup = strdup(opt->choices[i]->name);
+	free(gws);
+}
+
 /* Parse portal login/config response (POST /ssl-vpn/getconfig.esp)
  *
  * Extracts the list of gateways from the XML, writes them to the XML config,
- * presents the user with a form to choose the gateway, and redirects
- * to that gateway.
+ * presents the user with a form to choose the gateway (offering the one
+ * which answers fastest, if asked to probe them), and redirects to that
+ * gateway.
  *
  */
 static int parse_portal_xml(struct openconnect_info *vpninfo, xmlNode *xml_node, void *cb_data)
@@ -405,6 +456,7 @@ static int parse_portal_xml(struct openconnect_info *vpninfo, xmlNode *xml_node,
 	struct oc_form_opt_select *opt;
 	struct oc_text_buf *buf = NULL;
 	int max_choices = 0, result;
+	int *prio = NULL;
 	char *portal = NULL;
 	char *hip_interval = NULL;
 
@@ -496,7 +548,8 @@ static int parse_portal_xml(struct openconnect_info *vpninfo, xmlNode *xml_node,
 			max_choices++;
 
 	opt->choices = calloc(max_choices, sizeof(opt->choices[0]));
-	if (!opt->choices) {
+	prio = calloc(max_choices, sizeof(*prio));
+	if (!opt->choices || !prio) {
 		result = -ENOMEM;
 		goto out;
 	}
@@ -522,6 +575,7 @@ static int parse_portal_xml(struct openconnect_info *vpninfo, xmlNode *xml_node,
 					}
 				}
 
+			prio[opt->nr_choices] = gateway_priority(x);
 			opt->choices[opt->nr_choices++] = choice;
 			vpn_progress(vpninfo, PRG_INFO, _("  %s (%s)\n"),
 				     choice->label, choice->name);
@@ -533,6 +587,8 @@ static int parse_portal_xml(struct openconnect_info *vpninfo, xmlNode *xml_node,
 		result = -EINVAL;
 		goto out;
 	}
+	if (!vpninfo->authgroup && vpninfo->probe_gw && opt->nr_choices > 1)
+		probe_portal_gateways(vpninfo, opt, prio);
 	if (!vpninfo->authgroup && opt->nr_choices)
 		vpninfo->authgroup = strdup(opt->choices[0]->name);
 
@@ -559,6 +615,7 @@ static int parse_portal_xml(struct openconnect_info *vpninfo, xmlNode *xml_node,
 
 out:
 	buf_free(buf);
+	free(prio);
 	free(portal);
 	free(hip_interval);
 	free_auth_form(form);
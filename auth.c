@@ -1411,7 +1411,9 @@ newgroup:
 			form = NULL;
 
 			if (!cert_sent && vpninfo->certinfo[0].cert) {
-				/* Try again on a fresh connection. */
+				/* Try again on a fresh connection, and not by
+				 * resuming the session which lacked the cert. */
+				tls_session_forget(vpninfo);
 				cert_sent = 1;
 			} else if (cert_sent && vpninfo->certinfo[0].cert) {
 				/* Try again with <client-cert-fail/> in the request */
@@ -102,6 +102,11 @@ static void calculate_dtls_mtu(struct openconnect_info *vpninfo, int *base_mtu,
 	*mtu = vpninfo->reqmtu;
 	*base_mtu = vpninfo->basemtu;
 
+	/* Not connected yet, because the request is going in TLS early data.
+	 * We're reconnecting, so the last answer is the best guess. */
+	if (!*base_mtu && vpninfo->ssl_fd == -1)
+		*base_mtu = vpninfo->cstp_basemtu;
+
 #if defined(__linux__) && defined(TCP_INFO)
 	if (!*mtu || !*base_mtu) {
 		struct tcp_info ti;
@@ -295,8 +300,6 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 			buf_free(dtls12_cl);
 		}
 		append_compr_types(reqbuf, "DTLS", vpninfo->req_compr & ~COMPR_DEFLATE);
-
-		vpninfo->delay_tunnel_reason = "DTLS MTU detection";
 	}
 #endif
 	buf_append(reqbuf, "\r\n");
@@ -310,8 +313,16 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	if (vpninfo->dump_http_traffic)
 		dump_buf(vpninfo, '>', reqbuf->data);
 
-	vpninfo->ssl_write(vpninfo, reqbuf->data, reqbuf->pos);
+	i = openconnect_https_request(vpninfo, reqbuf);
 	buf_free(reqbuf);
+	if (i) {
+		if (!retried)
+			return i;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open HTTPS connection to %s\n"),
+			     vpninfo->hostname);
+		return -EIO;
+	}
 
 	/* FIXME: Use process_http_response() instead of reimplementing it. It has
 	   a header callback function, and can cope with CONNECT requests. */
@@ -323,13 +334,6 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 		if (!retried) {
 			retried = 1;
 			openconnect_close_https(vpninfo, 0);
-
-			if (openconnect_open_https(vpninfo)) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Failed to open HTTPS connection to %s\n"),
-					     vpninfo->hostname);
-				return -EIO;
-			}
 			goto retry;
 		}
 		return -EINVAL;
@@ -678,9 +682,14 @@ int cstp_connect(struct openconnect_info *vpninfo)
 		vpninfo->dtls_state = DTLS_SECRET;
 	}
 
-	ret = openconnect_open_https(vpninfo);
-	if (ret)
-		return ret;
+	/* If the CONNECT request may go in TLS early data, it's made before
+	 * there is a connection to measure the MTU on. Only do that when
+	 * reconnecting, and have start_cstp_connection() open it. */
+	if (!vpninfo->tls_early_data || !vpninfo->cstp_basemtu) {
+		ret = openconnect_open_https(vpninfo);
+		if (ret)
+			return ret;
+	}
 
 	ret = start_cstp_connection(vpninfo);
 	if (ret)
@@ -969,6 +978,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		case AC_PKT_DPD_RESP:
 			vpn_progress(vpninfo, PRG_DEBUG,
 				     _("Got CSTP DPD response\n"));
+			ka_probe_rcvd(&vpninfo->ssl_times);
 			continue;
 
 		case AC_PKT_KEEPALIVE:
@@ -1133,6 +1143,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send CSTP DPD\n"));
 
+		ka_probe_sent(&vpninfo->ssl_times);
 		vpninfo->current_ssl_pkt = (struct pkt *)&dpd_pkt;
 		goto handle_outgoing;
 
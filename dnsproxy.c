@@ -0,0 +1,923 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every lookup of an internal name otherwise goes all the way through the
+ * tunnel to the VPN's DNS servers, at the full round trip time of the VPN.
+ * With the DNS proxy enabled, the system resolver is configured to ask us
+ * instead (for the VPN's search domains, or for everything, just as it
+ * would have been for the VPN's own servers). We answer from a cache which
+ * respects the TTLs of the records, and forward misses to the real servers.
+ * Popular records are fetched again shortly before they expire, so that
+ * they never drop out of the cache while they are in use.
+ *
+ * Queries to the servers are our own rather than the clients', so that
+ * the answers can be shared between clients: the name in lower case, with
+ * an EDNS0 OPT record only if the client sent one, and no options in it.
+ * There is no DNS over TCP. */
+
+#define DNS_PORT		53
+#define DNS_MAX_NAME		255
+#define DNS_MAX_PKT		4096
+#define DNS_EDNS_SIZE		1232	/* DNS flag day 2020 */
+
+#define DNS_TYPE_SOA		6
+#define DNS_TYPE_OPT		41
+
+#define DNS_RCODE_FORMERR	1
+#define DNS_RCODE_SERVFAIL	2
+#define DNS_RCODE_NXDOMAIN	3
+#define DNS_RCODE_NOTIMP	4
+
+#define CACHE_BUCKETS		1024
+#define CACHE_MAX		4096
+#define CACHE_MAX_TTL		86400
+#define PREFETCH_HITS		2	/* While the record was cached */
+#define PREFETCH_MIN_TTL	10
+
+#define QUERY_MAX		256
+#define QUERY_MAX_WAITERS	16
+#define QUERY_TIMEOUT		2000
+#define QUERY_TRIES		4
+
+/* Things which make a difference to the answer, as well as the question */
+#define KEY_CD			1
+#define KEY_DO			2
+#define KEY_EDNS		4
+
+struct dns_key {
+	uint16_t type, class;
+	uint8_t flags;
+	uint8_t namelen;
+	unsigned char name[DNS_MAX_NAME];	/* Lower case, in wire format */
+};
+
+struct dns_entry {
+	struct dns_entry *next;			/* In the hash bucket */
+	struct dns_entry *older, *newer;	/* For eviction */
+	uint32_t hash;
+	struct dns_key key;
+	long long fetched, expires;
+	int ttl;
+	int hits;
+	int len;
+	unsigned char resp[];
+};
+
+/* A client waiting for an answer from the servers */
+struct dns_waiter {
+	struct dns_waiter *next;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	uint16_t id;
+	uint8_t rd;
+	int maxlen;
+	/* The question as the client asked it, in its own choice of case */
+	int qlen;
+	unsigned char q[DNS_MAX_NAME + 4];
+};
+
+struct dns_query {
+	struct dns_query *next;
+	uint16_t id;
+	uint32_t hash;
+	struct dns_key key;
+	int tries;
+	long long due;
+	struct dns_waiter *waiters;
+	int nr_waiters;
+	int len;
+	unsigned char pkt[];
+};
+
+struct dns_proxy {
+	struct dns_entry *buckets[CACHE_BUCKETS];
+	struct dns_entry *oldest, *newest;
+	int nr_entries;
+	struct dns_query *queries;
+	int nr_queries;
+	int up_family;
+	unsigned long hits, misses, prefetches;
+};
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+int dns_skip_name(const unsigned char *p, int len, int off)
+{
+	while (off < len) {
+		if (!p[off])
+			return off + 1;
+		if ((p[off] & 0xc0) == 0xc0)
+			return off + 2 <= len ? off + 2 : -1;
+		off += p[off] + 1;
+	}
+	return -1;
+}
+
+/* The address we listen on, which is also what the system resolver is
+ * told to use. Unless the user chose otherwise, it's our address on the
+ * tunnel, which can't change on reconnect. */
+const char *dnsproxy_addr(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->dns_proxy_listen)
+		return NULL;
+	if (vpninfo->dns_proxy_listen[0])
+		return vpninfo->dns_proxy_listen;
+	return vpninfo->ip_info.addr ? : vpninfo->ip_info.addr6;
+}
+
+/* Parse the question, which must be the only one. Returns the offset of
+ * the end of it, or -1. */
+static int dns_parse_question(const unsigned char *p, int len, struct dns_key *key)
+{
+	int off = 12, l, i;
+
+	if (len < 12 || load_be16(p + 4) != 1)
+		return -1;
+
+	key->namelen = 0;
+	do {
+		if (off >= len)
+			return -1;
+		l = p[off++];
+		/* Nothing to point back to, in the question */
+		if ((l & 0xc0) || off + l > len ||
+		    key->namelen + l + 1 > sizeof(key->name))
+			return -1;
+		key->name[key->namelen++] = l;
+		for (i = 0; i < l; i++) {
+			unsigned char c = p[off++];
+
+			key->name[key->namelen++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+		}
+	} while (l);
+
+	if (off + 4 > len)
+		return -1;
+	key->type = load_be16(p + off);
+	key->class = load_be16(p + off + 2);
+	key->flags = 0;
+	return off + 4;
+}
+
+static uint32_t dns_hash(const struct dns_key *key)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	/* FNV-1a */
+	for (i = 0; i < key->namelen; i++)
+		h = (h ^ key->name[i]) * 16777619;
+	h = (h ^ key->type) * 16777619;
+	h = (h ^ key->class) * 16777619;
+	return (h ^ key->flags) * 16777619;
+}
+
+static int dns_key_eq(const struct dns_key *a, const struct dns_key *b)
+{
+	return a->type == b->type && a->class == b->class && a->flags == b->flags &&
+		a->namelen == b->namelen && !memcmp(a->name, b->name, a->namelen);
+}
+
+/* Age the TTLs in a response by @elapsed seconds, and return the lowest
+ * of those in the answer and authority sections. For a negative answer,
+ * the SOA's MINIMUM field caps it too (RFC2308 §5). Returns -1 if the
+ * response doesn't parse. */
+static long dns_age_ttls(unsigned char *p, int len, uint32_t elapsed)
+{
+	int an = load_be16(p + 6), ns = load_be16(p + 8), ar = load_be16(p + 10);
+	int off, i, type, rdlen;
+	uint32_t ttl, min = CACHE_MAX_TTL;
+
+	off = dns_skip_name(p, len, 12);
+	if (off < 0 || off + 4 > len)
+		return -1;
+	off += 4;
+
+	for (i = 0; i < an + ns + ar; i++) {
+		off = dns_skip_name(p, len, off);
+		if (off < 0 || off + 10 > len)
+			return -1;
+		type = load_be16(p + off);
+		ttl = load_be32(p + off + 4);
+		rdlen = load_be16(p + off + 8);
+		off += 10;
+		if (off + rdlen > len)
+			return -1;
+
+		/* The OPT record's TTL field is flags, not a TTL */
+		if (type != DNS_TYPE_OPT) {
+			/* RFC2181 §8 */
+			if (ttl & 0x80000000)
+				ttl = 0;
+			ttl = ttl > elapsed ? ttl - elapsed : 0;
+			store_be32(p + off - 6, ttl);
+
+			if (i < an + ns)
+				min = MIN(min, ttl);
+			if (type == DNS_TYPE_SOA && i >= an && i < an + ns && rdlen >= 22)
+				min = MIN(min, load_be32(p + off + rdlen - 4));
+		}
+		off += rdlen;
+	}
+
+	return min;
+}
+
+/* Find the client's EDNS0 OPT record, if it sent one, to see how big an
+ * answer it can take and whether it wants DNSSEC records. */
+static int dns_parse_opt(const unsigned char *p, int len, int off, struct dns_key *key)
+{
+	int nr = load_be16(p + 6) + load_be16(p + 8) + load_be16(p + 10);
+	int i, rdlen;
+
+	for (i = 0; i < nr; i++) {
+		off = dns_skip_name(p, len, off);
+		if (off < 0 || off + 10 > len)
+			break;
+		if (load_be16(p + off) == DNS_TYPE_OPT) {
+			key->flags |= KEY_EDNS;
+			if (p[off + 6] & 0x80)
+				key->flags |= KEY_DO;
+			return MAX(load_be16(p + off + 2), 512);
+		}
+		rdlen = load_be16(p + off + 8);
+		off += 10 + rdlen;
+	}
+	return 512;
+}
+
+static void dns_send_reply(struct openconnect_info *vpninfo, struct dns_waiter *w,
+			   unsigned char *resp, int len)
+{
+	store_be16(resp, w->id);
+	resp[2] = (resp[2] & ~0x01) | w->rd;
+	memcpy(resp + 12, w->q, w->qlen);
+
+	/* Too big for the client. All it can do is try TCP, or another server */
+	if (len > w->maxlen) {
+		resp[2] |= 0x02;
+		memset(resp + 6, 0, 6);
+		len = 12 + w->qlen;
+	}
+
+	if (sendto(vpninfo->dns_fd, (void *)resp, len, 0, (void *)&w->addr, w->addrlen) < 0)
+		vpn_progress(vpninfo, PRG_TRACE, _("Failed to send DNS reply: %s\n"),
+			     strerror(errno));
+}
+
+/* An answer with no records, for errors */
+static void dns_send_error(struct openconnect_info *vpninfo, struct dns_waiter *w,
+			   const unsigned char *query, int rcode)
+{
+	unsigned char resp[12 + sizeof(w->q)];
+
+	memcpy(resp, query, 12);
+	resp[2] |= 0x80;
+	resp[3] = 0x80 | rcode;
+	store_be16(resp + 4, w->qlen ? 1 : 0);
+	memset(resp + 6, 0, 6);
+	dns_send_reply(vpninfo, w, resp, 12 + w->qlen);
+}
+
+static void cache_unlink(struct dns_proxy *dp, struct dns_entry *e)
+{
+	struct dns_entry **pe = &dp->buckets[e->hash % CACHE_BUCKETS];
+
+	while (*pe != e)
+		pe = &(*pe)->next;
+	*pe = e->next;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		dp->oldest = e->newer;
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		dp->newest = e->older;
+	dp->nr_entries--;
+}
+
+static void cache_touch(struct dns_proxy *dp, struct dns_entry *e)
+{
+	if (e == dp->newest)
+		return;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		dp->oldest = e->newer;
+	e->newer->older = e->older;
+
+	e->older = dp->newest;
+	e->newer = NULL;
+	dp->newest->newer = e;
+	dp->newest = e;
+}
+
+static struct dns_entry *cache_find(struct dns_proxy *dp, const struct dns_key *key,
+				    uint32_t hash)
+{
+	struct dns_entry *e;
+
+	for (e = dp->buckets[hash % CACHE_BUCKETS]; e; e = e->next)
+		if (e->hash == hash && dns_key_eq(&e->key, key))
+			return e;
+	return NULL;
+}
+
+static void cache_add(struct dns_proxy *dp, struct dns_query *q,
+		      const unsigned char *resp, int len)
+{
+	struct dns_entry *e, *old;
+	long ttl;
+
+	/* Only definite answers, positive or negative, and only if the
+	 * servers gave a TTL for them. */
+	if ((resp[3] & 0xf) != 0 && (resp[3] & 0xf) != DNS_RCODE_NXDOMAIN)
+		return;
+	if ((resp[2] & 0x02) || !(load_be16(resp + 6) + load_be16(resp + 8)))
+		return;
+
+	e = malloc(sizeof(*e) + len);
+	if (!e)
+		return;
+	memcpy(e->resp, resp, len);
+	ttl = dns_age_ttls(e->resp, len, 0);
+	if (ttl <= 0) {
+		free(e);
+		return;
+	}
+
+	e->len = len;
+	e->key = q->key;
+	e->hash = q->hash;
+	e->ttl = ttl;
+	e->hits = 0;
+	e->fetched = now_ms();
+	e->expires = e->fetched + ttl * 1000LL;
+
+	/* A prefetch replaces the old answer */
+	old = cache_find(dp, &e->key, e->hash);
+	if (old) {
+		cache_unlink(dp, old);
+		free(old);
+	}
+	while (dp->nr_entries >= CACHE_MAX) {
+		old = dp->oldest;
+		cache_unlink(dp, old);
+		free(old);
+	}
+
+	e->next = dp->buckets[e->hash % CACHE_BUCKETS];
+	dp->buckets[e->hash % CACHE_BUCKETS] = e;
+	e->older = dp->newest;
+	e->newer = NULL;
+	if (dp->newest)
+		dp->newest->newer = e;
+	else
+		dp->oldest = e;
+	dp->newest = e;
+	dp->nr_entries++;
+}
+
+/* The VPN's servers of the same family as our socket for talking to them */
+static int dns_servers(struct openconnect_info *vpninfo, struct sockaddr_storage *ss,
+		       socklen_t *sslen)
+{
+	int family = vpninfo->dns_proxy->up_family;
+	int i, nr = 0;
+
+	for (i = 0; i < 3; i++) {
+		const char *srv = vpninfo->ip_info.dns[i];
+
+		if (!srv || (strchr(srv, ':') ? AF_INET6 : AF_INET) != family)
+			continue;
+
+		memset(&ss[nr], 0, sizeof(ss[nr]));
+		if (family == AF_INET6) {
+			struct sockaddr_in6 *sin6 = (void *)&ss[nr];
+
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = htons(DNS_PORT);
+			sslen[nr] = sizeof(*sin6);
+			if (inet_pton(AF_INET6, srv, &sin6->sin6_addr) > 0)
+				nr++;
+		} else {
+			struct sockaddr_in *sin = (void *)&ss[nr];
+
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(DNS_PORT);
+			sslen[nr] = sizeof(*sin);
+			if (inet_pton(AF_INET, srv, &sin->sin_addr) > 0)
+				nr++;
+		}
+	}
+	return nr;
+}
+
+static int is_dns_server(struct openconnect_info *vpninfo,
+			 const struct sockaddr_storage *from, socklen_t fromlen)
+{
+	struct sockaddr_storage ss[3];
+	socklen_t sslen[3];
+	int i, nr = dns_servers(vpninfo, ss, sslen);
+
+	/* Port and address both, and nothing else matters */
+	for (i = 0; i < nr; i++) {
+		if (from->ss_family != ss[i].ss_family || fromlen < sslen[i])
+			continue;
+		if (ss[i].ss_family == AF_INET &&
+		    ((struct sockaddr_in *)from)->sin_port == htons(DNS_PORT) &&
+		    !memcmp(&((struct sockaddr_in *)from)->sin_addr,
+			    &((struct sockaddr_in *)&ss[i])->sin_addr, sizeof(struct in_addr)))
+			return 1;
+		if (ss[i].ss_family == AF_INET6 &&
+		    ((struct sockaddr_in6 *)from)->sin6_port == htons(DNS_PORT) &&
+		    !memcmp(&((struct sockaddr_in6 *)from)->sin6_addr,
+			    &((struct sockaddr_in6 *)&ss[i])->sin6_addr, sizeof(struct in6_addr)))
+			return 1;
+	}
+	return 0;
+}
+
+static int addr_is(int family, const void *addr, const char *str)
+{
+	unsigned char buf[16];
+
+	return str && inet_pton(family, str, buf) > 0 &&
+		!memcmp(addr, buf, family == AF_INET6 ? 16 : 4);
+}
+
+/* We're a resolver for this host, not an open one for whoever can reach
+ * the address we listen on, which by default is on the VPN. Queries from
+ * this host to one of its own addresses come from that same address. */
+static int is_local_client(struct openconnect_info *vpninfo,
+			   const struct sockaddr_storage *from, socklen_t fromlen)
+{
+	const char *listen_addr = dnsproxy_addr(vpninfo);
+
+	if (from->ss_family == AF_INET && fromlen >= sizeof(struct sockaddr_in)) {
+		const struct in_addr *a = &((struct sockaddr_in *)from)->sin_addr;
+
+		return (ntohl(a->s_addr) >> 24) == 127 ||
+			addr_is(AF_INET, a, listen_addr) ||
+			addr_is(AF_INET, a, vpninfo->ip_info.addr);
+	}
+	if (from->ss_family == AF_INET6 && fromlen >= sizeof(struct sockaddr_in6)) {
+		const struct in6_addr *a = &((struct sockaddr_in6 *)from)->sin6_addr;
+
+		return IN6_IS_ADDR_LOOPBACK(a) ||
+			addr_is(AF_INET6, a, listen_addr) ||
+			addr_is(AF_INET6, a, vpninfo->ip_info.addr6);
+	}
+	return 0;
+}
+
+static void query_send(struct openconnect_info *vpninfo, struct dns_query *q)
+{
+	struct sockaddr_storage ss[3];
+	socklen_t sslen[3];
+	int nr = dns_servers(vpninfo, ss, sslen), i;
+
+	q->due = now_ms() + QUERY_TIMEOUT;
+
+	/* Each of the servers in turn. If the send fails, the retry will
+	 * deal with it. */
+	i = nr ? q->tries % nr : 0;
+	if (nr && sendto(vpninfo->dns_up_fd, (void *)q->pkt, q->len, 0,
+			 (void *)&ss[i], sslen[i]) < 0)
+		vpn_progress(vpninfo, PRG_TRACE, _("Failed to send DNS query: %s\n"),
+			     strerror(errno));
+}
+
+static struct dns_query *query_find(struct dns_proxy *dp, const struct dns_key *key,
+				    uint32_t hash)
+{
+	struct dns_query *q;
+
+	for (q = dp->queries; q; q = q->next)
+		if (q->hash == hash && dns_key_eq(&q->key, key))
+			return q;
+	return NULL;
+}
+
+static struct dns_query *query_new(struct openconnect_info *vpninfo,
+				   const struct dns_key *key, uint32_t hash)
+{
+	struct dns_proxy *dp = vpninfo->dns_proxy;
+	struct dns_query *q, *q2;
+	unsigned char *p;
+
+	if (dp->nr_queries >= QUERY_MAX)
+		return NULL;
+
+	q = calloc(1, sizeof(*q) + 12 + key->namelen + 4 + 11);
+	if (!q)
+		return NULL;
+
+	q->key = *key;
+	q->hash = hash;
+
+	/* An ID which isn't already in use */
+	do {
+		openconnect_random(&q->id, sizeof(q->id));
+		for (q2 = dp->queries; q2 && q2->id != q->id; q2 = q2->next)
+			;
+	} while (q2);
+
+	p = q->pkt;
+	store_be16(p, q->id);
+	p[2] = 0x01; /* RD */
+	p[3] = (key->flags & KEY_CD) ? 0x10 : 0;
+	store_be16(p + 4, 1);
+	p += 12;
+	memcpy(p, key->name, key->namelen);
+	p += key->namelen;
+	store_be16(p, key->type);
+	store_be16(p + 2, key->class);
+	p += 4;
+	if (key->flags & KEY_EDNS) {
+		store_be16(q->pkt + 10, 1);
+		*(p++) = 0; /* Root */
+		store_be16(p, DNS_TYPE_OPT);
+		store_be16(p + 2, DNS_EDNS_SIZE);
+		store_be32(p + 4, (key->flags & KEY_DO) ? 0x8000 : 0);
+		store_be16(p + 8, 0);
+		p += 10;
+	}
+	q->len = p - q->pkt;
+
+	q->next = dp->queries;
+	dp->queries = q;
+	dp->nr_queries++;
+
+	query_send(vpninfo, q);
+	return q;
+}
+
+static void query_free(struct dns_proxy *dp, struct dns_query *q)
+{
+	struct dns_query **pq;
+	struct dns_waiter *w;
+
+	for (pq = &dp->queries; *pq != q; pq = &(*pq)->next)
+		;
+	*pq = q->next;
+	dp->nr_queries--;
+
+	while ((w = q->waiters)) {
+		q->waiters = w->next;
+		free(w);
+	}
+	free(q);
+}
+
+static void query_answer(struct openconnect_info *vpninfo, struct dns_query *q,
+			 const unsigned char *resp, int len)
+{
+	unsigned char buf[DNS_MAX_PKT];
+	struct dns_waiter *w;
+
+	for (w = q->waiters; w; w = w->next) {
+		memcpy(buf, resp, len);
+		dns_send_reply(vpninfo, w, buf, len);
+	}
+}
+
+static void dns_client_query(struct openconnect_info *vpninfo, unsigned char *p, int len,
+			     struct sockaddr_storage *from, socklen_t fromlen)
+{
+	struct dns_proxy *dp = vpninfo->dns_proxy;
+	unsigned char buf[DNS_MAX_PKT];
+	struct dns_waiter w, *nw;
+	struct dns_entry *e;
+	struct dns_query *q;
+	struct dns_key key;
+	long long now;
+	uint32_t hash;
+	int off;
+
+	/* Not a query at all, or an answer to one */
+	if (len < 12 || (p[2] & 0x80))
+		return;
+	if (!is_local_client(vpninfo, from, fromlen)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Ignoring DNS query from non-local address\n"));
+		return;
+	}
+
+	memset(&w, 0, sizeof(w));
+	memcpy(&w.addr, from, fromlen);
+	w.addrlen = fromlen;
+	w.id = load_be16(p);
+	w.rd = p[2] & 0x01;
+	w.maxlen = 512;
+
+	if (p[2] & 0x78) {
+		dns_send_error(vpninfo, &w, p, DNS_RCODE_NOTIMP);
+		return;
+	}
+	off = dns_parse_question(p, len, &key);
+	if (off < 0) {
+		dns_send_error(vpninfo, &w, p, DNS_RCODE_FORMERR);
+		return;
+	}
+	w.qlen = off - 12;
+	memcpy(w.q, p + 12, w.qlen);
+	if (p[3] & 0x10)
+		key.flags |= KEY_CD;
+	w.maxlen = MIN(dns_parse_opt(p, len, off, &key), DNS_MAX_PKT);
+	hash = dns_hash(&key);
+
+	now = now_ms();
+	e = cache_find(dp, &key, hash);
+	if (e && e->expires <= now) {
+		cache_unlink(dp, e);
+		free(e);
+		e = NULL;
+	}
+	if (e) {
+		dp->hits++;
+		cache_touch(dp, e);
+		memcpy(buf, e->resp, e->len);
+		dns_age_ttls(buf, e->len, (now - e->fetched) / 1000);
+		dns_send_reply(vpninfo, &w, buf, e->len);
+
+		/* Fetch it again before it expires, if it's popular */
+		if (++e->hits >= PREFETCH_HITS && e->ttl >= PREFETCH_MIN_TTL &&
+		    (e->expires - now) * 10 < e->ttl * 1000LL &&
+		    !query_find(dp, &key, hash) && query_new(vpninfo, &key, hash)) {
+			vpn_progress(vpninfo, PRG_TRACE, _("Prefetching DNS record\n"));
+			dp->prefetches++;
+		}
+		return;
+	}
+
+	dp->misses++;
+	q = query_find(dp, &key, hash);
+	if (!q)
+		q = query_new(vpninfo, &key, hash);
+	if (!q || q->nr_waiters >= QUERY_MAX_WAITERS || !(nw = malloc(sizeof(*nw)))) {
+		dns_send_error(vpninfo, &w, p, DNS_RCODE_SERVFAIL);
+		return;
+	}
+
+	*nw = w;
+	nw->next = q->waiters;
+	q->waiters = nw;
+	q->nr_waiters++;
+}
+
+static void dns_server_reply(struct openconnect_info *vpninfo, unsigned char *p, int len,
+			     struct sockaddr_storage *from, socklen_t fromlen)
+{
+	struct dns_proxy *dp = vpninfo->dns_proxy;
+	struct dns_query *q;
+	struct dns_key key;
+
+	if (len < 12 || !(p[2] & 0x80) || !is_dns_server(vpninfo, from, fromlen))
+		return;
+
+	for (q = dp->queries; q; q = q->next)
+		if (q->id == load_be16(p))
+			break;
+	if (!q || dns_parse_question(p, len, &key) < 0)
+		return;
+
+	key.flags = q->key.flags;
+	if (!dns_key_eq(&key, &q->key))
+		return;
+
+	cache_add(dp, q, p, len);
+	query_answer(vpninfo, q, p, len);
+	query_free(dp, q);
+}
+
+int dnsproxy_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
+{
+	struct dns_proxy *dp = vpninfo->dns_proxy;
+	struct sockaddr_storage from;
+	unsigned char buf[DNS_MAX_PKT];
+	struct dns_query *q, *next;
+	socklen_t fromlen;
+	long long now;
+	int work_done = 0, len;
+
+	if (!dp)
+		return 0;
+
+	if (readable) {
+		fromlen = sizeof(from);
+		while ((len = recvfrom(vpninfo->dns_up_fd, (void *)buf, sizeof(buf), 0,
+				       (void *)&from, &fromlen)) >= 0) {
+			dns_server_reply(vpninfo, buf, len, &from, fromlen);
+			fromlen = sizeof(from);
+			work_done = 1;
+		}
+
+		fromlen = sizeof(from);
+		while ((len = recvfrom(vpninfo->dns_fd, (void *)buf, sizeof(buf), 0,
+				       (void *)&from, &fromlen)) >= 0) {
+			dns_client_query(vpninfo, buf, len, &from, fromlen);
+			fromlen = sizeof(from);
+			work_done = 1;
+		}
+	}
+
+	if (!dp->queries)
+		return work_done;
+
+	now = now_ms();
+	for (q = dp->queries; q; q = next) {
+		next = q->next;
+
+		if (q->due <= now) {
+			if (++q->tries < QUERY_TRIES) {
+				query_send(vpninfo, q);
+			} else {
+				struct dns_waiter *w;
+
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("No reply from VPN DNS servers\n"));
+				for (w = q->waiters; w; w = w->next)
+					dns_send_error(vpninfo, w, q->pkt, DNS_RCODE_SERVFAIL);
+				query_free(dp, q);
+				continue;
+			}
+		}
+		if (q->due - now < *timeout)
+			*timeout = MAX(q->due - now, 0);
+	}
+
+	return work_done;
+}
+
+static int dns_socket(int family)
+{
+	int fd = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (fd < 0)
+		return -errno;
+	if (set_sock_nonblock(fd)) {
+		close(fd);
+		return -EIO;
+	}
+	set_fd_cloexec(fd);
+	return fd;
+}
+
+int dnsproxy_setup(struct openconnect_info *vpninfo)
+{
+	const char *addr = dnsproxy_addr(vpninfo);
+	struct sockaddr_storage ss, servers[3];
+	socklen_t sslen, serverlens[3];
+	struct dns_proxy *dp;
+	int fd, up_fd, ret;
+
+	if (!addr) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("No address for the DNS proxy to listen on\n"));
+		return -EINVAL;
+	}
+
+	dp = calloc(1, sizeof(*dp));
+	if (!dp)
+		return -ENOMEM;
+
+	/* The servers' own family, for the queries we forward to them */
+	dp->up_family = (vpninfo->ip_info.dns[0] && strchr(vpninfo->ip_info.dns[0], ':')) ?
+		AF_INET6 : AF_INET;
+	vpninfo->dns_proxy = dp;
+	if (!dns_servers(vpninfo, servers, serverlens)) {
+		/* Nor will the system be told to use us */
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("No DNS servers from the VPN; not starting DNS proxy\n"));
+		ret = 0;
+		goto err;
+	}
+
+	memset(&ss, 0, sizeof(ss));
+	if (strchr(addr, ':')) {
+		struct sockaddr_in6 *sin6 = (void *)&ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(DNS_PORT);
+		sslen = sizeof(*sin6);
+		ret = inet_pton(AF_INET6, addr, &sin6->sin6_addr);
+	} else {
+		struct sockaddr_in *sin = (void *)&ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(DNS_PORT);
+		sslen = sizeof(*sin);
+		ret = inet_pton(AF_INET, addr, &sin->sin_addr);
+	}
+	if (ret <= 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Invalid DNS proxy address '%s'\n"), addr);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	fd = dns_socket(ss.ss_family);
+	if (fd >= 0 && bind(fd, (void *)&ss, sslen)) {
+		ret = -errno;
+		close(fd);
+		fd = ret;
+	}
+	if (fd < 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to listen for DNS queries on %s: %s\n"),
+			     addr, strerror(-fd));
+		ret = fd;
+		goto err;
+	}
+
+	up_fd = dns_socket(dp->up_family);
+	if (up_fd < 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open socket for DNS queries: %s\n"),
+			     strerror(-up_fd));
+		close(fd);
+		ret = up_fd;
+		goto err;
+	}
+
+	vpninfo->dns_fd = fd;
+	vpninfo->dns_up_fd = up_fd;
+	monitor_fd_new(vpninfo, dns);
+	monitor_read_fd(vpninfo, dns);
+	monitor_fd_new(vpninfo, dns_up);
+	monitor_read_fd(vpninfo, dns_up);
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Caching DNS proxy listening on %s\n"), addr);
+	return 0;
+
+ err:
+	free(dp);
+	vpninfo->dns_proxy = NULL;
+	return ret;
+}
+
+void dnsproxy_free(struct openconnect_info *vpninfo)
+{
+	struct dns_proxy *dp = vpninfo->dns_proxy;
+	struct dns_entry *e;
+
+	if (!dp)
+		return;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("DNS proxy: %lu cache hits, %lu misses, %lu prefetches\n"),
+		     dp->hits, dp->misses, dp->prefetches);
+
+	while (dp->queries)
+		query_free(dp, dp->queries);
+	while ((e = dp->oldest)) {
+		cache_unlink(dp, e);
+		free(e);
+	}
+	free(dp);
+	vpninfo->dns_proxy = NULL;
+
+	unmonitor_fd(vpninfo, dns);
+	close(vpninfo->dns_fd);
+	vpninfo->dns_fd = -1;
+	unmonitor_fd(vpninfo, dns_up);
+	close(vpninfo->dns_up_fd);
+	vpninfo->dns_up_fd = -1;
+}
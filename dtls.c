@@ -96,11 +96,118 @@ char *openconnect_bin2base64(const char *prefix, const uint8_t *data, unsigned l
 	return p;
 }
 
+static void dtls_close_session(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->dtls_ssl) {
+		dtls_ssl_free(vpninfo);
+		unmonitor_fd(vpninfo, dtls);
+		closesocket(vpninfo->dtls_fd);
+		vpninfo->dtls_ssl = NULL;
+		vpninfo->dtls_fd = -1;
+	}
+}
+
+/* Start a handshake over the other address family as well, in new_dtls.
+ * If that can't even get as far as sending, don't bother with it again
+ * until the next time we connect and udp_sockaddr() is called. */
+static void dtls_start_race(struct openconnect_info *vpninfo)
+{
+	int dtls_fd;
+
+	udp_swap_family(vpninfo);
+	dtls_fd = udp_connect(vpninfo);
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+
+	if (dtls_fd >= 0 && start_dtls_handshake(vpninfo, dtls_fd)) {
+		closesocket(dtls_fd);
+		dtls_fd = -1;
+	}
+	if (dtls_fd >= 0) {
+		vpninfo->dtls_fd = dtls_fd;
+		monitor_fd_new(vpninfo, dtls);
+		monitor_read_fd(vpninfo, dtls);
+		monitor_except_fd(vpninfo, dtls);
+	}
+
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+	udp_swap_family(vpninfo);
+
+	if (dtls_fd < 0) {
+		free(vpninfo->dtls_addr_alt);
+		vpninfo->dtls_addr_alt = NULL;
+	}
+}
+
+/* While connecting, with a handshake over each address family: the
+ * one in use over dtls_addr, the other in new_dtls over dtls_addr_alt.
+ * Each is driven in turn with the other set aside, out of the way of
+ * the dtls_close() when one fails. The first to complete is kept, and
+ * its address family becomes the one in use. */
+static int dtls_race_handshake(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct dtls_slot other = vpninfo->new_dtls;
+	time_t started = vpninfo->new_dtls_started;
+
+	memset(&vpninfo->new_dtls, 0, sizeof(vpninfo->new_dtls));
+	vpninfo->new_dtls.fd = -1;
+
+	dtls_try_handshake(vpninfo, timeout);
+	if (vpninfo->dtls_state == DTLS_SLEEPING) {
+		/* Failed and closed already; leave it to the other one */
+		dtls_slot_swap(vpninfo, &other);
+		udp_swap_family(vpninfo);
+		vpninfo->dtls_state = DTLS_CONNECTING;
+		vpninfo->new_dtls_started = started;
+		return 0;
+	}
+
+	if (vpninfo->dtls_state == DTLS_CONNECTING) {
+		dtls_slot_swap(vpninfo, &other);
+		udp_swap_family(vpninfo);
+
+		dtls_try_handshake(vpninfo, timeout);
+		if (vpninfo->dtls_state == DTLS_CONNECTED) {
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("DTLS connected over IPv%d first\n"),
+				     vpninfo->dtls_addr->sa_family == AF_INET6 ? 6 : 4);
+		} else {
+			udp_swap_family(vpninfo);
+			dtls_slot_swap(vpninfo, &other);
+
+			if (vpninfo->dtls_state == DTLS_SLEEPING) {
+				/* The other failed; carry on with this one */
+				vpninfo->dtls_state = DTLS_CONNECTING;
+				vpninfo->new_dtls_started = started;
+				return 0;
+			}
+			if (vpninfo->dtls_state == DTLS_CONNECTING) {
+				vpninfo->new_dtls = other;
+				return 0;
+			}
+		}
+	}
+
+	/* Connected, or DTLS has been disabled. The other is not wanted */
+	dtls_slot_swap(vpninfo, &other);
+	dtls_close_session(vpninfo);
+	dtls_slot_swap(vpninfo, &other);
+
+	return vpninfo->dtls_state == DTLS_DISABLED ? -EIO : 0;
+}
+
+static int dtls_handshake(struct openconnect_info *vpninfo, int *timeout)
+{
+	if (vpninfo->new_dtls.ssl)
+		return dtls_race_handshake(vpninfo, timeout);
+
+	return dtls_try_handshake(vpninfo, timeout);
+}
+
 static int connect_dtls_socket(struct openconnect_info *vpninfo, int *timeout)
 {
 	int dtls_fd, ret;
 
-	/* Sanity check for the removal of new_dtls_{fd,ssl} */
+	/* Sanity check; a rekey in progress lives in new_dtls instead */
 	if (vpninfo->dtls_fd != -1) {
 		vpn_progress(vpninfo, PRG_ERR, _("DTLS connection attempted with an existing fd\n"));
 		vpninfo->dtls_attempt_period = 0;
@@ -127,7 +234,15 @@ static int connect_dtls_socket(struct openconnect_info *vpninfo, int *timeout)
 		return -EINVAL;
 	}
 
+	udp_check_families(vpninfo);
 	dtls_fd = udp_connect(vpninfo);
+	if (dtls_fd < 0 && vpninfo->dtls_addr_alt) {
+		/* Perhaps the other address family will do */
+		udp_swap_family(vpninfo);
+		free(vpninfo->dtls_addr_alt);
+		vpninfo->dtls_addr_alt = NULL;
+		dtls_fd = udp_connect(vpninfo);
+	}
 	if (dtls_fd < 0)
 		return -EINVAL;
 
@@ -145,23 +260,98 @@ static int connect_dtls_socket(struct openconnect_info *vpninfo, int *timeout)
 	monitor_read_fd(vpninfo, dtls);
 	monitor_except_fd(vpninfo, dtls);
 
+	if (vpninfo->dtls_addr_alt)
+		dtls_start_race(vpninfo);
+
 	time(&vpninfo->new_dtls_started);
 
-	return dtls_try_handshake(vpninfo, timeout);
+	return dtls_handshake(vpninfo, timeout);
 }
 
 void dtls_close(struct openconnect_info *vpninfo)
 {
-	if (vpninfo->dtls_ssl) {
-		dtls_ssl_free(vpninfo);
-		unmonitor_fd(vpninfo, dtls);
-		closesocket(vpninfo->dtls_fd);
-		vpninfo->dtls_ssl = NULL;
-		vpninfo->dtls_fd = -1;
+	dtls_close_session(vpninfo);
+
+	/* ... and any rekey in progress */
+	if (vpninfo->new_dtls.ssl) {
+		dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+		dtls_close_session(vpninfo);
+		dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
 	}
 	vpninfo->dtls_state = DTLS_SLEEPING;
 }
 
+/* Drive the handshake of the new session in vpninfo->new_dtls, with
+ * the old one set aside while we do so. Switch over to it as soon as
+ * it's established. Until then, or if it fails, the old session keeps
+ * carrying the traffic. */
+static int dtls_rekey_handshake(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct dtls_slot old = { .fd = -1 };
+	int ret;
+
+	dtls_slot_swap(vpninfo, &old);
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+
+	vpninfo->dtls_state = DTLS_CONNECTING;
+	ret = dtls_try_handshake(vpninfo, timeout);
+
+	if (vpninfo->dtls_state == DTLS_CONNECTED) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Switched to rekeyed DTLS session\n"));
+		dtls_slot_swap(vpninfo, &old);
+		dtls_close_session(vpninfo);
+		dtls_slot_swap(vpninfo, &old);
+		return 1;
+	}
+
+	/* Still in progress, or it failed and has been closed already */
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+	dtls_slot_swap(vpninfo, &old);
+
+	if (vpninfo->dtls_state == DTLS_DISABLED) {
+		/* Whatever made it give up on DTLS applies to the old one too */
+		dtls_close_session(vpninfo);
+		return 1;
+	}
+
+	if (ret)
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("DTLS rehandshake failed; keeping the existing session\n"));
+	vpninfo->dtls_state = DTLS_ESTABLISHED;
+	return ret ? 1 : 0;
+}
+
+/* Start a new session on a new socket to replace the current one. */
+static int dtls_start_rekey(struct openconnect_info *vpninfo, int *timeout)
+{
+	int dtls_fd, ret;
+
+	dtls_fd = udp_connect(vpninfo);
+	if (dtls_fd < 0)
+		return -EINVAL;
+
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+
+	ret = start_dtls_handshake(vpninfo, dtls_fd);
+	if (ret) {
+		closesocket(dtls_fd);
+	} else {
+		vpninfo->dtls_fd = dtls_fd;
+		monitor_fd_new(vpninfo, dtls);
+		monitor_read_fd(vpninfo, dtls);
+		monitor_except_fd(vpninfo, dtls);
+	}
+
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+	if (ret)
+		return ret;
+
+	time(&vpninfo->new_dtls_started);
+	dtls_rekey_handshake(vpninfo, timeout);
+	return 0;
+}
+
 int dtls_reconnect(struct openconnect_info *vpninfo, int *timeout)
 {
 	dtls_close(vpninfo);
@@ -244,12 +434,12 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	}
 
 	if (vpninfo->dtls_state == DTLS_CONNECTING) {
-		dtls_try_handshake(vpninfo, timeout);
-		if (vpninfo->dtls_state != DTLS_CONNECTED) {
-			vpninfo->delay_tunnel_reason = "DTLS MTU detection";
+		/* Traffic goes over CSTP in the meantime */
+		dtls_handshake(vpninfo, timeout);
+		if (vpninfo->dtls_state != DTLS_CONNECTED)
 			return 0;
-		}
-		return 1;
+		/* Carry on to start MTU detection straight away */
+		work_done = 1;
 	}
 
 	if (vpninfo->dtls_state == DTLS_SLEEPING) {
@@ -265,6 +455,9 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		return 0;
 	}
 
+	if (vpninfo->new_dtls.ssl && dtls_rekey_handshake(vpninfo, timeout))
+		work_done = 1;
+
 	/* Nothing to do here for Cisco DTLS as it is preauthenticated */
 	if (vpninfo->dtls_state == DTLS_CONNECTED)
 		vpninfo->dtls_state = DTLS_ESTABLISHED;
@@ -316,6 +509,12 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 		case AC_PKT_DPD_RESP:
 			vpn_progress(vpninfo, PRG_DEBUG, _("Got DTLS DPD response\n"));
+			/* Padded response to an MTU probe? */
+			if (len > sizeof(uint32_t) &&
+			    load_be32(buf + 1) == vpninfo->pmtud.probe_id + len - 1)
+				pmtud_probe_acked(vpninfo, len - 1);
+			else
+				ka_probe_rcvd(&vpninfo->dtls_times);
 			break;
 
 		case AC_PKT_KEEPALIVE:
@@ -352,23 +551,18 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	}
 
 	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
-	case KA_REKEY: {
-		int ret;
-
+	case KA_REKEY:
 		vpn_progress(vpninfo, PRG_INFO, _("DTLS rekey due\n"));
 
-		if (vpninfo->dtls_times.rekey_method == REKEY_SSL) {
-			time(&vpninfo->new_dtls_started);
-			vpninfo->dtls_state = DTLS_CONNECTING;
-			ret = dtls_try_handshake(vpninfo, timeout);
-			if (ret) {
-				vpn_progress(vpninfo, PRG_ERR, _("DTLS Rehandshake failed; reconnecting.\n"));
-				return connect_dtls_socket(vpninfo, timeout);
-			}
-		}
+		/* Handshake a new session on a new socket, while this one
+		 * carries on. If we can't even start, keep using this one. */
+		if (vpninfo->dtls_times.rekey_method == REKEY_SSL &&
+		    !vpninfo->new_dtls.ssl &&
+		    dtls_start_rekey(vpninfo, timeout))
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to start DTLS rehandshake\n"));
 
 		return 1;
-	}
 
 	case KA_DPD_DEAD:
 		vpn_progress(vpninfo, PRG_ERR, _("DTLS Dead Peer Detection detected dead peer!\n"));
@@ -383,6 +577,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		if (ssl_nonblock_write(vpninfo, 1, &magic_pkt, 1) != 1)
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to send DPD request. Expect disconnect\n"));
+		ka_probe_sent(&vpninfo->dtls_times);
 
 		/* last_dpd will just have been set */
 		vpninfo->dtls_times.last_tx = vpninfo->dtls_times.last_dpd;
@@ -409,6 +604,15 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		;
 	}
 
+	if (udp_degraded(vpninfo)) {
+		/* Try again after the usual DTLS attempt period */
+		dtls_close(vpninfo);
+		return 1;
+	}
+
+	if (pmtud_mainloop(vpninfo, timeout))
+		work_done = 1;
+
 	/* Service outgoing packet queue */
 	unmonitor_write_fd(vpninfo, dtls);
 	while (vpninfo->outgoing_queue.head) {
@@ -457,205 +661,34 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	return work_done;
 }
 
-/* This symbol is missing in glibc < 2.22 (bug 18643). */
-#if defined(__linux__) && !defined(HAVE_IPV6_PATHMTU)
-# define HAVE_IPV6_PATHMTU 1
-# define IPV6_PATHMTU 61
-#endif
-
-#define PKT_INTERVAL_MS 50
-
-/* Performs a binary search to detect MTU.
- * @buf: is preallocated with MTU size
- *
- * Returns: new MTU or 0
- */
-static int probe_mtu(struct openconnect_info *vpninfo, unsigned char *buf)
+/* Send a DPD request padded to the given size, for MTU detection. The
+ * payload starts with the probe ID plus size, which the server echoes
+ * back to us in the DPD response. */
+int dtls_send_mtu_probe(struct openconnect_info *vpninfo, int len)
 {
-	int max, min, cur, ret, absolute_min, last;
-	int tries = 0; /* Number of loops in bin search - includes resends */
-	uint32_t id, id_len;
-	struct timeval start_tv, now_tv, last_tv;
-
-	absolute_min = 576;
-	if (vpninfo->ip_info.addr6)
-		absolute_min = 1280;
+	struct pkt *pkt;
+	int ret;
 
-	/* We'll assume that it is at least functional, and permits the bare
-	 * minimum MTU for the protocol(s) it transports. All else is mad. */
-	min = absolute_min;
-
-	/* First send a probe at the configured maximum. Most of the time, this
-	   one will probably work. */
-	last = cur = max = vpninfo->ip_info.mtu;
-
-	if (max <= min)
-		goto fail;
-
-	/* Generate unique ID */
-	if (openconnect_random(&id, sizeof(id)) < 0)
-		goto fail;
-
-	vpn_progress(vpninfo, PRG_DEBUG,
-		     _("Initiating MTU detection (min=%d, max=%d)\n"), min, max);
-
-	gettimeofday(&start_tv, NULL);
-	last_tv = start_tv;
-
-	while (1) {
-		int wait_ms;
-
-#ifdef HAVE_IPV6_PATHMTU
-		if (vpninfo->peer_addr->sa_family == AF_INET6) {
-			struct ip6_mtuinfo mtuinfo;
-			socklen_t len = sizeof(mtuinfo);
-			int newmax;
-
-			if (getsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_PATHMTU, &mtuinfo, &len) >= 0) {
-				newmax = mtuinfo.ip6m_mtu;
-				if (newmax > 0) {
-					newmax = dtls_set_mtu(vpninfo, newmax) - /*ipv6*/40 - /*udp*/20 - /*oc dtls*/1;
-					if (absolute_min > newmax)
-						goto fail;
-					if (max > newmax)
-						max = newmax;
-					if (cur > newmax)
-						cur = newmax;
-				}
-			}
-		}
-#endif
-
-		buf[0] = AC_PKT_DPD_OUT;
-		id_len = id + cur;
-		memcpy(&buf[1], &id_len, sizeof(id_len));
-
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Sending MTU DPD probe (%u bytes)\n"), cur);
-		ret = openconnect_dtls_write(vpninfo, buf, cur + 1);
-		if (ret != cur + 1) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to send DPD request (%d %d)\n"), cur, ret);
-			if (cur == max) {
-				max = --cur;
-				if (cur >= absolute_min)
-					continue;
-			}
-			goto fail;
-		}
-		if (last == cur)
-			tries++;
-		else {
-			tries = 0;
-			last = cur;
-		}
-
-		memset(buf, 0, sizeof(id)+1);
-	keep_waiting:
-		gettimeofday(&now_tv, NULL);
-
-		if (now_tv.tv_sec > start_tv.tv_sec + 10) {
-                        if (absolute_min == min) {
-                                /* Hm, we never got *anything* back successfully? */
-                                vpn_progress(vpninfo, PRG_ERR,
-                                             _("Too long time in MTU detect loop; assuming negotiated MTU.\n"));
-                                goto fail;
-                        } else {
-                                vpn_progress(vpninfo, PRG_ERR,
-                                             _("Too long time in MTU detect loop; MTU set to %d.\n"), min);
-				ret = min;
-				goto out;
-                        }
-		}
-
-
-		wait_ms = PKT_INTERVAL_MS -
-			((now_tv.tv_sec - last_tv.tv_sec) * 1000) -
-			((now_tv.tv_usec - last_tv.tv_usec) / 1000);
-		if (wait_ms <= 0 || wait_ms > PKT_INTERVAL_MS)
-			wait_ms = PKT_INTERVAL_MS;
-
-		ret = openconnect_dtls_read(vpninfo, buf, max+1, wait_ms);
-		if (ret > 0 && (buf[0] != AC_PKT_DPD_RESP || !memcpy(&id_len, &buf[1], sizeof(id_len)) ||
-				id_len != id + ret - 1)) {
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Received unexpected packet (%.2x) in MTU detection; skipping.\n"), (unsigned)buf[0]);
-			goto keep_waiting;
-		}
-
-		if (ret == -ETIMEDOUT) {
-			if (tries >= 6) {
-				vpn_progress(vpninfo, PRG_DEBUG,
-					     _("No response to size %u after %d tries; declare MTU is %u\n"),
-					     last, tries, min);
-				ret = min;
-				goto out;
-			}
-		} else if (ret < 0) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to recv DPD request (%d)\n"), ret);
-			goto fail;
-		} else if (ret > 0) {
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Received MTU DPD probe (%u bytes)\n"), ret - 1);
-			ret--;
-			tries = 0;
-		}
-
-		if (ret == max)
-			goto out;
-
-		if (ret > min) {
-			min = ret;
-			if (min >= last) {
-				cur = (min + max + 1) / 2;
-			} else {
-				cur = (min + last + 1) / 2;
-			}
-		} else {
-			cur = (min + last + 1) / 2;
-		}
-	}
- fail:
-	ret = 0;
- out:
-	return ret;
-}
-
-
-
-void dtls_detect_mtu(struct openconnect_info *vpninfo)
-{
-	int mtu;
-	int prev_mtu = vpninfo->ip_info.mtu;
-	unsigned char *buf;
-
-	if (vpninfo->proto->proto != PROTO_ANYCONNECT)
-		return;
+	if (len < sizeof(uint32_t))
+		return -EINVAL;
 
-	if (vpninfo->ip_info.mtu < 1 + sizeof(uint32_t))
-		return;
+	pkt = alloc_pkt(vpninfo, len);
+	if (!pkt)
+		return -ENOMEM;
 
-	/* detect MTU */
-	buf = calloc(1, 1 + vpninfo->ip_info.mtu);
-	if (!buf) {
-		vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
-		return;
-	}
+	memset(pkt->data, 0, len);
+	pkt->cstp.hdr[7] = AC_PKT_DPD_OUT;
+	store_be32(pkt->data, vpninfo->pmtud.probe_id + len);
 
-	mtu = probe_mtu(vpninfo, buf);
-	if (mtu == 0)
-		goto skip_mtu;
+	ret = ssl_nonblock_write(vpninfo, 1, &pkt->cstp.hdr[7], len + 1);
+	free_pkt(vpninfo, pkt);
 
-	vpninfo->ip_info.mtu = mtu;
-	if (prev_mtu != vpninfo->ip_info.mtu) {
-		vpn_progress(vpninfo, PRG_INFO,
-		     _("Detected MTU of %d bytes (was %d)\n"), vpninfo->ip_info.mtu, prev_mtu);
-	} else {
+	if (ret < 0) {
 		vpn_progress(vpninfo, PRG_DEBUG,
-		     _("No change in MTU after detection (was %d)\n"), prev_mtu);
+			     _("Failed to send DPD request (%d %d)\n"), len, ret);
+		/* Larger than the DTLS layer will take */
+		return -EMSGSIZE;
 	}
-
- skip_mtu:
-	free(buf);
+	time(&vpninfo->dtls_times.last_tx);
+	return 0;
 }
@@ -76,6 +76,35 @@ int print_esp_keys(struct openconnect_info *vpninfo, const char *name, struct es
 	return 0;
 }
 
+/* Until ESP is up, the probes go over the other address family too, from
+ * a socket in vpninfo->new_dtls. Whichever gets an answer first is kept.
+ * If the other can't even be opened, it isn't tried again until the next
+ * time we connect and udp_sockaddr() is called. */
+static void esp_send_probes(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->proto->udp_send_probes)
+		return;
+
+	if (vpninfo->dtls_fd == -1 && vpninfo->new_dtls.fd == -1)
+		udp_check_families(vpninfo);
+
+	vpninfo->proto->udp_send_probes(vpninfo);
+
+	if (vpninfo->dtls_state != DTLS_SLEEPING || !vpninfo->dtls_addr_alt)
+		return;
+
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+	udp_swap_family(vpninfo);
+	vpninfo->proto->udp_send_probes(vpninfo);
+	udp_swap_family(vpninfo);
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+
+	if (vpninfo->new_dtls.fd == -1) {
+		free(vpninfo->dtls_addr_alt);
+		vpninfo->dtls_addr_alt = NULL;
+	}
+}
+
 int esp_setup(struct openconnect_info *vpninfo)
 {
 	if (vpninfo->dtls_state == DTLS_DISABLED ||
@@ -91,8 +120,7 @@ int esp_setup(struct openconnect_info *vpninfo)
 	print_esp_keys(vpninfo, _("outgoing"), &vpninfo->esp_out);
 
 	vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes\n"));
-	if (vpninfo->proto->udp_send_probes)
-		vpninfo->proto->udp_send_probes(vpninfo);
+	esp_send_probes(vpninfo);
 
 	return 0;
 }
@@ -128,31 +156,18 @@ int construct_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt, uint
 	return sizeof(pkt->esp) + pkt->len + padlen + 2 + vpninfo->hmac_out_len;
 }
 
-int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
+static int esp_receive(struct openconnect_info *vpninfo)
 {
 	struct esp *esp = &vpninfo->esp_in[vpninfo->current_esp_in];
 	struct esp *old_esp = &vpninfo->esp_in[vpninfo->current_esp_in ^ 1];
-	struct pkt *this;
 	int work_done = 0;
-	int ret;
 
 	/* Some servers send us packets that are larger than negotiated
 	   MTU, or lack the ability to negotiate MTU (see gpst.c). We
 	   reserve some extra space to handle that */
 	int receive_mtu = MAX(2048, vpninfo->ip_info.mtu + 256);
 
-	if (vpninfo->dtls_state == DTLS_SLEEPING) {
-		if (ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + vpninfo->dtls_attempt_period)
-		    || vpninfo->dtls_need_reconnect) {
-			vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes\n"));
-			if (vpninfo->proto->udp_send_probes)
-				vpninfo->proto->udp_send_probes(vpninfo);
-		}
-	}
-	if (vpninfo->dtls_fd == -1)
-		return 0;
-
-	while (readable) {
+	while (1) {
 		int len = receive_mtu + vpninfo->pkt_trailer;
 		int i;
 		struct pkt *pkt;
@@ -241,7 +256,9 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 					vpn_progress(vpninfo, PRG_INFO,
 						     _("ESP session established with server\n"));
 					vpninfo->dtls_state = DTLS_CONNECTED;
-				}
+					pmtud_start(vpninfo);
+				} else if (!pmtud_probe_acked(vpninfo, pkt->len))
+					ka_probe_rcvd(&vpninfo->dtls_times);
 				continue;
 			}
 		}
@@ -271,6 +288,68 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		}
 	}
 
+	return work_done;
+}
+
+/* Returns nonzero if the answer came here first, leaving this socket and
+ * its address family in use and the other one in new_dtls. */
+static int esp_race_receive(struct openconnect_info *vpninfo, int *work_done)
+{
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+	udp_swap_family(vpninfo);
+
+	if (esp_receive(vpninfo))
+		*work_done = 1;
+	if (vpninfo->dtls_state != DTLS_SLEEPING)
+		return 1;
+
+	udp_swap_family(vpninfo);
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+	return 0;
+}
+
+static void esp_close_race(struct openconnect_info *vpninfo)
+{
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+	if (vpninfo->dtls_fd != -1) {
+		unmonitor_fd(vpninfo, dtls);
+		closesocket(vpninfo->dtls_fd);
+		vpninfo->dtls_fd = -1;
+	}
+	dtls_slot_swap(vpninfo, &vpninfo->new_dtls);
+}
+
+int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
+{
+	struct pkt *this;
+	int work_done = 0;
+	int ret;
+
+	if (vpninfo->dtls_state == DTLS_SLEEPING) {
+		if (ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + vpninfo->dtls_attempt_period)
+		    || vpninfo->dtls_need_reconnect) {
+			vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes\n"));
+			esp_send_probes(vpninfo);
+		}
+	}
+
+	if (vpninfo->new_dtls.fd != -1) {
+		if (vpninfo->dtls_state == DTLS_SLEEPING &&
+		    esp_race_receive(vpninfo, &work_done))
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("ESP answered over IPv%d first\n"),
+				     vpninfo->dtls_addr->sa_family == AF_INET6 ? 6 : 4);
+	}
+
+	if (vpninfo->dtls_fd == -1)
+		return 0;
+
+	if (readable && esp_receive(vpninfo))
+		work_done = 1;
+
+	if (vpninfo->dtls_state != DTLS_SLEEPING && vpninfo->new_dtls.fd != -1)
+		esp_close_race(vpninfo);
+
 	if (vpninfo->dtls_state != DTLS_ESTABLISHED)
 		return 0;
 
@@ -283,14 +362,14 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		vpn_progress(vpninfo, PRG_ERR, _("ESP detected dead peer\n"));
 		if (vpninfo->proto->udp_close)
 			vpninfo->proto->udp_close(vpninfo);
-		if (vpninfo->proto->udp_send_probes)
-			vpninfo->proto->udp_send_probes(vpninfo);
+		esp_send_probes(vpninfo);
 		return 1;
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes for DPD\n"));
 		if (vpninfo->proto->udp_send_probes)
 			vpninfo->proto->udp_send_probes(vpninfo);
+		ka_probe_sent(&vpninfo->dtls_times);
 		work_done = 1;
 		break;
 
@@ -301,6 +380,17 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	case KA_NONE:
 		break;
 	}
+
+	if (udp_degraded(vpninfo)) {
+		/* Probes will resume after the usual attempt period */
+		if (vpninfo->proto->udp_close)
+			vpninfo->proto->udp_close(vpninfo);
+		return 1;
+	}
+
+	if (pmtud_mainloop(vpninfo, timeout))
+		work_done = 1;
+
 	while (1) {
 		int len;
 		int ip_version;
@@ -396,6 +486,7 @@ void esp_close(struct openconnect_info *vpninfo)
 		closesocket(vpninfo->dtls_fd);
 		vpninfo->dtls_fd = -1;
 	}
+	esp_close_race(vpninfo);
 	if (vpninfo->dtls_state > DTLS_DISABLED)
 		vpninfo->dtls_state = DTLS_SLEEPING;
 	if (vpninfo->deflate_pkt) {
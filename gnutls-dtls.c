@@ -463,7 +463,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo, int *timeout)
 			 * reasonable MRU values during PPP negotiation.
 			 */
 			int data_mtu = vpninfo->cstp_basemtu = 1500;
-			if (vpninfo->peer_addr->sa_family == IPPROTO_IPV6)
+			if (vpninfo->dtls_addr->sa_family == AF_INET6)
 				data_mtu -= 40; /* IPv6 header */
 			else
 				data_mtu -= 20; /* Legacy IP header */
@@ -474,7 +474,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo, int *timeout)
 			 * we have to determine the tunnel MTU
 			 * for ourselves based on the base MTU */
 			int data_mtu = vpninfo->cstp_basemtu;
-			if (vpninfo->peer_addr->sa_family == IPPROTO_IPV6)
+			if (vpninfo->dtls_addr->sa_family == AF_INET6)
 				data_mtu -= 40; /* IPv6 header */
 			else
 				data_mtu -= 20; /* Legacy IP header */
@@ -510,8 +510,10 @@ int dtls_try_handshake(struct openconnect_info *vpninfo, int *timeout)
 			}
 
 			/* Make sure GnuTLS's idea of the MTU is sufficient to take
-			   a full VPN MTU (with 1-byte header) in a data record. */
-			err = gnutls_dtls_set_data_mtu(vpninfo->dtls_ssl, vpninfo->ip_info.mtu + 1);
+			   a full VPN MTU (with 1-byte header) in a data record,
+			   or an MTU probe at the original negotiated MTU. */
+			err = gnutls_dtls_set_data_mtu(vpninfo->dtls_ssl,
+						       MAX(vpninfo->ip_info.mtu, vpninfo->pmtud.max) + 1);
 			if (err) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("Failed to set DTLS MTU: %s\n"),
@@ -538,7 +540,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo, int *timeout)
 		vpninfo->dtls_times.last_rekey = vpninfo->dtls_times.last_rx =
 			vpninfo->dtls_times.last_tx = time(NULL);
 
-		dtls_detect_mtu(vpninfo);
+		pmtud_start(vpninfo);
 		/* XXX: For OpenSSL we explicitly prevent retransmits here. */
 		return 0;
 	}
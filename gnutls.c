@@ -111,7 +111,7 @@ static int _openconnect_gnutls_write(gnutls_session_t ses, int fd, struct openco
 				FD_SET(fd, &rd_set);
 
 			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			if (select(maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
+			if (vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
 			    errno != EINTR) {
 				vpn_perror(vpninfo, _("Failed select() for TLS"));
 				return -EIO;
@@ -165,7 +165,7 @@ static int _openconnect_gnutls_read(gnutls_session_t ses, int fd, struct opencon
 				FD_SET(fd, &rd_set);
 
 			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			ret = select(maxfd + 1, &rd_set, &wr_set, NULL, tv);
+			ret = vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, tv);
 			if (ret < 0 && errno != EINTR) {
 				vpn_perror(vpninfo, _("Failed select() for TLS/DTLS"));
 				return -EIO;
@@ -262,7 +262,7 @@ static int openconnect_gnutls_gets(struct openconnect_info *vpninfo, char *buf,
 				FD_SET(vpninfo->ssl_fd, &rd_set);
 
 			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			if (select(maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
+			if (vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
 			    errno != EINTR) {
 				vpn_perror(vpninfo, _("Failed select() for TLS"));
 				return -EIO;
@@ -2177,9 +2177,34 @@ static int verify_peer(gnutls_session_t session)
 	return err;
 }
 
-int openconnect_open_https(struct openconnect_info *vpninfo)
+/* With TLSv1.3 there is nothing to resume until the server has sent
+ * a ticket, which it can do at any time after the handshake. */
+static void save_https_session(struct openconnect_info *vpninfo)
+{
+	gnutls_datum_t d;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	if (gnutls_protocol_get_version(vpninfo->https_sess) == GNUTLS_TLS1_3 &&
+	    !(gnutls_session_get_flags(vpninfo->https_sess) & GNUTLS_SFLAGS_SESSION_TICKET))
+		return;
+#endif
+	if (gnutls_session_get_data2(vpninfo->https_sess, &d))
+		return;
+
+	tls_session_save(vpninfo, d.data, d.size);
+	gnutls_free(d.data);
+}
+
+/* Returns 1 if @data went in early data and the server accepted it,
+ * 0 if it still needs to be sent. */
+int openconnect_open_https_early(struct openconnect_info *vpninfo,
+				 const void *data, int len)
 {
+	const unsigned char *prev_sess;
 	int ssl_sock = -1;
+	unsigned int flags;
+	int prev_len, checked = 0;
+	int early = 0;
 	int err;
 
 	if (vpninfo->https_sess)
@@ -2286,7 +2311,14 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 			}
 		}
 	}
-	gnutls_init(&vpninfo->https_sess, GNUTLS_CLIENT|GNUTLS_FORCE_CLIENT_CERT);
+	flags = GNUTLS_CLIENT|GNUTLS_FORCE_CLIENT_CERT;
+#ifdef HAVE_UCONTEXT
+	/* With a handshake timeout, GnuTLS would otherwise wait for the
+	 * socket itself instead of returning GNUTLS_E_AGAIN to us. */
+	if (async_running(vpninfo))
+		flags |= GNUTLS_NONBLOCK;
+#endif
+	gnutls_init(&vpninfo->https_sess, flags);
 	gnutls_session_set_ptr(vpninfo->https_sess, (void *) vpninfo);
 	/*
 	 * For versions of GnuTLS older than 3.2.9, we try to avoid long
@@ -2383,6 +2415,18 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	gnutls_credentials_set(vpninfo->https_sess, GNUTLS_CRD_CERTIFICATE, vpninfo->https_cred);
 	gnutls_transport_set_ptr(vpninfo->https_sess,(gnutls_transport_ptr_t)(intptr_t)ssl_sock);
 
+	prev_sess = tls_session_find(vpninfo, &prev_len, &checked);
+	if (prev_sess &&
+	    !gnutls_session_set_data(vpninfo->https_sess, prev_sess, prev_len)) {
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+		/* It goes in the first flight, if the session allows any at all.
+		 * Otherwise it's simply not sent, and we'll send it normally. */
+		if (data && checked &&
+		    gnutls_record_send_early_data(vpninfo->https_sess, data, len) >= 0)
+			early = 1;
+#endif
+	}
+
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
@@ -2395,15 +2439,45 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	if (err)
 		return err;
 
+	/* The server didn't send its certificate, so verify_peer() wasn't
+	 * called. Check the one from the session we resumed instead, as
+	 * it may not have been this instance which accepted it. */
+	if (gnutls_session_is_resumed(vpninfo->https_sess)) {
+		vpn_progress(vpninfo, PRG_DEBUG, _("Resumed previous TLS session\n"));
+		if (verify_peer(vpninfo->https_sess)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Server certificate from resumed session not accepted\n"));
+			tls_session_forget(vpninfo);
+			gnutls_deinit(vpninfo->https_sess);
+			vpninfo->https_sess = NULL;
+			closesocket(ssl_sock);
+			return -EIO;
+		}
+	}
+
 	vpninfo->ssl_fd = ssl_sock;
+	save_https_session(vpninfo);
 
 	vpninfo->ssl_read = openconnect_gnutls_read;
 	vpninfo->ssl_write = openconnect_gnutls_write;
 	vpninfo->ssl_gets = openconnect_gnutls_gets;
 
+	if (early) {
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+		if (gnutls_session_get_flags(vpninfo->https_sess) & GNUTLS_SFLAGS_EARLY_DATA)
+			return 1;
+#endif
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Server rejected TLS early data\n"));
+	}
 	return 0;
 }
 
+int openconnect_open_https(struct openconnect_info *vpninfo)
+{
+	return openconnect_open_https_early(vpninfo, NULL, 0);
+}
+
 int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 {
 	int err;
@@ -2425,7 +2499,7 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 				FD_SET(ssl_sock, &rd_set);
 
 			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			if (select(maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
+			if (vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
 			    errno != EINTR) {
 				vpn_perror(vpninfo, _("Failed select() for TLS"));
 				return -EIO;
@@ -2469,6 +2543,9 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
 	if (vpninfo->https_sess) {
+		/* It may have a ticket now which it didn't at first */
+		if (vpninfo->ssl_fd != -1)
+			save_https_session(vpninfo);
 		gnutls_deinit(vpninfo->https_sess);
 		vpninfo->https_sess = NULL;
 	}
@@ -30,6 +30,7 @@
 #include "win32-ipicmp.h"
 #else
 #include <sys/wait.h>
+#include <signal.h>
 /* The BSDs require the first two headers before netinet/ip.h
  * (Linux and macOS already #include them within netinet/ip.h)
  */
@@ -581,7 +582,6 @@ static int gpst_parse_config_xml(struct openconnect_info *vpninfo, xmlNode *xml_
 		} else {
 			/* prevent race condition between esp_mainloop() and gpst_mainloop() timers */
 			vpninfo->dtls_times.last_rekey = time(&vpninfo->new_dtls_started);
-			vpninfo->delay_tunnel_reason = "awaiting GPST ESP connection";
 		}
 	} else if (esp_keys && esp_v4 && new_ip_info.addr) {
 		/* We got ESP keys, an IPv4 esp_magic address, and an IPv4 address */
@@ -701,10 +701,6 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 	vpn_progress(vpninfo, PRG_DEBUG,
 		     _("Connecting to HTTPS tunnel endpoint ...\n"));
 
-	ret = openconnect_open_https(vpninfo);
-	if (ret)
-		return ret;
-
 	reqbuf = buf_alloc();
 	buf_append(reqbuf, "GET %s?", vpninfo->urlpath);
 	filter_opts(reqbuf, vpninfo->cookie, "user,authcookie", 1);
@@ -715,7 +711,9 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 	if (vpninfo->dump_http_traffic)
 		dump_buf(vpninfo, '>', reqbuf->data);
 
-	vpninfo->ssl_write(vpninfo, reqbuf->data, reqbuf->pos);
+	ret = openconnect_https_request(vpninfo, reqbuf);
+	if (ret)
+		goto out;
 
 	if ((ret = vpninfo->ssl_read(vpninfo, buf, 12)) < 0) {
 		if (ret == -EINTR)
@@ -878,37 +876,27 @@ out:
 	return result;
 }
 
-static int run_hip_script(struct openconnect_info *vpninfo)
+static int submit_hip_report(struct openconnect_info *vpninfo,
+			     struct oc_text_buf *report)
 {
-#if !defined(_WIN32) && !defined(__native_client__)
-	int pipefd[2];
 	int ret;
-	pid_t child;
-#endif
 
-	if (!vpninfo->csd_wrapper) {
-		/* Only warn once */
-		if (!vpninfo->last_trojan) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("WARNING: Server asked us to submit HIP report with md5sum %s.\n"
-				       "    VPN connectivity may be disabled or limited without HIP report submission.\n    %s\n"),
-				     vpninfo->csd_token,
-#if defined(_WIN32) || defined(__native_client__)
-				     _("However, running the HIP report submission script on this platform is not yet implemented.")
-#else
-				     _("You need to provide a --csd-wrapper argument with the HIP report submission script.")
-#endif
-				);
-			/* XXX: Many GlobalProtect VPNs work fine despite allegedly requiring HIP report submission */
-		}
-		return 0;
+	ret = check_or_submit_hip_report(vpninfo, report->data);
+	if (ret < 0) {
+		vpn_progress(vpninfo, PRG_ERR, _("HIP report submission failed.\n"));
+		return ret;
 	}
 
-#if defined(_WIN32) || defined(__native_client__)
-	vpn_progress(vpninfo, PRG_ERR,
-		     _("Error: Running the 'HIP Report' script on this platform is not yet implemented.\n"));
-	return -EPERM;
-#else
+	vpn_progress(vpninfo, PRG_INFO, _("HIP report submitted successfully.\n"));
+	return 0;
+}
+
+#if !defined(_WIN32) && !defined(__native_client__)
+/* Start the HIP script, with its output (the report) going to *fd. */
+static pid_t spawn_hip_script(struct openconnect_info *vpninfo, int *fd)
+{
+	int pipefd[2];
+	pid_t child;
 
 	vpn_progress(vpninfo, PRG_INFO,
 		     _("Trying to run HIP Trojan script '%s'.\n"),
@@ -920,7 +908,7 @@ static int run_hip_script(struct openconnect_info *vpninfo)
 	{
 		if (pipe(pipefd)) {
 			vpn_progress(vpninfo, PRG_ERR, _("Failed to create pipe for HIP script\n"));
-			return -EPERM;
+			return -1;
 		}
 		set_fd_cloexec(pipefd[0]);
 		set_fd_cloexec(pipefd[1]);
@@ -928,44 +916,14 @@ static int run_hip_script(struct openconnect_info *vpninfo)
 	child = fork();
 	if (child == -1) {
 		vpn_progress(vpninfo, PRG_ERR, _("Failed to fork for HIP script\n"));
-		return -EPERM;
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
 	} else if (child > 0) {
-		/* in parent: read report from child */
-		struct oc_text_buf *report_buf = buf_alloc();
-		char b[256];
-		int i, status;
+		/* in parent: the caller reads the report from the child */
 		close(pipefd[1]);
-
-		buf_truncate(report_buf);
-		while ((i = read(pipefd[0], b, sizeof(b))) > 0)
-			buf_append_bytes(report_buf, b, i);
-
-		waitpid(child, &status, 0);
-		if (!WIFEXITED(status)) {
-			vpn_progress(vpninfo, PRG_ERR,
-						 _("HIP script '%s' exited abnormally\n"),
-						 vpninfo->csd_wrapper);
-			ret = -EINVAL;
-		} else if (WEXITSTATUS(status) != 0) {
-			vpn_progress(vpninfo, PRG_ERR,
-						 _("HIP script '%s' returned non-zero status: %d\n"),
-						 vpninfo->csd_wrapper, WEXITSTATUS(status));
-			ret = -EINVAL;
-		} else {
-			vpn_progress(vpninfo, PRG_INFO,
-				     _("HIP script '%s' completed successfully (report is %d bytes).\n"),
-				     vpninfo->csd_wrapper, report_buf->pos);
-
-			ret = check_or_submit_hip_report(vpninfo, report_buf->data);
-			if (ret < 0)
-				vpn_progress(vpninfo, PRG_ERR, _("HIP report submission failed.\n"));
-			else {
-				vpn_progress(vpninfo, PRG_INFO, _("HIP report submitted successfully.\n"));
-				ret = 0;
-			}
-		}
-		buf_free(report_buf);
-		return ret;
+		*fd = pipefd[0];
+		return child;
 	} else {
 		/* in child: run HIP script */
 		const char *hip_argv[32];
@@ -999,7 +957,81 @@ static int run_hip_script(struct openconnect_info *vpninfo)
 				 _("Failed to exec HIP script %s\n"), hip_argv[0]);
 		exit(1);
 	}
+}
 
+/* Reap the HIP script once it has closed its output. */
+static int hip_script_status(struct openconnect_info *vpninfo, pid_t child,
+			     struct oc_text_buf *report)
+{
+	int status;
+
+	waitpid(child, &status, 0);
+	if (!WIFEXITED(status)) {
+		vpn_progress(vpninfo, PRG_ERR,
+					 _("HIP script '%s' exited abnormally\n"),
+					 vpninfo->csd_wrapper);
+		return -EINVAL;
+	} else if (WEXITSTATUS(status) != 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+					 _("HIP script '%s' returned non-zero status: %d\n"),
+					 vpninfo->csd_wrapper, WEXITSTATUS(status));
+		return -EINVAL;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("HIP script '%s' completed successfully (report is %d bytes).\n"),
+		     vpninfo->csd_wrapper, report->pos);
+	return buf_error(report);
+}
+#endif /* !_WIN32 && !__native_client__ */
+
+static int run_hip_script(struct openconnect_info *vpninfo)
+{
+#if !defined(_WIN32) && !defined(__native_client__)
+	struct oc_text_buf *report_buf;
+	char b[256];
+	int fd, i, ret;
+	pid_t child;
+#endif
+
+	if (!vpninfo->csd_wrapper) {
+		/* Only warn once */
+		if (!vpninfo->last_trojan) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("WARNING: Server asked us to submit HIP report with md5sum %s.\n"
+				       "    VPN connectivity may be disabled or limited without HIP report submission.\n    %s\n"),
+				     vpninfo->csd_token,
+#if defined(_WIN32) || defined(__native_client__)
+				     _("However, running the HIP report submission script on this platform is not yet implemented.")
+#else
+				     _("You need to provide a --csd-wrapper argument with the HIP report submission script.")
+#endif
+				);
+			/* XXX: Many GlobalProtect VPNs work fine despite allegedly requiring HIP report submission */
+		}
+		return 0;
+	}
+
+#if defined(_WIN32) || defined(__native_client__)
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("Error: Running the 'HIP Report' script on this platform is not yet implemented.\n"));
+	return -EPERM;
+#else
+	child = spawn_hip_script(vpninfo, &fd);
+	if (child == -1)
+		return -EPERM;
+
+	report_buf = buf_alloc();
+	while ((i = read(fd, b, sizeof(b))) > 0)
+		buf_append_bytes(report_buf, b, i);
+	close(fd);
+
+	ret = hip_script_status(vpninfo, child, report_buf);
+	if (!ret)
+		ret = submit_hip_report(vpninfo, report_buf);
+
+	buf_free(report_buf);
+	return ret;
 #endif /* !_WIN32 && !__native_client__ */
 }
 
@@ -1019,6 +1051,100 @@ static int check_and_maybe_submit_hip_report(struct openconnect_info *vpninfo)
 	return ret;
 }
 
+#if !defined(_WIN32) && !defined(__native_client__)
+/* Kill a periodic HIP script which has hung, rather than never running
+ * it again because the last one is still going. */
+#define HIP_SCRIPT_TIMEOUT 120
+
+/* For the periodic re-check, run the script in the background while the
+ * tunnel carries on, and collect its report in gpst_hip_mainloop(). */
+static int start_hip_script(struct openconnect_info *vpninfo)
+{
+	pid_t child;
+	int fd;
+
+	child = spawn_hip_script(vpninfo, &fd);
+	if (child == -1)
+		return -EPERM;
+
+	buf_free(vpninfo->hip_report);
+	vpninfo->hip_report = buf_alloc();
+	vpninfo->hip_pid = child;
+	vpninfo->hip_fd = fd;
+	vpninfo->hip_started = time(NULL);
+	set_sock_nonblock(fd);
+	monitor_fd_new(vpninfo, hip);
+	monitor_read_fd(vpninfo, hip);
+	return 0;
+}
+
+/* As check_and_maybe_submit_hip_report(), but with the script started in
+ * the background if the gateway wants a report. */
+static int check_and_maybe_start_hip_script(struct openconnect_info *vpninfo)
+{
+	int ret;
+
+	ret = check_or_submit_hip_report(vpninfo, NULL);
+	if (ret == -EAGAIN) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Gateway says HIP report submission is needed.\n"));
+		ret = start_hip_script(vpninfo);
+	} else if (ret == 0)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Gateway says no HIP report submission is needed.\n"));
+
+	return ret;
+}
+
+static int gpst_hip_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+	char b[256];
+	int i, ret;
+
+	while ((i = read(vpninfo->hip_fd, b, sizeof(b))) > 0)
+		buf_append_bytes(vpninfo->hip_report, b, i);
+	if (i < 0 && (errno == EAGAIN || errno == EINTR)) {
+		if (!ka_check_deadline(timeout, time(NULL),
+				       vpninfo->hip_started + HIP_SCRIPT_TIMEOUT))
+			return 0;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("HIP script '%s' still running after %d seconds; killing it\n"),
+			     vpninfo->csd_wrapper, HIP_SCRIPT_TIMEOUT);
+		kill(vpninfo->hip_pid, SIGKILL);
+	}
+
+	unmonitor_fd(vpninfo, hip);
+	close(vpninfo->hip_fd);
+	vpninfo->hip_fd = -1;
+
+	ret = hip_script_status(vpninfo, vpninfo->hip_pid, vpninfo->hip_report);
+	if (ret)
+		goto out;
+
+	/* Only now does the HTTPS tunnel, if that's what we're using,
+	 * have to make way for the submission. */
+	openconnect_close_https(vpninfo, 0);
+	ret = submit_hip_report(vpninfo, vpninfo->hip_report);
+
+ out:
+	buf_free(vpninfo->hip_report);
+	vpninfo->hip_report = NULL;
+
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR, _("HIP check or report failed\n"));
+		vpninfo->quit_reason = "HIP check or report failed";
+		return ret;
+	}
+
+	/* Don't leave the HTTPS connection behind if ESP is in use */
+	if (vpninfo->dtls_state == DTLS_ESTABLISHED)
+		openconnect_close_https(vpninfo, 0);
+	else if (gpst_connect(vpninfo))
+		vpninfo->quit_reason = "GPST connect failed";
+	return 1;
+}
+#endif /* !_WIN32 && !__native_client__ */
+
 int gpst_setup(struct openconnect_info *vpninfo)
 {
 	int ret;
@@ -1056,6 +1182,83 @@ out:
 	return ret;
 }
 
+/* The options which vpnc-script gets to see, so that we can tell
+ * whether a rekey actually changed anything. */
+static struct oc_text_buf *gpst_opts_snapshot(struct openconnect_info *vpninfo)
+{
+	struct oc_text_buf *buf = buf_alloc();
+	struct oc_vpn_option *opt;
+
+	for (opt = vpninfo->cstp_options; opt; opt = opt->next)
+		buf_append(buf, "%s=%s\n", opt->option, opt->value);
+
+	return buf;
+}
+
+/* Rekey while ESP is carrying the traffic, without tearing it down.
+ * Fetching the config gives us new keys; the new inbound SA goes into
+ * the other esp_in[] slot, so packets still in flight on the old one
+ * are accepted. The socket stays as it is, and the tun device is left
+ * alone unless the configuration changed. Returns non-zero if we need
+ * to fall back to a full reconnect. */
+static int gpst_rekey_esp(struct openconnect_info *vpninfo)
+{
+	struct oc_text_buf *old_opts, *new_opts = NULL;
+	uint32_t old_spi = vpninfo->esp_out.spi;
+	int mtu = vpninfo->ip_info.mtu, max_mtu = vpninfo->pmtud.max;
+	int ret;
+
+	old_opts = gpst_opts_snapshot(vpninfo);
+
+	ret = gpst_get_config(vpninfo);
+	if (!ret)
+		ret = check_and_maybe_submit_hip_report(vpninfo);
+
+	/* Don't keep the HTTPS connection; ESP is all we need */
+	openconnect_close_https(vpninfo, 0);
+	if (ret)
+		goto out;
+
+	vpninfo->last_trojan = time(NULL);
+
+	if (vpninfo->dtls_state != DTLS_ESTABLISHED ||
+	    vpninfo->esp_out.spi == old_spi) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("GlobalProtect rekey did not provide new ESP keys\n"));
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Keep what PMTUD found, unless the server changed the MTU */
+	if (vpninfo->ip_info.mtu == (max_mtu ? : mtu)) {
+		vpninfo->ip_info.mtu = mtu;
+		vpninfo->pmtud.max = max_mtu;
+	}
+
+	/* Let the gateway see the new SA in use straight away */
+	gpst_esp_send_probes(vpninfo);
+
+	new_opts = gpst_opts_snapshot(vpninfo);
+	if (buf_error(old_opts) || buf_error(new_opts) ||
+	    old_opts->pos != new_opts->pos ||
+	    (old_opts->pos && memcmp(old_opts->data, new_opts->data, old_opts->pos))) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("GlobalProtect configuration changed on rekey\n"));
+		if (tun_is_up(vpninfo)) {
+			script_config_tun(vpninfo, "reconnect");
+			if (vpninfo->reconnected)
+				vpninfo->reconnected(vpninfo->cbdata);
+		}
+	} else
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("GlobalProtect ESP rekeyed; configuration unchanged\n"));
+
+ out:
+	buf_free(old_opts);
+	buf_free(new_opts);
+	return ret;
+}
+
 int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 {
 	int ret;
@@ -1063,6 +1266,14 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	uint16_t ethertype;
 	uint32_t one, zero, magic;
 
+#if !defined(_WIN32) && !defined(__native_client__)
+	if (vpninfo->hip_fd != -1) {
+		ret = gpst_hip_mainloop(vpninfo, timeout);
+		if (ret)
+			return ret;
+	}
+#endif
+
 	/* Starting the HTTPS tunnel kills ESP, so we avoid starting
 	 * it if the ESP tunnel is connected or connecting.
 	 */
@@ -1090,11 +1301,11 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		return 0;
 	case DTLS_SECRET:
 	case DTLS_SLEEPING:
-		/* Allow 5 seconds after configuration for ESP to start */
-		if (!ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + 5)) {
-			vpninfo->delay_tunnel_reason = "awaiting GPST ESP connection";
+		/* Allow 5 seconds after configuration for ESP to start. The
+		 * tunnel is already up, but we can't carry its traffic over
+		 * HTTPS in the meantime; it waits on the queue for ESP. */
+		if (!ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + 5))
 			return 0;
-		}
 
 		/* ... before we switch to HTTPS instead */
 		vpn_progress(vpninfo, PRG_ERR,
@@ -1167,6 +1378,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		case 0:
 			vpn_progress(vpninfo, PRG_DEBUG,
 				     _("Got GPST DPD/keepalive response\n"));
+			ka_probe_rcvd(&vpninfo->ssl_times);
 
 			if (one != 0 || zero != 0) {
 				vpn_progress(vpninfo, PRG_DEBUG,
@@ -1243,6 +1455,11 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	if (trojan_check_deadline(vpninfo, timeout)) {
 	do_recheck_hip:
 		vpn_progress(vpninfo, PRG_INFO, _("GlobalProtect HIP check due\n"));
+#if !defined(_WIN32) && !defined(__native_client__)
+		/* Still running from last time, until its deadline */
+		if (vpninfo->hip_fd != -1)
+			return 1;
+#endif
 		/* We could just be lazy and treat this as a reconnect, but that
 		 * would require us to repull the routing configuration and new ESP
 		 * keys, instead of just redoing the HIP check/submission.
@@ -1252,7 +1469,15 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		 * if needed.
 		 */
 		openconnect_close_https(vpninfo, 0);
-		ret = check_and_maybe_submit_hip_report(vpninfo);
+#if !defined(_WIN32) && !defined(__native_client__)
+		/* The script can take a while, so don't stop the tunnel for
+		 * it. If it's needed, run it in the background and submit its
+		 * report from gpst_hip_mainloop() when it has finished. */
+		if (vpninfo->csd_wrapper)
+			ret = check_and_maybe_start_hip_script(vpninfo);
+		else
+#endif
+			ret = check_and_maybe_submit_hip_report(vpninfo);
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("HIP check or report failed\n"));
 			vpninfo->quit_reason = "HIP check or report failed";
@@ -1268,6 +1493,9 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	case KA_REKEY:
 	do_rekey:
 		vpn_progress(vpninfo, PRG_INFO, _("GlobalProtect rekey due\n"));
+		if (vpninfo->dtls_state == DTLS_ESTABLISHED &&
+		    !gpst_rekey_esp(vpninfo))
+			return 1;
 		goto do_reconnect;
 	case KA_DPD_DEAD:
 	peer_dead:
@@ -1294,6 +1522,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send GPST DPD/keepalive request\n"));
 
+		ka_probe_sent(&vpninfo->ssl_times);
 		vpninfo->current_ssl_pkt = (struct pkt *)&dpd_pkt;
 		goto handle_outgoing;
 	}
@@ -1326,27 +1555,112 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 }
 
 #ifdef HAVE_ESP
-static inline uint32_t csum_partial(uint16_t *buf, int nwords)
-{
-	uint32_t sum = 0;
-	for(sum=0; nwords>0; nwords--)
-		sum += ntohs(*buf++);
-	return sum;
-}
+static char magic_ping_payload[16] = "monitor\x00\x00pan ha ";
 
-static inline uint16_t csum_finish(uint32_t sum)
+/* Build a magic ping of plen bytes in total, padded with zeroes if
+ * larger than the minimum (for MTU probes). */
+static void build_magic_ping(struct openconnect_info *vpninfo, struct pkt *pkt,
+			     int plen, int seq)
 {
-	sum = (sum >> 16) + (sum &0xffff);
-	sum += (sum >> 16);
-	return htons((uint16_t)(~sum));
+	/* Zero one byte past the end, so that an odd-length
+	 * ICMP payload checksums correctly. */
+	memset(pkt, 0, sizeof(*pkt) + plen + 1);
+	pkt->len = plen;
+
+	if (vpninfo->esp_magic_af == AF_INET6) {
+		struct ip6_hdr *iph = (void *)pkt->data;
+		struct icmp6_hdr *icmph = (void *)(pkt->data + sizeof(*iph));
+		int icmplen = plen - sizeof(*iph);
+
+		/* IPv6 Header */
+		iph->ip6_flow = htonl((6 << 28) + /* version 6 */
+				      (0 << 20) + /* traffic class; match Windows client */
+				      (0 << 0));  /* flow ID; match Windows client */
+		iph->ip6_nxt = IPPROTO_ICMPV6;
+		iph->ip6_plen = htons(icmplen);
+		iph->ip6_hlim = 128; /* what the Windows client uses */
+		inet_pton(AF_INET6, vpninfo->ip_info.addr6, &iph->ip6_src);
+		memcpy(&iph->ip6_dst, vpninfo->esp_magic, 16);
+
+		/* ICMPv6 echo request */
+		icmph->icmp6_type = ICMP6_ECHO_REQUEST;
+		icmph->icmp6_code = 0;
+		/* Windows client seemingly uses random IDs here but fall back to
+		 * 0x4747 even if only to keep Coverity happy about error checking. */
+		if (openconnect_random(&icmph->icmp6_data16[0], 2))
+			icmph->icmp6_data16[0] = htons(0x4747);
+		icmph->icmp6_data16[1] = htons(seq);            /* sequence */
+
+		/* required to get gateway to respond */
+		memcpy(&icmph[1], magic_ping_payload, sizeof(magic_ping_payload));
+
+		/*
+		 * IPv6 upper-layer checksums include a pseudo-header
+		 * for IPv6 which contains the source address, the
+		 * destination address, the upper-layer packet length
+		 * and next-header field. See RFC8200 §8.1. The
+		 * checksum is as follows:
+		 *
+		 *   checksum 32 bytes of real IPv6 header:
+		 *     src addr (16 bytes)
+		 *     dst addr (16 bytes)
+		 *   8 bytes more:
+		 *     length of ICMPv6 in bytes (be32)
+		 *     3 bytes of 0
+		 *     next header byte (IPPROTO_ICMPV6)
+		 *   Then the actual ICMPv6 bytes
+		 */
+		uint32_t sum = csum_partial((uint16_t *)&iph->ip6_src, 8);      /* 8 uint16_t */
+		sum += csum_partial((uint16_t *)&iph->ip6_dst, 8);              /* 8 uint16_t */
+
+		/* The easiest way to checksum the following 8-byte
+		 * part of the pseudo-header without horridly violating
+		 * C type aliasing rules is *not* to build it in memory
+		 * at all. We know the length fits in 16 bits so the
+		 * partial checksum of 00 00 LL LL 00 00 00 NH ends up
+		 * being just LLLL + NH.
+		 */
+		sum += IPPROTO_ICMPV6;
+		sum += icmplen;
+
+		sum += csum_partial((uint16_t *)icmph, (icmplen + 1) / 2);
+		icmph->icmp6_cksum = csum_finish(sum);
+	} else {
+		struct ip *iph = (void *)pkt->data;
+		struct icmp *icmph = (void *)(pkt->data + sizeof(*iph));
+		char *pmagic = (void *)(pkt->data + sizeof(*iph) + ICMP_MINLEN);
+		int icmplen = plen - sizeof(*iph);
+
+		/* IP Header */
+		iph->ip_hl = 5;
+		iph->ip_v = 4;
+		iph->ip_len = htons(plen);
+		iph->ip_id = htons(0x4747); /* what the Windows client uses */
+		iph->ip_off = htons(IP_DF); /* don't fragment, frag offset = 0 */
+		iph->ip_ttl = 64; /* hops */
+		iph->ip_p = IPPROTO_ICMP;
+		iph->ip_src.s_addr = inet_addr(vpninfo->ip_info.addr);
+		memcpy(&iph->ip_dst.s_addr, vpninfo->esp_magic, 4);
+		iph->ip_sum = csum((uint16_t *)iph, sizeof(*iph)/2);
+
+		/* ICMP echo request */
+		icmph->icmp_type = ICMP_ECHO;
+		icmph->icmp_hun.ih_idseq.icd_id = htons(0x4747);
+		icmph->icmp_hun.ih_idseq.icd_seq = htons(seq);
+		memcpy(pmagic, magic_ping_payload, sizeof(magic_ping_payload)); /* required to get gateway to respond */
+		icmph->icmp_cksum = csum((uint16_t *)icmph, (icmplen + 1) / 2);
+	}
 }
 
-static inline uint16_t csum(uint16_t *buf, int nwords)
+static int magic_ping_len(struct openconnect_info *vpninfo)
 {
-	return csum_finish(csum_partial(buf, nwords));
-}
+	const int icmplen = ICMP_MINLEN + sizeof(magic_ping_payload);
 
-static char magic_ping_payload[16] = "monitor\x00\x00pan ha ";
+	if (vpninfo->esp_magic_af == AF_INET6)
+		return sizeof(struct ip6_hdr) + icmplen;
+	else
+		return sizeof(struct ip) + icmplen;
+}
 
 int gpst_esp_send_probes(struct openconnect_info *vpninfo)
 {
@@ -1368,14 +1682,10 @@ int gpst_esp_send_probes(struct openconnect_info *vpninfo)
 	 *
 	 *    Don't blame me. I didn't design this.
 	 */
-	const int icmplen = ICMP_MINLEN + sizeof(magic_ping_payload);
-	int plen, seq;
+	int plen = magic_ping_len(vpninfo);
+	int seq;
 
-	if (vpninfo->esp_magic_af == AF_INET6)
-		plen = sizeof(struct ip6_hdr) + icmplen;
-	else
-		plen = sizeof(struct ip) + icmplen;
-	struct pkt *pkt = alloc_pkt(vpninfo, plen + vpninfo->pkt_trailer);
+	struct pkt *pkt = alloc_pkt(vpninfo, plen + 1 + vpninfo->pkt_trailer);
 	if (!pkt)
 		return -ENOMEM;
 
@@ -1394,91 +1704,7 @@ int gpst_esp_send_probes(struct openconnect_info *vpninfo)
 	}
 
 	for (seq=1; seq <= (vpninfo->dtls_state==DTLS_ESTABLISHED ? 1 : 3); seq++) {
-		if (vpninfo->esp_magic_af == AF_INET6) {
-			memset(pkt, 0, sizeof(*pkt) + plen);
-			pkt->len = plen;
-			struct ip6_hdr *iph = (void *)pkt->data;
-			struct icmp6_hdr *icmph = (void *)(pkt->data + sizeof(*iph));
-
-			/* IPv6 Header */
-			iph->ip6_flow = htonl((6 << 28) + /* version 6 */
-					      (0 << 20) + /* traffic class; match Windows client */
-					      (0 << 0));  /* flow ID; match Windows client */
-			iph->ip6_nxt = IPPROTO_ICMPV6;
-			iph->ip6_plen = htons(icmplen);
-			iph->ip6_hlim = 128; /* what the Windows client uses */
-			inet_pton(AF_INET6, vpninfo->ip_info.addr6, &iph->ip6_src);
-			memcpy(&iph->ip6_dst, vpninfo->esp_magic, 16);
-
-			/* ICMPv6 echo request */
-			icmph->icmp6_type = ICMP6_ECHO_REQUEST;
-			icmph->icmp6_code = 0;
-			/* Windows client seemingly uses random IDs here but fall back to
-			 * 0x4747 even if only to keep Coverity happy about error checking. */
-			if (openconnect_random(&icmph->icmp6_data16[0], 2))
-				icmph->icmp6_data16[0] = htons(0x4747);
-			icmph->icmp6_data16[1] = htons(seq);            /* sequence */
-
-			/* required to get gateway to respond */
-			memcpy(&icmph[1], magic_ping_payload, sizeof(magic_ping_payload));
-
-			/*
-			 * IPv6 upper-layer checksums include a pseudo-header
-			 * for IPv6 which contains the source address, the
-			 * destination address, the upper-layer packet length
-			 * and next-header field. See RFC8200 §8.1. The
-			 * checksum is as follows:
-			 *
-			 *   checksum 32 bytes of real IPv6 header:
-			 *     src addr (16 bytes)
-			 *     dst addr (16 bytes)
-			 *   8 bytes more:
-			 *     length of ICMPv6 in bytes (be32)
-			 *     3 bytes of 0
-			 *     next header byte (IPPROTO_ICMPV6)
-			 *   Then the actual ICMPv6 bytes
-			 */
-			uint32_t sum = csum_partial((uint16_t *)&iph->ip6_src, 8);      /* 8 uint16_t */
-			sum += csum_partial((uint16_t *)&iph->ip6_dst, 8);              /* 8 uint16_t */
-
-			/* The easiest way to checksum the following 8-byte
-			 * part of the pseudo-header without horridly violating
-			 * C type aliasing rules is *not* to build it in memory
-			 * at all. We know the length fits in 16 bits so the
-			 * partial checksum of 00 00 LL LL 00 00 00 NH ends up
-			 * being just LLLL + NH.
-			 */
-			sum += IPPROTO_ICMPV6;
-			sum += ICMP_MINLEN + sizeof(magic_ping_payload);
-
-			sum += csum_partial((uint16_t *)icmph, icmplen / 2);
-			icmph->icmp6_cksum = csum_finish(sum);
-		} else {
-			memset(pkt, 0, sizeof(*pkt) + plen);
-			pkt->len = plen;
-			struct ip *iph = (void *)pkt->data;
-			struct icmp *icmph = (void *)(pkt->data + sizeof(*iph));
-			char *pmagic = (void *)(pkt->data + sizeof(*iph) + ICMP_MINLEN);
-
-			/* IP Header */
-			iph->ip_hl = 5;
-			iph->ip_v = 4;
-			iph->ip_len = htons(sizeof(*iph) + icmplen);
-			iph->ip_id = htons(0x4747); /* what the Windows client uses */
-			iph->ip_off = htons(IP_DF); /* don't fragment, frag offset = 0 */
-			iph->ip_ttl = 64; /* hops */
-			iph->ip_p = IPPROTO_ICMP;
-			iph->ip_src.s_addr = inet_addr(vpninfo->ip_info.addr);
-			memcpy(&iph->ip_dst.s_addr, vpninfo->esp_magic, 4);
-			iph->ip_sum = csum((uint16_t *)iph, sizeof(*iph)/2);
-
-			/* ICMP echo request */
-			icmph->icmp_type = ICMP_ECHO;
-			icmph->icmp_hun.ih_idseq.icd_id = htons(0x4747);
-			icmph->icmp_hun.ih_idseq.icd_seq = htons(seq);
-			memcpy(pmagic, magic_ping_payload, sizeof(magic_ping_payload)); /* required to get gateway to respond */
-			icmph->icmp_cksum = csum((uint16_t *)icmph, (ICMP_MINLEN+sizeof(magic_ping_payload))/2);
-		}
+		build_magic_ping(vpninfo, pkt, plen, seq);
 
 		if (vpninfo->dtls_state != DTLS_ESTABLISHED) {
 			vpn_progress(vpninfo, PRG_TRACE, _("ICMPv%d probe packet (seq %d) for GlobalProtect ESP:\n"),
@@ -1499,6 +1725,43 @@ int gpst_esp_send_probes(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+/* The gateway echoes the whole payload of the magic ping, so a padded
+ * one works nicely as an MTU probe. */
+int gpst_esp_send_mtu_probe(struct openconnect_info *vpninfo, int len)
+{
+	struct pkt *pkt;
+	int pktlen, ret = 0;
+
+	if (len < magic_ping_len(vpninfo))
+		return -EINVAL;
+
+	pkt = alloc_pkt(vpninfo, len + 1 + vpninfo->pkt_trailer);
+	if (!pkt)
+		return -ENOMEM;
+
+	build_magic_ping(vpninfo, pkt, len, 0);
+
+	pktlen = construct_esp_packet(vpninfo, pkt, vpninfo->esp_magic_af == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IPIP);
+	if (pktlen < 0) {
+		ret = -EIO;
+	} else if (send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0) < 0) {
+		/* A full socket buffer says nothing about the path */
+		if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK)
+			ret = -EAGAIN;
+		else if (errno == EMSGSIZE)
+			ret = -EMSGSIZE;
+		else
+			ret = -EIO;
+	} else
+		time(&vpninfo->dtls_times.last_tx);
+
+	if (ret)
+		vpn_progress(vpninfo, PRG_DEBUG, _("Failed to send ESP probe\n"));
+
+	free_pkt(vpninfo, pkt);
+	return ret;
+}
+
 int gpst_esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
 	if (vpninfo->esp_magic_af == AF_INET6) {
@@ -0,0 +1,247 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/* RFC1191 says the ICMP error should contain as much of the original
+ * datagram as will fit in a minimum-sized (576 bytes) reassembly buffer,
+ * and RFC4443 §2.4 likewise for the IPv6 minimum MTU of 1280 bytes. */
+#define ICMP4_ERR_MAXLEN 576
+#define ICMP6_ERR_MAXLEN 1280
+
+/* IPv6 hosts ignore a Packet Too Big with an MTU lower than this (RFC8201
+ * §4), so packets up to this size are sent even if the tunnel MTU is less. */
+#define IPV6_MIN_MTU 1280
+
+/* Maximum number of synthesised errors per second */
+#define ICMP_RATELIMIT 10
+
+#define IPPROTO_ICMP_ 1
+#define IPPROTO_ICMPV6_ 58
+
+static int icmp_ratelimited(struct openconnect_info *vpninfo)
+{
+	time_t now = time(NULL);
+
+	if (now != vpninfo->icmp_ratelimit_time) {
+		vpninfo->icmp_ratelimit_time = now;
+		vpninfo->icmp_ratelimit_count = 0;
+	}
+	return vpninfo->icmp_ratelimit_count++ >= ICMP_RATELIMIT;
+}
+
+/* Never send an ICMP error in response to an ICMP error (RFC1122 §3.2.2,
+ * RFC4443 §2.4(e)). */
+static int is_icmp_error(const unsigned char *data, int len, int hdrlen)
+{
+	if ((data[0] >> 4) == 4) {
+		if (data[9] != IPPROTO_ICMP_ || len <= hdrlen)
+			return 0;
+		switch (data[hdrlen]) {
+		case 3: /* Destination unreachable */
+		case 4: /* Source quench */
+		case 5: /* Redirect */
+		case 11: /* Time exceeded */
+		case 12: /* Parameter problem */
+			return 1;
+		}
+		return 0;
+	}
+
+	/* ICMPv6 error messages have types 0-127 */
+	return data[6] == IPPROTO_ICMPV6_ && len > hdrlen && data[hdrlen] < 128;
+}
+
+/* Build an ICMPv4 error (RFC792) in response to an outbound packet, with
+ * the 32-bit field after the checksum set to @info. It appears to come
+ * from the original destination, so that it passes any reverse path
+ * filtering on the tun device. */
+static struct pkt *build_icmp4_error(struct openconnect_info *vpninfo,
+				     const unsigned char *data, int len,
+				     int type, int code, uint32_t info)
+{
+	int quote = MIN(len, ICMP4_ERR_MAXLEN - 28);
+	/* Room to pad an odd length with a zero byte for the checksum */
+	struct pkt *new = alloc_pkt(vpninfo, 28 + quote + 1);
+	unsigned char *p;
+
+	if (!new)
+		return NULL;
+
+	new->len = 28 + quote;
+	new->next = NULL;
+	p = new->data;
+	memset(p, 0, 28);
+
+	/* IPv4 header */
+	p[0] = 0x45;
+	store_be16(p + 2, new->len);
+	p[8] = 64; /* TTL */
+	p[9] = IPPROTO_ICMP_;
+	memcpy(p + 12, data + 16, 4); /* Source is the original destination */
+	memcpy(p + 16, data + 12, 4); /* Destination is the original source */
+	store_be16(p + 10, ntohs(csum((uint16_t *)p, 10)));
+
+	p[20] = type;
+	p[21] = code;
+	store_be32(p + 24, info);
+	memcpy(p + 28, data, quote);
+	p[28 + quote] = 0;
+	store_be16(p + 22, ntohs(csum((uint16_t *)(p + 20), (8 + quote + 1) / 2)));
+
+	return new;
+}
+
+/* Build an ICMPv6 error (RFC4443 §2.1), likewise. */
+static struct pkt *build_icmp6_error(struct openconnect_info *vpninfo,
+				     const unsigned char *data, int len,
+				     int type, int code, uint32_t info)
+{
+	int quote = MIN(len, ICMP6_ERR_MAXLEN - 48);
+	struct pkt *new = alloc_pkt(vpninfo, 48 + quote + 1);
+	unsigned char *p;
+	uint32_t sum;
+
+	if (!new)
+		return NULL;
+
+	new->len = 48 + quote;
+	new->next = NULL;
+	p = new->data;
+	memset(p, 0, 48);
+
+	/* IPv6 header */
+	p[0] = 0x60;
+	store_be16(p + 4, 8 + quote);
+	p[6] = IPPROTO_ICMPV6_;
+	p[7] = 64; /* Hop limit */
+	memcpy(p + 8, data + 24, 16); /* Source is the original destination */
+	memcpy(p + 24, data + 8, 16); /* Destination is the original source */
+
+	p[40] = type;
+	p[41] = code;
+	store_be32(p + 44, info);
+	memcpy(p + 48, data, quote);
+	p[48 + quote] = 0;
+
+	/* Pseudo-header (RFC8200 §8.1) is source and destination addresses,
+	 * upper-layer length and next header, then the ICMPv6 message. */
+	sum = csum_partial((uint16_t *)(p + 8), 16);
+	sum += IPPROTO_ICMPV6_;
+	sum += 8 + quote;
+	sum += csum_partial((uint16_t *)(p + 40), (8 + quote + 1) / 2);
+	store_be16(p + 42, ntohs(csum_finish(sum)));
+
+	return new;
+}
+
+/* Called for packets read from the tun device which are larger than the
+ * tunnel can currently carry. Rather than letting them be dropped (or
+ * truncated) somewhere along the way, bounce an ICMP error back into the
+ * tun device with the MTU which *will* work, so that the local stack's
+ * path MTU discovery converges immediately.
+ *
+ * Returns 1 if the packet should be dropped, 0 if it should be sent
+ * anyway (IPv4 without DF set, or something we don't understand). */
+int icmp_pkt_too_big(struct openconnect_info *vpninfo, struct pkt *pkt, int mtu)
+{
+	const unsigned char *data = pkt->data;
+	int len = pkt->len;
+	struct pkt *new;
+	int hdrlen;
+
+	if (len < 20)
+		return 0;
+
+	if ((data[0] >> 4) == 4) {
+		hdrlen = (data[0] & 0xf) * 4;
+		/* Without DF, the sender doesn't care. Let it through. */
+		if (hdrlen < 20 || len < hdrlen || !(load_be16(data + 6) & 0x4000))
+			return 0;
+	} else if ((data[0] >> 4) == 6) {
+		hdrlen = 40;
+		/* Nothing smaller can be asked for, so send it anyway */
+		if (len < hdrlen || len <= IPV6_MIN_MTU)
+			return 0;
+	} else
+		return 0;
+
+	if (is_icmp_error(data, len, hdrlen) || icmp_ratelimited(vpninfo))
+		return 1;
+
+	/* ICMPv6 Packet Too Big (RFC4443 §3.2), or ICMPv4 Destination
+	 * Unreachable, Fragmentation Needed and DF set (RFC1191). */
+	if (hdrlen == 40)
+		new = build_icmp6_error(vpninfo, data, len, 2, 0, MAX(mtu, IPV6_MIN_MTU));
+	else
+		new = build_icmp4_error(vpninfo, data, len, 3, 4, mtu);
+	if (!new)
+		return 1;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Packet of %d bytes exceeds tunnel MTU %d; sending ICMPv%d error to tun\n"),
+		     len, mtu, hdrlen == 40 ? 6 : 4);
+	queue_packet(&vpninfo->incoming_queue, new);
+	return 1;
+}
+
+/* Called for packets read from the tun device which the server is never
+ * going to route, because they are outside the split includes. Answer
+ * with "administratively prohibited" so that the sender gives up at once
+ * instead of waiting for a timeout. The caller drops the packet. */
+void icmp_prohibited(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	const unsigned char *data = pkt->data;
+	int len = pkt->len;
+	struct pkt *new;
+	int hdrlen;
+
+	if (len < 20)
+		return;
+
+	if ((data[0] >> 4) == 4) {
+		hdrlen = (data[0] & 0xf) * 4;
+		/* Not for fragments other than the first (RFC1122 §3.2.2),
+		 * nor broadcast, multicast or unspecified addresses. */
+		if (hdrlen < 20 || len < hdrlen || (load_be16(data + 6) & 0x1fff) ||
+		    data[16] >= 224 || !load_be32(data + 12))
+			return;
+	} else if ((data[0] >> 4) == 6) {
+		static const unsigned char zero[16];
+
+		hdrlen = 40;
+		if (len < hdrlen || data[24] == 0xff || !memcmp(data + 8, zero, 16))
+			return;
+	} else
+		return;
+
+	if (is_icmp_error(data, len, hdrlen) || icmp_ratelimited(vpninfo))
+		return;
+
+	if (hdrlen == 40)
+		new = build_icmp6_error(vpninfo, data, len, 1, 1, 0);
+	else
+		new = build_icmp4_error(vpninfo, data, len, 3, 13, 0);
+	if (new)
+		queue_packet(&vpninfo->incoming_queue, new);
+}
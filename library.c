@@ -37,6 +37,10 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/wait.h>
+#endif
 
 #include <string.h>
 #include <errno.h>
@@ -77,11 +81,15 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 	init_pkt_queue(&vpninfo->incoming_queue);
 	init_pkt_queue(&vpninfo->outgoing_queue);
 	init_pkt_queue(&vpninfo->tcp_control_queue);
+	init_pkt_queue(&vpninfo->pkt_injected);
 	vpninfo->dtls_tos_current = 0;
 	vpninfo->dtls_pass_tos = 0;
 	vpninfo->ssl_fd = vpninfo->dtls_fd = -1;
+	vpninfo->netmon_fd = vpninfo->new_dtls.fd = -1;
+	vpninfo->dns_fd = vpninfo->dns_up_fd = -1;
+	vpninfo->resolve_fd = -1;
 	vpninfo->cmd_fd = vpninfo->cmd_fd_write = -1;
-	vpninfo->tncc_fd = -1;
+	vpninfo->tncc_fd = vpninfo->hip_fd = -1;
 	vpninfo->cert_expire_warning = 60 * 86400;
 	vpninfo->req_compr = COMPR_STATELESS;
 	vpninfo->max_qlen = 10;
@@ -124,7 +132,7 @@ static const struct vpn_proto openconnect_protos[] = {
 		.pretty_name = N_("Cisco AnyConnect or openconnect"),
 		.description = N_("Compatible with Cisco AnyConnect SSL VPN, as well as ocserv"),
 		.proto = PROTO_ANYCONNECT,
-		.flags = OC_PROTO_PROXY | OC_PROTO_CSD | OC_PROTO_AUTH_CERT | OC_PROTO_AUTH_OTP | OC_PROTO_AUTH_STOKEN,
+		.flags = OC_PROTO_PROXY | OC_PROTO_CSD | OC_PROTO_AUTH_CERT | OC_PROTO_AUTH_OTP | OC_PROTO_AUTH_STOKEN | OC_PROTO_EARLY_DATA,
 		.vpn_close_session = cstp_bye,
 		.tcp_connect = cstp_connect,
 		.tcp_mainloop = cstp_mainloop,
@@ -137,6 +145,7 @@ static const struct vpn_proto openconnect_protos[] = {
 		.udp_mainloop = dtls_mainloop,
 		.udp_close = dtls_close,
 		.udp_shutdown = dtls_shutdown,
+		.udp_send_mtu_probe = dtls_send_mtu_probe,
 #endif
 	}, {
 		.name = "nc",
@@ -164,7 +173,7 @@ static const struct vpn_proto openconnect_protos[] = {
 		.pretty_name = N_("Palo Alto Networks GlobalProtect"),
 		.description = N_("Compatible with Palo Alto Networks (PAN) GlobalProtect SSL VPN"),
 		.proto = PROTO_GPST,
-		.flags = OC_PROTO_PROXY | OC_PROTO_CSD | OC_PROTO_AUTH_CERT | OC_PROTO_AUTH_OTP | OC_PROTO_AUTH_STOKEN | OC_PROTO_PERIODIC_TROJAN,
+		.flags = OC_PROTO_PROXY | OC_PROTO_CSD | OC_PROTO_AUTH_CERT | OC_PROTO_AUTH_OTP | OC_PROTO_AUTH_STOKEN | OC_PROTO_PERIODIC_TROJAN | OC_PROTO_EARLY_DATA,
 		.vpn_close_session = gpst_bye,
 		.tcp_connect = gpst_setup,
 		.tcp_mainloop = gpst_mainloop,
@@ -178,6 +187,7 @@ static const struct vpn_proto openconnect_protos[] = {
 		.udp_shutdown = esp_shutdown,
 		.udp_send_probes = gpst_esp_send_probes,
 		.udp_catch_probe = gpst_esp_catch_probe,
+		.udp_send_mtu_probe = gpst_esp_send_mtu_probe,
 #endif
 	}, {
 		.name = "pulse",
@@ -362,6 +372,7 @@ int openconnect_obtain_cookie(struct openconnect_info *vpninfo)
 			return ret;
 	}
 #endif
+	probe_gw_candidates(vpninfo);
 	return vpninfo->proto->obtain_cookie(vpninfo);
 }
 
@@ -522,7 +533,10 @@ int install_vpn_opts(struct openconnect_info *vpninfo, struct oc_vpn_option *opt
 	/* Preserve gateway_addr and MTU if they were set */
 	ip_info->gateway_addr = vpninfo->ip_info.gateway_addr;
 	if (!ip_info->mtu)
-		ip_info->mtu = vpninfo->ip_info.mtu;
+		ip_info->mtu = vpninfo->pmtud.max ? : vpninfo->ip_info.mtu;
+
+	/* Rediscover the path MTU from the newly negotiated one */
+	vpninfo->pmtud.max = 0;
 
 	if (ip_info->mtu && ip_info->mtu < 1280 &&
 	    (ip_info->addr6 || ip_info->netmask6)) {
@@ -539,7 +553,7 @@ int install_vpn_opts(struct openconnect_info *vpninfo, struct oc_vpn_option *opt
 	vpninfo->cstp_options = opt;
 	vpninfo->ip_info = *ip_info;
 
-	return 0;
+	return split_filter_build(vpninfo);
 }
 
 void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
@@ -549,6 +563,31 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 		vpninfo->proto->udp_shutdown(vpninfo);
 	if (vpninfo->tncc_fd != -1)
 		closesocket(vpninfo->tncc_fd);
+	if (vpninfo->hip_fd != -1) {
+		close(vpninfo->hip_fd);
+#ifndef _WIN32
+		/* A periodic HIP script which hasn't finished yet */
+		kill(vpninfo->hip_pid, SIGKILL);
+		waitpid(vpninfo->hip_pid, NULL, 0);
+#endif
+	}
+	buf_free(vpninfo->hip_report);
+	netcfg_free(vpninfo);
+	free_injected_packets(vpninfo);
+	split_filter_free(vpninfo);
+#ifndef _WIN32
+	socks_free(vpninfo);
+	dnsproxy_free(vpninfo);
+#endif
+#ifdef HAVE_UCONTEXT
+	async_free(vpninfo);
+#endif
+	free_gw_probes(vpninfo);
+	free_gw_candidates(vpninfo);
+	preconnect_free(vpninfo);
+	free_resolved(vpninfo);
+	free_tls_sessions(vpninfo);
+	free(vpninfo->tls_session_file);
 	if (vpninfo->cmd_fd_write != -1) {
 		closesocket(vpninfo->cmd_fd);
 		closesocket(vpninfo->cmd_fd_write);
@@ -575,6 +614,7 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free(vpninfo->ifname_w);
 #endif
 	free(vpninfo->peer_addr);
+	free(vpninfo->peer_addr_alt);
 	free(vpninfo->ip_info.gateway_addr);
 	free_optlist(vpninfo->csd_env);
 	free_optlist(vpninfo->script_env);
@@ -594,6 +634,8 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free_pass(&vpninfo->proxy_pass);
 	free_pass(&vpninfo->certinfo[0].password);
 	free(vpninfo->vpnc_script);
+	free(vpninfo->socks_listen);
+	free(vpninfo->dns_proxy_listen);
 	free(vpninfo->cafile);
 	free(vpninfo->ifname);
 	free(vpninfo->dtls_cipher);
@@ -615,6 +657,7 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 #endif
 #endif
 	free(vpninfo->dtls_addr);
+	free(vpninfo->dtls_addr_alt);
 
 	if (vpninfo->csd_scriptname) {
 		unlink(vpninfo->csd_scriptname);
@@ -764,6 +807,8 @@ int openconnect_set_hostname(struct openconnect_info *vpninfo,
 	vpninfo->unique_hostname = NULL;
 	free(vpninfo->peer_addr);
 	vpninfo->peer_addr = NULL;
+	free(vpninfo->peer_addr_alt);
+	vpninfo->peer_addr_alt = NULL;
 	free(vpninfo->ip_info.gateway_addr);
 	vpninfo->ip_info.gateway_addr = NULL;
 
@@ -875,6 +920,67 @@ void openconnect_set_trojan_interval(struct openconnect_info *vpninfo, int secon
 	vpninfo->trojan_interval = seconds;
 }
 
+void openconnect_set_udp_fallback(struct openconnect_info *vpninfo, int max_loss, int max_rtt)
+{
+	vpninfo->udp_max_loss = max_loss;
+	vpninfo->udp_max_rtt = max_rtt;
+	/* DPD is only sent on an idle link; we need to measure a busy one */
+	vpninfo->dtls_times.probe = (max_loss || max_rtt) ? 2 : 0;
+}
+
+void openconnect_set_enforce_split(struct openconnect_info *vpninfo, int enable)
+{
+	vpninfo->enforce_split = enable;
+	split_filter_build(vpninfo);
+}
+
+int openconnect_set_builtin_netcfg(struct openconnect_info *vpninfo, int enable)
+{
+#ifdef __linux__
+	vpninfo->builtin_netcfg = enable;
+	return 0;
+#else
+	return enable ? -EOPNOTSUPP : 0;
+#endif
+}
+
+int openconnect_set_socks_proxy(struct openconnect_info *vpninfo, const char *listen)
+{
+#ifdef _WIN32
+	return -EOPNOTSUPP;
+#else
+	char *host, *port;
+	int ret;
+
+	if (listen) {
+		ret = socks_parse_listen(listen, &host, &port);
+		if (ret)
+			return ret;
+		free(host);
+		free(port);
+	}
+
+	STRDUP(vpninfo->socks_listen, listen);
+	return 0;
+#endif
+}
+
+int openconnect_set_dns_proxy(struct openconnect_info *vpninfo, const char *addr)
+{
+#ifdef _WIN32
+	return addr ? -EOPNOTSUPP : 0;
+#else
+	unsigned char buf[16];
+
+	if (addr && addr[0] && inet_pton(AF_INET, addr, buf) <= 0 &&
+	    inet_pton(AF_INET6, addr, buf) <= 0)
+		return -EINVAL;
+
+	STRDUP(vpninfo->dns_proxy_listen, addr);
+	return 0;
+#endif
+}
+
 int openconnect_get_idle_timeout(struct openconnect_info *vpninfo)
 {
 	return vpninfo->idle_timeout;
@@ -969,6 +1075,8 @@ void openconnect_reset_ssl(struct openconnect_info *vpninfo)
 
 	free(vpninfo->peer_addr);
 	vpninfo->peer_addr = NULL;
+	free(vpninfo->peer_addr_alt);
+	vpninfo->peer_addr_alt = NULL;
 	vpninfo->dtls_tos_optname = 0;
 	free(vpninfo->ip_info.gateway_addr);
 	vpninfo->ip_info.gateway_addr = NULL;
@@ -1023,6 +1131,11 @@ void openconnect_set_pfs(struct openconnect_info *vpninfo, unsigned val)
 	vpninfo->pfs = val;
 }
 
+void openconnect_set_tls_early_data(struct openconnect_info *vpninfo, int enable)
+{
+	vpninfo->tls_early_data = enable;
+}
+
 int openconnect_set_allow_insecure_crypto(struct openconnect_info *vpninfo, unsigned val)
 {
 	int ret = can_enable_insecure_crypto();
@@ -1281,7 +1394,9 @@ int openconnect_setup_tun_device(struct openconnect_info *vpninfo,
 	STRDUP(vpninfo->vpnc_script, vpnc_script);
 	STRDUP(vpninfo->ifname, ifname);
 
-	prepare_script_env(vpninfo);
+	/* The environment for thousands of split routes is not cheap */
+	if (!vpninfo->builtin_netcfg)
+		prepare_script_env(vpninfo);
 
 	/* XX: vpninfo->ifname will only be non-NULL here if set by the -i option,
 	   which only works on some platforms (see os_setup_tun implementations) */
@@ -1550,6 +1665,10 @@ retry:
 		}
 	}
 
+	/* The user may take a while. Have the next connection ready. */
+	if (!openconnect_https_connected(vpninfo))
+		preconnect_start(vpninfo);
+
 	ret = vpninfo->process_auth_form(vpninfo->cbdata, form);
 
 	if (ret == OC_FORM_RESULT_NEWGROUP &&
@@ -210,6 +210,15 @@ enum {
 	OPT_LOCAL_HOSTNAME,
 	OPT_PROTOCOL,
 	OPT_PASSTOS,
+	OPT_UDP_MAX_LOSS,
+	OPT_UDP_MAX_RTT,
+	OPT_BUILTIN_NETCFG,
+	OPT_ENFORCE_SPLIT,
+	OPT_SOCKS_PROXY,
+	OPT_DNS_PROXY,
+	OPT_PROBE_GATEWAYS,
+	OPT_TLS_SESSION_CACHE,
+	OPT_TLS_EARLY_DATA,
 	OPT_VERSION,
 	OPT_SERVER,
 };
@@ -230,11 +239,16 @@ static const struct option long_options[] = {
 	OPTION("pid-file", 1, OPT_PIDFILE),
 	OPTION("setuid", 1, 'U'),
 	OPTION("script-tun", 0, 'S'),
+	OPTION("socks-proxy", 1, OPT_SOCKS_PROXY),
+	OPTION("dns-proxy", 2, OPT_DNS_PROXY),
+	OPTION("probe-gateways", 0, OPT_PROBE_GATEWAYS),
 	OPTION("syslog", 0, 'l'),
 	OPTION("csd-user", 1, OPT_CSD_USER),
 	OPTION("csd-wrapper", 1, OPT_CSD_WRAPPER),
 #endif
 	OPTION("pfs", 0, OPT_PFS),
+	OPTION("tls-session-cache", 1, OPT_TLS_SESSION_CACHE),
+	OPTION("tls-early-data", 0, OPT_TLS_EARLY_DATA),
 	OPTION("allow-insecure-crypto", 0, OPT_ALLOW_INSECURE_CRYPTO),
 	OPTION("certificate", 1, 'c'),
 	OPTION("sslkey", 1, 'k'),
@@ -251,8 +265,12 @@ static const struct option long_options[] = {
 	OPTION("mtu", 1, 'm'),
 	OPTION("base-mtu", 1, OPT_BASEMTU),
 	OPTION("script", 1, 's'),
+	OPTION("builtin-netcfg", 0, OPT_BUILTIN_NETCFG),
+	OPTION("enforce-split", 0, OPT_ENFORCE_SPLIT),
 	OPTION("timestamp", 0, OPT_TIMESTAMP),
 	OPTION("passtos", 0, OPT_PASSTOS),
+	OPTION("udp-max-loss", 1, OPT_UDP_MAX_LOSS),
+	OPTION("udp-max-rtt", 1, OPT_UDP_MAX_RTT),
 	OPTION("key-password", 1, 'p'),
 	OPTION("proxy", 1, 'P'),
 	OPTION("proxy-auth", 1, OPT_PROXY_AUTH),
@@ -866,6 +884,9 @@ static void usage(void)
 	printf("      --non-inter                 %s\n", _("Do not expect user input; exit if it is required"));
 	printf("      --passwd-on-stdin           %s\n", _("Read password from standard input"));
 	printf("      --authgroup=GROUP           %s\n", _("Choose authentication login selection"));
+#ifndef _WIN32
+	printf("      --probe-gateways            %s\n", _("Choose the gateway which answers fastest"));
+#endif
 	printf("  -F, --form-entry=FORM:OPT=VALUE %s\n", _("Provide authentication form responses"));
 	printf("  -c, --certificate=CERT          %s\n", _("Use SSL client certificate CERT"));
 	printf("  -k, --sslkey=KEY                %s\n", _("Use SSL private key file KEY"));
@@ -928,12 +949,18 @@ static void usage(void)
 	printf("  -i, --interface=IFNAME          %s\n", _("Use IFNAME for tunnel interface"));
 	printf("  -s, --script=SCRIPT             %s\n", _("Shell command line for using a vpnc-compatible config script"));
 	printf("                                  %s: \"%s\"\n", _("default"), default_vpncscript);
+#ifdef __linux__
+	printf("      --builtin-netcfg            %s\n", _("Configure the network directly instead of using a script"));
+#endif
 #ifndef _WIN32
 	printf("  -S, --script-tun                %s\n", _("Pass traffic to 'script' program, not tun"));
+	printf("      --socks-proxy=[ADDR:]PORT   %s\n", _("Run a SOCKS5/HTTP proxy into the VPN, not tun"));
+	printf("      --dns-proxy[=ADDR]          %s\n", _("Cache DNS lookups, listening on ADDR or the tun address"));
 #endif
 
 	printf("\n%s:\n", _("Tunnel control"));
 	printf("      --disable-ipv6              %s\n", _("Do not ask for IPv6 connectivity"));
+	printf("      --enforce-split             %s\n", _("Drop traffic outside the split includes"));
 	printf("  -x, --xmlconfig=CONFIG          %s\n", _("XML config file"));
 	printf("  -m, --mtu=MTU                   %s\n", _("Request MTU from server (legacy servers only)"));
 	printf("      --base-mtu=MTU              %s\n", _("Indicate path MTU to/from server"));
@@ -941,7 +968,11 @@ static void usage(void)
 	printf("  -D, --no-deflate                %s\n", _("Disable all compression"));
 	printf("      --force-dpd=INTERVAL        %s\n", _("Set minimum Dead Peer Detection interval (in seconds)"));
 	printf("      --pfs                       %s\n", _("Require perfect forward secrecy"));
+	printf("      --tls-session-cache=FILE    %s\n", _("Keep TLS sessions in FILE, to resume them next time"));
+	printf("      --tls-early-data            %s\n", _("Send the tunnel request in TLS early data when reconnecting"));
 	printf("      --no-dtls                   %s\n", _("Disable DTLS and ESP"));
+	printf("      --udp-max-loss=PERCENT      %s\n", _("Use TLS instead of DTLS/ESP while loss exceeds PERCENT"));
+	printf("      --udp-max-rtt=MS            %s\n", _("Use TLS instead of DTLS/ESP while RTT exceeds MS"));
 	printf("      --dtls-ciphers=LIST         %s\n", _("OpenSSL ciphers to support for DTLS"));
 	printf("  -Q, --queue-len=LEN             %s\n", _("Set packet queue limit to LEN pkts"));
 
@@ -1501,6 +1532,17 @@ static void print_connection_stats(void *_vpninfo, const struct oc_stats *stats)
 		     _("RX: %"PRId64" packets (%"PRId64" B); TX: %"PRId64" packets (%"PRId64" B)\n"),
 		       stats->rx_pkts, stats->rx_bytes, stats->tx_pkts, stats->tx_bytes);
 
+	if (stats->tls_rtt)
+		vpn_progress(vpninfo, PRG_INFO, _("TLS RTT: %u ms (jitter %u ms), loss %u.%u%%\n"),
+			     stats->tls_rtt, stats->tls_rttvar, stats->tls_loss / 10, stats->tls_loss % 10);
+	if (stats->udp_rtt)
+		vpn_progress(vpninfo, PRG_INFO, _("%s RTT: %u ms (jitter %u ms), loss %u.%u%%\n"),
+			     vpninfo->proto->udp_protocol ? : "UDP",
+			     stats->udp_rtt, stats->udp_rttvar, stats->udp_loss / 10, stats->udp_loss % 10);
+	if (stats->tx_filtered_pkts)
+		vpn_progress(vpninfo, PRG_INFO, _("Filtered: %"PRId64" packets (%"PRId64" B) outside split includes\n"),
+			     stats->tx_filtered_pkts, stats->tx_filtered_bytes);
+
 	if (vpninfo->ssl_fd != -1)
 		vpn_progress(vpninfo, PRG_INFO, _("SSL ciphersuite: %s\n"), openconnect_get_cstp_cipher(vpninfo));
 	if (vpninfo->dtls_state == DTLS_CONNECTED)
@@ -1600,6 +1642,7 @@ int main(int argc, char **argv)
 	char *token_str = NULL;
 	oc_token_mode_t token_mode = OC_TOKEN_MODE_NONE;
 	int reconnect_timeout = 300;
+	int udp_max_loss = 0, udp_max_rtt = 0;
 	int ret;
 #ifdef HAVE_NL_LANGINFO
 	char *charset;
@@ -1707,6 +1750,26 @@ int main(int argc, char **argv)
 		case 'S':
 			vpninfo->use_tun_script = 1;
 			break;
+		case OPT_SOCKS_PROXY:
+			if (openconnect_set_socks_proxy(vpninfo, config_arg)) {
+				fprintf(stderr, _("Invalid SOCKS proxy listen address '%s'\n"),
+					config_arg);
+				exit(1);
+			}
+			break;
+		case OPT_DNS_PROXY:
+			if (openconnect_set_dns_proxy(vpninfo, config_arg ? : "")) {
+				fprintf(stderr, _("Invalid DNS proxy address '%s'\n"),
+					config_arg);
+				exit(1);
+			}
+			break;
+		case OPT_PROBE_GATEWAYS:
+			if (openconnect_set_gateway_probe(vpninfo, 1)) {
+				fprintf(stderr, _("Gateway probing is not supported on this platform\n"));
+				exit(1);
+			}
+			break;
 		case 'U':
 			assert_nonnull_config_arg("U", config_arg);
 			get_uids(config_arg, &vpninfo->uid, &vpninfo->gid);
@@ -1775,6 +1838,12 @@ int main(int argc, char **argv)
 		case OPT_PFS:
 			openconnect_set_pfs(vpninfo, 1);
 			break;
+		case OPT_TLS_SESSION_CACHE:
+			openconnect_set_tls_session_cache(vpninfo, config_arg);
+			break;
+		case OPT_TLS_EARLY_DATA:
+			openconnect_set_tls_early_data(vpninfo, 1);
+			break;
 		case OPT_ALLOW_INSECURE_CRYPTO:
 			if (openconnect_set_allow_insecure_crypto(vpninfo, 1)) {
 				fprintf(stderr, _("Cannot enable insecure 3DES or RC4 ciphers, because the library\n"
@@ -1946,6 +2015,15 @@ int main(int argc, char **argv)
 		case 's':
 			vpnc_script = dup_config_arg();
 			break;
+		case OPT_BUILTIN_NETCFG:
+			if (openconnect_set_builtin_netcfg(vpninfo, 1)) {
+				fprintf(stderr, _("Built-in network configuration is not supported on this platform\n"));
+				exit(1);
+			}
+			break;
+		case OPT_ENFORCE_SPLIT:
+			openconnect_set_enforce_split(vpninfo, 1);
+			break;
 		case 'u':
 			free(username);
 			username = dup_config_arg();
@@ -2044,6 +2122,16 @@ int main(int argc, char **argv)
 		case OPT_PASSTOS:
 			openconnect_set_pass_tos(vpninfo, 1);
 			break;
+		case OPT_UDP_MAX_LOSS:
+			assert_nonnull_config_arg("udp-max-loss", config_arg);
+			udp_max_loss = atoi(config_arg);
+			openconnect_set_udp_fallback(vpninfo, udp_max_loss, udp_max_rtt);
+			break;
+		case OPT_UDP_MAX_RTT:
+			assert_nonnull_config_arg("udp-max-rtt", config_arg);
+			udp_max_rtt = atoi(config_arg);
+			openconnect_set_udp_fallback(vpninfo, udp_max_loss, udp_max_rtt);
+			break;
 		case OPT_TIMESTAMP:
 			timestamp = 1;
 			break;
@@ -2604,6 +2692,9 @@ static int process_auth_form_cb(void *_vpninfo,
 	if (form->authgroup_opt) {
 		if (!authgroup)
 			authgroup = saved_form_field(vpninfo, form->auth_id, form->authgroup_opt->form.name);
+		/* Take the gateway it found, instead of asking */
+		if (!authgroup && vpninfo->probe_gw && vpninfo->authgroup)
+			authgroup = strdup(vpninfo->authgroup);
 		if (!authgroup ||
 		    match_choice_label(vpninfo, form->authgroup_opt, authgroup) != 0) {
 			if (prompt_opt_select(vpninfo, form->authgroup_opt, &authgroup) < 0)
@@ -20,6 +20,7 @@
 #include "openconnect-internal.h"
 
 #include <unistd.h>
+#include <sys/time.h>
 #ifndef _WIN32
 /* for setgroups() */
 # include <sys/types.h>
@@ -55,7 +56,15 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable, i
 	if (readable && read_fd_monitored(vpninfo, tun)) {
 		struct pkt *out_pkt = vpninfo->tun_pkt;
 		while (1) {
-			int len = vpninfo->ip_info.mtu;
+			/* The tun device may have a larger MTU than we can
+			 * currently carry, if it has been reduced since. */
+			int len = MAX(vpninfo->ip_info.mtu, vpninfo->tun_mtu);
+
+			/* ... or it may have been raised since this was allocated */
+			if (out_pkt && out_pkt->len < len) {
+				free_pkt(vpninfo, out_pkt);
+				out_pkt = NULL;
+			}
 
 			if (!out_pkt) {
 				out_pkt = alloc_pkt(vpninfo, len + vpninfo->pkt_trailer);
@@ -69,6 +78,19 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable, i
 			if (os_read_tun(vpninfo, out_pkt))
 				break;
 
+			if (out_pkt->len > vpninfo->ip_info.mtu &&
+			    icmp_pkt_too_big(vpninfo, out_pkt, vpninfo->ip_info.mtu)) {
+				out_pkt->len = len;
+				work_done = 1;
+				continue;
+			}
+
+			if (vpninfo->split_filter && split_filter_drop(vpninfo, out_pkt)) {
+				out_pkt->len = len;
+				work_done = 1;
+				continue;
+			}
+
 			vpninfo->stats.tx_pkts++;
 			vpninfo->stats.tx_bytes += out_pkt->len;
 			work_done = 1;
@@ -104,6 +126,212 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable, i
 	return work_done;
 }
 
+/* Tun-less operation, where the application exchanges packets with us
+ * directly. Outbound packets can be injected from any thread, so they are
+ * pushed onto a lock-free stack which the main loop takes over in one go. */
+#define PKT_CB_BATCH 32
+
+/* Not a real command; it just wakes the main loop */
+#define OC_CMD_WAKE 'w'
+
+int openconnect_setup_packet_callback(struct openconnect_info *vpninfo,
+				      openconnect_rx_packets_vfn rx)
+{
+	vpninfo->rx_packets = rx;
+	return 0;
+}
+
+/* Room for the protocol headers in front is in struct pkt itself. After
+ * the data, leave room for ESP padding and HMAC, as tun_mainloop() does. */
+int openconnect_alloc_packet(struct openconnect_info *vpninfo,
+			     struct oc_packet *pkt, int len)
+{
+	int alloc_len = sizeof(struct pkt) + len +
+		MAX_ESP_PAD + MAX_IV_SIZE + MAX_HMAC_SIZE;
+	struct pkt *new;
+
+	/* Not alloc_pkt(), which isn't safe outside the main loop's thread */
+	if (alloc_len < 2048)
+		alloc_len = 2048;
+	new = malloc(alloc_len);
+	if (!new)
+		return -ENOMEM;
+
+	new->alloc_len = alloc_len;
+	pkt->data = new->data;
+	pkt->len = len;
+	pkt->priv = new;
+	return 0;
+}
+
+void openconnect_free_packet(struct openconnect_info *vpninfo,
+			     struct oc_packet *pkt)
+{
+	free(pkt->priv);
+	pkt->priv = NULL;
+	pkt->data = NULL;
+}
+
+int openconnect_send_packets(struct openconnect_info *vpninfo,
+			     struct oc_packet *pkts, int nr)
+{
+	struct pkt *head = NULL, *tail = NULL, *old;
+	int i, queued, accepted = 0;
+
+	queued = __sync_fetch_and_add(&vpninfo->pkt_inject_count, 0);
+
+	for (i = 0; i < nr; i++) {
+		struct pkt *this = pkts[i].priv;
+
+		if (queued + accepted >= vpninfo->max_qlen || pkts[i].len <= 0) {
+			if (this)
+				openconnect_free_packet(vpninfo, &pkts[i]);
+			continue;
+		}
+
+		if (this) {
+			pkts[i].priv = NULL;
+		} else {
+			struct oc_packet copy;
+
+			if (openconnect_alloc_packet(vpninfo, &copy, pkts[i].len))
+				continue;
+			this = copy.priv;
+			memcpy(this->data, pkts[i].data, pkts[i].len);
+		}
+		this->len = pkts[i].len;
+
+		/* Build the batch newest first too */
+		this->next = head;
+		head = this;
+		if (!tail)
+			tail = this;
+		accepted++;
+	}
+
+	if (!head)
+		return 0;
+
+	__sync_fetch_and_add(&vpninfo->pkt_inject_count, accepted);
+	do {
+		old = vpninfo->pkt_inject;
+		tail->next = old;
+	} while (!__sync_bool_compare_and_swap(&vpninfo->pkt_inject, old, head));
+
+	/* If the stack was empty the main loop may be asleep */
+	if (!old && vpninfo->cmd_fd_write != -1) {
+		char cmd = OC_CMD_WAKE;
+
+		/* The main loop only reads the pipe when told to */
+		__sync_fetch_and_or(&vpninfo->need_poll_cmd_fd, 1);
+#ifdef _WIN32
+		send(vpninfo->cmd_fd_write, &cmd, 1, 0);
+#else
+		if (write(vpninfo->cmd_fd_write, &cmd, 1) < 0) {
+			/* If the pipe is full, it's awake anyway */
+		}
+#endif
+	}
+	return accepted;
+}
+
+void free_injected_packets(struct openconnect_info *vpninfo)
+{
+	struct pkt *this = __sync_lock_test_and_set(&vpninfo->pkt_inject, NULL);
+	struct pkt *next;
+
+	for (; this; this = next) {
+		next = this->next;
+		free(this);
+		__sync_fetch_and_sub(&vpninfo->pkt_inject_count, 1);
+	}
+	while ((this = dequeue_packet(&vpninfo->pkt_injected))) {
+		free(this);
+		__sync_fetch_and_sub(&vpninfo->pkt_inject_count, 1);
+	}
+}
+
+static int packet_cb_mainloop(struct openconnect_info *vpninfo)
+{
+	struct oc_packet batch[PKT_CB_BATCH];
+	struct pkt *pkts[PKT_CB_BATCH];
+	struct pkt *this, *next, *list = NULL;
+	int work_done = 0, nr, i;
+
+	/* Reverse the injected packets back into the order they were sent,
+	 * behind any left over from last time. */
+	for (this = __sync_lock_test_and_set(&vpninfo->pkt_inject, NULL); this; this = next) {
+		next = this->next;
+		this->next = list;
+		list = this;
+	}
+	for (this = list; this; this = next) {
+		next = this->next;
+		queue_packet(&vpninfo->pkt_injected, this);
+	}
+
+	/* Like the tun device, stop taking them while the queue is full. They
+	 * still count against max_qlen, so the sender sees back-pressure. */
+	while (vpninfo->outgoing_queue.count + vpninfo->tcp_control_queue.count < vpninfo->max_qlen &&
+	       (this = dequeue_packet(&vpninfo->pkt_injected))) {
+		__sync_fetch_and_sub(&vpninfo->pkt_inject_count, 1);
+		work_done = 1;
+
+		if ((this->len > vpninfo->ip_info.mtu &&
+		     icmp_pkt_too_big(vpninfo, this, vpninfo->ip_info.mtu)) ||
+		    (vpninfo->split_filter && split_filter_drop(vpninfo, this))) {
+			free_pkt(vpninfo, this);
+			continue;
+		}
+
+		vpninfo->stats.tx_pkts++;
+		vpninfo->stats.tx_bytes += this->len;
+		queue_packet(&vpninfo->outgoing_queue, this);
+	}
+
+	while (vpninfo->incoming_queue.head) {
+		for (nr = 0; nr < PKT_CB_BATCH &&
+			     (this = dequeue_packet(&vpninfo->incoming_queue)); nr++) {
+			pkts[nr] = this;
+			batch[nr].data = this->data;
+			batch[nr].len = this->len;
+			batch[nr].priv = NULL;
+
+			vpninfo->stats.rx_pkts++;
+			vpninfo->stats.rx_bytes += this->len;
+		}
+
+		vpninfo->rx_packets(vpninfo->cbdata, batch, nr);
+
+		for (i = 0; i < nr; i++)
+			free_pkt(vpninfo, pkts[i]);
+	}
+
+	/* The callback may have sent some more */
+	if (vpninfo->pkt_inject &&
+	    vpninfo->outgoing_queue.count + vpninfo->tcp_control_queue.count < vpninfo->max_qlen)
+		work_done = 1;
+
+	return work_done;
+}
+
+/* After the tun device is configured, so that we can bind to its address,
+ * but before giving up the privileges to bind to port 53. */
+static int setup_dns_proxy(struct openconnect_info *vpninfo)
+{
+#ifndef _WIN32
+	/* The SOCKS proxy looks names up through the tunnel already */
+	if (vpninfo->dns_proxy_listen && !vpninfo->socks && !vpninfo->dns_proxy &&
+	    dnsproxy_setup(vpninfo)) {
+		fprintf(stderr, _("Set up DNS proxy failed\n"));
+		if (!vpninfo->quit_reason)
+			vpninfo->quit_reason = "Set up DNS proxy failed";
+		return -EIO;
+	}
+#endif
+	return 0;
+}
+
 static int setup_tun_device(struct openconnect_info *vpninfo)
 {
 	int ret;
@@ -111,11 +339,21 @@ static int setup_tun_device(struct openconnect_info *vpninfo)
 	if (vpninfo->setup_tun) {
 		vpninfo->setup_tun(vpninfo->cbdata);
 		if (tun_is_up(vpninfo))
-			return 0;
+			return setup_dns_proxy(vpninfo);
 	}
 
+	pmtud_tun_setup(vpninfo);
+
 #ifndef _WIN32
-	if (vpninfo->use_tun_script) {
+	if (vpninfo->socks_listen) {
+		ret = socks_setup(vpninfo);
+		if (ret) {
+			fprintf(stderr, _("Set up SOCKS proxy failed\n"));
+			if (!vpninfo->quit_reason)
+				vpninfo->quit_reason = "Set up SOCKS proxy failed";
+			return ret;
+		}
+	} else if (vpninfo->use_tun_script) {
 		ret = openconnect_setup_tun_script(vpninfo, vpninfo->vpnc_script);
 		if (ret) {
 			fprintf(stderr, _("Set up tun script failed\n"));
@@ -131,6 +369,10 @@ static int setup_tun_device(struct openconnect_info *vpninfo)
 		return ret;
 	}
 
+	ret = setup_dns_proxy(vpninfo);
+	if (ret)
+		return ret;
+
 #if !defined(_WIN32) && !defined(__native_client__)
 	if (vpninfo->uid != getuid()) {
 		int e;
@@ -160,24 +402,9 @@ static int setup_tun_device(struct openconnect_info *vpninfo)
 	return 0;
 }
 
-/* Return value:
- *  = 0, when successfully paused (may call again)
- *  = -EINTR, if aborted locally via OC_CMD_CANCEL
- *  = -ECONNABORTED, if aborted locally via OC_CMD_DETACH
- *  = -EPIPE, if the remote end explicitly terminated the session
- *  = -EPERM, if the gateway sent 401 Unauthorized (cookie expired)
- *  < 0, for any other error
- */
-int openconnect_mainloop(struct openconnect_info *vpninfo,
-			 int reconnect_timeout,
-			 int reconnect_interval)
+void mainloop_start(struct openconnect_info *vpninfo,
+		    int reconnect_timeout, int reconnect_interval)
 {
-	int ret = 0;
-	int tun_r = 1, udp_r = 1, tcp_r = 1;
-#ifdef HAVE_VHOST
-	int vhost_r = 0;
-#endif
-
 	vpninfo->reconnect_timeout = reconnect_timeout;
 	vpninfo->reconnect_interval = reconnect_interval;
 
@@ -186,245 +413,505 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 		monitor_read_fd(vpninfo, cmd);
 	}
 
-	while (!vpninfo->quit_reason) {
-		int did_work = 0;
-		int timeout;
-#ifdef _WIN32
-		HANDLE events[4];
-		int nr_events = 0;
-#else
-		struct timeval tv;
-		fd_set rfds, wfds, efds;
-#endif
+	netmon_open(vpninfo);
+}
 
-		/* If tun is not up, loop more often to detect
-		 * a DTLS timeout (due to a firewall block) as soon. */
-		if (tun_is_up(vpninfo))
-			timeout = INT_MAX;
-		else
-			timeout = 1000;
-
-		if (!tun_is_up(vpninfo)) {
-			if (vpninfo->delay_tunnel_reason) {
-				vpn_progress(vpninfo, PRG_TRACE, _("Delaying tunnel with reason: %s\n"),
-					     vpninfo->delay_tunnel_reason);
-				/* XX: don't let this spin forever */
-				vpninfo->delay_tunnel_reason = NULL;
-			} else {
-				/* No DTLS, or DTLS failed; setup TUN device unconditionally */
-				ret = setup_tun_device(vpninfo);
-				if (ret)
-					break;
-			}
-		}
+/* Close all connections and wait for the user to call
+ * openconnect_mainloop() again */
+void mainloop_pause(struct openconnect_info *vpninfo)
+{
+	openconnect_close_https(vpninfo, 0);
+	if (vpninfo->dtls_state > DTLS_DISABLED) {
+		vpninfo->proto->udp_close(vpninfo);
+		vpninfo->new_dtls_started = 0;
+	}
 
-		if (vpninfo->dtls_state > DTLS_DISABLED) {
-			ret = vpninfo->proto->udp_mainloop(vpninfo, &timeout, udp_r);
-			if (vpninfo->quit_reason)
-				break;
-			did_work += ret;
-		}
+	vpninfo->got_pause_cmd = 0;
+	vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
 
-		ret = vpninfo->proto->tcp_mainloop(vpninfo, &timeout, tcp_r);
-		if (vpninfo->quit_reason)
-			break;
-		did_work += ret;
+	if (vpninfo->cmd_fd >= 0)
+		unmonitor_fd(vpninfo, cmd);
+	netmon_close(vpninfo);
+}
+
+/* One time round the main loop, with the fds in *rd having been found
+ * readable. Returns MAINLOOP_IDLE with *timeout set when it's time to
+ * sleep, MAINLOOP_BUSY to go round again straight away, or MAINLOOP_QUIT
+ * with *ret set for mainloop_finish(). */
+int mainloop_pass(struct openconnect_info *vpninfo, struct mainloop_rd *rd,
+		  int *timeout, int *ret)
+{
+	int did_work = 0;
 
+	*ret = 0;
+	if (vpninfo->quit_reason)
+		return MAINLOOP_QUIT;
 
-		/* Tun must be last because it will set/clear its bit
-		   in the select_rfds according to the queue length */
-		if (!tun_is_up(vpninfo)) {
-			struct pkt *this;
-			/* no tun yet; clear any queued packets */
-			while ((this = dequeue_packet(&vpninfo->incoming_queue)))
-				free_pkt(vpninfo, this);
+	/* If tun is not up, loop more often to detect
+	 * a DTLS timeout (due to a firewall block) as soon. */
+	if (tun_is_up(vpninfo))
+		*timeout = INT_MAX;
+	else
+		*timeout = 1000;
+
+	if (!tun_is_up(vpninfo)) {
+		if (vpninfo->delay_tunnel_reason) {
+			vpn_progress(vpninfo, PRG_TRACE, _("Delaying tunnel with reason: %s\n"),
+				     vpninfo->delay_tunnel_reason);
+			/* XX: don't let this spin forever */
+			vpninfo->delay_tunnel_reason = NULL;
+		} else {
+			/* Don't wait for DTLS/ESP; traffic can use TLS until it's up */
+			*ret = setup_tun_device(vpninfo);
+			if (*ret)
+				return MAINLOOP_QUIT;
+			vpninfo->tun_mtu = vpninfo->ip_info.mtu;
+		}
+	}
+
+	did_work += netmon_mainloop(vpninfo, rd->netmon);
+	resolve_mainloop(vpninfo, timeout);
+#ifndef _WIN32
+	did_work += dnsproxy_mainloop(vpninfo, timeout, rd->dns);
+#endif
+
+	if (vpninfo->dtls_state > DTLS_DISABLED) {
+		*ret = vpninfo->proto->udp_mainloop(vpninfo, timeout, rd->udp);
+		if (vpninfo->quit_reason)
+			return MAINLOOP_QUIT;
+		did_work += *ret;
+	}
+	pmtud_udp_fallback(vpninfo, timeout);
+
+	*ret = vpninfo->proto->tcp_mainloop(vpninfo, timeout, rd->tcp);
+	if (vpninfo->quit_reason)
+		return MAINLOOP_QUIT;
+	did_work += *ret;
+
+
+	/* Tun must be last because it will set/clear its bit
+	   in the select_rfds according to the queue length */
+	if (!tun_is_up(vpninfo)) {
+		struct pkt *this;
+		/* no tun yet; clear any queued packets */
+		while ((this = dequeue_packet(&vpninfo->incoming_queue)))
+			free_pkt(vpninfo, this);
+	} else if (vpninfo->rx_packets) {
+		did_work += packet_cb_mainloop(vpninfo);
+#ifndef _WIN32
+	} else if (vpninfo->socks) {
+		did_work += socks_mainloop(vpninfo, timeout);
+#endif
 #ifdef HAVE_VHOST
-		} else if (vpninfo->vhost_fd != -1) {
-			did_work += vhost_tun_mainloop(vpninfo, &timeout, vhost_r, did_work);
-			/* If it returns zero *then* it will have read the eventfd
-			 * and there's no need to do so again until we poll again. */
-			if (!did_work)
-				vhost_r = 0;
+	} else if (vpninfo->vhost_fd != -1) {
+		did_work += vhost_tun_mainloop(vpninfo, timeout, rd->vhost, did_work);
+		/* If it returns zero *then* it will have read the eventfd
+		 * and there's no need to do so again until we poll again. */
+		if (!did_work)
+			rd->vhost = 0;
 #endif
+	} else {
+		did_work += tun_mainloop(vpninfo, timeout, rd->tun, did_work);
+	}
+	if (vpninfo->quit_reason)
+		return MAINLOOP_QUIT;
+
+	if (vpninfo->need_poll_cmd_fd)
+		poll_cmd_fd(vpninfo, 0);
+
+	if (vpninfo->got_cancel_cmd) {
+		if (vpninfo->delay_close != NO_DELAY_CLOSE) {
+			if (vpninfo->delay_close == DELAY_CLOSE_IMMEDIATE_CALLBACK) {
+				vpn_progress(vpninfo, PRG_TRACE, _("Delaying cancel (immediate callback).\n"));
+				did_work++;
+			} else
+				vpn_progress(vpninfo, PRG_TRACE, _("Delaying cancel.\n"));
+			/* XX: don't let this spin forever */
+			vpninfo->delay_close = NO_DELAY_CLOSE;
+		} else if (vpninfo->cancel_type == OC_CMD_CANCEL) {
+			vpninfo->quit_reason = "Aborted by caller";
+			vpninfo->got_cancel_cmd = 0;
+			*ret = -EINTR;
+			return MAINLOOP_QUIT;
 		} else {
-			did_work += tun_mainloop(vpninfo, &timeout, tun_r, did_work);
+			vpninfo->got_cancel_cmd = 0;
+			*ret = -ECONNABORTED;
+			return MAINLOOP_QUIT;
 		}
-		if (vpninfo->quit_reason)
-			break;
+	}
 
-		if (vpninfo->need_poll_cmd_fd)
-			poll_cmd_fd(vpninfo, 0);
-
-		if (vpninfo->got_cancel_cmd) {
-			if (vpninfo->delay_close != NO_DELAY_CLOSE) {
-				if (vpninfo->delay_close == DELAY_CLOSE_IMMEDIATE_CALLBACK) {
-					vpn_progress(vpninfo, PRG_TRACE, _("Delaying cancel (immediate callback).\n"));
-					did_work++;
-				} else
-					vpn_progress(vpninfo, PRG_TRACE, _("Delaying cancel.\n"));
-				/* XX: don't let this spin forever */
-				vpninfo->delay_close = NO_DELAY_CLOSE;
-			} else if (vpninfo->cancel_type == OC_CMD_CANCEL) {
-				vpninfo->quit_reason = "Aborted by caller";
-				vpninfo->got_cancel_cmd = 0;
-				ret = -EINTR;
-				break;
-			} else {
-				vpninfo->got_cancel_cmd = 0;
-				ret = -ECONNABORTED;
-				break;
-			}
+	if (vpninfo->got_pause_cmd) {
+		if (vpninfo->delay_close != NO_DELAY_CLOSE) {
+			 /* XX: don't let this spin forever */
+			if (vpninfo->delay_close == DELAY_CLOSE_IMMEDIATE_CALLBACK) {
+				vpn_progress(vpninfo, PRG_TRACE, _("Delaying pause (immediate callback).\n"));
+				did_work++;
+			} else
+				vpn_progress(vpninfo, PRG_TRACE, _("Delaying pause.\n"));
+			/* XX: don't let this spin forever */
+			vpninfo->delay_close = NO_DELAY_CLOSE;
+		} else {
+			mainloop_pause(vpninfo);
+			return MAINLOOP_PAUSED;
 		}
+	}
 
-		if (vpninfo->got_pause_cmd) {
-			if (vpninfo->delay_close != NO_DELAY_CLOSE) {
-				 /* XX: don't let this spin forever */
-				if (vpninfo->delay_close == DELAY_CLOSE_IMMEDIATE_CALLBACK) {
-					vpn_progress(vpninfo, PRG_TRACE, _("Delaying pause (immediate callback).\n"));
-					did_work++;
-				} else
-					vpn_progress(vpninfo, PRG_TRACE, _("Delaying pause.\n"));
-				/* XX: don't let this spin forever */
-				vpninfo->delay_close = NO_DELAY_CLOSE;
-			} else {
-				/* close all connections and wait for the user to call
-				   openconnect_mainloop() again */
-				openconnect_close_https(vpninfo, 0);
-				if (vpninfo->dtls_state > DTLS_DISABLED) {
-					vpninfo->proto->udp_close(vpninfo);
-					vpninfo->new_dtls_started = 0;
-				}
+	if (did_work)
+		return MAINLOOP_BUSY;
 
-				vpninfo->got_pause_cmd = 0;
-				vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("No work to do; sleeping for %d ms...\n"), *timeout);
+	return MAINLOOP_IDLE;
+}
 
-				if (vpninfo->cmd_fd >= 0)
-					unmonitor_fd(vpninfo, cmd);
+#ifndef _WIN32
+static void mainloop_set_readable(struct openconnect_info *vpninfo,
+				  struct mainloop_rd *rd, int fd)
+{
+	if (fd == vpninfo->tun_fd)
+		rd->tun = 1;
+	else if (fd == vpninfo->ssl_fd || fd == vpninfo->hip_fd)
+		rd->tcp = 1;
+	else if (fd == vpninfo->dtls_fd || fd == vpninfo->new_dtls.fd)
+		rd->udp = 1;
+	else if (fd == vpninfo->netmon_fd)
+		rd->netmon = 1;
+	else if (fd == vpninfo->dns_fd || fd == vpninfo->dns_up_fd)
+		rd->dns = 1;
+#ifdef HAVE_VHOST
+	else if (fd == vpninfo->vhost_call_fd)
+		rd->vhost = 1;
+#endif
+}
+#endif
 
-				return 0;
-			}
-		}
+#ifdef HAVE_EPOLL
+/* During busy periods, monitor_read_fd() and unmonitor_read_fd() may get
+ * called multiple times as we go round and round the loop and queues get
+ * full then have space again. In the past with the select() loop, that
+ * was only a bitflip in the fd_set and didn't cost much. With epoll() it's
+ * actually a system call, so don't do it every time. Wait until we're
+ * about to sleep, and *then* ensure that we call epoll_ctl() to sync the
+ * set of events that we care about, if it's changed. */
+void mainloop_epoll_sync(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->epoll_update)
+		return;
+
+	update_epoll_fd(vpninfo, tun);
+	update_epoll_fd(vpninfo, ssl);
+	update_epoll_fd(vpninfo, cmd);
+	update_epoll_fd(vpninfo, dtls);
+	update_epoll_fd(vpninfo, netmon);
+	update_epoll_fd(vpninfo, hip);
+	update_epoll_fd(vpninfo, dns);
+	update_epoll_fd(vpninfo, dns_up);
+	update_epoll_fd(vpninfo, resolve);
+#ifdef HAVE_VHOST
+	update_epoll_fd(vpninfo, vhost_call);
+#endif
+	if (vpninfo->socks)
+		socks_update_epoll(vpninfo);
+}
 
-		if (did_work)
-			continue;
+void mainloop_epoll_events(struct openconnect_info *vpninfo, struct mainloop_rd *rd,
+			   struct epoll_event *evs, int nfds)
+{
+	memset(rd, 0, sizeof(*rd));
 
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("No work to do; sleeping for %d ms...\n"), timeout);
+	while (nfds--) {
+		if (evs[nfds].events & EPOLLIN)
+			mainloop_set_readable(vpninfo, rd, evs[nfds].data.fd);
+	}
+}
+#endif
 
+/* Sleep for up to timeout ms, and note in *rd what became readable */
+int mainloop_wait(struct openconnect_info *vpninfo, struct mainloop_rd *rd,
+		  int timeout)
+{
 #ifdef _WIN32
-		if (vpninfo->dtls_monitored) {
-			WSAEventSelect(vpninfo->dtls_fd, vpninfo->dtls_event, vpninfo->dtls_monitored);
-			events[nr_events++] = vpninfo->dtls_event;
-		}
-		if (vpninfo->ssl_monitored) {
-			WSAEventSelect(vpninfo->ssl_fd, vpninfo->ssl_event, vpninfo->ssl_monitored);
-			events[nr_events++] = vpninfo->ssl_event;
-		}
-		if (vpninfo->cmd_monitored) {
-			WSAEventSelect(vpninfo->cmd_fd, vpninfo->cmd_event, vpninfo->cmd_monitored);
-			events[nr_events++] = vpninfo->cmd_event;
-		}
-		if (vpninfo->tun_monitored) {
-			events[nr_events++] = vpninfo->tun_rd_overlap.hEvent;
-		}
-		if (WaitForMultipleObjects(nr_events, events, FALSE, timeout) == WAIT_FAILED) {
-			char *errstr = openconnect__win32_strerror(GetLastError());
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("WaitForMultipleObjects failed: %s\n"),
-				     errstr);
-			free(errstr);
-		}
+	HANDLE events[5];
+	int nr_events = 0;
+
+	if (vpninfo->dtls_monitored) {
+		WSAEventSelect(vpninfo->dtls_fd, vpninfo->dtls_event, vpninfo->dtls_monitored);
+		events[nr_events++] = vpninfo->dtls_event;
+	}
+	if (vpninfo->new_dtls.monitored) {
+		WSAEventSelect(vpninfo->new_dtls.fd, vpninfo->new_dtls.event, vpninfo->new_dtls.monitored);
+		events[nr_events++] = vpninfo->new_dtls.event;
+	}
+	if (vpninfo->ssl_monitored) {
+		WSAEventSelect(vpninfo->ssl_fd, vpninfo->ssl_event, vpninfo->ssl_monitored);
+		events[nr_events++] = vpninfo->ssl_event;
+	}
+	if (vpninfo->cmd_monitored) {
+		WSAEventSelect(vpninfo->cmd_fd, vpninfo->cmd_event, vpninfo->cmd_monitored);
+		events[nr_events++] = vpninfo->cmd_event;
+	}
+	if (vpninfo->tun_monitored) {
+		events[nr_events++] = vpninfo->tun_rd_overlap.hEvent;
+	}
+	if (WaitForMultipleObjects(nr_events, events, FALSE, timeout) == WAIT_FAILED) {
+		char *errstr = openconnect__win32_strerror(GetLastError());
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("WaitForMultipleObjects failed: %s\n"),
+			     errstr);
+		free(errstr);
+	}
 #else
+	struct timeval tv;
+	fd_set rfds, wfds, efds;
+
 #ifdef HAVE_EPOLL
-		if (vpninfo->epoll_fd >= 0) {
-			struct epoll_event evs[5];
-
-			/* During busy periods, monitor_read_fd() and unmonitor_read_fd()
-			 * may get called multiple times as we go round and round the
-			 * loop and queues get full then have space again. In the past
-			 * with the select() loop, that was only a bitflip in the fd_set
-			 * and didn't cost much. With epoll() it's actually a system
-			 * call, so don't do it every time. Wait until we're about to
-			 * sleep, and *then* ensure that we call epoll_ctl() to sync the
-			 * set of events that we care about, if it's changed. */
-			if (vpninfo->epoll_update) {
-				update_epoll_fd(vpninfo, tun);
-				update_epoll_fd(vpninfo, ssl);
-				update_epoll_fd(vpninfo, cmd);
-				update_epoll_fd(vpninfo, dtls);
-#ifdef HAVE_VHOST
-				update_epoll_fd(vpninfo, vhost_call);
-#endif
+	if (vpninfo->epoll_fd >= 0) {
+		struct epoll_event evs[8];
+		int nfds;
+
+		mainloop_epoll_sync(vpninfo);
+
+		nfds = epoll_wait(vpninfo->epoll_fd, evs, 8, timeout);
+		if (nfds < 0) {
+			if (errno != EINTR) {
+				int ret = -errno;
+				vpn_perror(vpninfo, _("Failed epoll_wait() in mainloop"));
+				return ret;
 			}
+			nfds = 0;
+		}
+		mainloop_epoll_events(vpninfo, rd, evs, nfds);
+		return 0;
+	}
+#endif
+	memcpy(&rfds, &vpninfo->_select_rfds, sizeof(rfds));
+	memcpy(&wfds, &vpninfo->_select_wfds, sizeof(wfds));
+	memcpy(&efds, &vpninfo->_select_efds, sizeof(efds));
 
-			tun_r = udp_r = tcp_r = 0;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	if (select(vpninfo->_select_nfds, &rfds, &wfds, &efds, &tv) < 0 &&
+	    errno != EINTR) {
+		int ret = -errno;
+		vpn_perror(vpninfo, _("Failed select() in mainloop"));
+		return ret;
+	}
 #ifdef HAVE_VHOST
-			vhost_r = 0;
+	if (vpninfo->vhost_call_fd >= 0)
+		rd->vhost = FD_ISSET(vpninfo->vhost_call_fd, &rfds);
 #endif
+	if (vpninfo->tun_fd >= 0)
+		rd->tun = FD_ISSET(vpninfo->tun_fd, &rfds);
+	if (vpninfo->dtls_fd >= 0)
+		rd->udp = FD_ISSET(vpninfo->dtls_fd, &rfds);
+	if (vpninfo->new_dtls.fd >= 0 && FD_ISSET(vpninfo->new_dtls.fd, &rfds))
+		rd->udp = 1;
+	if (vpninfo->ssl_fd >= 0)
+		rd->tcp = FD_ISSET(vpninfo->ssl_fd, &rfds);
+	if (vpninfo->hip_fd >= 0 && FD_ISSET(vpninfo->hip_fd, &rfds))
+		rd->tcp = 1;
+	if (vpninfo->netmon_fd >= 0)
+		rd->netmon = FD_ISSET(vpninfo->netmon_fd, &rfds);
+	if (vpninfo->dns_fd >= 0)
+		rd->dns = FD_ISSET(vpninfo->dns_fd, &rfds) ||
+			FD_ISSET(vpninfo->dns_up_fd, &rfds);
+#endif
+	return 0;
+}
 
-			int nfds = epoll_wait(vpninfo->epoll_fd, evs, 5, timeout);
-			if (nfds < 0) {
-				if (errno != EINTR) {
-					ret = -errno;
-					vpn_perror(vpninfo, _("Failed epoll_wait() in mainloop"));
-					break;
-				}
-				nfds = 0;
-			}
-			while (nfds--) {
-				if (evs[nfds].events & EPOLLIN) {
-					if (evs[nfds].data.fd == vpninfo->tun_fd)
-						tun_r = 1;
-					else if (evs[nfds].data.fd == vpninfo->ssl_fd)
-						tcp_r = 1;
-					else if (evs[nfds].data.fd == vpninfo->dtls_fd)
-						udp_r = 1;
-#ifdef HAVE_VHOST
-					else if (evs[nfds].data.fd == vpninfo->vhost_call_fd)
-						vhost_r = 1;
+int mainloop_finish(struct openconnect_info *vpninfo, int ret)
+{
+	if (vpninfo->quit_reason && vpninfo->proto->vpn_close_session)
+		vpninfo->proto->vpn_close_session(vpninfo, vpninfo->quit_reason);
+
+	if (vpninfo->rx_packets) {
+		script_config_tun(vpninfo, "disconnect");
+		vpninfo->rx_packets = NULL;
+#ifndef _WIN32
+	} else if (vpninfo->socks) {
+		socks_free(vpninfo);
 #endif
-				}
-			}
+	} else if (tun_is_up(vpninfo))
+		os_shutdown_tun(vpninfo);
+#ifndef _WIN32
+	dnsproxy_free(vpninfo);
+#endif
+
+	if (vpninfo->cmd_fd >= 0)
+		unmonitor_fd(vpninfo, cmd);
+	netmon_close(vpninfo);
+
+	return ret < 0 ? ret : -EIO;
+}
+
+/* Return value:
+ *  = 0, when successfully paused (may call again)
+ *  = -EINTR, if aborted locally via OC_CMD_CANCEL
+ *  = -ECONNABORTED, if aborted locally via OC_CMD_DETACH
+ *  = -EPIPE, if the remote end explicitly terminated the session
+ *  = -EPERM, if the gateway sent 401 Unauthorized (cookie expired)
+ *  < 0, for any other error
+ */
+int openconnect_mainloop(struct openconnect_info *vpninfo,
+			 int reconnect_timeout,
+			 int reconnect_interval)
+{
+	struct mainloop_rd rd = { .tun = 1, .udp = 1, .tcp = 1, .dns = 1 };
+	int ret = 0;
+
+	mainloop_start(vpninfo, reconnect_timeout, reconnect_interval);
+
+	while (1) {
+		int timeout;
+
+		switch (mainloop_pass(vpninfo, &rd, &timeout, &ret)) {
+		case MAINLOOP_PAUSED:
+			return 0;
+		case MAINLOOP_QUIT:
+			return mainloop_finish(vpninfo, ret);
+		case MAINLOOP_BUSY:
 			continue;
 		}
+
+		ret = mainloop_wait(vpninfo, &rd, timeout);
+		if (ret)
+			return mainloop_finish(vpninfo, ret);
+	}
+}
+
+#ifndef _WIN32
+int openconnect_mainloop_start(struct openconnect_info *vpninfo,
+			       int reconnect_timeout,
+			       int reconnect_interval)
+{
+	if (vpninfo->ext_running || vpninfo->async)
+		return -EBUSY;
+
+	mainloop_start(vpninfo, reconnect_timeout, reconnect_interval);
+
+	memset(&vpninfo->ext_rd, 0, sizeof(vpninfo->ext_rd));
+	vpninfo->ext_rd.tun = vpninfo->ext_rd.udp = vpninfo->ext_rd.tcp = vpninfo->ext_rd.dns = 1;
+	/* Go round straight away */
+	vpninfo->ext_timeout = 0;
+	vpninfo->ext_running = 1;
+	return 0;
+}
+
+/* Only the fds that we want to hear about right now, so the caller
+ * has to ask again after each call to openconnect_process(). */
+int openconnect_get_fds(struct openconnect_info *vpninfo,
+			struct oc_pollfd *fds, int nr)
+{
+	int fd, n = 0;
+
+#ifdef HAVE_UCONTEXT
+	if (vpninfo->async)
+		return async_get_fds(vpninfo, fds, nr);
 #endif
-		memcpy(&rfds, &vpninfo->_select_rfds, sizeof(rfds));
-		memcpy(&wfds, &vpninfo->_select_wfds, sizeof(wfds));
-		memcpy(&efds, &vpninfo->_select_efds, sizeof(efds));
+	if (!vpninfo->ext_running)
+		return -EINVAL;
 
-		tv.tv_sec = timeout / 1000;
-		tv.tv_usec = (timeout % 1000) * 1000;
+	for (fd = 0; fd < vpninfo->_select_nfds; fd++) {
+		int events = 0;
 
-		if (select(vpninfo->_select_nfds, &rfds, &wfds, &efds, &tv) < 0 &&
-		    errno != EINTR) {
-			ret = -errno;
-			vpn_perror(vpninfo, _("Failed select() in mainloop"));
-			break;
+		if (FD_ISSET(fd, &vpninfo->_select_rfds))
+			events |= OC_FD_READ;
+		if (FD_ISSET(fd, &vpninfo->_select_wfds))
+			events |= OC_FD_WRITE;
+		if (!events)
+			continue;
+
+		if (n < nr) {
+			fds[n].fd = fd;
+			fds[n].events = events;
 		}
-#ifdef HAVE_VHOST
-		if (vpninfo->vhost_call_fd >= 0)
-			vhost_r = FD_ISSET(vpninfo->vhost_call_fd, &rfds);
+		n++;
+	}
+	return n;
+}
+
+int openconnect_get_timeout(struct openconnect_info *vpninfo)
+{
+#ifdef HAVE_UCONTEXT
+	if (vpninfo->async)
+		return async_get_timeout(vpninfo);
 #endif
-		if (vpninfo->tun_fd >= 0)
-			tun_r = FD_ISSET(vpninfo->tun_fd, &rfds);
-		if (vpninfo->dtls_fd >= 0)
-			udp_r = FD_ISSET(vpninfo->dtls_fd, &rfds);
-		if (vpninfo->ssl_fd >= 0)
-			tcp_r = FD_ISSET(vpninfo->ssl_fd, &rfds);
+	if (!vpninfo->ext_running || vpninfo->ext_timeout == INT_MAX)
+		return -1;
+
+	return vpninfo->ext_timeout;
+}
+
+int openconnect_process(struct openconnect_info *vpninfo,
+			const int *readable, int nr_readable,
+			const int *writable, int nr_writable)
+{
+	struct mainloop_rd *rd = &vpninfo->ext_rd;
+	int i, ret = 0, timeout;
+
+#ifdef HAVE_UCONTEXT
+	if (vpninfo->async)
+		return async_process(vpninfo, readable, nr_readable,
+				     writable, nr_writable);
 #endif
+	if (!vpninfo->ext_running)
+		return -EINVAL;
+
+	/* After a sleep, only what the caller saw is readable. If we were
+	 * still busy, the handlers that had more to do get to carry on as
+	 * they would in openconnect_mainloop(). Writable fds don't matter;
+	 * the handlers just try again to write whatever they have queued. */
+	if (vpninfo->ext_timeout)
+		memset(rd, 0, sizeof(*rd));
+	for (i = 0; i < nr_readable; i++)
+		mainloop_set_readable(vpninfo, rd, readable[i]);
+
+	for (i = 0; i < MAINLOOP_BURST; i++) {
+		switch (mainloop_pass(vpninfo, rd, &timeout, &ret)) {
+		case MAINLOOP_PAUSED:
+			vpninfo->ext_running = 0;
+			return 0;
+
+		case MAINLOOP_QUIT:
+			vpninfo->ext_running = 0;
+			return mainloop_finish(vpninfo, ret);
+
+		case MAINLOOP_IDLE:
+			vpninfo->ext_timeout = timeout;
+			return -EINPROGRESS;
+		}
 	}
 
-	if (vpninfo->quit_reason && vpninfo->proto->vpn_close_session)
-		vpninfo->proto->vpn_close_session(vpninfo, vpninfo->quit_reason);
+	vpninfo->ext_timeout = 0;
+	return -EINPROGRESS;
+}
+#else
+int openconnect_mainloop_start(struct openconnect_info *vpninfo,
+			       int reconnect_timeout,
+			       int reconnect_interval)
+{
+	return -EOPNOTSUPP;
+}
 
-	if (tun_is_up(vpninfo))
-		os_shutdown_tun(vpninfo);
+int openconnect_get_fds(struct openconnect_info *vpninfo,
+			struct oc_pollfd *fds, int nr)
+{
+	return -EOPNOTSUPP;
+}
 
-	if (vpninfo->cmd_fd >= 0)
-		unmonitor_fd(vpninfo, cmd);
+int openconnect_get_timeout(struct openconnect_info *vpninfo)
+{
+	return -1;
+}
 
-	return ret < 0 ? ret : -EIO;
+int openconnect_process(struct openconnect_info *vpninfo,
+			const int *readable, int nr_readable,
+			const int *writable, int nr_writable)
+{
+	return -EOPNOTSUPP;
 }
+#endif
 
 int ka_check_deadline(int *timeout, time_t now, time_t due)
 {
@@ -441,6 +928,11 @@ int ka_stalled_action(struct keepalive_info *ka, int *timeout)
 {
 	time_t now = time(NULL);
 
+	if (ka->dead) {
+		ka->dead = 0;
+		return KA_DPD_DEAD;
+	}
+
 	/* We only support the new-tunnel rekey method for now. */
 	if (ka->rekey_method != REKEY_NONE &&
 	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
@@ -460,6 +952,11 @@ int keepalive_action(struct keepalive_info *ka, int *timeout)
 {
 	time_t now = time(NULL);
 
+	if (ka->dead) {
+		ka->dead = 0;
+		return KA_DPD_DEAD;
+	}
+
 	if (ka->rekey_method != REKEY_NONE &&
 	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
 		ka->last_rekey = now;
@@ -488,6 +985,13 @@ int keepalive_action(struct keepalive_info *ka, int *timeout)
 		}
 	}
 
+	/* Probe more often than that if we're measuring the path */
+	if (ka->probe &&
+	    ka_check_deadline(timeout, now, ka->last_dpd + ka->probe)) {
+		ka->last_dpd = now;
+		return KA_DPD;
+	}
+
 	/* Keepalive is just client -> server.
 	   If we haven't sent anything for $KEEPALIVE seconds, send a
 	   dummy packet (which the server will discard) */
@@ -498,6 +1002,80 @@ int keepalive_action(struct keepalive_info *ka, int *timeout)
 	return KA_NONE;
 }
 
+/* Loss is an EWMA of probe outcomes, with the same gain as SRTT */
+static void ka_update_loss(struct keepalive_info *ka, int lost)
+{
+	ka->loss += (lost ? 1000 : 0) - ka_loss(ka);
+	ka->samples++;
+}
+
+/* Called when sending a DPD request (or equivalent) which the peer will
+   answer. One still outstanding from last time is assumed lost. */
+void ka_probe_sent(struct keepalive_info *ka)
+{
+	if (ka->probe_sent.tv_sec)
+		ka_update_loss(ka, 1);
+	gettimeofday(&ka->probe_sent, NULL);
+}
+
+/* Called on receipt of the answer; update SRTT and RTTVAR as RFC6298 §2 */
+void ka_probe_rcvd(struct keepalive_info *ka)
+{
+	struct timeval now;
+	long rtt;
+
+	if (!ka->probe_sent.tv_sec)
+		return;
+
+	gettimeofday(&now, NULL);
+	rtt = (now.tv_sec - ka->probe_sent.tv_sec) * 1000 +
+		(now.tv_usec - ka->probe_sent.tv_usec) / 1000;
+	ka->probe_sent.tv_sec = 0;
+
+	/* Clock went backwards? */
+	if (rtt < 0)
+		return;
+
+	/* In fixed point, as the BSD and Linux TCP stacks do it */
+	if (!ka->srtt) {
+		ka->srtt = (rtt << KA_SRTT_SHIFT) ? : 1;
+		ka->rttvar = (rtt / 2) << KA_RTTVAR_SHIFT;
+	} else {
+		ka->rttvar += labs(ka_srtt(ka) - rtt) - ka_rttvar(ka);
+		ka->srtt += rtt - ka_srtt(ka);
+	}
+	ka_update_loss(ka, 0);
+}
+
+/* Don't make any judgement on fewer probes than this */
+#define UDP_MIN_SAMPLES 8
+
+/* Returns 1 if the UDP transport is measurably worse than the thresholds
+   given to openconnect_set_udp_fallback(). The caller should close it and
+   let traffic use TLS until it's next retried, as if DPD had failed. */
+int udp_degraded(struct openconnect_info *vpninfo)
+{
+	struct keepalive_info *ka = &vpninfo->dtls_times;
+
+	if (ka->samples < UDP_MIN_SAMPLES)
+		return 0;
+
+	if ((!vpninfo->udp_max_loss || ka_loss(ka) <= vpninfo->udp_max_loss * 10) &&
+	    (!vpninfo->udp_max_rtt || ka_srtt(ka) <= vpninfo->udp_max_rtt))
+		return 0;
+
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("%s has %d.%d%% loss and %dms RTT; falling back to TLS\n"),
+		     vpninfo->proto->udp_protocol ? : "UDP",
+		     ka_loss(ka) / 10, ka_loss(ka) % 10, ka_srtt(ka));
+
+	/* Start afresh when it is retried */
+	memset(&ka->probe_sent, 0, sizeof(ka->probe_sent));
+	ka->srtt = ka->rttvar = ka->loss = ka->samples = 0;
+	time(&vpninfo->new_dtls_started);
+	return 1;
+}
+
 int trojan_check_deadline(struct openconnect_info *vpninfo, int *timeout)
 {
 	time_t now = time(NULL);
@@ -43,7 +43,13 @@ int calculate_mtu(struct openconnect_info *vpninfo, int is_udp,
 		  int unpadded_overhead, int padded_overhead, int block_size)
 {
 	int mtu = vpninfo->reqmtu, base_mtu = vpninfo->basemtu;
-	int mss = 0;
+	int mss = 0, af = vpninfo->peer_addr->sa_family;
+
+	/* This is decided before we know which address family UDP will end
+	 * up using, so allow for the larger header if it might be IPv6. */
+	if (is_udp && vpninfo->dtls_addr_alt &&
+	    vpninfo->dtls_addr_alt->sa_family == AF_INET6)
+		af = AF_INET6;
 
 	/* Try to figure out base_mtu (from TCP PMTU), and save TCP MSS for later */
 #if defined(__linux__) && defined(TCP_INFO)
@@ -99,12 +105,12 @@ int calculate_mtu(struct openconnect_info *vpninfo, int is_udp,
 		else {
 			/* remove TCP/UDP, IP headers from base (wire) MTU */
 			mtu = base_mtu - (is_udp ? UDP_HEADER_SIZE : TCP_HEADER_SIZE);
-			mtu -= (vpninfo->peer_addr->sa_family == AF_INET6) ? IPV6_HEADER_SIZE : IPV4_HEADER_SIZE;
+			mtu -= (af == AF_INET6) ? IPV6_HEADER_SIZE : IPV4_HEADER_SIZE;
 		}
 	}
 
 	vpn_progress(vpninfo, PRG_TRACE, _("After removing %s/IPv%d headers, MTU of %d\n"),
-		     (is_udp ? "UDP" : "TCP"), vpninfo->peer_addr->sa_family == AF_INET6 ? 6 : 4, mtu);
+		     (is_udp ? "UDP" : "TCP"), af == AF_INET6 ? 6 : 4, mtu);
 
         /* MTU is now (we hope) the number of payload bytes that can fit in a UDP or
 	 * TCP packet exchanged with the VPN gateway. */
@@ -0,0 +1,1155 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A built-in alternative to vpnc-script, for Linux. Rather than forking a
+ * shell which runs 'ip route' once for each of potentially thousands of
+ * split routes, talk to the kernel directly with rtnetlink: aggregate
+ * the routes into as few prefixes as possible and send them in batches.
+ *
+ * It follows what vpnc-script does on Linux: the tun device gets the
+ * MTU and addresses, and either the split includes or a default route
+ * for each address family that has an address. The VPN server, at its
+ * addresses in both families if it has them, and any split excludes are
+ * routed via whatever path they took before. DNS goes to systemd-resolved for the tun device if that's
+ * running, otherwise into /etc/resolv.conf.
+ *
+ * What we applied is kept in vpninfo->netcfg. On reconnect, only the
+ * routes and addresses which differ are removed or added, so that
+ * existing connections aren't disturbed. Before each attempt to
+ * reconnect, the path to the VPN server is looked up again in case we
+ * have roamed to a different network, and the server and exclude routes
+ * are moved to it. */
+
+#ifdef __linux__
+
+#define RESOLV_CONF "/etc/resolv.conf"
+
+/* Requests per batch. The kernel can send an error for each of them,
+ * and they all need to fit in the socket's receive buffer. */
+#define NL_BATCH_MAX 64
+
+struct netcfg_route {
+	unsigned char family;
+	unsigned char plen;
+	unsigned char addr[16];
+};
+
+struct netcfg_routes {
+	struct netcfg_route *r;
+	int nr, alloc;
+};
+
+struct netcfg_path {
+	int family;
+	int oif;
+	int gwlen;
+	unsigned char gw[16];
+};
+
+struct netcfg_state {
+	int idx, mtu;
+	struct netcfg_routes addrs;	/* On the tun device */
+	struct netcfg_routes inc;	/* Via the tun device */
+	struct netcfg_routes exc;	/* Via phys[], including the VPN server */
+	struct netcfg_path tun;
+	struct netcfg_path phys[2];
+	int resolved;
+	unsigned char dns_md5[MD5_SIZE];
+};
+
+static int addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+static int nl_msg_start(struct oc_text_buf *buf, int type, int flags,
+			const void *hdr, int hdrlen)
+{
+	struct nlmsghdr nh;
+	int ofs = buf->pos;
+
+	memset(&nh, 0, sizeof(nh));
+	nh.nlmsg_type = type;
+	nh.nlmsg_flags = NLM_F_REQUEST | flags;
+	buf_append_bytes(buf, &nh, sizeof(nh));
+	buf_append_bytes(buf, hdr, hdrlen);
+	return ofs;
+}
+
+static void nl_add_attr(struct oc_text_buf *buf, int type, const void *data, int len)
+{
+	static const char pad[RTA_ALIGNTO];
+	struct rtattr rta;
+
+	rta.rta_type = type;
+	rta.rta_len = RTA_LENGTH(len);
+	buf_append_bytes(buf, &rta, sizeof(rta));
+	buf_append_bytes(buf, data, len);
+	buf_append_bytes(buf, pad, RTA_ALIGN(len) - len);
+}
+
+static void nl_msg_end(struct oc_text_buf *buf, int ofs)
+{
+	if (!buf_error(buf))
+		((struct nlmsghdr *)(buf->data + ofs))->nlmsg_len = buf->pos - ofs;
+}
+
+static void put_link(struct oc_text_buf *buf, int idx, int up, int mtu)
+{
+	struct ifinfomsg ifi;
+	int ofs;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = idx;
+	ifi.ifi_flags = up ? IFF_UP : 0;
+	ifi.ifi_change = IFF_UP;
+
+	ofs = nl_msg_start(buf, RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+	if (mtu > 0)
+		nl_add_attr(buf, IFLA_MTU, &mtu, sizeof(mtu));
+	nl_msg_end(buf, ofs);
+}
+
+static void put_addr(struct oc_text_buf *buf, int type, int flags, int idx,
+		     const struct netcfg_route *a)
+{
+	struct ifaddrmsg ifa;
+	int ofs;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = a->family;
+	ifa.ifa_prefixlen = a->plen;
+	ifa.ifa_index = idx;
+
+	ofs = nl_msg_start(buf, type, flags, &ifa, sizeof(ifa));
+	nl_add_attr(buf, IFA_LOCAL, a->addr, addr_len(a->family));
+	nl_add_attr(buf, IFA_ADDRESS, a->addr, addr_len(a->family));
+	nl_msg_end(buf, ofs);
+}
+
+static void put_route(struct oc_text_buf *buf, int type, int flags,
+		      const struct netcfg_route *r, const struct netcfg_path *via)
+{
+	struct rtmsg rtm;
+	int ofs;
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = r->family;
+	rtm.rtm_dst_len = r->plen;
+	rtm.rtm_table = RT_TABLE_MAIN;
+	rtm.rtm_protocol = RTPROT_STATIC;
+	rtm.rtm_scope = via->gwlen ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	rtm.rtm_type = RTN_UNICAST;
+
+	ofs = nl_msg_start(buf, type, flags, &rtm, sizeof(rtm));
+	nl_add_attr(buf, RTA_DST, r->addr, addr_len(r->family));
+	nl_add_attr(buf, RTA_OIF, &via->oif, sizeof(via->oif));
+	if (via->gwlen)
+		nl_add_attr(buf, RTA_GATEWAY, via->gw, via->gwlen);
+	nl_msg_end(buf, ofs);
+}
+
+static int nl_open(struct openconnect_info *vpninfo)
+{
+	int fd, one = 1;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		fd = -errno;
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to open netlink socket: %s\n"),
+			     strerror(-fd));
+		return fd;
+	}
+	/* Errors needn't include a copy of the request */
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	return fd;
+}
+
+/* Send a batch of requests, asking for an ACK only at the end of each
+ * chunk. The kernel reports any failures regardless. When deleting, or
+ * bringing the link down, it doesn't matter if things have already gone
+ * away. */
+static int nl_send_batch(struct openconnect_info *vpninfo, int fd,
+			 struct oc_text_buf *buf)
+{
+	union {
+		struct nlmsghdr nh;
+		char buf[8192];
+	} u;
+	int ofs = 0, seq = 0, nr_err = 0, ret = 0;
+
+	if (buf_error(buf))
+		return buf_error(buf);
+
+	while (ofs < buf->pos) {
+		struct nlmsghdr *nh, *last = NULL;
+		int len = 0, nr = 0, done = 0;
+
+		while (ofs + len < buf->pos && nr++ < NL_BATCH_MAX) {
+			nh = (void *)(buf->data + ofs + len);
+			nh->nlmsg_seq = ++seq;
+			nh->nlmsg_flags &= ~NLM_F_ACK;
+			len += NLMSG_ALIGN(nh->nlmsg_len);
+			last = nh;
+		}
+		last->nlmsg_flags |= NLM_F_ACK;
+
+		if (send(fd, buf->data + ofs, len, 0) != len) {
+			ret = -errno;
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to send netlink request: %s\n"),
+				     strerror(-ret));
+			return ret;
+		}
+		ofs += len;
+
+		while (!done) {
+			int rlen = recv(fd, &u, sizeof(u), 0);
+
+			if (rlen < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -errno;
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to receive netlink response: %s\n"),
+					     strerror(-ret));
+				return ret;
+			}
+			for (nh = &u.nh; NLMSG_OK(nh, rlen); nh = NLMSG_NEXT(nh, rlen)) {
+				struct nlmsgerr *e = NLMSG_DATA(nh);
+
+				if (nh->nlmsg_type != NLMSG_ERROR)
+					continue;
+				if (nh->nlmsg_seq == seq)
+					done = 1;
+				if (!e->error)
+					continue;
+				if ((e->msg.nlmsg_type == RTM_DELROUTE ||
+				     e->msg.nlmsg_type == RTM_DELADDR ||
+				     e->msg.nlmsg_type == RTM_NEWLINK) &&
+				    (e->error == -ESRCH || e->error == -ENOENT ||
+				     e->error == -ENODEV || e->error == -EADDRNOTAVAIL))
+					continue;
+				if (!nr_err++)
+					vpn_progress(vpninfo, PRG_ERR,
+						     _("Failed to configure network: %s\n"),
+						     strerror(-e->error));
+				ret = -EIO;
+			}
+		}
+	}
+
+	if (nr_err > 1)
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("%d network configuration requests failed\n"), nr_err);
+	return ret;
+}
+
+/* Find out which way we'd currently send to @addr. */
+static int get_path(struct openconnect_info *vpninfo, int fd, int family,
+		    const void *addr, struct netcfg_path *path)
+{
+	union {
+		struct nlmsghdr nh;
+		char buf[4096];
+	} u;
+	struct oc_text_buf *req = buf_alloc();
+	char abuf[INET6_ADDRSTRLEN];
+	struct rtmsg rtm;
+	struct rtattr *rta;
+	int ofs, len, rtlen;
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = family;
+	rtm.rtm_dst_len = addr_len(family) * 8;
+
+	ofs = nl_msg_start(req, RTM_GETROUTE, 0, &rtm, sizeof(rtm));
+	nl_add_attr(req, RTA_DST, addr, addr_len(family));
+	nl_msg_end(req, ofs);
+
+	if (buf_error(req) ||
+	    send(fd, req->data, req->pos, 0) != req->pos ||
+	    (len = recv(fd, &u, sizeof(u), 0)) < 0) {
+		buf_free(req);
+		goto err;
+	}
+	buf_free(req);
+
+	if (!NLMSG_OK(&u.nh, len) || u.nh.nlmsg_type != RTM_NEWROUTE)
+		goto err;
+
+	memset(path, 0, sizeof(*path));
+	path->family = family;
+	rtlen = RTM_PAYLOAD(&u.nh);
+	for (rta = RTM_RTA(NLMSG_DATA(&u.nh)); RTA_OK(rta, rtlen); rta = RTA_NEXT(rta, rtlen)) {
+		if (rta->rta_type == RTA_OIF)
+			memcpy(&path->oif, RTA_DATA(rta), sizeof(path->oif));
+		else if (rta->rta_type == RTA_GATEWAY &&
+			 RTA_PAYLOAD(rta) == addr_len(family)) {
+			path->gwlen = RTA_PAYLOAD(rta);
+			memcpy(path->gw, RTA_DATA(rta), path->gwlen);
+		}
+	}
+	if (path->oif)
+		return 0;
+
+ err:
+	vpn_progress(vpninfo, PRG_ERR, _("No existing route to %s\n"),
+		     inet_ntop(family, addr, abuf, sizeof(abuf)));
+	return -EHOSTUNREACH;
+}
+
+static int route_covers(const struct netcfg_route *a, const struct netcfg_route *b);
+static int routes_contain(const struct netcfg_routes *rs, const struct netcfg_route *r);
+
+/* As get_path(), but ignoring the routes we added ourselves: any via the
+ * tun device @tun_idx, and those to the server and excludes in @old. The
+ * kernel can't be asked to do that, so search its main table instead. */
+static int get_phys_path(struct openconnect_info *vpninfo, int fd, int family,
+			 const void *addr, const struct netcfg_state *old,
+			 int tun_idx, struct netcfg_path *path)
+{
+	union {
+		struct nlmsghdr nh;
+		char buf[32768];
+	} u;
+	struct oc_text_buf *req = buf_alloc();
+	struct netcfg_route dst, r;
+	char abuf[INET6_ADDRSTRLEN];
+	struct rtmsg rtm;
+	int ofs, len, done = 0, best = -1;
+	uint32_t best_prio = 0;
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = family;
+
+	ofs = nl_msg_start(req, RTM_GETROUTE, NLM_F_DUMP, &rtm, sizeof(rtm));
+	nl_msg_end(req, ofs);
+
+	if (buf_error(req) || send(fd, req->data, req->pos, 0) != req->pos) {
+		buf_free(req);
+		goto err;
+	}
+	buf_free(req);
+
+	memset(&dst, 0, sizeof(dst));
+	dst.family = family;
+	dst.plen = addr_len(family) * 8;
+	memcpy(dst.addr, addr, addr_len(family));
+
+	while (!done) {
+		struct nlmsghdr *nh;
+
+		len = recv(fd, &u, sizeof(u), 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			goto err;
+
+		for (nh = &u.nh; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			struct rtmsg *rm = NLMSG_DATA(nh);
+			struct netcfg_path p;
+			struct rtattr *rta;
+			uint32_t prio = 0;
+			int rtlen;
+
+			if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+				done = 1;
+				break;
+			}
+			if (nh->nlmsg_type != RTM_NEWROUTE || rm->rtm_family != family ||
+			    rm->rtm_table != RT_TABLE_MAIN || rm->rtm_type != RTN_UNICAST)
+				continue;
+
+			memset(&r, 0, sizeof(r));
+			memset(&p, 0, sizeof(p));
+			r.family = p.family = family;
+			r.plen = rm->rtm_dst_len;
+			rtlen = RTM_PAYLOAD(nh);
+			for (rta = RTM_RTA(rm); RTA_OK(rta, rtlen); rta = RTA_NEXT(rta, rtlen)) {
+				if (rta->rta_type == RTA_DST &&
+				    RTA_PAYLOAD(rta) == addr_len(family))
+					memcpy(r.addr, RTA_DATA(rta), addr_len(family));
+				else if (rta->rta_type == RTA_OIF)
+					memcpy(&p.oif, RTA_DATA(rta), sizeof(p.oif));
+				else if (rta->rta_type == RTA_PRIORITY)
+					memcpy(&prio, RTA_DATA(rta), sizeof(prio));
+				else if (rta->rta_type == RTA_GATEWAY &&
+					 RTA_PAYLOAD(rta) == addr_len(family)) {
+					p.gwlen = RTA_PAYLOAD(rta);
+					memcpy(p.gw, RTA_DATA(rta), p.gwlen);
+				}
+			}
+
+			if (!p.oif || p.oif == tun_idx || p.oif == old->idx ||
+			    (rm->rtm_protocol == RTPROT_STATIC && routes_contain(&old->exc, &r)) ||
+			    !route_covers(&r, &dst))
+				continue;
+
+			/* Longest prefix, then lowest metric */
+			if (r.plen > best || (r.plen == best && prio < best_prio)) {
+				best = r.plen;
+				best_prio = prio;
+				*path = p;
+			}
+		}
+	}
+	if (best >= 0)
+		return 0;
+
+ err:
+	vpn_progress(vpninfo, PRG_ERR, _("No route to %s outside the VPN\n"),
+		     inet_ntop(family, addr, abuf, sizeof(abuf)));
+	return -EHOSTUNREACH;
+}
+
+static int mask_len(const unsigned char *mask, int len)
+{
+	int i, plen = 0;
+
+	for (i = 0; i < len && mask[i] == 0xff; i++)
+		plen += 8;
+	if (i < len) {
+		unsigned char m = mask[i];
+
+		while (m & 0x80) {
+			m <<= 1;
+			plen++;
+		}
+		/* Anything after the first zero bit must be zero too */
+		if (m)
+			return -1;
+		while (++i < len)
+			if (mask[i])
+				return -1;
+	}
+	return plen;
+}
+
+static void mask_addr(struct netcfg_route *r)
+{
+	int i;
+
+	for (i = 0; i < addr_len(r->family); i++) {
+		if (r->plen <= i * 8)
+			r->addr[i] = 0;
+		else if (r->plen < (i + 1) * 8)
+			r->addr[i] &= 0xff << (8 - (r->plen & 7));
+	}
+}
+
+static void host_route(struct netcfg_route *r, const struct sockaddr *sa)
+{
+	memset(r, 0, sizeof(*r));
+	r->family = sa->sa_family;
+	r->plen = addr_len(r->family) * 8;
+	if (r->family == AF_INET)
+		memcpy(r->addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+	else
+		memcpy(r->addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+}
+
+/* Parse "addr", "addr/len" or "addr/mask" for either family. For a
+ * route, clear any host bits. */
+static int parse_route(const char *str, struct netcfg_route *r, int route)
+{
+	char tmp[INET6_ADDRSTRLEN + 5], *slash, *end;
+	unsigned char mask[16];
+	long plen;
+
+	if (strlen(str) >= sizeof(tmp))
+		return -EINVAL;
+	strcpy(tmp, str);
+
+	slash = strchr(tmp, '/');
+	if (slash)
+		*(slash++) = 0;
+
+	r->family = strchr(tmp, ':') ? AF_INET6 : AF_INET;
+	if (inet_pton(r->family, tmp, r->addr) <= 0)
+		return -EINVAL;
+
+	if (!slash) {
+		plen = addr_len(r->family) * 8;
+	} else if ((plen = strtol(slash, &end, 10)) >= 0 && end != slash &&
+		   (!*end || isspace((unsigned char)*end))) {
+		if (plen > addr_len(r->family) * 8)
+			return -EINVAL;
+	} else if (inet_pton(r->family, slash, mask) <= 0 ||
+		   (plen = mask_len(mask, addr_len(r->family))) < 0) {
+		return -EINVAL;
+	}
+
+	r->plen = plen;
+	if (route)
+		mask_addr(r);
+	return 0;
+}
+
+static int routes_add(struct netcfg_routes *rs, const struct netcfg_route *r)
+{
+	if (rs->nr == rs->alloc) {
+		int alloc = rs->alloc ? rs->alloc * 2 : 64;
+		struct netcfg_route *new = realloc(rs->r, alloc * sizeof(*new));
+
+		if (!new)
+			return -ENOMEM;
+		rs->r = new;
+		rs->alloc = alloc;
+	}
+	rs->r[rs->nr++] = *r;
+	return 0;
+}
+
+/* A default route is added as two /1 routes, which take precedence over
+ * the existing default route without having to replace it. */
+static int routes_add_default(struct netcfg_routes *rs, int family)
+{
+	struct netcfg_route r;
+
+	memset(&r, 0, sizeof(r));
+	r.family = family;
+	r.plen = 1;
+	if (routes_add(rs, &r))
+		return -ENOMEM;
+	r.addr[0] = 0x80;
+	return routes_add(rs, &r);
+}
+
+static int routes_add_list(struct openconnect_info *vpninfo, struct netcfg_routes *rs,
+			   struct oc_split_include *list, int include)
+{
+	struct netcfg_route r;
+	int ret;
+
+	for (; list; list = list->next) {
+		if (parse_route(list->route, &r, 1)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     include ? _("Discard bad split include: \"%s\"\n") :
+				     _("Discard bad split exclude: \"%s\"\n"),
+				     list->route);
+			continue;
+		}
+		if (!r.plen) {
+			if (!include)
+				continue;
+			ret = routes_add_default(rs, r.family);
+		} else
+			ret = routes_add(rs, &r);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int routes_have_family(struct netcfg_routes *rs, int family)
+{
+	int i;
+
+	for (i = 0; i < rs->nr; i++)
+		if (rs->r[i].family == family)
+			return 1;
+	return 0;
+}
+
+static int route_cmp(const void *_a, const void *_b)
+{
+	const struct netcfg_route *a = _a, *b = _b;
+	int ret = a->family - b->family;
+
+	if (!ret)
+		ret = memcmp(a->addr, b->addr, addr_len(a->family));
+	if (!ret)
+		ret = a->plen - b->plen;
+	return ret;
+}
+
+static int route_covers(const struct netcfg_route *a, const struct netcfg_route *b)
+{
+	struct netcfg_route tmp = *b;
+
+	if (a->family != b->family || a->plen > b->plen)
+		return 0;
+	tmp.plen = a->plen;
+	mask_addr(&tmp);
+	return !memcmp(a->addr, tmp.addr, addr_len(a->family));
+}
+
+/* Are @a and @b the two halves of the same prefix? We stop at /1, since
+ * we never want to add a /0 route. */
+static int route_siblings(const struct netcfg_route *a, const struct netcfg_route *b)
+{
+	struct netcfg_route tmp = *b;
+	int bit;
+
+	if (a->family != b->family || a->plen != b->plen || a->plen < 2)
+		return 0;
+	bit = a->plen - 1;
+	if (!(b->addr[bit / 8] & (0x80 >> (bit % 8))))
+		return 0;
+	tmp.addr[bit / 8] &= ~(0x80 >> (bit % 8));
+	return !memcmp(a->addr, tmp.addr, addr_len(a->family));
+}
+
+/* Sort the routes, drop any which are covered by another, and merge
+ * adjacent prefixes into the shorter prefix which contains both. */
+static void routes_aggregate(struct netcfg_routes *rs)
+{
+	int i, nr = 0;
+
+	qsort(rs->r, rs->nr, sizeof(rs->r[0]), route_cmp);
+
+	for (i = 0; i < rs->nr; i++) {
+		if (nr && route_covers(&rs->r[nr - 1], &rs->r[i]))
+			continue;
+		rs->r[nr++] = rs->r[i];
+		while (nr >= 2 && route_siblings(&rs->r[nr - 2], &rs->r[nr - 1])) {
+			nr--;
+			rs->r[nr - 1].plen--;
+		}
+	}
+	rs->nr = nr;
+}
+
+static int run_cmd(struct openconnect_info *vpninfo, char **argv)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (!pid) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) == -1 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status)) {
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to run '%s %s'\n"),
+			     argv[0], argv[1]);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int resolved_running(void)
+{
+	return !access("/run/systemd/resolve/resolv.conf", F_OK);
+}
+
+/* Split the domain list, which may be separated by spaces or commas */
+static int add_domains(char **argv, int argc, int max, char *list, const char *prefix)
+{
+	char *p;
+
+	for (p = strtok(list, " ,"); p && argc < max; p = strtok(NULL, " ,")) {
+		if (prefix && asprintf(&argv[argc], "%s%s", prefix, p) == -1)
+			break;
+		else if (!prefix && !(argv[argc] = strdup(p)))
+			break;
+		argc++;
+	}
+	return argc;
+}
+
+static int config_resolved(struct openconnect_info *vpninfo)
+{
+	struct oc_split_include *dns;
+	char *argv[64], *list;
+	int argc, i, ret;
+
+	argv[0] = strdup("resolvectl");
+	argv[1] = strdup("dns");
+	argv[2] = strdup(vpninfo->ifname);
+	argc = 3;
+	for (i = 0; i < 3; i++)
+		if (vpn_nameserver(vpninfo, i))
+			argv[argc++] = strdup(vpn_nameserver(vpninfo, i));
+	argv[argc] = NULL;
+	ret = run_cmd(vpninfo, argv);
+
+	for (i = 1; i < argc; i++)
+		free(argv[i]);
+	if (ret)
+		goto out;
+
+	/* With split DNS, only those domains go to the VPN's servers.
+	 * Otherwise it takes all queries, as it would in resolv.conf. */
+	argv[1] = strdup("domain");
+	argv[2] = strdup(vpninfo->ifname);
+	argc = 3;
+	if (vpninfo->ip_info.domain && (list = strdup(vpninfo->ip_info.domain))) {
+		argc = add_domains(argv, argc, 48, list, NULL);
+		free(list);
+	}
+	for (dns = vpninfo->ip_info.split_dns; dns; dns = dns->next) {
+		if ((list = strdup(dns->route))) {
+			argc = add_domains(argv, argc, 62, list, "~");
+			free(list);
+		}
+	}
+	if (!vpninfo->ip_info.split_dns)
+		argv[argc++] = strdup("~.");
+	argv[argc] = NULL;
+	ret = run_cmd(vpninfo, argv);
+
+	for (i = 1; i < argc; i++)
+		free(argv[i]);
+ out:
+	free(argv[0]);
+	return ret;
+}
+
+static void unconfig_resolved(struct openconnect_info *vpninfo)
+{
+	char *argv[] = { (char *)"resolvectl", (char *)"revert", vpninfo->ifname, NULL };
+
+	run_cmd(vpninfo, argv);
+}
+
+static int write_resolvconf(struct openconnect_info *vpninfo, const char *data, int len)
+{
+	FILE *f = fopen(RESOLV_CONF, "w");
+
+	if (!f || fwrite(data, 1, len, f) != len) {
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to write %s: %s\n"),
+			     RESOLV_CONF, strerror(errno));
+		if (f)
+			fclose(f);
+		return -EIO;
+	}
+	return fclose(f) ? -EIO : 0;
+}
+
+static const char *next_line(const char *p, int *len)
+{
+	const char *eol = strchr(p, '\n');
+
+	*len = eol ? eol + 1 - p : strlen(p);
+	return p + *len;
+}
+
+static int is_keyword(const char *p, const char *kw)
+{
+	int len = strlen(kw);
+
+	return !strncmp(p, kw, len) && isspace((unsigned char)p[len]);
+}
+
+/* Put our nameservers and search domains first, and keep the rest of
+ * the original file, which is restored on disconnect. */
+static int config_resolvconf(struct openconnect_info *vpninfo)
+{
+	struct oc_text_buf *buf;
+	const char *p, *next;
+	int i, len, ret;
+
+	if (!vpninfo->netcfg_resolvconf) {
+		char *old = NULL;
+
+		if (openconnect_read_file(vpninfo, RESOLV_CONF, &old) < 0)
+			old = strdup("");
+		if (!old)
+			return -ENOMEM;
+		vpninfo->netcfg_resolvconf = old;
+	}
+
+	buf = buf_alloc();
+	buf_append(buf, "# Generated by openconnect for %s\n", vpninfo->ifname);
+	for (i = 0; i < 3; i++)
+		if (vpn_nameserver(vpninfo, i))
+			buf_append(buf, "nameserver %s\n", vpn_nameserver(vpninfo, i));
+
+	if (vpninfo->ip_info.domain) {
+		buf_append(buf, "search %s", vpninfo->ip_info.domain);
+		/* Followed by the original search domains */
+		for (p = vpninfo->netcfg_resolvconf; *p; p = next) {
+			next = next_line(p, &len);
+			if (is_keyword(p, "search"))
+				buf_append_bytes(buf, p + 6, len - 6 - (p[len - 1] == '\n'));
+		}
+		buf_append(buf, "\n");
+	}
+
+	for (p = vpninfo->netcfg_resolvconf; *p; p = next) {
+		next = next_line(p, &len);
+		if (is_keyword(p, "nameserver") || is_keyword(p, "domain") ||
+		    (vpninfo->ip_info.domain && is_keyword(p, "search")))
+			continue;
+		buf_append_bytes(buf, p, len);
+		if (p[len - 1] != '\n')
+			buf_append(buf, "\n");
+	}
+
+	ret = buf_error(buf);
+	if (!ret)
+		ret = write_resolvconf(vpninfo, buf->data, buf->pos);
+	buf_free(buf);
+	return ret;
+}
+
+static void unconfig_resolvconf(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->netcfg_resolvconf)
+		return;
+
+	write_resolvconf(vpninfo, vpninfo->netcfg_resolvconf,
+			 strlen(vpninfo->netcfg_resolvconf));
+	free(vpninfo->netcfg_resolvconf);
+	vpninfo->netcfg_resolvconf = NULL;
+}
+
+static int config_dns(struct openconnect_info *vpninfo, struct netcfg_state *st)
+{
+	if (!vpninfo->ip_info.dns[0])
+		return 0;
+
+	if (resolved_running() && !config_resolved(vpninfo)) {
+		st->resolved = 1;
+		return 0;
+	}
+
+	return config_resolvconf(vpninfo);
+}
+
+static void unconfig_dns(struct openconnect_info *vpninfo, struct netcfg_state *st)
+{
+	if (vpninfo->netcfg_resolvconf)
+		unconfig_resolvconf(vpninfo);
+	else if (st->resolved)
+		unconfig_resolved(vpninfo);
+}
+
+static void dns_digest(struct openconnect_info *vpninfo, unsigned char *md5)
+{
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct oc_split_include *l;
+	struct oc_text_buf *buf = buf_alloc();
+	int i;
+
+	for (i = 0; i < 3; i++)
+		buf_append(buf, "%s\n", ip->dns[i] ? : "");
+	buf_append(buf, "%s\n", ip->domain ? : "");
+	for (l = ip->split_dns; l; l = l->next)
+		buf_append(buf, "%s\n", l->route);
+
+	if (buf_error(buf))
+		memset(md5, 0, MD5_SIZE);
+	else
+		openconnect_md5(md5, buf->data, buf->pos);
+	buf_free(buf);
+}
+
+static void state_free(struct netcfg_state *st)
+{
+	if (!st)
+		return;
+
+	free(st->addrs.r);
+	free(st->inc.r);
+	free(st->exc.r);
+	free(st);
+}
+
+void netcfg_free(struct openconnect_info *vpninfo)
+{
+	state_free(vpninfo->netcfg);
+	vpninfo->netcfg = NULL;
+	free(vpninfo->netcfg_resolvconf);
+	vpninfo->netcfg_resolvconf = NULL;
+}
+
+/* Work out the configuration we want, from vpninfo->ip_info. Once we
+ * have configured the tun device, the path to the VPN server has to be
+ * looked up without the routes we added, since by now the kernel would
+ * send it via the VPN. */
+static int netcfg_build(struct openconnect_info *vpninfo, int fd,
+			struct netcfg_state *st, struct netcfg_state *old)
+{
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct netcfg_route a, net;
+	int i, nr, ret, have_v4 = 0, have_v6 = 0, have_net = 0;
+
+	st->idx = if_nametoindex(vpninfo->ifname);
+	if (!st->idx) {
+		vpn_progress(vpninfo, PRG_ERR, _("Cannot find tun device %s\n"),
+			     vpninfo->ifname);
+		return -ENODEV;
+	}
+	st->tun.oif = st->idx;
+	st->mtu = ip->mtu;
+	dns_digest(vpninfo, st->dns_md5);
+
+	/* Point-to-point, as vpnc-script does. The legacy netmask is
+	 * just another route. */
+	if (ip->addr && !parse_route(ip->addr, &a, 0) && a.family == AF_INET) {
+		have_v4 = 1;
+		if (routes_add(&st->addrs, &a))
+			return -ENOMEM;
+		if (ip->netmask) {
+			char str[64];
+
+			snprintf(str, sizeof(str), "%s/%s", ip->addr, ip->netmask);
+			have_net = !parse_route(str, &net, 1);
+		}
+	}
+	/* The netmask6 option is the address *and* prefix length */
+	if ((ip->netmask6 || ip->addr6) &&
+	    !parse_route(ip->netmask6 ? : ip->addr6, &a, 0) && a.family == AF_INET6) {
+		have_v6 = 1;
+		if (routes_add(&st->addrs, &a))
+			return -ENOMEM;
+	}
+	qsort(st->addrs.r, st->addrs.nr, sizeof(a), route_cmp);
+
+	/* The VPN server goes first, so that it's what we look up. UDP may
+	 * go to its address in the other family, so that stays outside too. */
+	if (vpninfo->peer_addr) {
+		host_route(&a, vpninfo->peer_addr);
+		if (routes_add(&st->exc, &a))
+			return -ENOMEM;
+	}
+	if (vpninfo->peer_addr_alt) {
+		host_route(&a, vpninfo->peer_addr_alt);
+		if (routes_add(&st->exc, &a))
+			return -ENOMEM;
+	}
+
+	ret = routes_add_list(vpninfo, &st->inc, ip->split_includes, 1);
+	if (!ret)
+		ret = routes_add_list(vpninfo, &st->exc, ip->split_excludes, 0);
+	if (ret)
+		return ret;
+
+	/* No split includes for a family means a default route for it */
+	if (have_v4 && !routes_have_family(&st->inc, AF_INET) &&
+	    routes_add_default(&st->inc, AF_INET))
+		return -ENOMEM;
+	if (have_v6 && !routes_have_family(&st->inc, AF_INET6) &&
+	    routes_add_default(&st->inc, AF_INET6))
+		return -ENOMEM;
+	if (have_net && routes_add(&st->inc, &net))
+		return -ENOMEM;
+
+	/* Keep the VPN server, and the excluded routes, going the way they
+	 * would go without the VPN. */
+	for (i = 0; i < st->exc.nr; i++) {
+		const struct netcfg_route *r = &st->exc.r[i];
+		struct netcfg_path *p = &st->phys[r->family == AF_INET6];
+
+		if (p->family)
+			continue;
+		if (old ? get_phys_path(vpninfo, fd, r->family, r->addr, old, st->idx, p) :
+		    get_path(vpninfo, fd, r->family, r->addr, p))
+			p->family = -1;
+	}
+
+	routes_aggregate(&st->inc);
+	routes_aggregate(&st->exc);
+
+	for (i = nr = 0; i < st->exc.nr; i++)
+		if (st->phys[st->exc.r[i].family == AF_INET6].family > 0)
+			st->exc.r[nr++] = st->exc.r[i];
+	st->exc.nr = nr;
+
+	return 0;
+}
+
+static int routes_contain(const struct netcfg_routes *rs, const struct netcfg_route *r)
+{
+	return rs && bsearch(r, rs->r, rs->nr, sizeof(*r), route_cmp);
+}
+
+static int same_path(const struct netcfg_path *a, const struct netcfg_path *b)
+{
+	return a->oif == b->oif && a->gwlen == b->gwlen && !memcmp(a->gw, b->gw, a->gwlen);
+}
+
+/* Add (or delete) those of the routes @rs in @st which aren't in @other
+ * by the same path */
+static int put_routes(struct oc_text_buf *buf, int type, const struct netcfg_state *st,
+		      const struct netcfg_routes *rs, const struct netcfg_state *other)
+{
+	int inc = rs == &st->inc;
+	int i, nr = 0;
+
+	for (i = 0; i < rs->nr; i++) {
+		const struct netcfg_route *r = &rs->r[i];
+		const struct netcfg_path *via = inc ? &st->tun : &st->phys[r->family == AF_INET6];
+
+		if (other && routes_contain(inc ? &other->inc : &other->exc, r) &&
+		    same_path(via, inc ? &other->tun : &other->phys[r->family == AF_INET6]))
+			continue;
+		put_route(buf, type, type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_REPLACE : 0, r, via);
+		nr++;
+	}
+	return nr;
+}
+
+static void put_addrs(struct oc_text_buf *buf, int type, const struct netcfg_state *st,
+		      const struct netcfg_state *other)
+{
+	int i;
+
+	for (i = 0; i < st->addrs.nr; i++)
+		if (!other || !routes_contain(&other->addrs, &st->addrs.r[i]))
+			put_addr(buf, type, type == RTM_NEWADDR ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+				 st->idx, &st->addrs.r[i]);
+}
+
+/* Get from the @old configuration (if any) to the @new one (if any).
+ * Remove what's no longer wanted first, then add. */
+static int netcfg_apply(struct openconnect_info *vpninfo, int fd,
+			struct netcfg_state *old, struct netcfg_state *new)
+{
+	struct oc_text_buf *buf = buf_alloc();
+	int added = 0, removed = 0, ret;
+
+	if (old) {
+		removed += put_routes(buf, RTM_DELROUTE, old, &old->inc, new);
+		removed += put_routes(buf, RTM_DELROUTE, old, &old->exc, new);
+		put_addrs(buf, RTM_DELADDR, old, new);
+		if (!new)
+			put_link(buf, old->idx, 0, 0);
+	}
+	if (new) {
+		if (!old || old->mtu != new->mtu)
+			put_link(buf, new->idx, 1, new->mtu);
+		put_addrs(buf, RTM_NEWADDR, new, old);
+		added += put_routes(buf, RTM_NEWROUTE, new, &new->exc, old);
+		added += put_routes(buf, RTM_NEWROUTE, new, &new->inc, old);
+	}
+
+	if (new && !old)
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Configuring %s with %d routes and %d excluded routes\n"),
+			     vpninfo->ifname, new->inc.nr, new->exc.nr);
+	else if (new && (added || removed))
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Reconfiguring %s: %d routes added, %d removed\n"),
+			     vpninfo->ifname, added, removed);
+
+	ret = nl_send_batch(vpninfo, fd, buf);
+	buf_free(buf);
+	return ret;
+}
+
+/* Have we routed @sa outside the VPN, to the way it went before? */
+int netcfg_routes_outside(struct openconnect_info *vpninfo, const struct sockaddr *sa)
+{
+	struct netcfg_state *st = vpninfo->netcfg;
+	struct netcfg_route r;
+	int i;
+
+	if (!st || (sa->sa_family != AF_INET && sa->sa_family != AF_INET6))
+		return 0;
+
+	host_route(&r, sa);
+	for (i = 0; i < st->exc.nr; i++)
+		if (route_covers(&st->exc.r[i], &r))
+			return 1;
+	return 0;
+}
+
+int netcfg_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	struct netcfg_state *old = vpninfo->netcfg, *new = NULL;
+	int fd, ret = 0;
+
+	if (!vpninfo->ifname)
+		return 0;
+
+	/* Before each attempt to reconnect, move the routes to the server
+	 * and the excludes, in case the network has changed underneath us.
+	 * The configuration from the gateway is still the old one. */
+	if (!strcmp(reason, "disconnect") || !strcmp(reason, "attempt-reconnect")) {
+		if (!old)
+			return 0;
+	} else if (strcmp(reason, "connect") && strcmp(reason, "reconnect"))
+		return 0;
+
+	fd = nl_open(vpninfo);
+	if (fd < 0)
+		return fd;
+
+	if (strcmp(reason, "disconnect")) {
+		new = calloc(1, sizeof(*new));
+		if (!new)
+			ret = -ENOMEM;
+		else
+			ret = netcfg_build(vpninfo, fd, new, old);
+		if (ret) {
+			state_free(new);
+			goto out;
+		}
+	}
+
+	ret = netcfg_apply(vpninfo, fd, old, new);
+
+	if (!old || !new || memcmp(old->dns_md5, new->dns_md5, MD5_SIZE)) {
+		if (old)
+			unconfig_dns(vpninfo, old);
+		if (new && !ret)
+			ret = config_dns(vpninfo, new);
+	} else
+		new->resolved = old->resolved;
+
+	/* Even if it failed, this is what we need to remove later */
+	state_free(old);
+	vpninfo->netcfg = new;
+ out:
+	close(fd);
+	return ret;
+}
+
+#else /* !__linux__ */
+
+int netcfg_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	return -EOPNOTSUPP;
+}
+
+int netcfg_routes_outside(struct openconnect_info *vpninfo, const struct sockaddr *sa)
+{
+	return 0;
+}
+
+void netcfg_free(struct openconnect_info *vpninfo)
+{
+}
+
+#endif
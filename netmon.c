@@ -0,0 +1,239 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+/* When we roam to a different network, our existing TCP and UDP sockets
+ * are still bound to the old local address. Nothing that we send on them
+ * will ever get a response, and without this we would only notice when
+ * Dead Peer Detection gives up, after twice the DPD interval.
+ *
+ * Watch for address and route changes with rtnetlink instead, and when
+ * the local address that we'd use to reach the server changes, reconnect
+ * immediately. */
+
+#ifdef __linux__
+
+void netmon_open(struct openconnect_info *vpninfo)
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	if (vpninfo->netmon_fd >= 0)
+		return;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		goto err;
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+		RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+	if (bind(fd, (void *)&snl, sizeof(snl)) < 0) {
+		close(fd);
+		goto err;
+	}
+
+	vpninfo->netmon_fd = fd;
+	monitor_fd_new(vpninfo, netmon);
+	monitor_read_fd(vpninfo, netmon);
+	return;
+
+ err:
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Cannot monitor network changes: %s\n"),
+		     strerror(errno));
+}
+
+void netmon_close(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->netmon_fd < 0)
+		return;
+
+	unmonitor_fd(vpninfo, netmon);
+	close(vpninfo->netmon_fd);
+	vpninfo->netmon_fd = -1;
+}
+
+/* Drain the netlink socket. Returns 1 if any of the notifications were
+ * for something other than our own tun device; we don't care about the
+ * routes that vpnc-script adds to that. */
+static int netmon_read(struct openconnect_info *vpninfo)
+{
+	union {
+		struct nlmsghdr nh;
+		char buf[8192];
+	} u;
+	unsigned int tun_idx = 0;
+	int changed = 0;
+	int len;
+
+	if (vpninfo->ifname)
+		tun_idx = if_nametoindex(vpninfo->ifname);
+
+	while ((len = recv(vpninfo->netmon_fd, &u, sizeof(u), 0)) > 0) {
+		struct nlmsghdr *nh;
+
+		for (nh = &u.nh; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			unsigned int idx = 0;
+
+			switch (nh->nlmsg_type) {
+			case RTM_NEWADDR:
+			case RTM_DELADDR: {
+				struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+
+				idx = ifa->ifa_index;
+				break;
+			}
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE: {
+				struct rtmsg *rtm = NLMSG_DATA(nh);
+				struct rtattr *rta = RTM_RTA(rtm);
+				int rtlen = RTM_PAYLOAD(nh);
+
+				if (rtm->rtm_table == RT_TABLE_LOCAL)
+					continue;
+
+				for (; RTA_OK(rta, rtlen); rta = RTA_NEXT(rta, rtlen)) {
+					if (rta->rta_type == RTA_OIF)
+						memcpy(&idx, RTA_DATA(rta), sizeof(idx));
+				}
+				break;
+			}
+			default:
+				continue;
+			}
+
+			if (!tun_idx || idx != tun_idx)
+				changed = 1;
+		}
+	}
+
+	/* If we missed some, assume something changed */
+	if (len < 0 && errno == ENOBUFS)
+		changed = 1;
+
+	return changed;
+}
+
+static int same_addr(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+
+	if (a->ss_family == AF_INET)
+		return !memcmp(&((struct sockaddr_in *)a)->sin_addr,
+			       &((struct sockaddr_in *)b)->sin_addr,
+			       sizeof(struct in_addr));
+	if (a->ss_family == AF_INET6)
+		return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+			       &((struct sockaddr_in6 *)b)->sin6_addr,
+			       sizeof(struct in6_addr));
+	return 1;
+}
+
+/* Would a new socket to @peer now use a different local address from
+ * the one that @fd is bound to? Connecting a UDP socket sends nothing;
+ * it just asks the kernel to look up the route. If there's no route at
+ * all, say no. There's nothing useful to do until one appears. */
+static int src_addr_changed(struct openconnect_info *vpninfo, int fd,
+			    const struct sockaddr *peer, socklen_t peerlen)
+{
+	struct sockaddr_storage cur, want;
+	socklen_t curlen = sizeof(cur), wantlen = sizeof(want);
+	int route_fd, ret = 0;
+
+	if (fd < 0 || !peer || getsockname(fd, (void *)&cur, &curlen))
+		return 0;
+
+	route_fd = socket(peer->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (route_fd < 0)
+		return 0;
+	if (vpninfo->protect_socket)
+		vpninfo->protect_socket(vpninfo->cbdata, route_fd);
+
+	if (!connect(route_fd, peer, peerlen) &&
+	    !getsockname(route_fd, (void *)&want, &wantlen))
+		ret = !same_addr(&cur, &want);
+
+	close(route_fd);
+	return ret;
+}
+
+int netmon_mainloop(struct openconnect_info *vpninfo, int readable)
+{
+	int work_done = 0;
+
+	if (vpninfo->netmon_fd < 0 || !readable || !netmon_read(vpninfo))
+		return 0;
+
+	/* ESP is connectionless, so this keeps the SAs and just sends probes
+	 * from a new socket. DTLS has to handshake again. Either way it's the
+	 * same as coming back from SLEEPING, only without waiting for it. */
+	if (vpninfo->dtls_state >= DTLS_CONNECTING &&
+	    src_addr_changed(vpninfo, vpninfo->dtls_fd, vpninfo->dtls_addr,
+			     vpninfo->dtls_addrlen)) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Local address changed; reconnecting UDP\n"));
+		vpninfo->proto->udp_close(vpninfo);
+		vpninfo->new_dtls_started = 0;
+		work_done = 1;
+	}
+
+	/* The TCP mainloop will reconnect when it next checks keepalives */
+	if (src_addr_changed(vpninfo, vpninfo->ssl_fd, vpninfo->peer_addr,
+			     vpninfo->peer_addrlen)) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Local address changed; reconnecting TLS\n"));
+		vpninfo->ssl_times.dead = 1;
+		work_done = 1;
+	}
+
+	return work_done;
+}
+
+#else /* !__linux__ */
+
+void netmon_open(struct openconnect_info *vpninfo)
+{
+}
+
+void netmon_close(struct openconnect_info *vpninfo)
+{
+}
+
+int netmon_mainloop(struct openconnect_info *vpninfo, int readable)
+{
+	return 0;
+}
+
+#endif
@@ -273,6 +273,26 @@ struct pkt {
 
 #define DTLS_APP_ID_EXT 48018
 
+/* A DTLS session other than the one in use, which dtls_slot_swap()
+ * can exchange with it. Used to handshake a new session while the old
+ * one carries on, when rekeying, and for the attempt over the other
+ * address family while connecting DTLS or ESP. */
+struct dtls_slot {
+	int fd;
+#if defined(OPENCONNECT_OPENSSL)
+	SSL *ssl;
+#elif defined(OPENCONNECT_GNUTLS)
+	gnutls_session_t ssl;
+	gnutls_psk_client_credentials_t psk_cred;
+#endif
+#ifdef _WIN32
+	long monitored;
+	HANDLE event;
+#elif defined(HAVE_EPOLL)
+	uint32_t epoll;
+#endif
+};
+
 struct keepalive_info {
 	int dpd;
 	int keepalive;
@@ -282,6 +302,52 @@ struct keepalive_info {
 	time_t last_tx;
 	time_t last_rx;
 	time_t last_dpd;
+	int probe;		/* Send DPD at least this often, to measure the path */
+	int dead;		/* Declared dead without waiting for DPD */
+
+	/* RTT (RFC6298) and loss, measured from DPD and other echoed probes.
+	 * Kept in fixed point so that the EWMAs don't stall short of the
+	 * true value through integer truncation. */
+	struct timeval probe_sent;
+	int srtt;		/* in ms, << KA_SRTT_SHIFT */
+	int rttvar;		/* in ms, << KA_RTTVAR_SHIFT */
+	int loss;		/* in units of 0.1%, << KA_LOSS_SHIFT */
+	int samples;
+};
+
+#define KA_SRTT_SHIFT	3	/* The EWMA gains, 1/8 and 1/4 */
+#define KA_RTTVAR_SHIFT	2
+#define KA_LOSS_SHIFT	3
+
+#define ka_srtt(ka)	((ka)->srtt >> KA_SRTT_SHIFT)
+#define ka_rttvar(ka)	((ka)->rttvar >> KA_RTTVAR_SHIFT)
+#define ka_loss(ka)	((ka)->loss >> KA_LOSS_SHIFT)
+
+/* Datagram PLPMTU discovery (RFC8899) for the UDP transports */
+#define PMTUD_DISABLED	0
+#define PMTUD_SEARCHING	1
+#define PMTUD_COMPLETE	2
+
+#define PMTUD_BURST	5	/* Probes sent at once when starting */
+
+struct pmtud_info {
+	int state;
+	int base;		/* BASE_PLPMTU: assumed always to work */
+	int max;		/* MAX_PLPMTU: the negotiated tunnel MTU */
+	int lo;			/* Largest size known to work */
+	int hi;			/* Largest size not known to fail */
+	int probe_size;		/* Size of the outstanding probe, if any */
+	int probe_count;	/* Number of times it has been sent */
+	int burst[PMTUD_BURST];	/* Outstanding sizes in the initial burst */
+	int nr_burst;
+	int acked;		/* Peer has answered a probe */
+	uint32_t probe_id;
+	time_t started;		/* Start of current search */
+	time_t first_probe;
+	time_t last_probe;
+	time_t confirm_due;	/* Next confirmation of the current PLPMTU */
+	time_t raise_due;	/* Next attempt to raise the PLPMTU */
+	time_t clamped;		/* Tun MTU made conservative, awaiting UDP */
 };
 
 struct pin_cache {
@@ -379,6 +445,17 @@ struct esp {
 struct oc_pcsc_ctx;
 struct oc_tpm1_ctx;
 struct oc_tpm2_ctx;
+struct netcfg_state;
+struct split_filter;
+struct socks_proxy;
+struct dns_proxy;
+struct oc_async;
+struct gw_probe;
+struct resolved;
+struct preconnect;
+struct tls_session;
+struct ustack;
+struct ustack_sock;
 
 struct openconnect_info;
 
@@ -401,6 +478,37 @@ struct pkt_q {
 	int count;
 };
 
+/* Free packets shared by all the sessions in a session manager */
+struct pkt_pool {
+	struct pkt_q q;
+	int max;
+};
+
+/* Which fds the last wait found readable, for the next mainloop_pass() */
+struct mainloop_rd {
+	int tun, udp, tcp, netmon, dns;
+#ifdef HAVE_VHOST
+	int vhost;
+#endif
+};
+
+#define MAINLOOP_IDLE	0	/* Nothing more to do until woken or timeout */
+#define MAINLOOP_BUSY	1	/* Work was done; go round again before sleeping */
+#define MAINLOOP_PAUSED	2
+#define MAINLOOP_QUIT	3
+
+/* Passes a busy session gets before others (or the caller) get a turn */
+#define MAINLOOP_BURST	16
+
+/* Most fds a coroutine in async.c can wait for at once */
+#define ASYNC_MAX_WAIT	8
+
+/* A server we might connect to, for openconnect_probe_gateways() */
+struct gw_candidate {
+	const char *url;
+	int tier;		/* Lower is preferred, whatever the latency */
+};
+
 struct vpn_proto;
 
 struct openconnect_info {
@@ -502,6 +610,12 @@ struct openconnect_info {
 	char *csd_wrapper;
 	int trojan_interval;
 	time_t last_trojan;
+	struct oc_text_buf *hip_report; /* From a periodic HIP script still running */
+	int hip_fd;
+#ifndef _WIN32
+	pid_t hip_pid;
+	time_t hip_started;
+#endif
 	int no_http_keepalive;
 	int dump_http_traffic;
 
@@ -603,6 +717,9 @@ struct openconnect_info {
 	struct pkt *dtls_pkt;
 	struct pkt *tun_pkt;
 	int pkt_trailer; /* How many bytes after payload for encryption (ESP HMAC) */
+	int tun_mtu; /* MTU the tun device was configured with */
+	time_t icmp_ratelimit_time; /* For limiting synthesised ICMP errors */
+	int icmp_ratelimit_count;
 
 	z_stream inflate_strm;
 	uint32_t inflate_adler32;
@@ -612,6 +729,27 @@ struct openconnect_info {
 	int disable_ipv6;
 	int reconnect_timeout;
 	int reconnect_interval;
+
+	/* For openconnect_process() */
+	int ext_running;
+	int ext_timeout;
+	struct mainloop_rd ext_rd;
+	struct oc_async *async;
+
+	int probe_gw;
+	struct gw_probe *gw_probes;
+	/* From the XML profile, to be probed when we connect */
+	struct gw_candidate *gw_candidates;
+	int nr_gw_candidates;
+
+	struct resolved *resolved;
+	struct preconnect *preconnect;
+
+	struct tls_session *tls_sessions;
+	char *tls_session_file;
+	int tls_sessions_loaded;
+	int tls_early_data;
+
 	int dtls_attempt_period;
 	time_t auth_expiration;
 	time_t new_dtls_started;
@@ -625,6 +763,7 @@ struct openconnect_info {
 	   have fewer ifdefs and accessor macros for it. */
 	gnutls_session_t dtls_ssl;
 #endif
+	struct dtls_slot new_dtls;
 	char *cstp_cipher; /* library-dependent description of TLS cipher */
 	char *dtls_cipher_desc; /* library-dependent description of DTLS cipher, cached for openconnect_get_dtls_cipher() */
 
@@ -635,6 +774,7 @@ struct openconnect_info {
 				  * over the TCP channel to switch to UDP. */
 
 	struct keepalive_info dtls_times;
+	struct pmtud_info pmtud;
 	unsigned char dtls_session_id[32];
 	unsigned char dtls_secret[TLS_MASTER_KEY_SIZE];
 	unsigned char dtls_app_id[32];
@@ -655,6 +795,17 @@ struct openconnect_info {
 			    * ("PSK-NEGOTIATE", or an OpenSSL cipher name). */
 
 	char *vpnc_script;
+	int builtin_netcfg; /* Use netcfg.c instead of vpnc_script */
+	struct netcfg_state *netcfg; /* As last applied */
+	char *netcfg_resolvconf;
+	unsigned char script_md5[MD5_SIZE]; /* Of the ip_info last given to the script */
+	int enforce_split; /* Drop tun packets outside the split includes */
+	struct split_filter *split_filter;
+	char *socks_listen; /* SOCKS proxy with ustack.c instead of a tun device */
+	struct socks_proxy *socks;
+	struct ustack *ustack;
+	char *dns_proxy_listen; /* Caching DNS proxy; "" for the tunnel's address */
+	struct dns_proxy *dns_proxy;
 #ifndef _WIN32
 	int uid_csd_given;
 	uid_t uid_csd;
@@ -685,7 +836,8 @@ struct openconnect_info {
 #ifdef HAVE_EPOLL
 	int epoll_fd;
 	int epoll_update;
-	uint32_t tun_epoll, ssl_epoll, dtls_epoll, cmd_epoll;
+	uint32_t tun_epoll, ssl_epoll, dtls_epoll, cmd_epoll, netmon_epoll, hip_epoll;
+	uint32_t dns_epoll, dns_up_epoll, resolve_epoll;
 #ifdef HAVE_VHOST
 	uint32_t vhost_call_epoll;
 #endif
@@ -713,8 +865,16 @@ struct openconnect_info {
 #else
 	int tun_fd;
 #endif
+	/* For openconnect_setup_packet_callback() instead of a tun device */
+	openconnect_rx_packets_vfn rx_packets;
+	struct pkt *volatile pkt_inject; /* Newest first */
+	struct pkt_q pkt_injected; /* Taken off pkt_inject, waiting for room */
+	int pkt_inject_count; /* In both of the above */
 	int ssl_fd;
 	int dtls_fd;
+	int netmon_fd;
+	int dns_fd, dns_up_fd;
+	int resolve_fd; /* A background lookup, for the mainloop to collect */
 
 	int dtls_tos_current;
 	int dtls_pass_tos;
@@ -733,6 +893,7 @@ struct openconnect_info {
 	char cancel_type;
 
 	struct pkt_q free_queue;
+	struct pkt_pool *pkt_pool;		/* Instead of free_queue, if shared */
 	struct pkt_q incoming_queue;
 	struct pkt_q outgoing_queue;
 	struct pkt_q tcp_control_queue;		/* Control packets to be sent via TCP */
@@ -742,9 +903,16 @@ struct openconnect_info {
 
 	socklen_t peer_addrlen;
 	struct sockaddr *peer_addr;
+	socklen_t peer_addr_altlen;
+	struct sockaddr *peer_addr_alt;		/* Of the other address family */
+	socklen_t dtls_addrlen;
 	struct sockaddr *dtls_addr;
+	socklen_t dtls_addr_altlen;
+	struct sockaddr *dtls_addr_alt;
 
 	int dtls_local_port;
+	int udp_max_loss; /* Percent; fall back to TLS above this */
+	int udp_max_rtt; /* Milliseconds; likewise */
 
 	int req_compr; /* What we requested */
 	int cstp_compr; /* Accepted for CSTP */
@@ -817,6 +985,11 @@ struct vpn_proto {
 
 	/* Catch probe packet confirming the (UDP) session */
 	int (*udp_catch_probe)(struct openconnect_info *vpninfo, struct pkt *p);
+
+	/* Send a padded probe of the given tunnel packet size for PMTU discovery.
+	 * Returns -EMSGSIZE if it's too large to send at all, or -EAGAIN if
+	 * it couldn't be sent just now. */
+	int (*udp_send_mtu_probe)(struct openconnect_info *vpninfo, int len);
 };
 
 static inline struct pkt *dequeue_packet(struct pkt_q *q)
@@ -855,11 +1028,11 @@ static inline void init_pkt_queue(struct pkt_q *q)
 
 static inline struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
 {
+	struct pkt_q *free_q = vpninfo->pkt_pool ? &vpninfo->pkt_pool->q : &vpninfo->free_queue;
 	int alloc_len = sizeof(struct pkt) + len;
 
-	if (vpninfo->free_queue.head &&
-	    vpninfo->free_queue.head->alloc_len >= alloc_len)
-		return dequeue_packet(&vpninfo->free_queue);
+	if (free_q->head && free_q->head->alloc_len >= alloc_len)
+		return dequeue_packet(free_q);
 
 	if (alloc_len < 2048)
 		alloc_len = 2048;
@@ -872,11 +1045,19 @@ static inline struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
 
 static inline void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
+	struct pkt_q *free_q = &vpninfo->free_queue;
+	int max = vpninfo->max_qlen * 2;
+
 	if (!pkt)
 		return;
 
-	if (vpninfo->free_queue.count < vpninfo->max_qlen * 2)
-		requeue_packet(&vpninfo->free_queue, pkt);
+	if (vpninfo->pkt_pool) {
+		free_q = &vpninfo->pkt_pool->q;
+		max = vpninfo->pkt_pool->max;
+	}
+
+	if (free_q->count < max)
+		requeue_packet(free_q, pkt);
 	else
 		free(pkt);
 }
@@ -1098,6 +1279,8 @@ static inline int set_fd_cloexec(int fd)
 }
 static inline int tun_is_up(struct openconnect_info *vpninfo)
 {
+	if (vpninfo->rx_packets || vpninfo->socks)
+		return 1;
 #ifdef _WIN32
 	return vpninfo->tun_fh != NULL;
 #else
@@ -1154,6 +1337,7 @@ char *openconnect_legacy_to_utf8(struct openconnect_info *vpninfo, const char *l
 unsigned char unhex(const char *data);
 int script_setenv(struct openconnect_info *vpninfo, const char *opt, const char *val, int trunc, int append);
 int script_setenv_int(struct openconnect_info *vpninfo, const char *opt, int value);
+const char *vpn_nameserver(struct openconnect_info *vpninfo, int i);
 void prepare_script_env(struct openconnect_info *vpninfo);
 int script_config_tun(struct openconnect_info *vpninfo, const char *reason);
 int apply_script_env(struct oc_vpn_option *envs);
@@ -1171,6 +1355,7 @@ void os_shutdown_tun(struct openconnect_info *vpninfo);
 int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 intptr_t os_setup_tun(struct openconnect_info *vpninfo);
+int os_set_tun_mtu(struct openconnect_info *vpninfo, int mtu);
 
 #ifdef _WIN32
 #define OPEN_TUN_SOFTFAIL 0
@@ -1203,12 +1388,111 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable);
 void dtls_close(struct openconnect_info *vpninfo);
 void dtls_shutdown(struct openconnect_info *vpninfo);
 void gather_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *buf, struct oc_text_buf *buf12);
-void dtls_detect_mtu(struct openconnect_info *vpninfo);
+int dtls_send_mtu_probe(struct openconnect_info *vpninfo, int len);
 int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms);
 int openconnect_dtls_write(struct openconnect_info *vpninfo, void *buf, size_t len);
 char *openconnect_bin2hex(const char *prefix, const uint8_t *data, unsigned len);
 char *openconnect_bin2base64(const char *prefix, const uint8_t *data, unsigned len);
 
+/* pmtud.c */
+void pmtud_start(struct openconnect_info *vpninfo);
+void pmtud_tun_setup(struct openconnect_info *vpninfo);
+void pmtud_udp_fallback(struct openconnect_info *vpninfo, int *timeout);
+int pmtud_mainloop(struct openconnect_info *vpninfo, int *timeout);
+int pmtud_probe_acked(struct openconnect_info *vpninfo, int len);
+
+/* netcfg.c */
+int netcfg_config_tun(struct openconnect_info *vpninfo, const char *reason);
+int netcfg_routes_outside(struct openconnect_info *vpninfo, const struct sockaddr *sa);
+void netcfg_free(struct openconnect_info *vpninfo);
+
+/* split.c */
+int split_filter_build(struct openconnect_info *vpninfo);
+int split_filter_drop(struct openconnect_info *vpninfo, struct pkt *pkt);
+void split_filter_free(struct openconnect_info *vpninfo);
+int split_routes_addr(struct openconnect_info *vpninfo, const struct sockaddr *sa);
+
+/* ustack.c */
+int ustack_init(struct openconnect_info *vpninfo);
+void ustack_free(struct openconnect_info *vpninfo);
+void ustack_input(struct openconnect_info *vpninfo, struct pkt *pkt);
+int ustack_mainloop(struct openconnect_info *vpninfo, int *timeout);
+int ustack_tcp_connect(struct openconnect_info *vpninfo, int family,
+		       const void *addr, int port, struct ustack_sock **ret);
+int ustack_udp_open(struct openconnect_info *vpninfo, int family,
+		    const void *addr, int port, struct ustack_sock **ret);
+int ustack_connected(struct ustack_sock *s);
+int ustack_sndspace(struct ustack_sock *s);
+int ustack_send(struct openconnect_info *vpninfo, struct ustack_sock *s,
+		const void *buf, int len);
+int ustack_recv(struct openconnect_info *vpninfo, struct ustack_sock *s,
+		void *buf, int len);
+void ustack_shutdown(struct ustack_sock *s);
+void ustack_close(struct openconnect_info *vpninfo, struct ustack_sock *s);
+void ustack_abort(struct openconnect_info *vpninfo, struct ustack_sock *s);
+
+/* socks.c */
+int socks_parse_listen(const char *str, char **host, char **port);
+int socks_setup(struct openconnect_info *vpninfo);
+int socks_mainloop(struct openconnect_info *vpninfo, int *timeout);
+void socks_update_epoll(struct openconnect_info *vpninfo);
+void socks_free(struct openconnect_info *vpninfo);
+
+/* dnsproxy.c */
+int dns_skip_name(const unsigned char *p, int len, int off);
+const char *dnsproxy_addr(struct openconnect_info *vpninfo);
+int dnsproxy_setup(struct openconnect_info *vpninfo);
+int dnsproxy_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable);
+void dnsproxy_free(struct openconnect_info *vpninfo);
+
+/* async.c */
+int async_start(struct openconnect_info *vpninfo,
+		int (*fn)(struct openconnect_info *));
+int async_running(struct openconnect_info *vpninfo);
+int async_select(struct openconnect_info *vpninfo, int nfds, fd_set *rd_set,
+		 fd_set *wr_set, fd_set *ex_set, struct timeval *tv);
+int async_get_fds(struct openconnect_info *vpninfo, struct oc_pollfd *fds, int nr);
+int async_get_timeout(struct openconnect_info *vpninfo);
+int async_process(struct openconnect_info *vpninfo,
+		  const int *readable, int nr_readable,
+		  const int *writable, int nr_writable);
+void async_free(struct openconnect_info *vpninfo);
+
+/* probe.c */
+int openconnect_probe_gateways(struct openconnect_info *vpninfo,
+			       const struct gw_candidate *gws, int nr);
+void free_gw_probes(struct openconnect_info *vpninfo);
+void probe_gw_candidates(struct openconnect_info *vpninfo);
+void free_gw_candidates(struct openconnect_info *vpninfo);
+
+/* resolve.c */
+int resolve_host(struct openconnect_info *vpninfo, const char *host,
+		 const char *port, const struct addrinfo *hints,
+		 struct addrinfo **res);
+void resolve_free(struct addrinfo *res);
+void resolve_forget(struct openconnect_info *vpninfo, const char *host,
+		    const char *port);
+void resolve_mainloop(struct openconnect_info *vpninfo, int *timeout);
+void resolve_adopt(struct openconnect_info *vpninfo, struct openconnect_info *from);
+void free_resolved(struct openconnect_info *vpninfo);
+
+/* preconnect.c */
+void preconnect_start(struct openconnect_info *vpninfo);
+int preconnect_take(struct openconnect_info *vpninfo);
+void preconnect_free(struct openconnect_info *vpninfo);
+
+/* tlscache.c */
+const unsigned char *tls_session_find(struct openconnect_info *vpninfo, int *len,
+				      int *checked);
+void tls_session_save(struct openconnect_info *vpninfo, const void *data, int len);
+void tls_session_forget(struct openconnect_info *vpninfo);
+void free_tls_sessions(struct openconnect_info *vpninfo);
+
+/* netmon.c */
+void netmon_open(struct openconnect_info *vpninfo);
+void netmon_close(struct openconnect_info *vpninfo);
+int netmon_mainloop(struct openconnect_info *vpninfo, int readable);
+
 /* mtucalc.c */
 
 int calculate_mtu(struct openconnect_info *vpninfo, int is_udp, int unpadded_overhead, int padded_overhead, int block_size);
@@ -1310,6 +1594,7 @@ int gpst_setup(struct openconnect_info *vpninfo);
 int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable);
 int gpst_esp_send_probes(struct openconnect_info *vpninfo);
 int gpst_esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt);
+int gpst_esp_send_mtu_probe(struct openconnect_info *vpninfo, int len);
 
 /* lzs.c */
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
@@ -1318,6 +1603,8 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 /* ssl.c */
 unsigned string_is_hostname(const char* str);
 int connect_https_socket(struct openconnect_info *vpninfo);
+int openconnect_https_request(struct openconnect_info *vpninfo,
+			      struct oc_text_buf *req);
 int __attribute__ ((format(printf, 4, 5)))
     request_passphrase(struct openconnect_info *vpninfo, const char *label,
 		       char **response, const char *fmt, ...);
@@ -1332,6 +1619,8 @@ int openconnect_print_err_cb(const char *str, size_t len, void *ptr);
 const char *keystore_strerror(int err);
 int keystore_fetch(const char *key, unsigned char **result);
 #endif
+int vpn_select(struct openconnect_info *vpninfo, int nfds, fd_set *rd_set,
+	       fd_set *wr_set, fd_set *ex_set, struct timeval *tv);
 void cmd_fd_set(struct openconnect_info *vpninfo, fd_set *fds, int *maxfd);
 void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds);
 int is_cancel_pending(struct openconnect_info *vpninfo, fd_set *fds);
@@ -1344,6 +1633,9 @@ ssize_t openconnect_read_file(struct openconnect_info *vpninfo, const char *fnam
 			      char **ptr);
 int udp_sockaddr(struct openconnect_info *vpninfo, int port);
 int udp_connect(struct openconnect_info *vpninfo);
+void udp_swap_family(struct openconnect_info *vpninfo);
+void udp_check_families(struct openconnect_info *vpninfo);
+void dtls_slot_swap(struct openconnect_info *vpninfo, struct dtls_slot *slot);
 int ssl_reconnect(struct openconnect_info *vpninfo);
 void openconnect_clear_cookies(struct openconnect_info *vpninfo);
 int cancellable_gets(struct openconnect_info *vpninfo, int fd,
@@ -1383,6 +1675,8 @@ int can_enable_insecure_crypto(void);
 int ssl_nonblock_read(struct openconnect_info *vpninfo, int dtls, void *buf, int maxlen);
 int ssl_nonblock_write(struct openconnect_info *vpninfo, int dtls, void *buf, int buflen);
 int openconnect_open_https(struct openconnect_info *vpninfo);
+int openconnect_open_https_early(struct openconnect_info *vpninfo,
+				 const void *data, int len);
 void openconnect_close_https(struct openconnect_info *vpninfo, int final);
 int cstp_handshake(struct openconnect_info *vpninfo, unsigned init);
 int get_cert_md5_fingerprint(struct openconnect_info *vpninfo, void *cert,
@@ -1409,13 +1703,34 @@ int openconnect_install_ctx_verify(struct openconnect_info *vpninfo,
 				   SSL_CTX *ctx);
 #endif
 
+/* icmp.c */
+int icmp_pkt_too_big(struct openconnect_info *vpninfo, struct pkt *pkt, int mtu);
+void icmp_prohibited(struct openconnect_info *vpninfo, struct pkt *pkt);
+
 /* mainloop.c */
+void mainloop_start(struct openconnect_info *vpninfo,
+		    int reconnect_timeout, int reconnect_interval);
+int mainloop_pass(struct openconnect_info *vpninfo, struct mainloop_rd *rd,
+		  int *timeout, int *ret);
+void mainloop_pause(struct openconnect_info *vpninfo);
+int mainloop_wait(struct openconnect_info *vpninfo, struct mainloop_rd *rd,
+		  int timeout);
+int mainloop_finish(struct openconnect_info *vpninfo, int ret);
+#ifdef HAVE_EPOLL
+void mainloop_epoll_sync(struct openconnect_info *vpninfo);
+void mainloop_epoll_events(struct openconnect_info *vpninfo, struct mainloop_rd *rd,
+			   struct epoll_event *evs, int nfds);
+#endif
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable, int did_work);
+void free_injected_packets(struct openconnect_info *vpninfo);
 int queue_new_packet(struct openconnect_info *vpninfo,
 		     struct pkt_q *q, void *buf, int len);
 int keepalive_action(struct keepalive_info *ka, int *timeout);
 int ka_stalled_action(struct keepalive_info *ka, int *timeout);
 int ka_check_deadline(int *timeout, time_t now, time_t due);
+void ka_probe_sent(struct keepalive_info *ka);
+void ka_probe_rcvd(struct keepalive_info *ka);
+int udp_degraded(struct openconnect_info *vpninfo);
 int trojan_check_deadline(struct openconnect_info *vpninfo, int *timeout);
 
 /* xml.c */
@@ -1649,6 +1964,27 @@ static inline void store_be16(void *_p, uint16_t d)
 	p->d = htons(d);
 }
 
+/* Internet checksum (RFC1071) helpers */
+static inline uint32_t csum_partial(uint16_t *buf, int nwords)
+{
+	uint32_t sum = 0;
+	for(sum=0; nwords>0; nwords--)
+		sum += ntohs(*buf++);
+	return sum;
+}
+
+static inline uint16_t csum_finish(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum &0xffff);
+	sum += (sum >> 16);
+	return htons((uint16_t)(~sum));
+}
+
+static inline uint16_t csum(uint16_t *buf, int nwords)
+{
+	return csum_finish(csum_partial(buf, nwords));
+}
+
 /* It doesn't matter if we don't find one. It'll default to the
  * "not known to be little-endian" case, and do the bytewise
  * load/store. Modern compilers might even spot the pattern and
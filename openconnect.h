@@ -43,6 +43,23 @@ extern "C" {
  *  - Add openconnect_get_auth_expiration()
  *  - Add openconnect_disable_dtls()
  *  - Make openconnect_disable_ipv6() return int
+ *  - Add RTT, jitter and loss to struct oc_stats
+ *  - Add openconnect_set_udp_fallback()
+ *  - Add openconnect_set_builtin_netcfg()
+ *  - Add openconnect_set_enforce_split(), and filtered packets to struct oc_stats
+ *  - Add openconnect_setup_packet_callback(), openconnect_alloc_packet(),
+ *    openconnect_free_packet() and openconnect_send_packets()
+ *  - Add openconnect_set_socks_proxy()
+ *  - Add openconnect_set_dns_proxy()
+ *  - Add openconnect_session_mgr_new(), openconnect_session_mgr_add(),
+ *    openconnect_session_mgr_run() and openconnect_session_mgr_free()
+ *  - Add openconnect_mainloop_start(), openconnect_get_fds(),
+ *    openconnect_get_timeout() and openconnect_process()
+ *  - Add openconnect_obtain_cookie_start() and
+ *    openconnect_make_cstp_connection_start()
+ *  - Add openconnect_set_gateway_probe()
+ *  - Add openconnect_set_tls_session_cache()
+ *  - Add openconnect_set_tls_early_data() and OC_PROTO_EARLY_DATA
  *
  * API version 5.6 (v8.06; 2020-03-31):
  *  - Add openconnect_set_trojan_interval()
@@ -195,6 +212,7 @@ extern "C" {
 #define OC_PROTO_AUTH_STOKEN	(1<<4)
 #define OC_PROTO_PERIODIC_TROJAN	(1<<5)
 #define OC_PROTO_HIDDEN	(1<<6)
+#define OC_PROTO_EARLY_DATA	(1<<7)
 
 struct oc_vpn_proto {
 	const char *name;
@@ -317,6 +335,19 @@ struct oc_stats {
 	uint64_t tx_bytes;
 	uint64_t rx_pkts;
 	uint64_t rx_bytes;
+	/* Since API 5.7: smoothed round trip time and its variation (jitter)
+	   in milliseconds, and loss in tenths of a percent, measured by DPD
+	   on the TLS and UDP (DTLS/ESP) transports. Zero if not measured. */
+	uint32_t tls_rtt;
+	uint32_t tls_rttvar;
+	uint32_t tls_loss;
+	uint32_t udp_rtt;
+	uint32_t udp_rttvar;
+	uint32_t udp_loss;
+	/* Since API 5.7: packets from the tun device which were dropped
+	   because they were outside the split includes. */
+	uint64_t tx_filtered_pkts;
+	uint64_t tx_filtered_bytes;
 };
 
 struct oc_cert {
@@ -353,6 +384,7 @@ struct oc_cert {
 #define RECONNECT_INTERVAL_MAX	100
 
 struct openconnect_info;
+struct openconnect_session_mgr;
 
 typedef enum {
 	OC_TOKEN_MODE_NONE,
@@ -612,6 +644,11 @@ const char *openconnect_get_ifname(struct openconnect_info *);
 void openconnect_set_reqmtu(struct openconnect_info *, int reqmtu);
 void openconnect_set_dpd(struct openconnect_info *, int min_seconds);
 void openconnect_set_trojan_interval(struct openconnect_info *, int seconds);
+/* Fall back from DTLS/ESP to TLS (until the next attempt to reconnect it)
+   when the measured loss exceeds max_loss percent, or the round trip time
+   exceeds max_rtt milliseconds. Zero disables each check. Enabling either
+   causes the UDP transport to be probed every couple of seconds. */
+void openconnect_set_udp_fallback(struct openconnect_info *, int max_loss, int max_rtt);
 int openconnect_get_idle_timeout(struct openconnect_info *);
 time_t openconnect_get_auth_expiration(struct openconnect_info *);
 
@@ -670,6 +707,17 @@ int openconnect_make_cstp_connection(struct openconnect_info *vpninfo);
 int openconnect_setup_tun_device(struct openconnect_info *vpninfo,
 				 const char *vpnc_script, const char *ifname);
 
+/* Configure the tun device created by openconnect_setup_tun_device()
+   directly, instead of invoking vpnc_script. Linux only; elsewhere,
+   enabling it returns -EOPNOTSUPP. */
+int openconnect_set_builtin_netcfg(struct openconnect_info *vpninfo, int enable);
+
+/* Drop packets from the tun device for destinations outside the split
+   includes (or inside the split excludes) that the server gave us, and
+   answer them with ICMP "administratively prohibited". Address families
+   without split includes are not filtered. */
+void openconnect_set_enforce_split(struct openconnect_info *vpninfo, int enable);
+
 /* Pass traffic to a script program (no tun device). */
 int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
 				 const char *tun_script);
@@ -681,6 +729,77 @@ int openconnect_setup_tun_fd(struct openconnect_info *vpninfo, intptr_t tun_fd);
 /* Caller will provide a file descriptor for the tunnel traffic. */
 int openconnect_setup_tun_fd(struct openconnect_info *vpninfo, int tun_fd);
 #endif
+
+/* Instead of a tun device, exchange packets with the application directly.
+   Call this from the setup_tun callback, in place of openconnect_setup_tun_fd().
+
+   Packets received from the VPN are passed to @rx in batches of up to 32,
+   from the thread running openconnect_mainloop(). They point into our own
+   buffers and are only valid until the callback returns.
+
+   Outgoing packets are passed to openconnect_send_packets(), which may be
+   called from any thread. From threads other than the one running the
+   main loop, openconnect_setup_cmd_pipe() must have been used so that the
+   main loop can be woken. Packets in buffers from openconnect_alloc_packet()
+   are sent without being copied, and are freed afterwards; any others are
+   copied. Returns the number of packets accepted. If too many packets are
+   already waiting to be sent the rest are dropped, as a network interface
+   would, and any which came from openconnect_alloc_packet() are freed. */
+struct oc_packet {
+	void *data;
+	int len;
+	void *priv; /* Set by openconnect_alloc_packet(); otherwise NULL */
+};
+
+typedef void (*openconnect_rx_packets_vfn) (void *privdata, const struct oc_packet *pkts, int nr);
+int openconnect_setup_packet_callback(struct openconnect_info *vpninfo,
+				      openconnect_rx_packets_vfn rx);
+int openconnect_alloc_packet(struct openconnect_info *vpninfo,
+			     struct oc_packet *pkt, int len);
+void openconnect_free_packet(struct openconnect_info *vpninfo,
+			     struct oc_packet *pkt);
+int openconnect_send_packets(struct openconnect_info *vpninfo,
+			     struct oc_packet *pkts, int nr);
+
+/* Instead of a tun device, terminate the tunnel's traffic in a userspace
+   TCP/IP stack and run a SOCKS5 and HTTP CONNECT proxy on @listen, which
+   is "[ADDR:]PORT" (ADDR defaults to 127.0.0.1). Connections are made from
+   the address the VPN gave us, and names are looked up with its DNS
+   servers. No script is run. Not supported on Windows. */
+int openconnect_set_socks_proxy(struct openconnect_info *vpninfo, const char *listen);
+
+/* Run a caching DNS proxy on port 53 of @addr, which is an IP address or
+   "" for our own address on the tunnel, and have the system resolver use
+   it in place of the VPN's DNS servers. Misses are forwarded to those.
+   NULL disables it. Not supported on Windows. */
+int openconnect_set_dns_proxy(struct openconnect_info *vpninfo, const char *addr);
+
+/* Where the GlobalProtect portal lists several gateways, or the XML
+   config gives backup servers for a host, connect to all of them at once
+   during authentication and choose the one which completes a TLS
+   handshake fastest, from the best priority tier that answers at all.
+   This only happens when no gateway has been chosen with
+   openconnect_set_authgroup(), and not through a proxy. It can take a
+   few seconds; results are remembered for five minutes, for when we
+   have to authenticate again. Not supported on Windows. */
+int openconnect_set_gateway_probe(struct openconnect_info *vpninfo, int enable);
+
+/* TLS sessions are always kept in memory, so that reconnecting can
+   resume them instead of making a full handshake. With a filename, they
+   are also kept in that file for the next vpninfo or process to use. It
+   is created readable only by its owner; anyone who can read it can
+   resume the sessions in it. NULL keeps them in memory only. */
+int openconnect_set_tls_session_cache(struct openconnect_info *vpninfo,
+				      const char *fname);
+
+/* When reconnecting with a resumed TLSv1.3 session, send the request
+   which starts the tunnel as early data (0-RTT) in the first flight,
+   saving a round trip. Only for protocols with OC_PROTO_EARLY_DATA,
+   whose tunnel request does no harm if an attacker replays it. Early
+   data isn't forward secret, and the request carries the session
+   cookie, so this is off by default. */
+void openconnect_set_tls_early_data(struct openconnect_info *vpninfo, int enable);
+
 /* Optional call to enable DTLS on the connection. */
 int openconnect_setup_dtls(struct openconnect_info *vpninfo, int dtls_attempt_period);
 
@@ -690,6 +809,76 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			 int reconnect_timeout,
 			 int reconnect_interval);
 
+/* Instead of openconnect_mainloop(), for running the session from the
+   caller's own event loop. After openconnect_mainloop_start(), call
+   openconnect_get_fds() to find the fds to watch, and the events
+   (OC_FD_READ and/or OC_FD_WRITE) wanted on each, and wait on them for
+   up to openconnect_get_timeout() ms (-1 for no timeout). Then pass those
+   which were ready to openconnect_process(), which does a bounded amount
+   of work, and ask again; both the fds and the timeout may have changed.
+   openconnect_get_fds() returns the number of fds wanted, which may be
+   more than @nr. openconnect_process() returns -EINPROGRESS while the
+   session is still running, and otherwise what openconnect_mainloop()
+   would have returned. Not supported on Windows. */
+#define OC_FD_READ	1
+#define OC_FD_WRITE	2
+
+struct oc_pollfd {
+	int fd;
+	int events;
+};
+
+int openconnect_mainloop_start(struct openconnect_info *vpninfo,
+			       int reconnect_timeout,
+			       int reconnect_interval);
+int openconnect_get_fds(struct openconnect_info *vpninfo,
+			struct oc_pollfd *fds, int nr);
+int openconnect_get_timeout(struct openconnect_info *vpninfo);
+int openconnect_process(struct openconnect_info *vpninfo,
+			const int *readable, int nr_readable,
+			const int *writable, int nr_writable);
+
+/* Likewise for openconnect_obtain_cookie() and
+   openconnect_make_cstp_connection(), which otherwise block until they
+   are done. Each returns -EINPROGRESS if it is waiting for the network,
+   and is then driven with openconnect_get_fds() and openconnect_process()
+   as above until that returns something else: the result of the function.
+   The callbacks, such as for auth forms and certificate validation, are
+   still called from openconnect_process() and must answer straight
+   away. Host names are still resolved in the blocking way. To abandon
+   one, send OC_CMD_CANCEL on the cmd_fd and keep going until it returns.
+   Not supported on Windows. */
+int openconnect_obtain_cookie_start(struct openconnect_info *vpninfo);
+int openconnect_make_cstp_connection_start(struct openconnect_info *vpninfo);
+
+/* Run many sessions from one thread, instead of a thread in
+   openconnect_mainloop() for each. Add each one when it would otherwise
+   have been passed to openconnect_mainloop(); its tun device, or packet
+   callback, is set up in the same way. When a session is cancelled,
+   paused or fails, it is dropped and @done is called with what
+   openconnect_mainloop() would have returned; the vpninfo may be freed
+   from there. The sessions share a pool of packet buffers and a single
+   set of timers, and cost nothing while idle. For more than one core,
+   run a manager in each of several threads.
+
+   openconnect_session_mgr_run() waits up to @timeout ms (-1 for ever) for
+   any session to have work to do, does it, and returns the number of
+   sessions left. Reconnecting and running the vpnc-script still block
+   the thread, as they do in openconnect_mainloop(). The library still
+   uses select() in places, so every session's fds must be below
+   FD_SETSIZE; that allows for a couple of hundred sessions per process.
+   Freeing the manager pauses any sessions still in it. Linux only. */
+typedef void (*openconnect_session_done_vfn) (void *privdata,
+					      struct openconnect_info *vpninfo,
+					      int ret);
+struct openconnect_session_mgr *openconnect_session_mgr_new(openconnect_session_done_vfn done,
+							    void *privdata);
+int openconnect_session_mgr_add(struct openconnect_session_mgr *mgr,
+				struct openconnect_info *vpninfo,
+				int reconnect_timeout, int reconnect_interval);
+int openconnect_session_mgr_run(struct openconnect_session_mgr *mgr, int timeout);
+void openconnect_session_mgr_free(struct openconnect_session_mgr *mgr);
+
 /* The first (privdata) argument to each of these functions is either
    the privdata argument provided to openconnect_vpninfo_new_with_cbdata(),
    or if that argument was NULL then it'll be the vpninfo itself. */
@@ -625,7 +625,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo, int *timeout)
 			 * reasonable MRU values during PPP negotiation.
 			 */
 			int data_mtu = vpninfo->cstp_basemtu = 1500;
-			if (vpninfo->peer_addr->sa_family == IPPROTO_IPV6)
+			if (vpninfo->dtls_addr->sa_family == AF_INET6)
 				data_mtu -= 40; /* IPv6 header */
 			else
 				data_mtu -= 20; /* Legacy IP header */
@@ -635,7 +635,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo, int *timeout)
 			/* For PSK-NEGOTIATE, we have to determine the tunnel MTU
 			 * for ourselves based on the base MTU */
 			int data_mtu = vpninfo->cstp_basemtu;
-			if (vpninfo->peer_addr->sa_family == AF_INET6)
+			if (vpninfo->dtls_addr->sa_family == AF_INET6)
 				data_mtu -= 40; /* IPv6 header */
 			else
 				data_mtu -= 20; /* Legacy IP header */
@@ -748,7 +748,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo, int *timeout)
 		 * trying to disable. So do nothing...
 		 */
 #endif
-		dtls_detect_mtu(vpninfo);
+		pmtud_start(vpninfo);
 		return 0;
 	}
 
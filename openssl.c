@@ -170,7 +170,7 @@ static int _openconnect_openssl_write(SSL *ssl, int fd, struct openconnect_info
 				return -EIO;
 			}
 			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
+			vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, NULL);
 			if (is_cancel_pending(vpninfo, &rd_set)) {
 				vpn_progress(vpninfo, PRG_ERR, _("TLS/DTLS write cancelled\n"));
 				return -EINTR;
@@ -220,7 +220,7 @@ static int _openconnect_openssl_read(SSL *ssl, int fd, struct openconnect_info *
 			return -EIO;
 		}
 		cmd_fd_set(vpninfo, &rd_set, &maxfd);
-		ret = select(maxfd + 1, &rd_set, &wr_set, NULL, tv);
+		ret = vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, tv);
 		if (is_cancel_pending(vpninfo, &rd_set)) {
 			vpn_progress(vpninfo, PRG_ERR, _("TLS/DTLS read cancelled\n"));
 			return -EINTR;
@@ -287,7 +287,7 @@ static int openconnect_openssl_gets(struct openconnect_info *vpninfo, char *buf,
 				break;
 			}
 			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
+			vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, NULL);
 			if (is_cancel_pending(vpninfo, &rd_set)) {
 				vpn_progress(vpninfo, PRG_ERR, _("TLS/DTLS read cancelled\n"));
 				ret = -EINTR;
@@ -1782,11 +1782,90 @@ int openconnect_install_ctx_verify(struct openconnect_info *vpninfo, SSL_CTX *ct
 	return 0;
 }
 
-int openconnect_open_https(struct openconnect_info *vpninfo)
+/* Called at the end of the handshake with TLSv1.2, or whenever the
+ * server sends a ticket with TLSv1.3. */
+static int new_https_session(SSL *ssl, SSL_SESSION *sess)
+{
+	struct openconnect_info *vpninfo = SSL_get_app_data(ssl);
+	unsigned char *data, *p;
+	int len;
+
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (len <= 0)
+		return 0;
+
+	data = p = malloc(len);
+	if (!data)
+		return 0;
+
+	if (i2d_SSL_SESSION(sess, &p) == len)
+		tls_session_save(vpninfo, data, len);
+	free(data);
+
+	/* We didn't keep a reference to it */
+	return 0;
+}
+
+/* Returns 1 if we may send @early_len bytes of early data with it */
+static int resume_https_session(struct openconnect_info *vpninfo, SSL *https_ssl,
+				int early_len)
+{
+	const unsigned char *data;
+	SSL_SESSION *sess;
+	int len, checked = 0;
+	int early = 0;
+
+	data = tls_session_find(vpninfo, &len, &checked);
+	if (!data)
+		return 0;
+
+	sess = d2i_SSL_SESSION(NULL, &data, len);
+	if (!sess)
+		return 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (checked && early_len &&
+	    SSL_SESSION_get_max_early_data(sess) >= (uint32_t)early_len)
+		early = 1;
+#endif
+	SSL_set_session(https_ssl, sess);
+	SSL_SESSION_free(sess);
+	return early;
+}
+
+/* The server didn't send its certificate, so ssl_app_verify_callback()
+ * wasn't called. Check the one from the session we resumed instead, as
+ * it may not have been this instance which accepted it. */
+static int verify_resumed_session(struct openconnect_info *vpninfo, SSL *https_ssl)
+{
+	X509_STORE_CTX *ctx;
+	X509 *cert;
+	int ret = 0;
+
+	cert = SSL_get_peer_certificate(https_ssl);
+	if (!cert)
+		return 0;
+
+	ctx = X509_STORE_CTX_new();
+	if (ctx && X509_STORE_CTX_init(ctx, SSL_CTX_get_cert_store(vpninfo->https_ctx),
+				       cert, SSL_get_peer_cert_chain(https_ssl))) {
+		X509_STORE_CTX_set_purpose(ctx, X509_PURPOSE_ANY);
+		ret = ssl_app_verify_callback(ctx, vpninfo);
+	}
+	X509_STORE_CTX_free(ctx);
+	X509_free(cert);
+	return ret;
+}
+
+/* Returns 1 if @data went in early data and the server accepted it,
+ * 0 if it still needs to be sent. */
+int openconnect_open_https_early(struct openconnect_info *vpninfo,
+				 const void *data, int len)
 {
 	SSL *https_ssl;
 	BIO *https_bio;
 	int ssl_sock;
+	int early = 0;
 	int err;
 
 	if (vpninfo->https_ssl)
@@ -1905,8 +1984,14 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 			closesocket(ssl_sock);
 			return err;
 		}
+
+		/* We keep the sessions ourselves. See tlscache.c */
+		SSL_CTX_set_session_cache_mode(vpninfo->https_ctx, SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(vpninfo->https_ctx, new_https_session);
 	}
 	https_ssl = SSL_new(vpninfo->https_ctx);
+	SSL_set_app_data(https_ssl, vpninfo);
 	workaround_openssl_certchain_bug(vpninfo, https_ssl);
 
 	https_bio = BIO_new_socket(ssl_sock, BIO_NOCLOSE);
@@ -1938,14 +2023,33 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		SSL_set_tlsext_host_name(https_ssl, vpninfo->hostname);
 #endif
 	SSL_set_verify(https_ssl, SSL_VERIFY_PEER, NULL);
+	early = resume_https_session(vpninfo, https_ssl, data ? len : 0);
 
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
-	while ((err = SSL_connect(https_ssl)) <= 0) {
+	while (1) {
 		fd_set wr_set, rd_set;
 		int maxfd = ssl_sock;
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+		/* This sends the ClientHello, then the data after it */
+		if (early == 1) {
+			size_t written;
+
+			err = SSL_write_early_data(https_ssl, data, len, &written);
+			if (err > 0) {
+				early = 2;
+				continue;
+			}
+		} else
+#endif
+		{
+			err = SSL_connect(https_ssl);
+			if (err > 0)
+				break;
+		}
+
 		FD_ZERO(&wr_set);
 		FD_ZERO(&rd_set);
 
@@ -1963,7 +2067,7 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 
 		cmd_fd_set(vpninfo, &rd_set, &maxfd);
-		select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
+		vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, NULL);
 		if (is_cancel_pending(vpninfo, &rd_set)) {
 			vpn_progress(vpninfo, PRG_ERR, _("SSL connection cancelled\n"));
 			SSL_free(https_ssl);
@@ -1972,6 +2076,18 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 	}
 
+	if (SSL_session_reused(https_ssl)) {
+		vpn_progress(vpninfo, PRG_DEBUG, _("Resumed previous TLS session\n"));
+		if (!verify_resumed_session(vpninfo, https_ssl)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Server certificate from resumed session not accepted\n"));
+			tls_session_forget(vpninfo);
+			SSL_free(https_ssl);
+			closesocket(ssl_sock);
+			return -EINVAL;
+		}
+	}
+
 	if (asprintf(&vpninfo->cstp_cipher, "%s-%s",
 		     SSL_get_version(https_ssl), SSL_get_cipher_name(https_ssl)) < 0) {
 		SSL_free(https_ssl);
@@ -1990,9 +2106,22 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	vpn_progress(vpninfo, PRG_INFO, _("Connected to HTTPS on %s with ciphersuite %s\n"),
 		     vpninfo->hostname, vpninfo->cstp_cipher);
 
+	if (early) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+		if (SSL_get_early_data_status(https_ssl) == SSL_EARLY_DATA_ACCEPTED)
+			return 1;
+#endif
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Server rejected TLS early data\n"));
+	}
 	return 0;
 }
 
+int openconnect_open_https(struct openconnect_info *vpninfo)
+{
+	return openconnect_open_https_early(vpninfo, NULL, 0);
+}
+
 int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 {
 	return -EOPNOTSUPP;
@@ -0,0 +1,496 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Datagram Packetization Layer PMTU Discovery (RFC8899) for the UDP
+ * transports. Instead of relying on ICMP, which is frequently filtered,
+ * we send padded probes of a given size over the tunnel to the server,
+ * and a reply tells us that a tunnel packet of that size gets through.
+ *
+ * When the transport comes up, a burst of probes of several sizes is
+ * sent at once and the largest one to get through is used immediately.
+ * A bisection between that and the smallest one which didn't then
+ * refines it in the background. The tunnel doesn't wait for any of
+ * this; it starts with a conservative MTU and is raised to match.
+ *
+ * The search is repeated occasionally in case the path MTU has gone up
+ * (e.g. after roaming from LTE to a wired network). In between, the
+ * current MTU is periodically confirmed so that we notice if it has
+ * shrunk, instead of black-holing all full-sized packets until DPD
+ * gives up.
+ *
+ * Probes are only sent while the UDP transport is connected, from its
+ * mainloop, and never block it.
+ */
+
+#define PMTUD_MAX_PROBES	3	/* MAX_PROBES */
+#define PMTUD_PROBE_TIMER	2	/* PROBE_TIMER, in seconds */
+#define PMTUD_CONFIRM_TIMER	30	/* Confirm current PLPMTU this often */
+#define PMTUD_RAISE_TIMER	600	/* PMTU_RAISE_TIMER */
+#define PMTUD_GRANULARITY	8	/* Stop searching when this close */
+#define PMTUD_CONSERVATIVE	1280	/* Tun MTU until we know better */
+#define PMTUD_UDP_TIMEOUT	10	/* ... as long as UDP comes up by then */
+
+/* Set DF on the UDP socket, and don't let the kernel fragment it for us;
+ * otherwise oversized probes would make it through in fragments. */
+static void udp_set_dontfrag(struct openconnect_info *vpninfo)
+{
+	int ret = 0, on = 1;
+
+	(void)on;
+	if (vpninfo->dtls_addr->sa_family == AF_INET6) {
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+		int val = IPV6_PMTUDISC_PROBE;
+		ret = setsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER,
+				 (void *)&val, sizeof(val));
+#elif defined(IPV6_DONTFRAG)
+		ret = setsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_DONTFRAG,
+				 (void *)&on, sizeof(on));
+#endif
+	} else {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+		int val = IP_PMTUDISC_PROBE;
+		ret = setsockopt(vpninfo->dtls_fd, IPPROTO_IP, IP_MTU_DISCOVER,
+				 (void *)&val, sizeof(val));
+#elif defined(IP_DONTFRAG)
+		ret = setsockopt(vpninfo->dtls_fd, IPPROTO_IP, IP_DONTFRAG,
+				 (void *)&on, sizeof(on));
+#elif defined(IP_DONTFRAGMENT)
+		ret = setsockopt(vpninfo->dtls_fd, IPPROTO_IP, IP_DONTFRAGMENT,
+				 (void *)&on, sizeof(on));
+#endif
+	}
+	if (ret)
+		vpn_perror(vpninfo, _("Failed to set DF on UDP socket"));
+}
+
+static void pmtud_set_mtu(struct openconnect_info *vpninfo, int mtu)
+{
+	if (mtu == vpninfo->ip_info.mtu)
+		return;
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Detected MTU of %d bytes (was %d)\n"), mtu, vpninfo->ip_info.mtu);
+	vpninfo->ip_info.mtu = mtu;
+
+	/* Keep the tun device in step, so the local stack sizes its packets
+	 * correctly. If we can't (e.g. after dropping privileges), then
+	 * tun_mainloop() will still bounce oversized packets back to their
+	 * sender with ICMP errors carrying the new MTU. */
+	if (tun_is_up(vpninfo) && vpninfo->ifname && !vpninfo->script_tun &&
+	    !os_set_tun_mtu(vpninfo, mtu))
+		vpninfo->tun_mtu = mtu;
+}
+
+/* Can we change the MTU of the tun device after it's up? */
+static int tun_mtu_settable(struct openconnect_info *vpninfo)
+{
+#if defined(_WIN32) || defined(__sun__) || defined(__native_client__)
+	return 0;
+#else
+	/* Not if a script owns it, or once we've dropped privileges */
+	return !vpninfo->use_tun_script && vpninfo->uid == getuid();
+#endif
+}
+
+static void pmtud_no_response(struct openconnect_info *vpninfo)
+{
+	/* Hm, we never got *anything* back successfully? */
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("No response to MTU probes; assuming negotiated MTU.\n"));
+	pmtud_set_mtu(vpninfo, vpninfo->pmtud.max);
+	vpninfo->pmtud.state = PMTUD_DISABLED;
+}
+
+static void pmtud_next_probe(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	time_t now = time(NULL);
+
+	p->probe_count = 0;
+
+	if (p->hi - p->lo < PMTUD_GRANULARITY) {
+		p->probe_size = 0;
+		if (!p->acked) {
+			pmtud_no_response(vpninfo);
+			return;
+		}
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("MTU detection complete: %d bytes\n"), p->lo);
+		pmtud_set_mtu(vpninfo, p->lo);
+		p->state = PMTUD_COMPLETE;
+		p->confirm_due = now + PMTUD_CONFIRM_TIMER;
+		p->raise_due = now + PMTUD_RAISE_TIMER;
+		return;
+	}
+
+	p->probe_size = (p->lo + p->hi + 1) / 2;
+}
+
+static void pmtud_search(struct openconnect_info *vpninfo, int lo, int hi)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+
+	p->state = PMTUD_SEARCHING;
+	p->lo = lo;
+	p->hi = hi;
+	p->probe_size = 0;
+	time(&p->started);
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Initiating MTU detection (min=%d, max=%d)\n"), lo, hi);
+
+	/* Try the top of the range first; most of the time it'll work. */
+	p->probe_size = hi;
+	p->probe_count = 0;
+}
+
+/* Rather than waiting a round trip for each step of a bisection, start
+ * with probes of several sizes at once, spread between base and max. */
+static void pmtud_burst(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int i;
+
+	p->state = PMTUD_SEARCHING;
+	p->lo = p->base;
+	p->hi = p->max;
+	p->probe_size = 0;
+	p->probe_count = 0;
+	time(&p->started);
+
+	/* Largest first, which is the order pmtud_burst_lost() expects.
+	 * The smallest is base itself, so that if none of them get through
+	 * we know the peer isn't answering at all. */
+	for (i = 0; i < PMTUD_BURST; i++)
+		p->burst[i] = p->max - i * (p->max - p->base) / (PMTUD_BURST - 1);
+	p->nr_burst = PMTUD_BURST;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Initiating MTU detection (min=%d, max=%d)\n"), p->base, p->max);
+}
+
+static int pmtud_burst_acked(struct openconnect_info *vpninfo, int len)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int i, n = 0, found = 0;
+
+	/* Once one size gets through, we don't care about smaller ones */
+	for (i = 0; i < p->nr_burst; i++) {
+		if (p->burst[i] > len)
+			p->burst[n++] = p->burst[i];
+		else if (p->burst[i] == len)
+			found = 1;
+	}
+	if (!found)
+		return 0;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Received MTU DPD probe (%u bytes)\n"), len);
+
+	p->nr_burst = n;
+	p->acked = 1;
+	p->lo = len;
+	if (len > vpninfo->ip_info.mtu)
+		pmtud_set_mtu(vpninfo, len);
+
+	/* If the largest got through, there's nothing more to do. */
+	if (!n)
+		pmtud_next_probe(vpninfo);
+	return 1;
+}
+
+static void pmtud_burst_lost(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+
+	p->hi = p->burst[p->nr_burst - 1] - 1;
+	p->nr_burst = 0;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("No response to size %u after %d tries\n"),
+		     p->hi + 1, p->probe_count);
+
+	/* Even the smallest didn't make it. The peer probably isn't
+	 * answering at all; bisecting down to base would take ages. */
+	if (!p->acked) {
+		pmtud_no_response(vpninfo);
+		return;
+	}
+
+	if (vpninfo->ip_info.mtu > p->hi)
+		pmtud_set_mtu(vpninfo, p->lo);
+	pmtud_next_probe(vpninfo);
+}
+
+static int pmtud_send_burst(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	time_t now = time(NULL);
+	int i;
+
+	if (!p->probe_count++)
+		p->first_probe = now;
+	p->last_probe = now;
+
+	/* If one is too large to send at all, it will just time out
+	 * with the rest. */
+	for (i = 0; i < p->nr_burst; i++) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Sending MTU DPD probe (%u bytes)\n"), p->burst[i]);
+		vpninfo->proto->udp_send_mtu_probe(vpninfo, p->burst[i]);
+	}
+
+	ka_check_deadline(timeout, now, now + PMTUD_PROBE_TIMER);
+	return 1;
+}
+
+void pmtud_start(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+
+	p->state = PMTUD_DISABLED;
+	p->probe_size = 0;
+	p->nr_burst = 0;
+
+	if (!vpninfo->proto->udp_send_mtu_probe || vpninfo->dtls_fd == -1)
+		return;
+
+	/* The negotiated MTU is as big as we go. Remember it, since we'll
+	 * be adjusting ip_info.mtu as we go along. */
+	if (!p->max)
+		p->max = vpninfo->ip_info.mtu;
+
+	/* We'll assume that it is at least functional, and permits the bare
+	 * minimum MTU for the protocol(s) it transports. All else is mad. */
+	p->base = vpninfo->ip_info.addr6 ? 1280 : 576;
+	if (p->max <= p->base)
+		return;
+
+	if (openconnect_random(&p->probe_id, sizeof(p->probe_id)))
+		return;
+
+	p->acked = 0;
+
+	udp_set_dontfrag(vpninfo);
+	pmtud_burst(vpninfo);
+}
+
+/* Called just before we create the tun device. Unless we already know
+ * better, start with a conservative MTU and raise it when probes succeed,
+ * rather than making the tunnel wait for MTU detection. Only do that if
+ * we'll be able to raise it afterwards. */
+void pmtud_tun_setup(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int mtu;
+
+	if (!vpninfo->proto->udp_send_mtu_probe || p->acked ||
+	    vpninfo->dtls_state <= DTLS_DISABLED || !tun_mtu_settable(vpninfo))
+		return;
+
+	if (!p->max)
+		p->max = vpninfo->ip_info.mtu;
+
+	mtu = MIN(p->max, PMTUD_CONSERVATIVE);
+	if (mtu < vpninfo->ip_info.mtu) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Using MTU of %d bytes until path MTU is detected\n"), mtu);
+		vpninfo->ip_info.mtu = mtu;
+		p->clamped = time(NULL);
+	}
+}
+
+/* Called from the mainloop. The conservative MTU set by pmtud_tun_setup()
+ * is only meant to last until the UDP transport comes up and probes for
+ * something better. If it is disabled, or doesn't come up in time (it's
+ * filtered, or we've fallen back to TLS), nothing else would raise it
+ * again; go back to the negotiated MTU instead. */
+void pmtud_udp_fallback(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+
+	if (!p->clamped)
+		return;
+
+	/* Detection has taken over, and will fall back itself if need be */
+	if (p->acked || p->state != PMTUD_DISABLED) {
+		p->clamped = 0;
+		return;
+	}
+
+	if (vpninfo->dtls_state > DTLS_DISABLED &&
+	    !ka_check_deadline(timeout, time(NULL), p->clamped + PMTUD_UDP_TIMEOUT))
+		return;
+
+	p->clamped = 0;
+	if (p->max > vpninfo->ip_info.mtu) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("No UDP transport for MTU detection; using MTU of %d bytes\n"),
+			     p->max);
+		pmtud_set_mtu(vpninfo, p->max);
+	}
+}
+
+/* Returns 1 if it was the answer to an MTU probe */
+int pmtud_probe_acked(struct openconnect_info *vpninfo, int len)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+
+	if (p->state == PMTUD_DISABLED)
+		return 0;
+
+	if (p->nr_burst)
+		return pmtud_burst_acked(vpninfo, len);
+
+	if (!p->probe_size || len != p->probe_size)
+		return 0;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Received MTU DPD probe (%u bytes)\n"), len);
+
+	if (p->state == PMTUD_COMPLETE) {
+		/* Confirmed current PLPMTU */
+		p->probe_size = 0;
+		p->confirm_due = time(NULL) + PMTUD_CONFIRM_TIMER;
+		return 1;
+	}
+
+	p->acked = 1;
+	p->lo = len;
+	/* If we're searching upwards from a working MTU, use the
+	 * larger size straight away. */
+	if (len > vpninfo->ip_info.mtu)
+		pmtud_set_mtu(vpninfo, len);
+	pmtud_next_probe(vpninfo);
+	return 1;
+}
+
+static void pmtud_probe_lost(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int len = p->probe_size;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("No response to size %u after %d tries\n"),
+		     len, p->probe_count);
+
+	if (p->state == PMTUD_COMPLETE) {
+		/* If *nothing* is getting through, it's not our problem;
+		 * leave it to DPD. But if smaller packets are, then the
+		 * path MTU has shrunk and we are black-holing full-sized
+		 * packets. Drop to the base MTU, and search from there. */
+		if (vpninfo->dtls_times.last_rx < p->first_probe) {
+			p->probe_size = 0;
+			p->confirm_due = time(NULL) + PMTUD_CONFIRM_TIMER;
+			return;
+		}
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Packets of %d bytes no longer get through; detecting MTU\n"),
+			     len);
+		pmtud_set_mtu(vpninfo, p->base);
+		pmtud_search(vpninfo, p->base, len - 1);
+		return;
+	}
+
+	p->hi = len - 1;
+	/* The MTU we're currently using is too large. Fall back to
+	 * what we know works while the search continues. Unless the
+	 * peer has never answered a probe at all, in which case we
+	 * don't know anything yet. */
+	if (p->acked && vpninfo->ip_info.mtu > p->hi)
+		pmtud_set_mtu(vpninfo, p->lo);
+	pmtud_next_probe(vpninfo);
+}
+
+int pmtud_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	time_t now = time(NULL);
+	int ret;
+
+	if (p->state == PMTUD_DISABLED)
+		return 0;
+
+	if (p->nr_burst) {
+		if (p->probe_count &&
+		    !ka_check_deadline(timeout, now, p->last_probe + PMTUD_PROBE_TIMER))
+			return 0;
+		if (p->probe_count < PMTUD_MAX_PROBES)
+			return pmtud_send_burst(vpninfo, timeout);
+		pmtud_burst_lost(vpninfo);
+		if (p->state == PMTUD_DISABLED)
+			return 0;
+	}
+
+	if (p->probe_size) {
+		if (p->probe_count &&
+		    !ka_check_deadline(timeout, now, p->last_probe + PMTUD_PROBE_TIMER))
+			return 0;
+		if (p->probe_count >= PMTUD_MAX_PROBES)
+			pmtud_probe_lost(vpninfo);
+	}
+
+	if (!p->probe_size) {
+		/* Search complete. Time to try for a larger MTU again? */
+		if (ka_check_deadline(timeout, now, p->raise_due) &&
+		    vpninfo->ip_info.mtu < p->max)
+			pmtud_search(vpninfo, vpninfo->ip_info.mtu, p->max);
+		else if (ka_check_deadline(timeout, now, p->confirm_due)) {
+			p->probe_size = vpninfo->ip_info.mtu;
+			p->probe_count = 0;
+		}
+		if (!p->probe_size)
+			return 0;
+	}
+
+	if (!p->probe_count++)
+		p->first_probe = now;
+	p->last_probe = now;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Sending MTU DPD probe (%u bytes)\n"), p->probe_size);
+	ret = vpninfo->proto->udp_send_mtu_probe(vpninfo, p->probe_size);
+	if (ret == -EMSGSIZE) {
+		/* Too large to send at all; no point in retrying */
+		p->probe_count = PMTUD_MAX_PROBES;
+		p->last_probe = now - PMTUD_PROBE_TIMER;
+		*timeout = 0;
+	} else if (ret == -EAGAIN) {
+		/* Not sent, so it doesn't count. Try again shortly. */
+		p->probe_count--;
+		p->last_probe = now - PMTUD_PROBE_TIMER + 1;
+		ka_check_deadline(timeout, now, now + 1);
+	} else
+		ka_check_deadline(timeout, now, now + PMTUD_PROBE_TIMER);
+
+	return 1;
+}
@@ -0,0 +1,307 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* While an auth form is waiting for the user, there is usually no
+ * connection open to the server: most of them close it after each
+ * response, and we do so ourselves until a client certificate has been
+ * asked for. So whatever comes next has to look up the name and connect
+ * again, once the user has finished typing.
+ *
+ * Do that while they're typing instead. A throwaway vpninfo runs
+ * connect_https_socket() on a thread of its own, and the next call on
+ * the real one takes the socket if it's still good, along with the name
+ * lookup which found it.
+ *
+ * The TLS handshake is left until then. It calls back to the application
+ * to check the server's certificate and perhaps for a PIN, and it can't
+ * be doing that while it's already in the middle of a form. */
+
+#define PRECONNECT_MAX_AGE	60	/* seconds */
+
+struct preconnect {
+	struct openconnect_info *p;
+	pthread_t thread;
+	int fds[2];		/* A byte is written when it's done */
+	int fd;			/* The connected socket, or -errno */
+	time_t connected;
+};
+
+static void __attribute__ ((format(printf, 3, 4)))
+    preconnect_progress(void *_vpninfo, int level, const char *fmt, ...)
+{
+	/* Not from our thread, while the application is busy with a form */
+}
+
+static void *preconnect_thread(void *_pc)
+{
+	struct preconnect *pc = _pc;
+	char c = 0;
+
+	pc->fd = connect_https_socket(pc->p);
+	pc->connected = time(NULL);
+
+	if (write(pc->fds[1], &c, 1) != 1) {
+		/* The pipe can't be full. Nothing to be done anyway */
+	}
+	return NULL;
+}
+
+static void preconnect_release(struct preconnect *pc)
+{
+	if (pc->fd >= 0)
+		closesocket(pc->fd);
+	close(pc->fds[0]);
+	close(pc->fds[1]);
+	openconnect_vpninfo_free(pc->p);
+	free(pc);
+}
+
+/* Tell it to give up, and wait until it has */
+void preconnect_free(struct openconnect_info *vpninfo)
+{
+	struct preconnect *pc = vpninfo->preconnect;
+	char cmd = OC_CMD_CANCEL;
+
+	if (!pc)
+		return;
+
+	vpninfo->preconnect = NULL;
+	if (write(pc->p->cmd_fd_write, &cmd, 1) != 1) {
+		/* It'll finish in its own time */
+	}
+	pthread_join(pc->thread, NULL);
+	preconnect_release(pc);
+}
+
+void preconnect_start(struct openconnect_info *vpninfo)
+{
+	struct preconnect *pc = vpninfo->preconnect;
+	struct openconnect_info *p;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int ret;
+
+	if (pc) {
+		if (!strcmp(pc->p->hostname, vpninfo->hostname) &&
+		    pc->p->port == vpninfo->port)
+			return;
+		preconnect_free(vpninfo);
+	}
+
+	/* Anything which would call back into the application from our
+	 * thread, or might ask the user for proxy credentials. */
+	if (!vpninfo->hostname || vpninfo->proxy || vpninfo->protect_socket ||
+	    vpninfo->getaddrinfo_override)
+		return;
+#ifdef LIBPROXY_HDR
+	if (vpninfo->proxy_factory)
+		return;
+#endif
+
+	pc = calloc(1, sizeof(*pc));
+	if (!pc)
+		return;
+	pc->fd = -EINVAL;
+
+	p = openconnect_vpninfo_new("OpenConnect", NULL, NULL, NULL,
+				    preconnect_progress, NULL);
+	if (!p) {
+		free(pc);
+		return;
+	}
+	p->verbose = -1;
+	p->is_dyndns = vpninfo->is_dyndns;
+	if (openconnect_set_hostname(p, vpninfo->hostname) ||
+	    openconnect_setup_cmd_pipe(p) < 0)
+		goto err;
+	p->port = vpninfo->port;
+	if (vpninfo->peer_addr) {
+		p->peer_addr = malloc(vpninfo->peer_addrlen);
+		if (!p->peer_addr)
+			goto err;
+		memcpy(p->peer_addr, vpninfo->peer_addr, vpninfo->peer_addrlen);
+		p->peer_addrlen = vpninfo->peer_addrlen;
+	}
+	if (vpninfo->peer_addr_alt) {
+		p->peer_addr_alt = malloc(vpninfo->peer_addr_altlen);
+		if (!p->peer_addr_alt)
+			goto err;
+		memcpy(p->peer_addr_alt, vpninfo->peer_addr_alt, vpninfo->peer_addr_altlen);
+		p->peer_addr_altlen = vpninfo->peer_addr_altlen;
+	}
+	pc->p = p;
+
+	if (pipe(pc->fds))
+		goto err;
+	set_fd_cloexec(pc->fds[0]);
+	set_fd_cloexec(pc->fds[1]);
+	set_sock_nonblock(pc->fds[0]);
+
+	/* Signals are for the application's threads, not ours */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_attr_init(&attr);
+	ret = pthread_create(&pc->thread, &attr, preconnect_thread, pc);
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		preconnect_release(pc);
+		return;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Connecting to %s in the background\n"), vpninfo->hostname);
+	vpninfo->preconnect = pc;
+	return;
+
+ err:
+	openconnect_vpninfo_free(p);
+	free(pc);
+}
+
+/* The server has nothing to say before our ClientHello, unless it's
+ * to hang up on us. */
+static int preconnect_usable(struct preconnect *pc)
+{
+	struct pollfd pfd;
+
+	if (time(NULL) - pc->connected > PRECONNECT_MAX_AGE)
+		return 0;
+
+	pfd.fd = pc->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+#define TAKE(_f) do {				\
+		free(vpninfo->_f);		\
+		vpninfo->_f = p->_f;		\
+		p->_f = NULL;			\
+	} while (0)
+
+/* Returns the socket if there's a good one for the server we're about
+ * to connect to, or -ENOENT. */
+int preconnect_take(struct openconnect_info *vpninfo)
+{
+	struct preconnect *pc = vpninfo->preconnect;
+	struct openconnect_info *p;
+	char c;
+	int fd;
+
+	if (!pc)
+		return -ENOENT;
+
+	p = pc->p;
+	if (!vpninfo->hostname || strcmp(p->hostname, vpninfo->hostname) ||
+	    p->port != vpninfo->port || vpninfo->proxy) {
+		preconnect_free(vpninfo);
+		return -ENOENT;
+	}
+
+	/* If the user was quick, it may still be going */
+	while (read(pc->fds[0], &c, 1) != 1) {
+		fd_set rd_set;
+		int maxfd = pc->fds[0];
+
+		FD_ZERO(&rd_set);
+		FD_SET(pc->fds[0], &rd_set);
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		if (vpn_select(vpninfo, maxfd + 1, &rd_set, NULL, NULL, NULL) < 0 &&
+		    errno != EINTR) {
+			vpn_perror(vpninfo, _("Failed select() for background connect"));
+			preconnect_free(vpninfo);
+			return -ENOENT;
+		}
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			preconnect_free(vpninfo);
+			return -EINTR;
+		}
+	}
+	pthread_join(pc->thread, NULL);
+	vpninfo->preconnect = NULL;
+
+	resolve_adopt(vpninfo, p);
+
+	fd = pc->fd;
+	if (fd < 0) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Background connect to %s failed; trying again\n"),
+			     vpninfo->hostname);
+		fd = -ENOENT;
+	} else if (!preconnect_usable(pc)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Connection made in the background has gone stale; connecting again\n"));
+		fd = -ENOENT;
+	} else {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Using connection to %s made in the background\n"),
+			     p->ip_info.gateway_addr ?: vpninfo->hostname);
+		pc->fd = -1;
+
+		/* As connect_https_socket() would have done for itself */
+		if (p->peer_addr) {
+			TAKE(peer_addr);
+			vpninfo->peer_addrlen = p->peer_addrlen;
+			TAKE(peer_addr_alt);
+			vpninfo->peer_addr_altlen = p->peer_addr_altlen;
+		}
+		if (p->ip_info.gateway_addr)
+			TAKE(ip_info.gateway_addr);
+		if (p->unique_hostname)
+			TAKE(unique_hostname);
+	}
+
+	preconnect_release(pc);
+	return fd;
+}
+
+#else /* !HAVE_PTHREAD || _WIN32 */
+
+void preconnect_start(struct openconnect_info *vpninfo)
+{
+}
+
+int preconnect_take(struct openconnect_info *vpninfo)
+{
+	return -ENOENT;
+}
+
+void preconnect_free(struct openconnect_info *vpninfo)
+{
+}
+#endif
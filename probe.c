@@ -0,0 +1,456 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_UCONTEXT
+#include <poll.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Where the portal or the XML profile offers more than one server,
+ * connect to all of them at once and see which answers fastest. Each
+ * probe is a TCP connection and TLS handshake, made by a throwaway
+ * vpninfo running openconnect_open_https() on a stack of its own, so
+ * they can all be in flight together from a single poll() loop.
+ *
+ * Only the time spent waiting for the network is counted. Handshakes
+ * take a fair amount of CPU and the probes have to take turns at it;
+ * counting wall time would penalise whichever happened to go last. */
+
+#define PROBE_TIMEOUT	5000	/* ms, for all of them together */
+#define PROBE_CANCEL	1000	/* ms more, for cancelled ones to give up */
+#define PROBE_CACHE_TTL	300	/* seconds */
+
+struct gw_probe {
+	struct gw_probe *next;
+	char *url;
+	int rtt;		/* ms, or -1 if it failed */
+	time_t when;
+};
+
+struct probe {
+	struct openconnect_info *p;
+	long long waited;
+	long long since;	/* When it last started waiting */
+	int first, nr_fds;	/* Its entries in the pollfd array */
+	int cached;
+	int unneeded;		/* Stopped because another already won */
+	int ret;
+};
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static struct gw_probe *find_probe(struct openconnect_info *vpninfo, const char *url)
+{
+	struct gw_probe *gp;
+	time_t now = time(NULL);
+
+	for (gp = vpninfo->gw_probes; gp; gp = gp->next) {
+		if (!strcmp(gp->url, url))
+			return (now - gp->when < PROBE_CACHE_TTL) ? gp : NULL;
+	}
+	return NULL;
+}
+
+static void cache_probe(struct openconnect_info *vpninfo, const char *url, int rtt)
+{
+	struct gw_probe *gp;
+
+	for (gp = vpninfo->gw_probes; gp; gp = gp->next) {
+		if (!strcmp(gp->url, url))
+			break;
+	}
+	if (!gp) {
+		gp = calloc(1, sizeof(*gp));
+		if (!gp)
+			return;
+		gp->url = strdup(url);
+		if (!gp->url) {
+			free(gp);
+			return;
+		}
+		gp->next = vpninfo->gw_probes;
+		vpninfo->gw_probes = gp;
+	}
+	gp->rtt = rtt;
+	gp->when = time(NULL);
+}
+
+/* A failure which says something about us, not about the gateway */
+static int probe_failed_locally(int ret)
+{
+	return ret == -ENOMEM || ret == -EMFILE || ret == -ENFILE || ret == -ENOBUFS;
+}
+
+void free_gw_probes(struct openconnect_info *vpninfo)
+{
+	struct gw_probe *gp;
+
+	while ((gp = vpninfo->gw_probes)) {
+		vpninfo->gw_probes = gp->next;
+		free(gp->url);
+		free(gp);
+	}
+}
+
+/* Nothing is sent over the connection. The one we choose will have
+ * its certificate checked properly when we connect to it for real. */
+static int probe_accept_cert(void *privdata, const char *reason)
+{
+	return 0;
+}
+
+/* What the probes have to say is only of interest when debugging */
+static void __attribute__ ((format(printf, 3, 4)))
+    probe_progress(void *_vpninfo, int level, const char *fmt, ...)
+{
+	struct openconnect_info *vpninfo = _vpninfo;
+	char buf[512];
+	va_list args;
+
+	level += PRG_DEBUG;
+	if (level > PRG_TRACE || vpninfo->verbose < level)
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	vpninfo->progress(vpninfo->cbdata, level, "%s", buf);
+}
+
+static void probe_protect_socket(void *_vpninfo, int fd)
+{
+	struct openconnect_info *vpninfo = _vpninfo;
+
+	vpninfo->protect_socket(vpninfo->cbdata, fd);
+}
+
+static struct openconnect_info *probe_new(struct openconnect_info *vpninfo,
+					  const char *url)
+{
+	struct openconnect_info *p;
+
+	p = openconnect_vpninfo_new("OpenConnect", probe_accept_cert, NULL, NULL,
+				    probe_progress, vpninfo);
+	if (!p)
+		return NULL;
+
+	if (vpninfo->protect_socket)
+		p->protect_socket = probe_protect_socket;
+	p->no_system_trust = vpninfo->no_system_trust;
+	p->allow_insecure_crypto = vpninfo->allow_insecure_crypto;
+	if (vpninfo->cafile)
+		p->cafile = strdup(vpninfo->cafile);
+
+	if (openconnect_parse_url(p, url) ||
+	    openconnect_setup_cmd_pipe(p) < 0) {
+		openconnect_vpninfo_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+static void probe_cancel(struct probe *pr)
+{
+	char cmd = OC_CMD_CANCEL;
+
+	if (write(pr->p->cmd_fd_write, &cmd, 1) != 1) {
+		async_free(pr->p);
+		pr->ret = -ETIMEDOUT;
+	}
+}
+
+/* Once something in the best tier still in the running has answered,
+ * those still waiting in that tier or a worse one can't beat it. */
+static int probes_needed(struct probe *probes, const struct gw_candidate *gws, int nr)
+{
+	int i, tier = INT_MAX;
+
+	for (i = 0; i < nr; i++) {
+		if (!probes[i].ret && gws[i].tier < tier)
+			tier = gws[i].tier;
+	}
+	for (i = 0; i < nr; i++) {
+		if (probes[i].ret == -EINPROGRESS && gws[i].tier < tier)
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns the index of the chosen candidate: the one which answered
+ * fastest, from the best tier in which any answered at all. */
+int openconnect_probe_gateways(struct openconnect_info *vpninfo,
+			       const struct gw_candidate *gws, int nr)
+{
+	struct probe *probes;
+	struct pollfd *pfd;
+	long long deadline;
+	int i, j, best = -1, running = 0, cancelled = 0;
+
+	if (vpninfo->proxy) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Not probing gateways through a proxy\n"));
+		return -EOPNOTSUPP;
+	}
+
+	probes = calloc(nr, sizeof(*probes));
+	pfd = calloc(nr * ASYNC_MAX_WAIT, sizeof(*pfd));
+	if (!probes || !pfd) {
+		free(probes);
+		free(pfd);
+		return -ENOMEM;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO, _("Probing %d gateways\n"), nr);
+
+	for (i = 0; i < nr; i++) {
+		struct probe *pr = &probes[i];
+		struct gw_probe *gp;
+
+		if (!gws[i].url) {
+			pr->ret = -EINVAL;
+			continue;
+		}
+
+		gp = find_probe(vpninfo, gws[i].url);
+		if (gp) {
+			pr->cached = 1;
+			pr->waited = gp->rtt;
+			pr->ret = gp->rtt < 0 ? -EIO : 0;
+			continue;
+		}
+
+		pr->p = probe_new(vpninfo, gws[i].url);
+		if (!pr->p) {
+			pr->ret = -ENOMEM;
+			continue;
+		}
+		/* DNS lookup and the start of the connect() happen here,
+		 * and aren't counted. */
+		pr->ret = async_start(pr->p, openconnect_open_https);
+		pr->since = now_ms();
+		if (pr->ret == -EINPROGRESS)
+			running++;
+	}
+
+	deadline = now_ms() + PROBE_TIMEOUT;
+	while (running) {
+		struct oc_pollfd fds[ASYNC_MAX_WAIT];
+		long long now = now_ms();
+		int n = 0, timeout;
+
+		if (now >= deadline || (!cancelled && !probes_needed(probes, gws, nr))) {
+			for (i = 0; i < nr; i++) {
+				if (probes[i].ret != -EINPROGRESS)
+					continue;
+				if (!cancelled) {
+					probes[i].unneeded = now < deadline;
+					probe_cancel(&probes[i]);
+				} else {
+					/* Still not gone; unwind it, or abandon it */
+					async_free(probes[i].p);
+					probes[i].ret = -ETIMEDOUT;
+				}
+				if (probes[i].ret != -EINPROGRESS)
+					running--;
+			}
+			cancelled = 1;
+			deadline = now + PROBE_CANCEL;
+			continue;
+		}
+
+		timeout = (int)(deadline - now);
+		for (i = 0; i < nr; i++) {
+			struct probe *pr = &probes[i];
+			int t;
+
+			if (pr->ret != -EINPROGRESS)
+				continue;
+
+			pr->first = n;
+			pr->nr_fds = async_get_fds(pr->p, fds, ASYNC_MAX_WAIT);
+			for (j = 0; j < pr->nr_fds; j++, n++) {
+				pfd[n].fd = fds[j].fd;
+				pfd[n].events = 0;
+				if (fds[j].events & OC_FD_READ)
+					pfd[n].events |= POLLIN;
+				if (fds[j].events & OC_FD_WRITE)
+					pfd[n].events |= POLLOUT;
+				pfd[n].revents = 0;
+			}
+			t = async_get_timeout(pr->p);
+			if (t >= 0 && t < timeout)
+				timeout = t;
+		}
+
+		if (poll(pfd, n, timeout) < 0 && errno != EINTR) {
+			vpn_perror(vpninfo, _("Failed to poll gateway probes"));
+			deadline = 0;
+			continue;
+		}
+
+		now = now_ms();
+		for (i = 0; i < nr; i++) {
+			struct probe *pr = &probes[i];
+			int rd[ASYNC_MAX_WAIT], wr[ASYNC_MAX_WAIT];
+			int nr_rd = 0, nr_wr = 0;
+
+			if (pr->ret != -EINPROGRESS)
+				continue;
+
+			for (j = pr->first; j < pr->first + pr->nr_fds; j++) {
+				short ev = pfd[j].revents;
+
+				if (ev & (POLLIN | POLLHUP | POLLERR))
+					rd[nr_rd++] = pfd[j].fd;
+				if (ev & (POLLOUT | POLLHUP | POLLERR))
+					wr[nr_wr++] = pfd[j].fd;
+			}
+			if (!nr_rd && !nr_wr && async_get_timeout(pr->p))
+				continue;
+
+			pr->waited += now - pr->since;
+			pr->ret = async_process(pr->p, rd, nr_rd, wr, nr_wr);
+			pr->since = now_ms();
+			if (pr->ret != -EINPROGRESS)
+				running--;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct probe *pr = &probes[i];
+
+		if (pr->p) {
+			openconnect_close_https(pr->p, 0);
+			openconnect_vpninfo_free(pr->p);
+		}
+		if (!gws[i].url)
+			continue;
+
+		if (pr->unneeded) {
+			vpn_progress(vpninfo, PRG_INFO, _("  %s: slower\n"),
+				     gws[i].url);
+			continue;
+		}
+		if (!pr->cached && !probe_failed_locally(pr->ret))
+			cache_probe(vpninfo, gws[i].url, pr->ret ? -1 : (int)pr->waited);
+
+		if (pr->ret) {
+			vpn_progress(vpninfo, PRG_INFO, _("  %s: no response\n"),
+				     gws[i].url);
+			continue;
+		}
+		vpn_progress(vpninfo, PRG_INFO, _("  %s: %d ms%s\n"),
+			     gws[i].url, (int)pr->waited,
+			     pr->cached ? _(" (cached)") : "");
+
+		if (best < 0 || gws[i].tier < gws[best].tier ||
+		    (gws[i].tier == gws[best].tier &&
+		     pr->waited < probes[best].waited))
+			best = i;
+	}
+
+	if (best >= 0)
+		vpn_progress(vpninfo, PRG_INFO, _("Selected gateway %s\n"),
+			     gws[best].url);
+	else
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("No gateway responded to probing\n"));
+
+	free(probes);
+	free(pfd);
+	return best >= 0 ? best : -ENOENT;
+}
+
+int openconnect_set_gateway_probe(struct openconnect_info *vpninfo, int enable)
+{
+	vpninfo->probe_gw = enable;
+	return 0;
+}
+
+#else /* !HAVE_UCONTEXT */
+
+int openconnect_probe_gateways(struct openconnect_info *vpninfo,
+			       const struct gw_candidate *gws, int nr)
+{
+	return -EOPNOTSUPP;
+}
+
+void free_gw_probes(struct openconnect_info *vpninfo)
+{
+}
+
+int openconnect_set_gateway_probe(struct openconnect_info *vpninfo, int enable)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+/* config_lookup_host() found backup servers in the XML profile. They're
+ * only probed once we're about to connect, from inside the library. */
+void probe_gw_candidates(struct openconnect_info *vpninfo)
+{
+	struct gw_candidate *gws = vpninfo->gw_candidates;
+	int i;
+
+	if (!gws)
+		return;
+
+	i = openconnect_probe_gateways(vpninfo, gws, vpninfo->nr_gw_candidates);
+	if (i >= 0 && gws[i].tier) {
+		char *urlpath = vpninfo->urlpath;
+
+		vpninfo->urlpath = NULL;
+		if (!openconnect_parse_url(vpninfo, gws[i].url))
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Using backup server %s\n"), gws[i].url);
+		/* Keep the UserGroup, unless the backup has its own path */
+		if (!vpninfo->urlpath)
+			vpninfo->urlpath = urlpath;
+		else
+			free(urlpath);
+	}
+	free_gw_candidates(vpninfo);
+}
+
+void free_gw_candidates(struct openconnect_info *vpninfo)
+{
+	int i;
+
+	for (i = 0; i < vpninfo->nr_gw_candidates; i++)
+		free((char *)vpninfo->gw_candidates[i].url);
+	free(vpninfo->gw_candidates);
+	vpninfo->gw_candidates = NULL;
+	vpninfo->nr_gw_candidates = 0;
+}
@@ -0,0 +1,553 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define RESOLVE_THREAD
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+/* Looking up the server's name can take a long time, and getaddrinfo()
+ * blocks while it does. So it runs on a thread of its own, and we wait
+ * for that in vpn_select() like for anything else: with the cmd_fd, so
+ * that it can be cancelled, and without blocking the caller's event loop
+ * when we're running from openconnect_obtain_cookie_start() and friends.
+ *
+ * The answers are kept, for reconnecting. getaddrinfo() doesn't tell us
+ * the TTL, so they are all taken to last RESOLVE_TTL seconds. After that
+ * they are still used for a while if there's nothing better, while they
+ * are looked up again in the background. For a server with dynamic DNS,
+ * where we look up its name again each time we reconnect, the mainloop
+ * also does so shortly before the answer expires, so that there is
+ * always a fresh one ready. */
+
+#define RESOLVE_TTL		60	/* seconds */
+#define RESOLVE_STALE		3600	/* seconds after expiry */
+#define RESOLVE_PREFETCH	10	/* seconds before expiry */
+
+#ifdef RESOLVE_THREAD
+struct resolve_job {
+	pthread_mutex_t lock;
+	int refs;			/* The thread has one, and the cache */
+	int fds[2];			/* A byte is written when it's done */
+	char *host, *port;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	int err;
+};
+#endif
+
+struct resolved {
+	struct resolved *next;
+	char *host, *port;
+	struct addrinfo hints;
+	struct addrinfo *res;		/* NULL if there's no usable answer */
+	int err;			/* from the last lookup */
+	time_t expires;
+	time_t started;			/* the last lookup */
+#ifdef RESOLVE_THREAD
+	struct resolve_job *job;	/* Lookup in progress */
+#endif
+};
+
+/* Our own copy, with each sockaddr in the same allocation as its addrinfo.
+ * It has to be freed with resolve_free(), not freeaddrinfo(). */
+static struct addrinfo *copy_addrinfo(const struct addrinfo *ai)
+{
+	struct addrinfo *res = NULL, **next = &res;
+
+	for (; ai; ai = ai->ai_next) {
+		struct addrinfo *rp = malloc(sizeof(*rp) + ai->ai_addrlen);
+
+		if (!rp) {
+			resolve_free(res);
+			return NULL;
+		}
+		*rp = *ai;
+		rp->ai_canonname = NULL;
+		rp->ai_addr = (void *)(rp + 1);
+		memcpy(rp->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		rp->ai_next = NULL;
+
+		*next = rp;
+		next = &rp->ai_next;
+	}
+	return res;
+}
+
+void resolve_free(struct addrinfo *res)
+{
+	struct addrinfo *next;
+
+	for (; res; res = next) {
+		next = res->ai_next;
+		free(res);
+	}
+}
+
+static int lookup(const char *host, const char *port, const struct addrinfo *hints,
+		  struct addrinfo **res)
+{
+	struct addrinfo *result;
+	int err;
+
+	err = getaddrinfo(host, port, hints, &result);
+	if (err)
+		return err;
+
+	*res = copy_addrinfo(result);
+	freeaddrinfo(result);
+	return *res ? 0 : EAI_MEMORY;
+}
+
+#ifdef RESOLVE_THREAD
+static void job_put(struct resolve_job *job)
+{
+	int refs;
+
+	pthread_mutex_lock(&job->lock);
+	refs = --job->refs;
+	pthread_mutex_unlock(&job->lock);
+	if (refs)
+		return;
+
+	pthread_mutex_destroy(&job->lock);
+	close(job->fds[0]);
+	close(job->fds[1]);
+	resolve_free(job->res);
+	free(job->host);
+	free(job->port);
+	free(job);
+}
+
+static void *resolve_thread(void *_job)
+{
+	struct resolve_job *job = _job;
+	char c = 0;
+
+	job->err = lookup(job->host, job->port, &job->hints, &job->res);
+
+	if (write(job->fds[1], &c, 1) != 1) {
+		/* The pipe can't be full. Nothing to be done anyway */
+	}
+	job_put(job);
+	return NULL;
+}
+
+static struct resolve_job *job_new(struct resolved *r)
+{
+	struct resolve_job *job = calloc(1, sizeof(*job));
+
+	if (!job)
+		return NULL;
+
+	job->hints = r->hints;
+	job->host = strdup(r->host);
+	job->port = strdup(r->port);
+	if (!job->host || !job->port || pipe(job->fds)) {
+		free(job->host);
+		free(job->port);
+		free(job);
+		return NULL;
+	}
+	set_fd_cloexec(job->fds[0]);
+	set_fd_cloexec(job->fds[1]);
+	set_sock_nonblock(job->fds[0]);
+
+	pthread_mutex_init(&job->lock, NULL);
+	job->refs = 2;
+	return job;
+}
+
+static int job_thread(struct resolve_job *job)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int ret;
+
+	/* Signals are for the application's threads, not ours */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, resolve_thread, job);
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret;
+}
+
+/* Returns nonzero if it has finished */
+static int job_done(struct resolve_job *job)
+{
+	char c;
+
+	return read(job->fds[0], &c, 1) == 1;
+}
+#endif
+
+static void resolved_update(struct resolved *r, int err, struct addrinfo *res)
+{
+	r->err = err;
+	if (err)
+		return;
+
+	resolve_free(r->res);
+	r->res = res;
+	r->expires = time(NULL) + RESOLVE_TTL;
+}
+
+/* In the background if possible, else here and now */
+static void resolve_start(struct openconnect_info *vpninfo, struct resolved *r)
+{
+	struct addrinfo *res = NULL;
+	int err;
+#ifdef RESOLVE_THREAD
+	struct resolve_job *job;
+#endif
+
+	r->started = time(NULL);
+#ifdef RESOLVE_THREAD
+	job = job_new(r);
+	if (job && !job_thread(job)) {
+		r->job = job;
+		return;
+	}
+	if (job) {
+		job->refs = 1;
+		job_put(job);
+	}
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Failed to start resolver thread; looking up %s directly\n"),
+		     r->host);
+#endif
+	err = lookup(r->host, r->port, &r->hints, &res);
+	resolved_update(r, err, res);
+}
+
+#ifdef RESOLVE_THREAD
+/* The mainloop wakes for a lookup in the background when its pipe
+ * becomes readable. Only one is watched at a time. */
+static void job_unmonitor(struct openconnect_info *vpninfo, struct resolve_job *job)
+{
+	if (vpninfo->resolve_fd < 0 || (job && vpninfo->resolve_fd != job->fds[0]))
+		return;
+
+	unmonitor_fd(vpninfo, resolve);
+	vpninfo->resolve_fd = -1;
+}
+
+static void job_monitor(struct openconnect_info *vpninfo, struct resolve_job *job)
+{
+	if (vpninfo->resolve_fd == job->fds[0])
+		return;
+
+	job_unmonitor(vpninfo, NULL);
+	vpninfo->resolve_fd = job->fds[0];
+	monitor_fd_new(vpninfo, resolve);
+	monitor_read_fd(vpninfo, resolve);
+}
+
+/* Take the answer from a lookup which has finished */
+static void job_collect(struct openconnect_info *vpninfo, struct resolved *r)
+{
+	struct resolve_job *job = r->job;
+
+	job_unmonitor(vpninfo, job);
+
+	if (job->err && r->res)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Failed to look up %s again: %s\n"),
+			     r->host, gai_strerror(job->err));
+
+	resolved_update(r, job->err, job->res);
+	job->res = NULL;
+	r->job = NULL;
+	job_put(job);
+}
+
+static int job_wait(struct openconnect_info *vpninfo, struct resolved *r)
+{
+	int fd = r->job->fds[0];
+
+	while (!job_done(r->job)) {
+		fd_set rd_set;
+		int maxfd = fd;
+
+		FD_ZERO(&rd_set);
+		FD_SET(fd, &rd_set);
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		if (vpn_select(vpninfo, maxfd + 1, &rd_set, NULL, NULL, NULL) < 0 &&
+		    errno != EINTR) {
+			vpn_perror(vpninfo, _("Failed select() for name lookup"));
+			return EAI_SYSTEM;
+		}
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			/* The thread carries on, and the answer will be
+			 * there if we try again. */
+			vpn_progress(vpninfo, PRG_ERR, _("Name lookup cancelled\n"));
+			errno = EINTR;
+			return EAI_SYSTEM;
+		}
+	}
+	job_collect(vpninfo, r);
+	return r->err;
+}
+#endif
+
+static int resolve_running(struct resolved *r)
+{
+#ifdef RESOLVE_THREAD
+	return r->job != NULL;
+#else
+	return 0;
+#endif
+}
+
+static void resolved_free(struct resolved *r)
+{
+#ifdef RESOLVE_THREAD
+	/* If the thread is still running, it'll free the job */
+	if (r->job)
+		job_put(r->job);
+#endif
+	resolve_free(r->res);
+	free(r->host);
+	free(r->port);
+	free(r);
+}
+
+static struct resolved *resolved_find(struct openconnect_info *vpninfo,
+				      const char *host, const char *port,
+				      const struct addrinfo *hints)
+{
+	struct resolved *r;
+
+	for (r = vpninfo->resolved; r; r = r->next) {
+		if (!strcmp(r->host, host) && !strcmp(r->port, port))
+			return r;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->host = strdup(host);
+	r->port = strdup(port);
+	if (!r->host || !r->port) {
+		free(r->host);
+		free(r->port);
+		free(r);
+		return NULL;
+	}
+	r->hints.ai_family = hints->ai_family;
+	r->hints.ai_socktype = hints->ai_socktype;
+	r->hints.ai_protocol = hints->ai_protocol;
+	r->hints.ai_flags = hints->ai_flags;
+
+	r->next = vpninfo->resolved;
+	vpninfo->resolved = r;
+	return r;
+}
+
+/* Like getaddrinfo(), but the result must be freed with resolve_free() */
+int resolve_host(struct openconnect_info *vpninfo, const char *host,
+		 const char *port, const struct addrinfo *hints,
+		 struct addrinfo **res)
+{
+	struct resolved *r;
+	time_t now = time(NULL);
+	int err;
+
+	if (vpninfo->getaddrinfo_override) {
+		struct addrinfo *result;
+
+		err = vpninfo->getaddrinfo_override(vpninfo->cbdata, host, port,
+						    hints, &result);
+		if (err)
+			return err;
+		*res = copy_addrinfo(result);
+		freeaddrinfo(result);
+		return *res ? 0 : EAI_MEMORY;
+	}
+
+	/* Nothing to wait for, and nothing worth keeping */
+	if (hints->ai_flags & AI_NUMERICHOST)
+		return lookup(host, port, hints, res);
+
+	r = resolved_find(vpninfo, host, port, hints);
+	if (!r)
+		return lookup(host, port, hints, res);
+
+#ifdef RESOLVE_THREAD
+	if (r->job && job_done(r->job))
+		job_collect(vpninfo, r);
+#endif
+	if (r->res && now >= r->expires + RESOLVE_STALE) {
+		resolve_free(r->res);
+		r->res = NULL;
+	}
+
+	if (r->res && now >= r->expires && !resolve_running(r)) {
+		resolve_start(vpninfo, r);
+		if (resolve_running(r))
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Using previous addresses for %s while looking it up again\n"),
+				     host);
+	}
+
+	if (!r->res) {
+		if (!resolve_running(r))
+			resolve_start(vpninfo, r);
+#ifdef RESOLVE_THREAD
+		if (r->job) {
+			err = job_wait(vpninfo, r);
+			if (err)
+				return err;
+		}
+#endif
+		if (!r->res)
+			return r->err;
+	}
+
+	*res = copy_addrinfo(r->res);
+	return *res ? 0 : EAI_MEMORY;
+}
+
+/* None of the addresses worked. Look it up properly next time */
+void resolve_forget(struct openconnect_info *vpninfo, const char *host,
+		    const char *port)
+{
+	struct resolved *r;
+
+	for (r = vpninfo->resolved; r; r = r->next) {
+		if (!strcmp(r->host, host) && !strcmp(r->port, port)) {
+			resolve_free(r->res);
+			r->res = NULL;
+			return;
+		}
+	}
+}
+
+/* Take the answers which another vpninfo looked up on our behalf,
+ * where they're newer than what we have. */
+void resolve_adopt(struct openconnect_info *vpninfo, struct openconnect_info *from)
+{
+	struct resolved *r, *mine;
+
+	while ((r = from->resolved)) {
+		from->resolved = r->next;
+
+		for (mine = vpninfo->resolved; mine; mine = mine->next) {
+			if (!strcmp(mine->host, r->host) && !strcmp(mine->port, r->port))
+				break;
+		}
+		if (!mine) {
+			r->next = vpninfo->resolved;
+			vpninfo->resolved = r;
+			continue;
+		}
+		if (r->res && !resolve_running(mine) &&
+		    (!mine->res || r->expires > mine->expires)) {
+			resolve_free(mine->res);
+			mine->res = r->res;
+			mine->expires = r->expires;
+			mine->started = r->started;
+			mine->err = 0;
+			r->res = NULL;
+		}
+		resolved_free(r);
+	}
+}
+
+void resolve_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+#ifdef RESOLVE_THREAD
+	struct resolved *r;
+	time_t now = time(NULL), due;
+	char port[6];
+
+	/* Whichever name it was for, in case that has changed since */
+	for (r = vpninfo->resolved; r; r = r->next) {
+		if (r->job && r->job->fds[0] == vpninfo->resolve_fd && job_done(r->job))
+			job_collect(vpninfo, r);
+	}
+
+	/* With a proxy, or without dynamic DNS, we'll reconnect to the
+	 * same address without looking it up again. */
+	if (!vpninfo->is_dyndns || vpninfo->proxy || !vpninfo->hostname)
+		return;
+
+	snprintf(port, sizeof(port), "%d", vpninfo->port);
+	for (r = vpninfo->resolved; r; r = r->next) {
+		if (!strcmp(r->host, vpninfo->hostname) && !strcmp(r->port, port))
+			break;
+	}
+	if (!r || !r->res)
+		return;
+
+	/* Perhaps started by resolve_host(), rather than by us */
+	if (r->job) {
+		if (job_done(r->job))
+			job_collect(vpninfo, r);
+		else
+			job_monitor(vpninfo, r->job);
+		return;
+	}
+
+	/* No more often than that, if it keeps failing */
+	due = MAX(r->expires, r->started + RESOLVE_PREFETCH * 2) - RESOLVE_PREFETCH;
+	if (now >= due) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Looking up %s again before it expires\n"), r->host);
+		resolve_start(vpninfo, r);
+		if (r->job) {
+			job_monitor(vpninfo, r->job);
+			return;
+		}
+		/* It was looked up here and now */
+		due = MAX(r->expires, r->started + RESOLVE_PREFETCH * 2) - RESOLVE_PREFETCH;
+	}
+	if (*timeout > (due - now) * 1000)
+		*timeout = (due - now) * 1000;
+#endif
+}
+
+void free_resolved(struct openconnect_info *vpninfo)
+{
+	struct resolved *r;
+
+#ifdef RESOLVE_THREAD
+	job_unmonitor(vpninfo, NULL);
+#endif
+	while ((r = vpninfo->resolved)) {
+		vpninfo->resolved = r->next;
+		resolved_free(r);
+	}
+}
@@ -295,11 +295,33 @@ static void set_banner(struct openconnect_info *vpninfo)
 	free(banner);
 }
 
+/* The nameservers that the system should use. With the DNS proxy, that's
+ * just us; we ask the VPN's own servers. */
+const char *vpn_nameserver(struct openconnect_info *vpninfo, int i)
+{
+#ifndef _WIN32
+	if (vpninfo->dns_proxy_listen && vpninfo->ip_info.dns[0])
+		return i ? NULL : dnsproxy_addr(vpninfo);
+#endif
+	return vpninfo->ip_info.dns[i];
+}
+
 void prepare_script_env(struct openconnect_info *vpninfo)
 {
+	char host[80];
+
 	if (vpninfo->ip_info.gateway_addr)
 		script_setenv(vpninfo, "VPNGATEWAY", vpninfo->ip_info.gateway_addr, 0, 0);
 
+	/* DTLS or ESP may go to the gateway's address in the other family,
+	 * which also needs to be routed outside the VPN. */
+	if (vpninfo->peer_addr_alt &&
+	    !getnameinfo(vpninfo->peer_addr_alt, vpninfo->peer_addr_altlen,
+			 host, sizeof(host), NULL, 0, NI_NUMERICHOST))
+		script_setenv(vpninfo, "VPNGATEWAY_ALT", host, 0, 0);
+	else
+		script_setenv(vpninfo, "VPNGATEWAY_ALT", NULL, 0, 0);
+
 	set_banner(vpninfo);
 	script_setenv(vpninfo, "CISCO_SPLIT_INC", NULL, 0, 0);
 	script_setenv(vpninfo, "CISCO_SPLIT_EXC", NULL, 0, 0);
@@ -356,14 +378,14 @@ void prepare_script_env(struct openconnect_info *vpninfo)
 				      slash - vpninfo->ip_info.netmask6, 0);
 	}
 
-	if (vpninfo->ip_info.dns[0])
-		script_setenv(vpninfo, "INTERNAL_IP4_DNS", vpninfo->ip_info.dns[0], 0, 0);
+	if (vpn_nameserver(vpninfo, 0))
+		script_setenv(vpninfo, "INTERNAL_IP4_DNS", vpn_nameserver(vpninfo, 0), 0, 0);
 	else
 		script_setenv(vpninfo, "INTERNAL_IP4_DNS", NULL, 0, 0);
-	if (vpninfo->ip_info.dns[1])
-		script_setenv(vpninfo, "INTERNAL_IP4_DNS", vpninfo->ip_info.dns[1], 0, 1);
-	if (vpninfo->ip_info.dns[2])
-		script_setenv(vpninfo, "INTERNAL_IP4_DNS", vpninfo->ip_info.dns[2], 0, 1);
+	if (vpn_nameserver(vpninfo, 1))
+		script_setenv(vpninfo, "INTERNAL_IP4_DNS", vpn_nameserver(vpninfo, 1), 0, 1);
+	if (vpn_nameserver(vpninfo, 2))
+		script_setenv(vpninfo, "INTERNAL_IP4_DNS", vpn_nameserver(vpninfo, 2), 0, 1);
 
 	if (vpninfo->ip_info.nbns[0])
 		script_setenv(vpninfo, "INTERNAL_IP4_NBNS", vpninfo->ip_info.nbns[0], 0, 0);
@@ -468,6 +490,105 @@ void free_split_routes(struct oc_ip_info *ip_info)
 		ip_info->split_excludes = NULL;
 }
 
+static void digest_addr(struct oc_text_buf *buf, const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET)
+		buf_append_bytes(buf, &((struct sockaddr_in *)sa)->sin_addr,
+				 sizeof(struct in_addr));
+	else if (sa->sa_family == AF_INET6)
+		buf_append_bytes(buf, &((struct sockaddr_in6 *)sa)->sin6_addr,
+				 sizeof(struct in6_addr));
+	buf_append(buf, "\n");
+}
+
+/* The gateway address, and the local address we'd now reach it from.
+ * If we've moved to a different network, the script has to fix up the
+ * host route to the gateway even if the configuration is the same.
+ * Connecting a UDP socket sends nothing; it just looks up the route. */
+static void digest_route(struct openconnect_info *vpninfo, struct oc_text_buf *buf,
+			 const struct sockaddr *peer, socklen_t peerlen)
+{
+	struct sockaddr_storage src;
+	socklen_t srclen = sizeof(src);
+	int fd;
+
+	digest_addr(buf, peer);
+
+	fd = socket(peer->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		return;
+	if (vpninfo->protect_socket)
+		vpninfo->protect_socket(vpninfo->cbdata, fd);
+	if (!connect(fd, peer, peerlen) && !getsockname(fd, (void *)&src, &srclen))
+		digest_addr(buf, (void *)&src);
+	closesocket(fd);
+}
+
+static void ip_info_digest(struct openconnect_info *vpninfo, unsigned char *md5)
+{
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct oc_split_include *l;
+	struct oc_text_buf *buf = buf_alloc();
+	int i;
+
+	/* Not the MTU in use, which MTU detection changes as it goes; the
+	 * one the gateway gave us, which is what we'll get again. */
+	buf_append(buf, "%s\n%s\n%s\n%s\n%s\n%s\n%s\n%d\n",
+		   ip->addr ? : "", ip->netmask ? : "", ip->addr6 ? : "",
+		   ip->netmask6 ? : "", ip->domain ? : "", ip->proxy_pac ? : "",
+		   ip->gateway_addr ? : "", vpninfo->pmtud.max ? : ip->mtu);
+	for (i = 0; i < 3; i++)
+		buf_append(buf, "%s\n%s\n", ip->dns[i] ? : "", ip->nbns[i] ? : "");
+	for (l = ip->split_dns; l; l = l->next)
+		buf_append(buf, "dns %s\n", l->route);
+	for (l = ip->split_includes; l; l = l->next)
+		buf_append(buf, "inc %s\n", l->route);
+	for (l = ip->split_excludes; l; l = l->next)
+		buf_append(buf, "exc %s\n", l->route);
+
+	if (vpninfo->peer_addr)
+		digest_route(vpninfo, buf, vpninfo->peer_addr, vpninfo->peer_addrlen);
+	/* And VPNGATEWAY_ALT, which UDP may use */
+	if (vpninfo->peer_addr_alt)
+		digest_route(vpninfo, buf, vpninfo->peer_addr_alt, vpninfo->peer_addr_altlen);
+
+	if (buf_error(buf))
+		memset(md5, 0, MD5_SIZE);
+	else
+		openconnect_md5(md5, buf->data, buf->pos);
+	buf_free(buf);
+}
+
+/* On reconnect, the gateway almost always gives us the same configuration
+ * again. Don't disturb anything unless it, or the way we reach the
+ * gateway, has actually changed. */
+static int config_unchanged(struct openconnect_info *vpninfo, const char *reason)
+{
+	unsigned char md5[MD5_SIZE];
+	int reconnect = !strcmp(reason, "reconnect");
+
+	if (!reconnect && strcmp(reason, "connect"))
+		return 0;
+
+	/* The built-in configuration works out for itself what has changed,
+	 * including the route to the gateway, and touches nothing else. */
+	if (vpninfo->builtin_netcfg)
+		return 0;
+
+	ip_info_digest(vpninfo, md5);
+	if (reconnect && !memcmp(md5, vpninfo->script_md5, MD5_SIZE)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("IP configuration unchanged; not reconfiguring\n"));
+		return 1;
+	}
+	memcpy(vpninfo->script_md5, md5, MD5_SIZE);
+
+	/* The script needs to see the new configuration */
+	if (reconnect)
+		prepare_script_env(vpninfo);
+	return 0;
+}
+
 
 #ifdef _WIN32
 static wchar_t *create_script_env(struct openconnect_info *vpninfo)
@@ -553,7 +674,8 @@ int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
 	STARTUPINFOW si;
 	DWORD cpflags, exit_status;
 
-	if (!vpninfo->vpnc_script || vpninfo->script_tun)
+	if (!vpninfo->vpnc_script || vpninfo->script_tun ||
+	    config_unchanged(vpninfo, reason))
 		return 0;
 
 	memset(&si, 0, sizeof(si));
@@ -651,7 +773,13 @@ int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
 	int ret;
 	pid_t pid;
 
-	if (!vpninfo->vpnc_script || vpninfo->script_tun)
+	if (vpninfo->script_tun || config_unchanged(vpninfo, reason))
+		return 0;
+
+	if (vpninfo->builtin_netcfg)
+		return netcfg_config_tun(vpninfo, reason);
+
+	if (!vpninfo->vpnc_script)
 		return 0;
 
 	pid = fork();
@@ -0,0 +1,406 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_EPOLL
+/* Many sessions in one thread. Each session keeps its own epoll set, just
+ * as it does for openconnect_mainloop(), and that set is itself in the
+ * manager's epoll set; an epoll fd is readable when anything in it is.
+ * So the manager only learns which sessions have work to do, and each
+ * of those finds out which of its own fds are ready with a non-blocking
+ * wait on its own set. Timeouts go in a single heap, ordered by when
+ * they fall due, so sleeping sessions cost nothing at all.
+ *
+ * A busy session gets a limited number of passes before it goes to the
+ * back of the queue, so that one flooded tunnel can't starve the rest. */
+
+#define SESSION_MAX_EVENTS	64
+/* For a session which has lost its own epoll set, and must be polled */
+#define SESSION_POLL		100
+
+struct oc_session {
+	struct openconnect_info *vpninfo;
+	struct oc_session *prev, *next;
+	struct oc_session *next_ready;
+	struct mainloop_rd rd;
+	long long due;
+	int heap_idx;		/* -1 when no timeout is pending */
+	int on_ready;
+	int woken;		/* Needs to find out which fds are readable */
+	int pool_share;
+};
+
+struct openconnect_session_mgr {
+	int epoll_fd;
+	openconnect_session_done_vfn done;
+	void *privdata;
+
+	struct oc_session *sessions;
+	int nr_sessions;
+
+	struct oc_session *ready, **ready_tail;
+
+	struct oc_session **heap;
+	int heap_len, heap_size;
+
+	struct pkt_pool pool;
+};
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void heap_set(struct openconnect_session_mgr *mgr, int i, struct oc_session *s)
+{
+	mgr->heap[i] = s;
+	s->heap_idx = i;
+}
+
+static void heap_up(struct openconnect_session_mgr *mgr, int i)
+{
+	struct oc_session *s = mgr->heap[i];
+
+	while (i) {
+		int parent = (i - 1) / 2;
+
+		if (mgr->heap[parent]->due <= s->due)
+			break;
+		heap_set(mgr, i, mgr->heap[parent]);
+		i = parent;
+	}
+	heap_set(mgr, i, s);
+}
+
+static void heap_down(struct openconnect_session_mgr *mgr, int i)
+{
+	struct oc_session *s = mgr->heap[i];
+
+	while (1) {
+		int child = i * 2 + 1;
+
+		if (child >= mgr->heap_len)
+			break;
+		if (child + 1 < mgr->heap_len &&
+		    mgr->heap[child + 1]->due < mgr->heap[child]->due)
+			child++;
+		if (s->due <= mgr->heap[child]->due)
+			break;
+		heap_set(mgr, i, mgr->heap[child]);
+		i = child;
+	}
+	heap_set(mgr, i, s);
+}
+
+static void heap_del(struct openconnect_session_mgr *mgr, struct oc_session *s)
+{
+	int i = s->heap_idx;
+
+	if (i < 0)
+		return;
+
+	s->heap_idx = -1;
+	if (i == --mgr->heap_len)
+		return;
+
+	s = mgr->heap[mgr->heap_len];
+	heap_set(mgr, i, s);
+	heap_up(mgr, i);
+	heap_down(mgr, s->heap_idx);
+}
+
+/* There's always room; the heap is sized for every session */
+static void heap_add(struct openconnect_session_mgr *mgr, struct oc_session *s,
+		     long long due)
+{
+	s->due = due;
+	heap_set(mgr, mgr->heap_len++, s);
+	heap_up(mgr, s->heap_idx);
+}
+
+static void ready_add(struct openconnect_session_mgr *mgr, struct oc_session *s)
+{
+	if (s->on_ready)
+		return;
+
+	heap_del(mgr, s);
+	s->on_ready = 1;
+	s->next_ready = NULL;
+	*mgr->ready_tail = s;
+	mgr->ready_tail = &s->next_ready;
+}
+
+static void wake_session(struct openconnect_session_mgr *mgr, struct oc_session *s)
+{
+	s->woken = 1;
+	ready_add(mgr, s);
+}
+
+static void session_done(struct openconnect_session_mgr *mgr, struct oc_session *s,
+			 int ret)
+{
+	struct openconnect_info *vpninfo = s->vpninfo;
+	struct pkt *pkt;
+
+	heap_del(mgr, s);
+	if (vpninfo->epoll_fd >= 0)
+		epoll_ctl(mgr->epoll_fd, EPOLL_CTL_DEL, vpninfo->epoll_fd, NULL);
+
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		mgr->sessions = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	mgr->nr_sessions--;
+
+	vpninfo->pkt_pool = NULL;
+	mgr->pool.max -= s->pool_share;
+	while (mgr->pool.q.count > mgr->pool.max &&
+	       (pkt = dequeue_packet(&mgr->pool.q)))
+		free(pkt);
+
+	free(s);
+
+	/* Last, since it may well free the vpninfo */
+	if (mgr->done)
+		mgr->done(mgr->privdata, vpninfo, ret);
+}
+
+static void session_run(struct openconnect_session_mgr *mgr, struct oc_session *s)
+{
+	struct openconnect_info *vpninfo = s->vpninfo;
+	int i, ret = 0, timeout;
+
+	if (s->woken) {
+		s->woken = 0;
+		ret = mainloop_wait(vpninfo, &s->rd, 0);
+		if (ret) {
+			session_done(mgr, s, mainloop_finish(vpninfo, ret));
+			return;
+		}
+	}
+
+	for (i = 0; i < MAINLOOP_BURST; i++) {
+		switch (mainloop_pass(vpninfo, &s->rd, &timeout, &ret)) {
+		case MAINLOOP_PAUSED:
+			session_done(mgr, s, 0);
+			return;
+
+		case MAINLOOP_QUIT:
+			session_done(mgr, s, mainloop_finish(vpninfo, ret));
+			return;
+
+		case MAINLOOP_IDLE:
+			if (vpninfo->epoll_fd < 0) {
+				if (timeout > SESSION_POLL)
+					timeout = SESSION_POLL;
+			} else
+				mainloop_epoll_sync(vpninfo);
+
+			if (timeout != INT_MAX)
+				heap_add(mgr, s, now_ms() + timeout);
+			return;
+		}
+	}
+
+	/* Still busy; let the others have a turn first */
+	ready_add(mgr, s);
+	return;
+}
+
+struct openconnect_session_mgr *openconnect_session_mgr_new(openconnect_session_done_vfn done,
+							    void *privdata)
+{
+	struct openconnect_session_mgr *mgr = calloc(1, sizeof(*mgr));
+
+	if (!mgr)
+		return NULL;
+
+	mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (mgr->epoll_fd < 0) {
+		free(mgr);
+		return NULL;
+	}
+
+	mgr->done = done;
+	mgr->privdata = privdata;
+	mgr->ready_tail = &mgr->ready;
+	init_pkt_queue(&mgr->pool.q);
+	return mgr;
+}
+
+int openconnect_session_mgr_add(struct openconnect_session_mgr *mgr,
+				struct openconnect_info *vpninfo,
+				int reconnect_timeout, int reconnect_interval)
+{
+	struct oc_session *s;
+
+	if (mgr->nr_sessions == mgr->heap_size) {
+		int size = mgr->heap_size ? mgr->heap_size * 2 : 16;
+		struct oc_session **heap = realloc(mgr->heap, size * sizeof(*heap));
+
+		if (!heap)
+			return -ENOMEM;
+		mgr->heap = heap;
+		mgr->heap_size = size;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->vpninfo = vpninfo;
+	s->heap_idx = -1;
+	s->rd.tun = s->rd.udp = s->rd.tcp = s->rd.dns = 1;
+
+	if (vpninfo->epoll_fd >= 0) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = s;
+		if (epoll_ctl(mgr->epoll_fd, EPOLL_CTL_ADD, vpninfo->epoll_fd, &ev)) {
+			int ret = -errno;
+
+			vpn_perror(vpninfo, _("Failed to add session to epoll set"));
+			free(s);
+			return ret;
+		}
+	}
+
+	s->next = mgr->sessions;
+	if (s->next)
+		s->next->prev = s;
+	mgr->sessions = s;
+	mgr->nr_sessions++;
+
+	s->pool_share = vpninfo->max_qlen * 2;
+	mgr->pool.max += s->pool_share;
+	vpninfo->pkt_pool = &mgr->pool;
+
+	mainloop_start(vpninfo, reconnect_timeout, reconnect_interval);
+	ready_add(mgr, s);
+	return 0;
+}
+
+int openconnect_session_mgr_run(struct openconnect_session_mgr *mgr, int timeout)
+{
+	struct epoll_event evs[SESSION_MAX_EVENTS];
+	struct oc_session *s, *next;
+	long long now = now_ms();
+	int i, nfds;
+
+	if (mgr->ready)
+		timeout = 0;
+	else if (mgr->heap_len) {
+		long long wait = mgr->heap[0]->due - now;
+
+		if (wait < 0)
+			wait = 0;
+		if (timeout < 0 || wait < timeout)
+			timeout = (int)wait;
+	}
+
+	nfds = epoll_wait(mgr->epoll_fd, evs, SESSION_MAX_EVENTS, timeout);
+	if (nfds < 0) {
+		if (errno != EINTR)
+			return -errno;
+		nfds = 0;
+	}
+
+	for (i = 0; i < nfds; i++)
+		wake_session(mgr, evs[i].data.ptr);
+
+	now = now_ms();
+	while (mgr->heap_len && mgr->heap[0]->due <= now)
+		wake_session(mgr, mgr->heap[0]);
+
+	/* Only those which are ready now; any which are still busy
+	 * afterwards will be put back on the list for next time. */
+	s = mgr->ready;
+	mgr->ready = NULL;
+	mgr->ready_tail = &mgr->ready;
+
+	for (; s; s = next) {
+		next = s->next_ready;
+		s->on_ready = 0;
+		session_run(mgr, s);
+	}
+
+	return mgr->nr_sessions;
+}
+
+void openconnect_session_mgr_free(struct openconnect_session_mgr *mgr)
+{
+	struct pkt *pkt;
+
+	if (!mgr)
+		return;
+
+	mgr->ready = NULL;
+	while (mgr->sessions) {
+		mainloop_pause(mgr->sessions->vpninfo);
+		session_done(mgr, mgr->sessions, 0);
+	}
+
+	while ((pkt = dequeue_packet(&mgr->pool.q)))
+		free(pkt);
+
+	close(mgr->epoll_fd);
+	free(mgr->heap);
+	free(mgr);
+}
+
+#else /* !HAVE_EPOLL */
+
+struct openconnect_session_mgr *openconnect_session_mgr_new(openconnect_session_done_vfn done,
+							    void *privdata)
+{
+	return NULL;
+}
+
+int openconnect_session_mgr_add(struct openconnect_session_mgr *mgr,
+				struct openconnect_info *vpninfo,
+				int reconnect_timeout, int reconnect_interval)
+{
+	return -EOPNOTSUPP;
+}
+
+int openconnect_session_mgr_run(struct openconnect_session_mgr *mgr, int timeout)
+{
+	return -EOPNOTSUPP;
+}
+
+void openconnect_session_mgr_free(struct openconnect_session_mgr *mgr)
+{
+}
+#endif
@@ -0,0 +1,798 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Where there's no tun device to be had (containers, CI runners), we can
+ * still be useful by running a local proxy instead. Clients connect to us
+ * with SOCKS5 (RFC1928) or HTTP CONNECT, and we make the connection they
+ * ask for through the tunnel, using the userspace stack in ustack.c.
+ * Names are resolved by asking the VPN's own DNS servers, through the
+ * tunnel likewise. */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SOCKS_MAX_CONNS	256
+#define SOCKS_BUFSIZE	16384
+
+#define DNS_TIMEOUT	2000
+#define DNS_TRIES	4
+#define DNS_A		1
+#define DNS_AAAA	28
+
+enum {
+	SOCKS_REQUEST,
+	SOCKS_RESOLVING,
+	SOCKS_CONNECTING,
+	SOCKS_RELAY,
+};
+
+struct socks_conn {
+	struct socks_conn *next;
+	int fd;
+	uint32_t epoll;
+	int state;
+	int http;	/* HTTP CONNECT, not SOCKS5 */
+	int greeted;	/* SOCKS5 method selection is done */
+	int replied;
+
+	char host[256];
+	int port;
+
+	struct ustack_sock *dns;
+	int dns_type, dns_tries;
+	uint16_t dns_id;
+	long long dns_due;
+
+	struct ustack_sock *tcp;
+	int client_eof, remote_eof;
+
+	/* The request from the client, and then data on its way to it */
+	unsigned char buf[SOCKS_BUFSIZE];
+	int buflen, bufoff;
+};
+
+struct socks_proxy {
+	int listen_fd;
+	uint32_t listen_epoll;
+	struct socks_conn *conns;
+	int nr_conns;
+};
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/* Split "[ADDR:]PORT" into its parts, which the caller must free */
+int socks_parse_listen(const char *str, char **host, char **port)
+{
+	const char *p;
+	char *end;
+	long nr;
+
+	if (str[0] == '[') {
+		p = strchr(str, ']');
+		if (!p || p[1] != ':')
+			return -EINVAL;
+		*host = strndup(str + 1, p - str - 1);
+		p += 2;
+	} else if ((p = strrchr(str, ':'))) {
+		*host = strndup(str, p - str);
+		p++;
+	} else {
+		/* Not listening on the outside unless asked to */
+		*host = strdup("127.0.0.1");
+		p = str;
+	}
+
+	nr = strtol(p, &end, 10);
+	if (!*host || !*p || *end || nr < 1 || nr > 65535) {
+		free(*host);
+		*host = NULL;
+		return -EINVAL;
+	}
+
+	*port = strdup(p);
+	if (!*port) {
+		free(*host);
+		*host = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void socks_monitor(struct openconnect_info *vpninfo, int fd, int rd, int wr)
+{
+	if (rd)
+		__monitor_fd_event(vpninfo, fd, &vpninfo->_select_rfds);
+	else
+		__unmonitor_fd_event(vpninfo, fd, &vpninfo->_select_rfds);
+	if (wr)
+		__monitor_fd_event(vpninfo, fd, &vpninfo->_select_wfds);
+	else
+		__unmonitor_fd_event(vpninfo, fd, &vpninfo->_select_wfds);
+}
+
+static void socks_unmonitor(struct openconnect_info *vpninfo, int fd)
+{
+	socks_monitor(vpninfo, fd, 0, 0);
+#ifdef HAVE_EPOLL
+	__remove_epoll_fd(vpninfo, fd);
+#endif
+}
+
+static int socks_write(struct socks_conn *c, const void *buf, int len)
+{
+	c->replied = 1;
+	return send(c->fd, buf, len, MSG_NOSIGNAL) == len ? 0 : -EIO;
+}
+
+/* Tell the client how it went, in whichever protocol it's speaking */
+static int socks_reply(struct socks_conn *c, int err)
+{
+	char buf[64];
+
+	if (c->http) {
+		const char *status;
+
+		switch (err) {
+		case 0:			status = "200 Connection established"; break;
+		case -EINVAL:		status = "400 Bad Request"; break;
+		case -EOPNOTSUPP:	status = "405 Method Not Allowed"; break;
+		case -ETIMEDOUT:	status = "504 Gateway Timeout"; break;
+		default:		status = "502 Bad Gateway"; break;
+		}
+		snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\n\r\n", status);
+		return socks_write(c, buf, strlen(buf));
+	}
+
+	/* RFC1928 §6, with a bound address of 0.0.0.0:0 */
+	memset(buf, 0, 10);
+	buf[0] = 5;
+	buf[3] = 1;
+	switch (err) {
+	case 0:			buf[1] = 0; break;
+	case -ECONNREFUSED:	buf[1] = 5; break;
+	case -ENETUNREACH:	buf[1] = 3; break;
+	case -ETIMEDOUT:
+	case -ENOENT:
+	case -ENODATA:		buf[1] = 4; break;
+	case -EOPNOTSUPP:	buf[1] = 7; break;
+	case -EADDRNOTAVAIL:	buf[1] = 8; break;
+	default:		buf[1] = 1; break;
+	}
+	return socks_write(c, buf, 10);
+}
+
+static void socks_consume(struct socks_conn *c, int len)
+{
+	memmove(c->buf, c->buf + len, c->buflen - len);
+	c->buflen -= len;
+}
+
+/* These return 1 when the request is complete, 0 if there's more to come,
+ * or a negative error. */
+static int socks5_parse(struct openconnect_info *vpninfo, struct socks_conn *c)
+{
+	unsigned char *p = c->buf;
+	int len;
+
+	if (!c->greeted) {
+		if (c->buflen < 2 || c->buflen < 2 + p[1])
+			return 0;
+		/* We only do "no authentication required" */
+		if (!memchr(p + 2, 0, p[1])) {
+			socks_write(c, "\x05\xff", 2);
+			return -EPERM;
+		}
+		if (socks_write(c, "\x05\x00", 2))
+			return -EIO;
+		c->replied = 0;
+		socks_consume(c, 2 + p[1]);
+		c->greeted = 1;
+	}
+
+	if (c->buflen < 5)
+		return 0;
+	if (p[0] != 5)
+		return -EINVAL;
+	if (p[1] != 1) /* CONNECT */
+		return -EOPNOTSUPP;
+
+	switch (p[3]) {
+	case 1:
+		len = 8;
+		if (c->buflen < len + 2)
+			return 0;
+		inet_ntop(AF_INET, p + 4, c->host, sizeof(c->host));
+		break;
+	case 3:
+		len = 5 + p[4];
+		if (c->buflen < len + 2)
+			return 0;
+		memcpy(c->host, p + 5, p[4]);
+		c->host[p[4]] = 0;
+		break;
+	case 4:
+		len = 20;
+		if (c->buflen < len + 2)
+			return 0;
+		inet_ntop(AF_INET6, p + 4, c->host, sizeof(c->host));
+		break;
+	default:
+		return -EADDRNOTAVAIL;
+	}
+
+	c->port = load_be16(p + len);
+	socks_consume(c, len + 2);
+	return 1;
+}
+
+static int http_parse(struct openconnect_info *vpninfo, struct socks_conn *c)
+{
+	char *req = (char *)c->buf, *host, *port, *p, *end;
+	int i;
+	long nr;
+
+	for (i = 0; i + 4 <= c->buflen; i++)
+		if (!memcmp(req + i, "\r\n\r\n", 4))
+			break;
+	if (i + 4 > c->buflen)
+		return c->buflen == sizeof(c->buf) ? -EINVAL : 0;
+	req[i] = 0;
+
+	p = strchr(req, '\r');
+	if (p)
+		*p = 0;
+	if (strncmp(req, "CONNECT ", 8))
+		return -EOPNOTSUPP;
+
+	host = req + 8;
+	p = strchr(host, ' ');
+	if (!p)
+		return -EINVAL;
+	*p = 0;
+
+	if (host[0] == '[') {
+		p = strchr(host, ']');
+		if (!p || p[1] != ':')
+			return -EINVAL;
+		*p = 0;
+		host++;
+		port = p + 2;
+	} else {
+		port = strrchr(host, ':');
+		if (!port)
+			return -EINVAL;
+		*(port++) = 0;
+	}
+
+	nr = strtol(port, &end, 10);
+	if (!*port || *end || nr < 1 || nr > 65535 || strlen(host) >= sizeof(c->host))
+		return -EINVAL;
+
+	strcpy(c->host, host);
+	c->port = nr;
+	socks_consume(c, i + 4);
+	return 1;
+}
+
+static int dns_send(struct openconnect_info *vpninfo, struct socks_conn *c)
+{
+	unsigned char q[12 + 256 + 4], addr[16], *p;
+	const char *label, *dot, *server;
+	int nr_servers, family, len, ret;
+
+	for (nr_servers = 0; nr_servers < 3 && vpninfo->ip_info.dns[nr_servers]; nr_servers++)
+		;
+	if (!nr_servers)
+		return -ENOENT;
+
+	server = vpninfo->ip_info.dns[c->dns_tries % nr_servers];
+	family = strchr(server, ':') ? AF_INET6 : AF_INET;
+	if (inet_pton(family, server, addr) <= 0)
+		return -ENOENT;
+
+	/* A fresh port and ID each time; never mind what's still in flight */
+	if (c->dns)
+		ustack_abort(vpninfo, c->dns);
+	c->dns = NULL;
+	ret = ustack_udp_open(vpninfo, family, addr, 53, &c->dns);
+	if (ret)
+		return ret;
+
+	openconnect_random(&c->dns_id, sizeof(c->dns_id));
+	memset(q, 0, 12);
+	store_be16(q, c->dns_id);
+	store_be16(q + 2, 0x0100); /* RD */
+	store_be16(q + 4, 1);
+
+	p = q + 12;
+	for (label = c->host; *label; label = dot + 1) {
+		dot = strchr(label, '.');
+		if (!dot)
+			dot = label + strlen(label);
+		len = dot - label;
+		if (!len || len > 63 || p + len + 6 > q + sizeof(q))
+			return -ENOENT;
+		*(p++) = len;
+		memcpy(p, label, len);
+		p += len;
+		if (!*dot)
+			break;
+	}
+	*(p++) = 0;
+	store_be16(p, c->dns_type);
+	store_be16(p + 2, 1); /* IN */
+	p += 4;
+
+	c->dns_due = now_ms() + DNS_TIMEOUT;
+	ret = ustack_send(vpninfo, c->dns, q, p - q);
+	/* If the queue was full, the retry will deal with it */
+	return ret == -EAGAIN ? 0 : MIN(ret, 0);
+}
+
+/* Returns 1 with @addr filled in, 0 if the response wasn't for us, or
+ * a negative error. */
+static int dns_parse(struct socks_conn *c, const unsigned char *p, int len,
+		     unsigned char *addr)
+{
+	int off = 12, qd, an, type, rdlen, i;
+
+	if (len < 12 || load_be16(p) != c->dns_id || !(p[2] & 0x80))
+		return 0;
+	if ((p[3] & 0xf) == 3) /* NXDOMAIN */
+		return -ENOENT;
+	if (p[3] & 0xf)
+		return -EIO;
+
+	qd = load_be16(p + 4);
+	an = load_be16(p + 6);
+
+	for (i = 0; i < qd; i++) {
+		off = dns_skip_name(p, len, off);
+		if (off < 0 || off + 4 > len)
+			return -EIO;
+		off += 4;
+	}
+
+	for (i = 0; i < an; i++) {
+		off = dns_skip_name(p, len, off);
+		if (off < 0 || off + 10 > len)
+			return -EIO;
+		type = load_be16(p + off);
+		rdlen = load_be16(p + off + 8);
+		off += 10;
+		if (off + rdlen > len)
+			return -EIO;
+
+		/* Skipping any CNAMEs along the way */
+		if (type == c->dns_type && load_be16(p + off - 8) == 1 &&
+		    rdlen == (type == DNS_A ? 4 : 16)) {
+			memcpy(addr, p + off, rdlen);
+			return 1;
+		}
+		off += rdlen;
+	}
+
+	return -ENODATA;
+}
+
+static int socks_connect(struct openconnect_info *vpninfo, struct socks_conn *c,
+			 int family, const unsigned char *addr)
+{
+	char abuf[INET6_ADDRSTRLEN];
+
+	if (c->dns) {
+		ustack_abort(vpninfo, c->dns);
+		c->dns = NULL;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG, _("SOCKS: connecting to %s port %d\n"),
+		     inet_ntop(family, addr, abuf, sizeof(abuf)), c->port);
+
+	c->state = SOCKS_CONNECTING;
+	return ustack_tcp_connect(vpninfo, family, addr, c->port, &c->tcp);
+}
+
+static int socks_resolve(struct openconnect_info *vpninfo, struct socks_conn *c)
+{
+	unsigned char addr[16];
+
+	if (inet_pton(AF_INET, c->host, addr) > 0)
+		return socks_connect(vpninfo, c, AF_INET, addr);
+	if (inet_pton(AF_INET6, c->host, addr) > 0)
+		return socks_connect(vpninfo, c, AF_INET6, addr);
+
+	vpn_progress(vpninfo, PRG_DEBUG, _("SOCKS: looking up %s\n"), c->host);
+
+	c->state = SOCKS_RESOLVING;
+	c->dns_type = vpninfo->ip_info.addr ? DNS_A : DNS_AAAA;
+	c->dns_tries = 0;
+	return dns_send(vpninfo, c);
+}
+
+static int socks_dns_poll(struct openconnect_info *vpninfo, struct socks_conn *c)
+{
+	unsigned char resp[1500], addr[16];
+	int ret;
+
+	while ((ret = ustack_recv(vpninfo, c->dns, resp, sizeof(resp))) > 0) {
+		ret = dns_parse(c, resp, ret, addr);
+		if (ret > 0)
+			return socks_connect(vpninfo, c,
+					     c->dns_type == DNS_A ? AF_INET : AF_INET6, addr);
+
+		/* No IPv4 address? Try IPv6 if we have it */
+		if (ret == -ENODATA && c->dns_type == DNS_A &&
+		    (vpninfo->ip_info.addr6 || vpninfo->ip_info.netmask6)) {
+			c->dns_type = DNS_AAAA;
+			c->dns_tries = 0;
+			return dns_send(vpninfo, c);
+		}
+		if (ret < 0)
+			return ret;
+	}
+
+	if (now_ms() >= c->dns_due) {
+		if (++c->dns_tries >= DNS_TRIES)
+			return -ETIMEDOUT;
+		return dns_send(vpninfo, c);
+	}
+
+	return 0;
+}
+
+static int socks_relay(struct openconnect_info *vpninfo, struct socks_conn *c)
+{
+	unsigned char buf[SOCKS_BUFSIZE];
+	int work_done = 0, space, ret;
+
+	/* From the VPN to the client */
+	while (!c->remote_eof) {
+		if (c->bufoff == c->buflen) {
+			ret = ustack_recv(vpninfo, c->tcp, c->buf, sizeof(c->buf));
+			if (ret == -EAGAIN)
+				break;
+			if (ret < 0)
+				return ret;
+			if (!ret) {
+				shutdown(c->fd, SHUT_WR);
+				c->remote_eof = 1;
+				work_done = 1;
+				break;
+			}
+			c->buflen = ret;
+			c->bufoff = 0;
+		}
+		ret = send(c->fd, c->buf + c->bufoff, c->buflen - c->bufoff, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+		c->bufoff += ret;
+		work_done = 1;
+	}
+
+	/* And from the client to the VPN */
+	while (!c->client_eof && (space = ustack_sndspace(c->tcp)) > 0) {
+		ret = recv(c->fd, buf, MIN(space, SOCKS_BUFSIZE), 0);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+		if (!ret) {
+			ustack_shutdown(c->tcp);
+			c->client_eof = 1;
+		} else
+			ustack_send(vpninfo, c->tcp, buf, ret);
+		work_done = 1;
+	}
+
+	/* Reset after the remote end had finished sending */
+	ret = ustack_connected(c->tcp);
+	if (ret < 0 && c->bufoff == c->buflen)
+		return ret;
+
+	return work_done;
+}
+
+/* Returns whether anything happened, or a negative error */
+static int socks_conn_process(struct openconnect_info *vpninfo, struct socks_conn *c)
+{
+	int work_done = 0, ret;
+
+	if (c->state == SOCKS_REQUEST) {
+		ret = recv(c->fd, c->buf + c->buflen, sizeof(c->buf) - c->buflen, 0);
+		if (ret < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+		if (!ret)
+			return -ECONNRESET;
+		c->buflen += ret;
+		work_done = 1;
+
+		if (c->buf[0] == 5) {
+			ret = socks5_parse(vpninfo, c);
+		} else {
+			c->http = 1;
+			ret = http_parse(vpninfo, c);
+		}
+		if (ret <= 0)
+			return ret ? : work_done;
+
+		ret = socks_resolve(vpninfo, c);
+		if (ret)
+			return ret;
+	}
+
+	if (c->state == SOCKS_RESOLVING) {
+		ret = socks_dns_poll(vpninfo, c);
+		if (ret)
+			return ret;
+	}
+
+	if (c->state == SOCKS_CONNECTING) {
+		ret = ustack_connected(c->tcp);
+		if (ret <= 0)
+			return ret;
+
+		if (socks_reply(c, 0))
+			return -EIO;
+
+		/* Anything the client sent after its request */
+		if (c->buflen)
+			ustack_send(vpninfo, c->tcp, c->buf, c->buflen);
+		c->buflen = c->bufoff = 0;
+		c->state = SOCKS_RELAY;
+		work_done = 1;
+	}
+
+	if (c->state != SOCKS_RELAY)
+		return work_done;
+
+	ret = socks_relay(vpninfo, c);
+	if (ret < 0)
+		return ret;
+	return work_done | ret;
+}
+
+static void socks_conn_free(struct openconnect_info *vpninfo, struct socks_conn *c, int err)
+{
+	if (err < 0) {
+		vpn_progress(vpninfo, PRG_DEBUG, _("SOCKS: connection to %s port %d failed: %s\n"),
+			     c->host[0] ? c->host : "?", c->port, strerror(-err));
+		if (!c->replied)
+			socks_reply(c, err);
+	}
+
+	if (c->dns)
+		ustack_abort(vpninfo, c->dns);
+	if (c->tcp) {
+		if (err < 0)
+			ustack_abort(vpninfo, c->tcp);
+		else
+			ustack_close(vpninfo, c->tcp);
+	}
+
+	socks_unmonitor(vpninfo, c->fd);
+	close(c->fd);
+	free(c);
+	vpninfo->socks->nr_conns--;
+}
+
+static void socks_accept(struct openconnect_info *vpninfo)
+{
+	struct socks_proxy *sp = vpninfo->socks;
+	struct socks_conn *c;
+	int fd;
+
+	while (sp->nr_conns < SOCKS_MAX_CONNS) {
+		fd = accept(sp->listen_fd, NULL, NULL);
+		if (fd < 0)
+			break;
+
+		/* We might end up on select() */
+		if (fd >= FD_SETSIZE || set_sock_nonblock(fd)) {
+			close(fd);
+			continue;
+		}
+		set_fd_cloexec(fd);
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			break;
+		}
+		c->fd = fd;
+		c->next = sp->conns;
+		sp->conns = c;
+		sp->nr_conns++;
+		__monitor_fd_new(vpninfo, fd);
+	}
+
+	/* Leave the rest in the backlog until there's room */
+	socks_monitor(vpninfo, sp->listen_fd, sp->nr_conns < SOCKS_MAX_CONNS, 0);
+}
+
+int socks_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct socks_proxy *sp = vpninfo->socks;
+	struct socks_conn *c, **cp;
+	struct pkt *this;
+	long long now;
+	int work_done = 0, ret;
+
+	/* Everything from the VPN goes to the stack, instead of a tun device */
+	while ((this = dequeue_packet(&vpninfo->incoming_queue))) {
+		vpninfo->stats.rx_pkts++;
+		vpninfo->stats.rx_bytes += this->len;
+		ustack_input(vpninfo, this);
+	}
+
+	socks_accept(vpninfo);
+
+	now = now_ms();
+	for (cp = &sp->conns; (c = *cp); ) {
+		ret = socks_conn_process(vpninfo, c);
+		if (ret < 0 || (c->client_eof && c->remote_eof && c->bufoff == c->buflen)) {
+			*cp = c->next;
+			socks_conn_free(vpninfo, c, ret);
+			work_done = 1;
+			continue;
+		}
+		work_done |= ret;
+
+		switch (c->state) {
+		case SOCKS_REQUEST:
+			socks_monitor(vpninfo, c->fd, 1, 0);
+			break;
+		case SOCKS_RESOLVING:
+			socks_monitor(vpninfo, c->fd, 0, 0);
+			if (c->dns_due - now < *timeout)
+				*timeout = MAX(c->dns_due - now, 0);
+			break;
+		case SOCKS_CONNECTING:
+			socks_monitor(vpninfo, c->fd, 0, 0);
+			break;
+		case SOCKS_RELAY:
+			socks_monitor(vpninfo, c->fd,
+				      !c->client_eof && ustack_sndspace(c->tcp) > 0,
+				      c->bufoff < c->buflen);
+			break;
+		}
+		cp = &c->next;
+	}
+
+	work_done |= ustack_mainloop(vpninfo, timeout);
+	return work_done;
+}
+
+#ifdef HAVE_EPOLL
+void socks_update_epoll(struct openconnect_info *vpninfo)
+{
+	struct socks_proxy *sp = vpninfo->socks;
+	struct socks_conn *c;
+
+	__sync_epoll_fd(vpninfo, sp->listen_fd, &sp->listen_epoll);
+	for (c = sp->conns; c; c = c->next)
+		__sync_epoll_fd(vpninfo, c->fd, &c->epoll);
+}
+#endif
+
+int socks_setup(struct openconnect_info *vpninfo)
+{
+	struct addrinfo hints, *res = NULL;
+	struct socks_proxy *sp;
+	char *host = NULL, *port = NULL;
+	int fd = -1, one = 1, ret;
+
+	ret = socks_parse_listen(vpninfo->socks_listen, &host, &port);
+	if (ret)
+		return ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to look up SOCKS listen address '%s': %s\n"),
+			     host, gai_strerror(ret));
+		ret = -EINVAL;
+		goto out;
+	}
+
+	fd = socket(res->ai_family, SOCK_STREAM, 0);
+	if (fd < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 16) ||
+	    set_sock_nonblock(fd)) {
+		ret = -errno;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to listen for SOCKS clients on %s: %s\n"),
+			     vpninfo->socks_listen, strerror(errno));
+		goto out;
+	}
+	set_fd_cloexec(fd);
+
+	ret = ustack_init(vpninfo);
+	if (ret)
+		goto out;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	sp->listen_fd = fd;
+	fd = -1;
+	vpninfo->socks = sp;
+
+	__monitor_fd_new(vpninfo, sp->listen_fd);
+	socks_monitor(vpninfo, sp->listen_fd, 1, 0);
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("SOCKS5 and HTTP CONNECT proxy listening on %s\n"),
+		     vpninfo->socks_listen);
+ out:
+	if (fd >= 0)
+		close(fd);
+	if (res)
+		freeaddrinfo(res);
+	free(host);
+	free(port);
+	return ret;
+}
+
+void socks_free(struct openconnect_info *vpninfo)
+{
+	struct socks_proxy *sp = vpninfo->socks;
+	struct socks_conn *c;
+
+	if (!sp)
+		return;
+
+	while ((c = sp->conns)) {
+		sp->conns = c->next;
+		socks_conn_free(vpninfo, c, 0);
+	}
+	socks_unmonitor(vpninfo, sp->listen_fd);
+	close(sp->listen_fd);
+	free(sp);
+	vpninfo->socks = NULL;
+
+	ustack_free(vpninfo);
+}
@@ -0,0 +1,440 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* When the server gives us split includes, it isn't going to route
+ * anything else for us. Packets for other destinations can still turn
+ * up on the tun device though, if the routing was done by something
+ * other than vpnc-script or if the user added routes of their own, and
+ * we'd encrypt and send them only for the server to drop them.
+ *
+ * With enforcement enabled, we look up the destination of each packet
+ * read from the tun device in a path-compressed binary (PATRICIA) trie
+ * of the includes and excludes for its address family. The most specific
+ * match wins, just as it does for the routes. A packet which doesn't end
+ * up in an include is dropped, and an ICMP error is sent back to tell the
+ * sender so. Address families for which there are no split includes are
+ * not filtered at all. */
+
+#define SPLIT_NONE	0
+#define SPLIT_INCLUDE	1
+#define SPLIT_EXCLUDE	2
+
+/* Keys are held as host-order 32-bit words, so that IPv4 lookups are a
+ * single masked comparison at each node. */
+struct lpm_node {
+	uint32_t key[4];
+	uint8_t plen;
+	uint8_t verdict;
+	int32_t child[2];
+};
+
+struct lpm_trie {
+	struct lpm_node *nodes;
+	int nr, alloc;
+	int root;
+	int bits;
+};
+
+struct split_filter {
+	struct lpm_trie v4, v6;
+};
+
+static inline int key_bit(const uint32_t *key, int bit)
+{
+	return (key[bit >> 5] >> (31 - (bit & 31))) & 1;
+}
+
+/* The number of leading bits that @a and @b have in common, up to @max */
+static inline int common_bits(const uint32_t *a, const uint32_t *b, int max)
+{
+	int i;
+
+	for (i = 0; i * 32 < max; i++) {
+		uint32_t diff = a[i] ^ b[i];
+
+		if (diff) {
+			int bits = i * 32;
+
+			while (!(diff & 0x80000000)) {
+				diff <<= 1;
+				bits++;
+			}
+			return MIN(bits, max);
+		}
+	}
+	return max;
+}
+
+static inline int prefix_match(const uint32_t *prefix, const uint32_t *key, int plen)
+{
+	int i;
+
+	for (i = 0; i < plen / 32; i++)
+		if (prefix[i] != key[i])
+			return 0;
+
+	return !(plen & 31) || !((prefix[i] ^ key[i]) >> (32 - (plen & 31)));
+}
+
+static int lpm_new_node(struct lpm_trie *t, const uint32_t *key,
+			int plen, int verdict)
+{
+	struct lpm_node *n = &t->nodes[t->nr];
+	int i;
+
+	memset(n, 0, sizeof(*n));
+	for (i = 0; i * 32 < plen; i++)
+		n->key[i] = key[i];
+	if (plen & 31)
+		n->key[plen / 32] &= ~0U << (32 - (plen & 31));
+	n->plen = plen;
+	n->verdict = verdict;
+	n->child[0] = n->child[1] = -1;
+
+	return t->nr++;
+}
+
+static int lpm_insert(struct lpm_trie *t, const uint32_t *key,
+		      int plen, int verdict)
+{
+	int32_t *slot = &t->root;
+
+	/* An insertion adds at most two nodes. Make room up front so
+	 * that @slot can't be left pointing into the old array. */
+	if (t->nr + 2 > t->alloc) {
+		int alloc = t->alloc ? t->alloc * 2 : 64;
+		struct lpm_node *new = realloc(t->nodes, alloc * sizeof(*new));
+
+		if (!new)
+			return -ENOMEM;
+		t->nodes = new;
+		t->alloc = alloc;
+	}
+
+	while (*slot != -1) {
+		struct lpm_node *n = &t->nodes[*slot];
+		int common = common_bits(n->key, key, MIN(n->plen, plen));
+
+		if (common < n->plen) {
+			/* Diverges part way along this node's prefix. Put
+			 * a new node in its place at the branch point. */
+			int idx = lpm_new_node(t, key, common,
+					       common == plen ? verdict : SPLIT_NONE);
+			struct lpm_node *mid = &t->nodes[idx];
+
+			mid->child[key_bit(n->key, common)] = *slot;
+			if (common < plen)
+				mid->child[key_bit(key, common)] =
+					lpm_new_node(t, key, plen, verdict);
+			*slot = idx;
+			return 0;
+		}
+
+		if (n->plen == plen) {
+			/* If the server both includes and excludes the same
+			 * prefix, believe the exclude. */
+			if (n->verdict != SPLIT_EXCLUDE)
+				n->verdict = verdict;
+			return 0;
+		}
+
+		slot = &n->child[key_bit(key, n->plen)];
+	}
+
+	*slot = lpm_new_node(t, key, plen, verdict);
+	return 0;
+}
+
+static int lpm_lookup(const struct lpm_trie *t, const uint32_t *key)
+{
+	int verdict = SPLIT_NONE;
+	int idx = t->root;
+
+	while (idx != -1) {
+		const struct lpm_node *n = &t->nodes[idx];
+
+		if (!prefix_match(n->key, key, n->plen))
+			break;
+		if (n->verdict)
+			verdict = n->verdict;
+		if (n->plen == t->bits)
+			break;
+		idx = n->child[key_bit(key, n->plen)];
+	}
+
+	return verdict;
+}
+
+static void load_key(uint32_t *key, const unsigned char *addr, int bits)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		key[i] = i * 32 < bits ? load_be32(addr + i * 4) : 0;
+}
+
+/* Parse "addr", "addr/len" or "addr/mask" for either family */
+static int parse_prefix(const char *str, uint32_t *key, int *plen)
+{
+	char tmp[INET6_ADDRSTRLEN + 5], *slash, *end;
+	unsigned char addr[16];
+	uint32_t mask[4];
+	int family, bits, i;
+	long len;
+
+	if (strlen(str) >= sizeof(tmp))
+		return -EINVAL;
+	strcpy(tmp, str);
+
+	slash = strchr(tmp, '/');
+	if (slash)
+		*(slash++) = 0;
+
+	family = strchr(tmp, ':') ? AF_INET6 : AF_INET;
+	bits = family == AF_INET6 ? 128 : 32;
+	if (inet_pton(family, tmp, addr) <= 0)
+		return -EINVAL;
+	load_key(key, addr, bits);
+
+	if (!slash) {
+		len = bits;
+	} else if ((len = strtol(slash, &end, 10)) >= 0 && end != slash &&
+		   (!*end || isspace((unsigned char)*end))) {
+		if (len > bits)
+			return -EINVAL;
+	} else if (inet_pton(family, slash, addr) > 0) {
+		/* Contiguous masks only */
+		load_key(mask, addr, bits);
+		for (len = 0; len < bits && key_bit(mask, len); len++)
+			;
+		for (i = len; i < bits; i++)
+			if (key_bit(mask, i))
+				return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+
+	*plen = len;
+	return family;
+}
+
+static int split_add(struct split_filter *sf, const char *str, int verdict)
+{
+	uint32_t key[4];
+	int plen, family;
+
+	family = parse_prefix(str, key, &plen);
+	if (family < 0)
+		return family;
+
+	return lpm_insert(family == AF_INET6 ? &sf->v6 : &sf->v4,
+			  key, plen, verdict);
+}
+
+static int split_add_list(struct split_filter *sf, struct oc_split_include *list,
+			  int verdict)
+{
+	int ret;
+
+	for (; list; list = list->next) {
+		ret = split_add(sf, list->route, verdict);
+		if (ret == -ENOMEM)
+			return ret;
+	}
+	return 0;
+}
+
+static void lpm_free(struct lpm_trie *t)
+{
+	free(t->nodes);
+	t->nodes = NULL;
+	t->nr = t->alloc = 0;
+	t->root = -1;
+}
+
+void split_filter_free(struct openconnect_info *vpninfo)
+{
+	struct split_filter *sf = vpninfo->split_filter;
+
+	if (!sf)
+		return;
+
+	lpm_free(&sf->v4);
+	lpm_free(&sf->v6);
+	free(sf);
+	vpninfo->split_filter = NULL;
+}
+
+/* Called whenever the IP configuration is (re)installed */
+int split_filter_build(struct openconnect_info *vpninfo)
+{
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct split_filter *sf;
+	char buf[64];
+	int has_v4, has_v6, i, ret;
+
+	split_filter_free(vpninfo);
+
+	if (!vpninfo->enforce_split || !ip->split_includes)
+		return 0;
+
+	sf = calloc(1, sizeof(*sf));
+	if (!sf)
+		return -ENOMEM;
+	sf->v4.root = sf->v6.root = -1;
+	sf->v4.bits = 32;
+	sf->v6.bits = 128;
+
+	ret = split_add_list(sf, ip->split_includes, SPLIT_INCLUDE);
+	if (ret)
+		goto err;
+	has_v4 = sf->v4.nr;
+	has_v6 = sf->v6.nr;
+
+	/* The VPN's own subnet, and the DNS and WINS servers it gave us, are
+	 * reachable even if the server didn't list them. */
+	if (ip->addr && ip->netmask) {
+		snprintf(buf, sizeof(buf), "%s/%s", ip->addr, ip->netmask);
+		split_add(sf, buf, SPLIT_INCLUDE);
+	}
+	if (ip->netmask6)
+		split_add(sf, ip->netmask6, SPLIT_INCLUDE);
+	for (i = 0; i < 3; i++) {
+		if (ip->dns[i])
+			split_add(sf, ip->dns[i], SPLIT_INCLUDE);
+		if (ip->nbns[i])
+			split_add(sf, ip->nbns[i], SPLIT_INCLUDE);
+	}
+
+	ret = split_add_list(sf, ip->split_excludes, SPLIT_EXCLUDE);
+	if (ret)
+		goto err;
+
+	/* Families with no split includes aren't filtered */
+	if (!has_v4)
+		lpm_free(&sf->v4);
+	if (!has_v6)
+		lpm_free(&sf->v6);
+
+	if (sf->v4.root == -1 && sf->v6.root == -1) {
+		free(sf);
+		return 0;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Enforcing split tunnel for%s%s\n"),
+		     sf->v4.root != -1 ? " IPv4" : "",
+		     sf->v6.root != -1 ? " IPv6" : "");
+	vpninfo->split_filter = sf;
+	return 0;
+
+ err:
+	lpm_free(&sf->v4);
+	lpm_free(&sf->v6);
+	free(sf);
+	return ret;
+}
+
+/* Called for each packet read from the tun device, when there is a
+ * filter in place. Returns 1 if the packet should be dropped. */
+int split_filter_drop(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	struct split_filter *sf = vpninfo->split_filter;
+	const struct lpm_trie *t;
+	uint32_t dst[4];
+
+	if (pkt->len >= 20 && (pkt->data[0] >> 4) == 4)
+		t = &sf->v4;
+	else if (pkt->len >= 40 && (pkt->data[0] >> 4) == 6)
+		t = &sf->v6;
+	else
+		return 0;
+
+	if (t->root == -1)
+		return 0;
+
+	load_key(dst, pkt->data + (t->bits == 32 ? 16 : 24), t->bits);
+	if (lpm_lookup(t, dst) == SPLIT_INCLUDE)
+		return 0;
+
+	vpninfo->stats.tx_filtered_pkts++;
+	vpninfo->stats.tx_filtered_bytes += pkt->len;
+	icmp_prohibited(vpninfo, pkt);
+	return 1;
+}
+
+/* Would the routes for the VPN send @sa through it? That's the split
+ * includes, or a default route for a family which has an address in the
+ * VPN, less the split excludes; as netcfg.c and vpnc-script set them up. */
+int split_routes_addr(struct openconnect_info *vpninfo, const struct sockaddr *sa)
+{
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct oc_split_include *l;
+	uint32_t addr[4], key[4];
+	int family = sa->sa_family, plen, best = -1, verdict = SPLIT_NONE;
+	int has_inc = 0;
+	char buf[64];
+
+	if (family == AF_INET && ip->addr)
+		load_key(addr, (void *)&((struct sockaddr_in *)sa)->sin_addr, 32);
+	else if (family == AF_INET6 && (ip->addr6 || ip->netmask6))
+		load_key(addr, (void *)&((struct sockaddr_in6 *)sa)->sin6_addr, 128);
+	else
+		return 0;
+
+	for (l = ip->split_includes; l; l = l->next) {
+		if (parse_prefix(l->route, key, &plen) != family)
+			continue;
+		has_inc = 1;
+		if (plen > best && prefix_match(key, addr, plen)) {
+			best = plen;
+			verdict = SPLIT_INCLUDE;
+		}
+	}
+	if (!has_inc) {
+		best = 0;
+		verdict = SPLIT_INCLUDE;
+	}
+	if (family == AF_INET && ip->netmask) {
+		snprintf(buf, sizeof(buf), "%s/%s", ip->addr, ip->netmask);
+		if (parse_prefix(buf, key, &plen) == family && plen > best &&
+		    prefix_match(key, addr, plen)) {
+			best = plen;
+			verdict = SPLIT_INCLUDE;
+		}
+	}
+
+	/* The most specific wins, and an exclude beats an equal include */
+	for (l = ip->split_excludes; l; l = l->next) {
+		if (parse_prefix(l->route, key, &plen) == family && plen >= best &&
+		    prefix_match(key, addr, plen)) {
+			best = plen;
+			verdict = SPLIT_EXCLUDE;
+		}
+	}
+
+	return verdict == SPLIT_INCLUDE;
+}
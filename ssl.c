@@ -81,15 +81,9 @@ static inline int connect_pending(void)
  * negative value, that's a normal errno and should be handled with
  * strerror(). No, you can't just pass the latter value (negated) to
  * openconnect__win32_strerror() because it gives nonsense results. */
-static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
-			       const struct sockaddr *addr, socklen_t addrlen)
+static int start_connect(struct openconnect_info *vpninfo, int sockfd,
+			 const struct sockaddr *addr, socklen_t addrlen)
 {
-	struct sockaddr_storage peer;
-	socklen_t peerlen = sizeof(peer);
-	fd_set wr_set, rd_set, ex_set;
-	int maxfd = sockfd;
-	int err;
-
 	if (set_sock_nonblock(sockfd))
 		goto sockerr;
 
@@ -104,28 +98,15 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 		return -errno;
 #endif
 	}
+	return 0;
+}
 
-	do {
-		FD_ZERO(&wr_set);
-		FD_ZERO(&rd_set);
-		FD_ZERO(&ex_set);
-		FD_SET(sockfd, &wr_set);
-#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
-		FD_SET(sockfd, &ex_set);
-#endif
-		cmd_fd_set(vpninfo, &rd_set, &maxfd);
-		if (select(maxfd + 1, &rd_set, &wr_set, &ex_set, NULL) < 0 &&
-		    errno != EINTR) {
-			vpn_perror(vpninfo, _("Failed select() for socket connect"));
-			return -EIO;
-		}
-
-		if (is_cancel_pending(vpninfo, &rd_set)) {
-			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
-			return -EINTR;
-		}
-	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
-		 !vpninfo->got_pause_cmd);
+/* Once select() says it's done, did it work? */
+static int connect_result(int sockfd)
+{
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	int err;
 
 	/* Check whether connect() succeeded or failed by using
 	   getpeername(). See https://cr.yp.to/docs/connect.html */
@@ -156,6 +137,42 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 	return err;
 }
 
+static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
+			       const struct sockaddr *addr, socklen_t addrlen)
+{
+	fd_set wr_set, rd_set, ex_set;
+	int maxfd = sockfd;
+	int err;
+
+	err = start_connect(vpninfo, sockfd, addr, addrlen);
+	if (err)
+		return err;
+
+	do {
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		FD_SET(sockfd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+		FD_SET(sockfd, &ex_set);
+#endif
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		if (vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, &ex_set, NULL) < 0 &&
+		    errno != EINTR) {
+			vpn_perror(vpninfo, _("Failed select() for socket connect"));
+			return -EIO;
+		}
+
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			return -EINTR;
+		}
+	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
+		 !vpninfo->got_pause_cmd);
+
+	return connect_result(sockfd);
+}
+
 /* checks whether the provided string is an IP or a hostname.
  */
 unsigned string_is_hostname(const char *str)
@@ -204,11 +221,222 @@ static int set_tcp_nodelay(struct openconnect_info *vpninfo, int ssl_sock)
 }
 
 
+/* Happy Eyeballs (RFC 8305). Rather than waiting for each address in
+ * turn to fail, which can take over a minute when the path for one
+ * address family is broken, start on the next one if the last hasn't
+ * connected within CONNECT_ATTEMPT_DELAY, or as soon as it fails. The
+ * address families alternate, so a broken one costs only that delay.
+ * The first to connect wins, and the rest are closed. */
+#define CONNECT_ATTEMPT_DELAY	250	/* ms */
+#define MAX_CONNECT_ATTEMPTS	(ASYNC_MAX_WAIT - 1)	/* And the cmd_fd */
+
+struct connect_attempt {
+	struct addrinfo *rp;
+	int fd;
+	char host[80];
+};
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Alternate between address families, starting with whichever came
+ * first from getaddrinfo(). But the address which worked last time,
+ * if it's still there, goes before all of them. */
+static struct addrinfo **order_addrinfo(struct openconnect_info *vpninfo,
+					struct addrinfo *result, int *nr)
+{
+	struct addrinfo **addrs, **first, **other, *rp;
+	int n = 0, nr_first = 0, nr_other = 0, i = 0, j, k;
+
+	for (rp = result; rp; rp = rp->ai_next)
+		n++;
+
+	addrs = calloc(n * 3, sizeof(*addrs));
+	if (!addrs)
+		return NULL;
+	first = addrs + n;
+	other = addrs + n * 2;
+
+	for (rp = result; rp; rp = rp->ai_next) {
+		if (!i && vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
+		    match_sockaddr(vpninfo->peer_addr, rp->ai_addr))
+			addrs[i++] = rp;
+		else if (rp->ai_family == result->ai_family)
+			first[nr_first++] = rp;
+		else
+			other[nr_other++] = rp;
+	}
+
+	for (j = k = 0; j < nr_first || k < nr_other; ) {
+		if (j < nr_first)
+			addrs[i++] = first[j++];
+		if (k < nr_other)
+			addrs[i++] = other[k++];
+	}
+
+	*nr = i;
+	return addrs;
+}
+
+static void connect_failed(struct openconnect_info *vpninfo,
+			   struct connect_attempt *a, const char *port, int err)
+{
+	if (a->host[0]) {
+		char *errstr;
+#ifdef _WIN32
+		if (err > 0)
+			errstr = openconnect__win32_strerror(err);
+		else
+#endif
+			errstr = strerror(-err);
+
+		vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
+			     a->rp->ai_family == AF_INET6 ? "[" : "",
+			     a->host,
+			     a->rp->ai_family == AF_INET6 ? "]" : "",
+			     port, errstr);
+#ifdef _WIN32
+		if (err > 0)
+			free(errstr);
+#endif
+	}
+
+	/* If we're in DynDNS mode but this *was* the cached IP address,
+	 * don't bother falling back to it if it didn't work. */
+	if (vpninfo->peer_addr && vpninfo->peer_addrlen == a->rp->ai_addrlen &&
+	    match_sockaddr(vpninfo->peer_addr, a->rp->ai_addr)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Forgetting non-functional previous peer address\n"));
+		free(vpninfo->peer_addr);
+		vpninfo->peer_addr = 0;
+		vpninfo->peer_addrlen = 0;
+		free(vpninfo->ip_info.gateway_addr);
+		vpninfo->ip_info.gateway_addr = NULL;
+	}
+}
+
+/* Returns the connected socket, with the details of the winner in @won */
+static int happy_eyeballs(struct openconnect_info *vpninfo, struct addrinfo **addrs,
+			  int nr, const char *port, struct connect_attempt *won)
+{
+	struct connect_attempt att[MAX_CONNECT_ATTEMPTS];
+	long long now, next_at = 0;
+	int next = 0, nr_att = 0, i, err, ret = -EINVAL;
+
+	while (next < nr || nr_att) {
+		fd_set wr_set, rd_set, ex_set;
+		struct timeval tv, *tvp = NULL;
+		int maxfd = 0;
+
+		now = now_ms();
+		if (next < nr && nr_att < MAX_CONNECT_ATTEMPTS &&
+		    (!nr_att || now >= next_at)) {
+			struct connect_attempt *a = &att[nr_att];
+
+			a->rp = addrs[next++];
+			a->host[0] = 0;
+			if (!getnameinfo(a->rp->ai_addr, a->rp->ai_addrlen, a->host,
+					 sizeof(a->host), NULL, 0, NI_NUMERICHOST))
+				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
+						     _("Attempting to connect to proxy %s%s%s:%s\n") :
+						     _("Attempting to connect to server %s%s%s:%s\n"),
+					     a->rp->ai_family == AF_INET6 ? "[" : "",
+					     a->host,
+					     a->rp->ai_family == AF_INET6 ? "]" : "",
+					     port);
+
+			a->fd = socket(a->rp->ai_family, a->rp->ai_socktype,
+				       a->rp->ai_protocol);
+			if (a->fd < 0)
+				continue;
+			set_fd_cloexec(a->fd);
+			set_tcp_nodelay(vpninfo, a->fd);
+			err = start_connect(vpninfo, a->fd, a->rp->ai_addr, a->rp->ai_addrlen);
+			if (err) {
+				connect_failed(vpninfo, a, port, err);
+				closesocket(a->fd);
+				continue;
+			}
+			nr_att++;
+			next_at = now + CONNECT_ATTEMPT_DELAY;
+			continue;
+		}
+
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		for (i = 0; i < nr_att; i++) {
+			FD_SET(att[i].fd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+			FD_SET(att[i].fd, &ex_set);
+#endif
+			if (att[i].fd > maxfd)
+				maxfd = att[i].fd;
+		}
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		/* Until it's time to start on the next one */
+		if (next < nr && nr_att < MAX_CONNECT_ATTEMPTS) {
+			tv.tv_sec = (next_at - now) / 1000;
+			tv.tv_usec = ((next_at - now) % 1000) * 1000;
+			tvp = &tv;
+		}
+		if (vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, &ex_set, tvp) < 0 &&
+		    errno != EINTR) {
+			vpn_perror(vpninfo, _("Failed select() for socket connect"));
+			ret = -EIO;
+			goto out;
+		}
+
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			ret = -EINTR;
+			goto out;
+		}
+
+		for (i = 0; i < nr_att; ) {
+			if (!FD_ISSET(att[i].fd, &wr_set) && !FD_ISSET(att[i].fd, &ex_set)) {
+				i++;
+				continue;
+			}
+
+			err = connect_result(att[i].fd);
+			if (!err) {
+				*won = att[i];
+				ret = att[i].fd;
+				att[i] = att[--nr_att];
+				goto out;
+			}
+
+			connect_failed(vpninfo, &att[i], port, err);
+			closesocket(att[i].fd);
+			att[i] = att[--nr_att];
+			/* No need to wait before starting the next */
+			next_at = now;
+		}
+	}
+
+ out:
+	for (i = 0; i < nr_att; i++)
+		closesocket(att[i].fd);
+	return ret;
+}
+
 int connect_https_socket(struct openconnect_info *vpninfo)
 {
 	int ssl_sock = -1;
 	int err;
 
+	/* Perhaps it was done while the user was filling in a form */
+	ssl_sock = preconnect_take(vpninfo);
+	if (ssl_sock >= 0 || ssl_sock == -EINTR)
+		return ssl_sock;
+
 	/* If we're talking to a server which told us it has dynamic DNS, don't
 	   just re-use its previous IP address. If we're talking to a proxy, we
 	   can use *its* previous IP address. We expect it'll re-do the DNS
@@ -261,9 +489,11 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			goto out;
 		}
 	} else {
-		struct addrinfo hints, *result, *rp;
+		struct addrinfo hints, *result, **addrs;
+		struct connect_attempt won;
 		char *hostname;
 		char port[6];
+		int nr, i;
 
 		memset(&hints, 0, sizeof(struct addrinfo));
 		hints.ai_family = AF_UNSPEC;
@@ -337,11 +567,16 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			hints.ai_flags |= AI_NUMERICHOST;
 		}
 
-		if (vpninfo->getaddrinfo_override)
-			err = vpninfo->getaddrinfo_override(vpninfo->cbdata, hostname, port, &hints, &result);
-		else
-			err = getaddrinfo(hostname, port, &hints, &result);
-
+		err = resolve_host(vpninfo, hostname, port, &hints, &result);
+#ifdef EAI_SYSTEM
+		if (err == EAI_SYSTEM && errno == EINTR) {
+			/* Cancelled */
+			if (hints.ai_flags & AI_NUMERICHOST)
+				free(hostname);
+			ssl_sock = -EINTR;
+			goto out;
+		}
+#endif
 		if (err) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("getaddrinfo failed for host '%s': %s\n"),
@@ -361,122 +596,97 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 		if (hints.ai_flags & AI_NUMERICHOST)
 			free(hostname);
 
-		for (rp = result; rp ; rp = rp->ai_next) {
-			char host[80];
+		addrs = order_addrinfo(vpninfo, result, &nr);
+		if (!addrs) {
+			resolve_free(result);
+			ssl_sock = -ENOMEM;
+			goto out;
+		}
 
-			host[0] = 0;
-			if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
-					 sizeof(host), NULL, 0, NI_NUMERICHOST))
-				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
-						     _("Attempting to connect to proxy %s%s%s:%s\n") :
-						     _("Attempting to connect to server %s%s%s:%s\n"),
+		ssl_sock = happy_eyeballs(vpninfo, addrs, nr, port, &won);
+		if (ssl_sock >= 0) {
+			struct addrinfo *rp = won.rp;
+			char *host = won.host;
+
+			/* Store the peer address we actually used, so that DTLS can
+			   use it again later */
+			free(vpninfo->ip_info.gateway_addr);
+			vpninfo->ip_info.gateway_addr = NULL;
+
+			if (host[0]) {
+				vpninfo->ip_info.gateway_addr = strdup(host);
+				vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
 					     rp->ai_family == AF_INET6 ? "[" : "",
 					     host,
 					     rp->ai_family == AF_INET6 ? "]" : "",
 					     port);
+			}
 
-			ssl_sock = socket(rp->ai_family, rp->ai_socktype,
-					  rp->ai_protocol);
-			if (ssl_sock < 0)
-				continue;
-			set_fd_cloexec(ssl_sock);
-			set_tcp_nodelay(vpninfo, ssl_sock);
-			err = cancellable_connect(vpninfo, ssl_sock, rp->ai_addr, rp->ai_addrlen);
-			if (!err) {
-				/* Store the peer address we actually used, so that DTLS can
-				   use it again later */
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
-
-				if (host[0]) {
-					vpninfo->ip_info.gateway_addr = strdup(host);
-					vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
-						     rp->ai_family == AF_INET6 ? "[" : "",
-						     host,
-						     rp->ai_family == AF_INET6 ? "]" : "",
-						     port);
-				}
-
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addrlen = 0;
-				vpninfo->peer_addr = malloc(rp->ai_addrlen);
-				if (!vpninfo->peer_addr) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to allocate sockaddr storage\n"));
-					closesocket(ssl_sock);
-					ssl_sock = -ENOMEM;
-					freeaddrinfo(result);
-					goto out;
-				}
-				vpninfo->peer_addrlen = rp->ai_addrlen;
-				memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
-				/* If no proxy, ensure that we output *this* IP address in
-				 * authentication results because we're going to need to
-				 * reconnect to the *same* server from the rotation. And with
-				 * some trick DNS setups, it might possibly be a "rotation"
-				 * even if we only got one result from getaddrinfo() this
-				 * time.
-				 *
-				 * If there's a proxy, we're kind of screwed; we can't know
-				 * which IP address we connected to. Perhaps we ought to do
-				 * the DNS lookup locally and connect to a specific IP? */
-				if (!vpninfo->proxy && host[0]) {
-					char *p = malloc(strlen(host) + 3);
-					if (p) {
-						free(vpninfo->unique_hostname);
-						vpninfo->unique_hostname = p;
-						if (rp->ai_family == AF_INET6)
-							*p++ = '[';
-						memcpy(p, host, strlen(host));
-						p += strlen(host);
-						if (rp->ai_family == AF_INET6)
-							*p++ = ']';
-						*p = 0;
-					}
+			free(vpninfo->peer_addr);
+			vpninfo->peer_addrlen = 0;
+			vpninfo->peer_addr = malloc(rp->ai_addrlen);
+			if (!vpninfo->peer_addr) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to allocate sockaddr storage\n"));
+				closesocket(ssl_sock);
+				ssl_sock = -ENOMEM;
+				free(addrs);
+				resolve_free(result);
+				goto out;
+			}
+			vpninfo->peer_addrlen = rp->ai_addrlen;
+			memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
+
+			/* And the first of the other address family, if there is
+			 * one, for UDP to try too. See udp_sockaddr(). */
+			free(vpninfo->peer_addr_alt);
+			vpninfo->peer_addr_alt = NULL;
+			vpninfo->peer_addr_altlen = 0;
+			for (i = 0; !vpninfo->proxy && i < nr; i++) {
+				if (addrs[i]->ai_family == rp->ai_family)
+					continue;
+				vpninfo->peer_addr_alt = malloc(addrs[i]->ai_addrlen);
+				if (vpninfo->peer_addr_alt) {
+					vpninfo->peer_addr_altlen = addrs[i]->ai_addrlen;
+					memcpy(vpninfo->peer_addr_alt, addrs[i]->ai_addr,
+					       addrs[i]->ai_addrlen);
 				}
 				break;
 			}
-			if (host[0]) {
-				char *errstr;
-#ifdef _WIN32
-				if (err > 0)
-					errstr = openconnect__win32_strerror(err);
-				else
-#endif
-					errstr = strerror(-err);
-
-				vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
-					     rp->ai_family == AF_INET6 ? "[" : "",
-					     host,
-					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port, errstr);
-#ifdef _WIN32
-				if (err > 0)
-					free(errstr);
-#endif
-			}
-			closesocket(ssl_sock);
-			ssl_sock = -1;
-
-			/* If we're in DynDNS mode but this *was* the cached IP address,
-			 * don't bother falling back to it if it didn't work. */
-			if (vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
-			    match_sockaddr(vpninfo->peer_addr, rp->ai_addr)) {
-				vpn_progress(vpninfo, PRG_TRACE,
-					     _("Forgetting non-functional previous peer address\n"));
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addr = 0;
-				vpninfo->peer_addrlen = 0;
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
+			/* If no proxy, ensure that we output *this* IP address in
+			 * authentication results because we're going to need to
+			 * reconnect to the *same* server from the rotation. And with
+			 * some trick DNS setups, it might possibly be a "rotation"
+			 * even if we only got one result from getaddrinfo() this
+			 * time.
+			 *
+			 * If there's a proxy, we're kind of screwed; we can't know
+			 * which IP address we connected to. Perhaps we ought to do
+			 * the DNS lookup locally and connect to a specific IP? */
+			if (!vpninfo->proxy && host[0]) {
+				char *p = malloc(strlen(host) + 3);
+				if (p) {
+					free(vpninfo->unique_hostname);
+					vpninfo->unique_hostname = p;
+					if (rp->ai_family == AF_INET6)
+						*p++ = '[';
+					memcpy(p, host, strlen(host));
+					p += strlen(host);
+					if (rp->ai_family == AF_INET6)
+						*p++ = ']';
+					*p = 0;
+				}
 			}
 		}
-		freeaddrinfo(result);
+		free(addrs);
+		resolve_free(result);
 
 		if (ssl_sock < 0) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to connect to host %s\n"),
 				     vpninfo->proxy?:vpninfo->hostname);
+			/* Perhaps it has moved, if that was an old answer */
+			resolve_forget(vpninfo, vpninfo->proxy?:vpninfo->hostname, port);
 			ssl_sock = -EINVAL;
 			if (vpninfo->peer_addr) {
 				vpn_progress(vpninfo, PRG_ERR,
@@ -507,6 +717,36 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 	return ssl_sock;
 }
 
+/* Open the HTTPS connection if it isn't already, and send the request to
+ * start the tunnel on it. When reconnecting, that can go as TLSv1.3 early
+ * data, if the user has allowed it and the protocol says an attacker can't
+ * do any harm by replaying the request. If the server won't take it that
+ * way, it is sent again after the handshake as usual.
+ *
+ * Returns an error only if the connection couldn't be made. If the request
+ * couldn't be sent, the caller finds out when it reads the response. */
+int openconnect_https_request(struct openconnect_info *vpninfo,
+			      struct oc_text_buf *req)
+{
+	int ret;
+
+	if (vpninfo->tls_early_data && (vpninfo->proto->flags & OC_PROTO_EARLY_DATA))
+		ret = openconnect_open_https_early(vpninfo, req->data, req->pos);
+	else
+		ret = openconnect_open_https(vpninfo);
+	if (ret < 0)
+		return ret;
+
+	if (ret) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Sent request in TLS early data\n"));
+		return 0;
+	}
+
+	vpninfo->ssl_write(vpninfo, req->data, req->pos);
+	return 0;
+}
+
 int  __attribute__ ((format (printf, 2, 3)))
     openconnect_SSL_printf(struct openconnect_info *vpninfo, const char *fmt, ...)
 {
@@ -799,6 +1039,19 @@ int keystore_fetch(const char *key, unsigned char **result)
 }
 #endif
 
+/* For the places where authentication and connection wait for a socket.
+ * When they are being run by openconnect_process(), hand the fds to the
+ * application's event loop instead, and carry on when they're ready. */
+int vpn_select(struct openconnect_info *vpninfo, int nfds, fd_set *rd_set,
+	       fd_set *wr_set, fd_set *ex_set, struct timeval *tv)
+{
+#ifdef HAVE_UCONTEXT
+	if (async_running(vpninfo))
+		return async_select(vpninfo, nfds, rd_set, wr_set, ex_set, tv);
+#endif
+	return select(nfds, rd_set, wr_set, ex_set, tv);
+}
+
 void cmd_fd_set(struct openconnect_info *vpninfo, fd_set *fds, int *maxfd)
 {
 	if (vpninfo->cmd_fd != -1) {
@@ -837,8 +1090,15 @@ void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
 		vpninfo->got_pause_cmd = 1;
 		break;
 	case OC_CMD_STATS:
-		if (vpninfo->stats_handler)
+		if (vpninfo->stats_handler) {
+			vpninfo->stats.tls_rtt = ka_srtt(&vpninfo->ssl_times);
+			vpninfo->stats.tls_rttvar = ka_rttvar(&vpninfo->ssl_times);
+			vpninfo->stats.tls_loss = ka_loss(&vpninfo->ssl_times);
+			vpninfo->stats.udp_rtt = ka_srtt(&vpninfo->dtls_times);
+			vpninfo->stats.udp_rttvar = ka_rttvar(&vpninfo->dtls_times);
+			vpninfo->stats.udp_loss = ka_loss(&vpninfo->dtls_times);
 			vpninfo->stats_handler(vpninfo->cbdata, &vpninfo->stats);
+		}
 	}
 }
 
@@ -867,7 +1127,7 @@ void poll_cmd_fd(struct openconnect_info *vpninfo, int timeout)
 
 		FD_ZERO(&rd_set);
 		cmd_fd_set(vpninfo, &rd_set, &maxfd);
-		if (select(maxfd + 1, &rd_set, NULL, NULL, &tv) < 0 &&
+		if (vpn_select(vpninfo, maxfd + 1, &rd_set, NULL, NULL, &tv) < 0 &&
 		    errno != EINTR) {
 			vpn_perror(vpninfo, _("Failed select() for command socket"));
 		}
@@ -1007,47 +1267,164 @@ ssize_t openconnect_read_file(struct openconnect_info *vpninfo, const char *fnam
 	return len;
 }
 
-int udp_sockaddr(struct openconnect_info *vpninfo, int port)
+static int udp_addr(const struct sockaddr *peer, socklen_t peerlen, int port,
+		    struct sockaddr **addr, socklen_t *addrlen)
 {
-	free(vpninfo->dtls_addr);
-	vpninfo->dtls_addr = malloc(vpninfo->peer_addrlen);
-	if (!vpninfo->dtls_addr)
+	free(*addr);
+	*addr = NULL;
+	*addrlen = 0;
+
+	if (peer->sa_family != AF_INET && peer->sa_family != AF_INET6)
+		return -EINVAL;
+
+	*addr = malloc(peerlen);
+	if (!*addr)
 		return -ENOMEM;
 
-	memcpy(vpninfo->dtls_addr, vpninfo->peer_addr, vpninfo->peer_addrlen);
+	memcpy(*addr, peer, peerlen);
+	*addrlen = peerlen;
 
-	if (vpninfo->peer_addr->sa_family == AF_INET) {
-		struct sockaddr_in *sin = (void *)vpninfo->dtls_addr;
-		sin->sin_port = htons(port);
+	if (peer->sa_family == AF_INET)
+		((struct sockaddr_in *)*addr)->sin_port = htons(port);
+	else
+		((struct sockaddr_in6 *)*addr)->sin6_port = htons(port);
+	return 0;
+}
+
+static void udp_set_tos(struct openconnect_info *vpninfo)
+{
+	/* in case DTLS TOS copy is disabled, leave the optname unset */
+	/* so that the copy won't be applied in dtls.c / dtls_mainloop() */
+	vpninfo->dtls_tos_optname = 0;
+	if (!vpninfo->dtls_pass_tos)
+		return;
+
+	if (vpninfo->dtls_addr->sa_family == AF_INET) {
 		vpninfo->dtls_tos_proto = IPPROTO_IP;
 		vpninfo->dtls_tos_optname = IP_TOS;
-	} else if (vpninfo->peer_addr->sa_family == AF_INET6) {
-		struct sockaddr_in6 *sin = (void *)vpninfo->dtls_addr;
-		sin->sin6_port = htons(port);
+	}
 #if defined(IPV6_TCLASS)
+	else if (vpninfo->dtls_addr->sa_family == AF_INET6) {
 		vpninfo->dtls_tos_proto = IPPROTO_IPV6;
 		vpninfo->dtls_tos_optname = IPV6_TCLASS;
+	}
 #endif
-	} else {
+}
+
+int udp_sockaddr(struct openconnect_info *vpninfo, int port)
+{
+	int ret;
+
+	ret = udp_addr(vpninfo->peer_addr, vpninfo->peer_addrlen, port,
+		       &vpninfo->dtls_addr, &vpninfo->dtls_addrlen);
+	if (ret == -EINVAL)
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("Unknown protocol family %d. Cannot create UDP server address\n"),
 			     vpninfo->peer_addr->sa_family);
-		return -EINVAL;
+	if (ret)
+		return ret;
+
+	udp_set_tos(vpninfo);
+
+	/* UDP may be filtered over one address family and not the other,
+	 * so if the server has both, the DTLS handshake or ESP probes go
+	 * over both and whichever answers first is used. */
+	if (!vpninfo->peer_addr_alt ||
+	    udp_addr(vpninfo->peer_addr_alt, vpninfo->peer_addr_altlen, port,
+		     &vpninfo->dtls_addr_alt, &vpninfo->dtls_addr_altlen)) {
+		free(vpninfo->dtls_addr_alt);
+		vpninfo->dtls_addr_alt = NULL;
 	}
 
-	/* in case DTLS TOS copy is disabled, reset the optname value */
-	/* so that the copy won't be applied in dtls.c / dtls_mainloop() */
-	if (!vpninfo->dtls_pass_tos)
-		vpninfo->dtls_tos_optname = 0;
-
 	return 0;
 }
 
+/* Exchange dtls_addr with dtls_addr_alt, to use the other address family */
+void udp_swap_family(struct openconnect_info *vpninfo)
+{
+	struct sockaddr *addr = vpninfo->dtls_addr;
+	socklen_t addrlen = vpninfo->dtls_addrlen;
+
+	vpninfo->dtls_addr = vpninfo->dtls_addr_alt;
+	vpninfo->dtls_addrlen = vpninfo->dtls_addr_altlen;
+	vpninfo->dtls_addr_alt = addr;
+	vpninfo->dtls_addr_altlen = addrlen;
+
+	udp_set_tos(vpninfo);
+	vpninfo->dtls_tos_current = 0;
+}
+
+/* Only the gateway's address used for HTTPS is sure to be routed outside
+ * the VPN, by vpnc-script or whatever else sets up the routes. Any UDP to
+ * its other address would loop back into the tun device if the VPN routes
+ * that too, unless the built-in configuration has routed it outside as
+ * well. Whoever sets up the routes, they are the ones the server gave us,
+ * so only use it if those don't cover it. Without a tun device, nothing
+ * is routed through the VPN at all. */
+static int udp_family_usable(struct openconnect_info *vpninfo, const struct sockaddr *sa)
+{
+	if (vpninfo->script_tun || vpninfo->socks_listen)
+		return 1;
+
+	return netcfg_routes_outside(vpninfo, sa) || !split_routes_addr(vpninfo, sa);
+}
+
+/* Before opening new UDP sockets, stop using the other address family if
+ * it has become unsafe, even if it won the last race. */
+void udp_check_families(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->dtls_addr_alt || !vpninfo->peer_addr)
+		return;
+
+	if (vpninfo->dtls_addr->sa_family != vpninfo->peer_addr->sa_family) {
+		if (udp_family_usable(vpninfo, vpninfo->dtls_addr))
+			return;
+		udp_swap_family(vpninfo);
+	} else if (udp_family_usable(vpninfo, vpninfo->dtls_addr_alt))
+		return;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Not using IPv%d for UDP, as it would be routed through the VPN\n"),
+		     vpninfo->dtls_addr_alt->sa_family == AF_INET6 ? 6 : 4);
+	free(vpninfo->dtls_addr_alt);
+	vpninfo->dtls_addr_alt = NULL;
+}
+
+/* Exchange the UDP socket in use with the one in @slot, along with its
+ * DTLS session if any. The socket stays monitored as it was; only the
+ * primary one gets its epoll state synced by the mainloop, so sync it
+ * before it's swapped out. */
+void dtls_slot_swap(struct openconnect_info *vpninfo, struct dtls_slot *slot)
+{
+	struct dtls_slot tmp = *slot;
+
+#ifdef HAVE_EPOLL
+	update_epoll_fd(vpninfo, dtls);
+#endif
+	slot->fd = vpninfo->dtls_fd;
+	vpninfo->dtls_fd = tmp.fd;
+	slot->ssl = vpninfo->dtls_ssl;
+	vpninfo->dtls_ssl = tmp.ssl;
+#if defined(OPENCONNECT_GNUTLS)
+	slot->psk_cred = vpninfo->psk_cred;
+	vpninfo->psk_cred = tmp.psk_cred;
+#endif
+#ifdef _WIN32
+	slot->monitored = vpninfo->dtls_monitored;
+	slot->event = vpninfo->dtls_event;
+	vpninfo->dtls_monitored = tmp.monitored;
+	vpninfo->dtls_event = tmp.event;
+#elif defined(HAVE_EPOLL)
+	slot->epoll = vpninfo->dtls_epoll;
+	vpninfo->dtls_epoll = tmp.epoll;
+#endif
+}
+
 int udp_connect(struct openconnect_info *vpninfo)
 {
 	int fd, sndbuf;
 
-	fd = socket(vpninfo->peer_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	fd = socket(vpninfo->dtls_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
 	if (fd < 0) {
 		vpn_perror(vpninfo, _("Open UDP socket"));
 		return -EINVAL;
@@ -1075,13 +1452,13 @@ int udp_connect(struct openconnect_info *vpninfo)
 		int dtls_bind_addrlen;
 		memset(&dtls_bind_addr, 0, sizeof(dtls_bind_addr));
 
-		if (vpninfo->peer_addr->sa_family == AF_INET) {
+		if (vpninfo->dtls_addr->sa_family == AF_INET) {
 			struct sockaddr_in *addr = &dtls_bind_addr.in;
 			dtls_bind_addrlen = sizeof(*addr);
 			addr->sin_family = AF_INET;
 			addr->sin_addr.s_addr = INADDR_ANY;
 			addr->sin_port = htons(vpninfo->dtls_local_port);
-		} else if (vpninfo->peer_addr->sa_family == AF_INET6) {
+		} else if (vpninfo->dtls_addr->sa_family == AF_INET6) {
 			struct sockaddr_in6 *addr = &dtls_bind_addr.in6;
 			dtls_bind_addrlen = sizeof(*addr);
 			addr->sin6_family = AF_INET6;
@@ -1090,7 +1467,7 @@ int udp_connect(struct openconnect_info *vpninfo)
 		} else {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Unknown protocol family %d. Cannot use UDP transport\n"),
-				     vpninfo->peer_addr->sa_family);
+				     vpninfo->dtls_addr->sa_family);
 			vpninfo->dtls_attempt_period = 0;
 			closesocket(fd);
 			return -EINVAL;
@@ -1103,7 +1480,7 @@ int udp_connect(struct openconnect_info *vpninfo)
 		}
 	}
 
-	if (connect(fd, vpninfo->dtls_addr, vpninfo->peer_addrlen)) {
+	if (connect(fd, vpninfo->dtls_addr, vpninfo->dtls_addrlen)) {
 		vpn_perror(vpninfo, _("Connect UDP socket\n"));
 		closesocket(fd);
 		return -EINVAL;
@@ -1221,7 +1598,7 @@ int cancellable_send(struct openconnect_info *vpninfo, int fd,
 		FD_SET(fd, &wr_set);
 		cmd_fd_set(vpninfo, &rd_set, &maxfd);
 
-		if (select(maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
+		if (vpn_select(vpninfo, maxfd + 1, &rd_set, &wr_set, NULL, NULL) < 0 &&
 		    errno != EINTR) {
 			vpn_perror(vpninfo, _("Failed select() for socket send"));
 			return -EIO;
@@ -1261,7 +1638,7 @@ int cancellable_recv(struct openconnect_info *vpninfo, int fd,
 		FD_SET(fd, &rd_set);
 		cmd_fd_set(vpninfo, &rd_set, &maxfd);
 
-		if (select(maxfd + 1, &rd_set, NULL, NULL, NULL) < 0 &&
+		if (vpn_select(vpninfo, maxfd + 1, &rd_set, NULL, NULL, NULL) < 0 &&
 		    errno != EINTR) {
 			vpn_perror(vpninfo, _("Failed select() for socket recv"));
 			return -EIO;
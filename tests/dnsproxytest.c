@@ -0,0 +1,385 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../dnsproxy.c"
+
+#define FAIL(...) do { printf(__VA_ARGS__); exit(1); } while (0)
+
+int openconnect_random(void *bytes, int len)
+{
+	static unsigned char n;
+
+	memset(bytes, n++, len);
+	return 0;
+}
+
+static void progress(void *cbdata, int level, const char *fmt, ...)
+{
+}
+
+/* "WWW.Example.com" */
+static const unsigned char qname[] = {
+	3, 'W', 'W', 'W', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+};
+
+/* A query for @qname of @type, with an OPT record if @edns is set */
+static int make_query(unsigned char *p, int type, int edns, int do_bit)
+{
+	int len = 12;
+
+	memset(p, 0, 12);
+	store_be16(p, 0xabcd);
+	p[2] = 0x01; /* RD */
+	store_be16(p + 4, 1);
+	memcpy(p + len, qname, sizeof(qname));
+	len += sizeof(qname);
+	store_be16(p + len, type);
+	store_be16(p + len + 2, 1);
+	len += 4;
+	if (edns) {
+		store_be16(p + 10, 1);
+		p[len] = 0;
+		store_be16(p + len + 1, DNS_TYPE_OPT);
+		store_be16(p + len + 3, edns);
+		store_be32(p + len + 5, do_bit ? 0x8000 : 0);
+		store_be16(p + len + 9, 0);
+		len += 11;
+	}
+	return len;
+}
+
+static void test_skip_name(void)
+{
+	static const unsigned char p[] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		3, 'w', 'w', 'w', 0,		/* 12 */
+		1, 'a', 0xc0, 12,		/* 17, then a pointer */
+		0,				/* 21, the root */
+		5, 'a', 'b',			/* 22, runs off the end */
+	};
+
+	if (dns_skip_name(p, sizeof(p), 12) != 17)
+		FAIL("Failed to skip a name\n");
+	if (dns_skip_name(p, sizeof(p), 17) != 21)
+		FAIL("Failed to skip a name ending in a pointer\n");
+	if (dns_skip_name(p, sizeof(p), 21) != 22)
+		FAIL("Failed to skip the root\n");
+	if (dns_skip_name(p, sizeof(p), 22) != -1)
+		FAIL("Skipped a label past the end\n");
+	/* Half a pointer */
+	if (dns_skip_name(p, 20, 17) != -1)
+		FAIL("Skipped a truncated pointer\n");
+	if (dns_skip_name(p, 12, 12) != -1)
+		FAIL("Skipped a name past the end\n");
+}
+
+static void test_question(void)
+{
+	unsigned char p[512];
+	struct dns_key key;
+	int len, off, i;
+
+	len = make_query(p, 1, 0, 0);
+	off = dns_parse_question(p, len, &key);
+	if (off != len)
+		FAIL("Question ends at %d, expected %d\n", off, len);
+	if (key.namelen != sizeof(qname) || memcmp(key.name, "\3www\7example\3com", sizeof(qname)))
+		FAIL("Name not in lower case\n");
+	if (key.type != 1 || key.class != 1 || key.flags)
+		FAIL("Parsed type %d class %d flags %d\n", key.type, key.class, key.flags);
+
+	for (i = 0; i < len; i++)
+		if (dns_parse_question(p, i, &key) != -1)
+			FAIL("Parsed a question truncated to %d bytes\n", i);
+
+	/* Exactly one question, or we don't want to know */
+	store_be16(p + 4, 2);
+	if (dns_parse_question(p, len, &key) != -1)
+		FAIL("Parsed two questions\n");
+	store_be16(p + 4, 1);
+
+	/* Nothing before it to point at */
+	p[12] = 0xc0;
+	if (dns_parse_question(p, len, &key) != -1)
+		FAIL("Parsed a compressed question\n");
+
+	/* A name longer than 255 bytes: five labels of 63 */
+	memset(p, 0, sizeof(p));
+	store_be16(p + 4, 1);
+	for (i = 0; i < 5; i++)
+		p[12 + i * 64] = 63;
+	if (dns_parse_question(p, 12 + 5 * 64 + 5, &key) != -1)
+		FAIL("Parsed an overlong name\n");
+}
+
+static void test_opt(void)
+{
+	unsigned char p[512];
+	struct dns_key key;
+	int len, off;
+
+	len = make_query(p, 1, 0, 0);
+	off = dns_parse_question(p, len, &key);
+	if (dns_parse_opt(p, len, off, &key) != 512 || key.flags)
+		FAIL("Found EDNS in a plain query\n");
+
+	len = make_query(p, 1, 4096, 1);
+	off = dns_parse_question(p, len, &key);
+	if (dns_parse_opt(p, len, off, &key) != 4096 || key.flags != (KEY_EDNS | KEY_DO))
+		FAIL("EDNS with DO not found (flags %d)\n", key.flags);
+
+	/* Never less than we'd allow without it */
+	len = make_query(p, 1, 100, 0);
+	off = dns_parse_question(p, len, &key);
+	if (dns_parse_opt(p, len, off, &key) != 512 || key.flags != KEY_EDNS)
+		FAIL("EDNS with a small payload size not handled\n");
+
+	/* Cut off part way through the OPT record */
+	len = make_query(p, 1, 4096, 1);
+	off = dns_parse_question(p, len, &key);
+	if (dns_parse_opt(p, len - 3, off, &key) != 512 || key.flags)
+		FAIL("Parsed a truncated OPT record\n");
+}
+
+/* An answer with an A record, an SOA in the authority section and an
+ * OPT record, whose TTL field isn't one. */
+static int make_response(unsigned char *p, uint32_t a_ttl, uint32_t soa_ttl, uint32_t minimum)
+{
+	static const unsigned char soa_rdata[] = {
+		2, 'n', 's', 0xc0, 16,		/* MNAME */
+		0,				/* RNAME */
+		0, 0, 0, 1,			/* SERIAL */
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* REFRESH, RETRY, EXPIRE */
+	};
+	int len = make_query(p, 1, 0, 0);
+
+	p[2] |= 0x80;
+	p[3] = 0x80;
+	store_be16(p + 6, 1);
+	store_be16(p + 8, 1);
+	store_be16(p + 10, 1);
+
+	p[len] = 0xc0;
+	p[len + 1] = 12;
+	store_be16(p + len + 2, 1);
+	store_be16(p + len + 4, 1);
+	store_be32(p + len + 6, a_ttl);
+	store_be16(p + len + 10, 4);
+	store_be32(p + len + 12, 0xc0000250);
+	len += 16;
+
+	p[len] = 0xc0;
+	p[len + 1] = 16;
+	store_be16(p + len + 2, DNS_TYPE_SOA);
+	store_be16(p + len + 4, 1);
+	store_be32(p + len + 6, soa_ttl);
+	store_be16(p + len + 10, sizeof(soa_rdata) + 4);
+	memcpy(p + len + 12, soa_rdata, sizeof(soa_rdata));
+	store_be32(p + len + 12 + sizeof(soa_rdata), minimum);
+	len += 12 + sizeof(soa_rdata) + 4;
+
+	p[len] = 0;
+	store_be16(p + len + 1, DNS_TYPE_OPT);
+	store_be16(p + len + 3, 1232);
+	store_be32(p + len + 5, 0x8000);
+	store_be16(p + len + 9, 0);
+	return len + 11;
+}
+
+static void test_ttls(void)
+{
+	unsigned char p[512];
+	int len, a_off, soa_off, opt_off, i;
+
+	len = make_response(p, 300, 3600, 600);
+	a_off = 12 + sizeof(qname) + 4 + 6;
+	soa_off = a_off + 16;
+	opt_off = len - 6;
+
+	if (dns_age_ttls(p, len, 100) != 200)
+		FAIL("Lowest TTL not 200\n");
+	if (load_be32(p + a_off) != 200 || load_be32(p + soa_off) != 3500)
+		FAIL("TTLs aged to %u and %u\n", load_be32(p + a_off), load_be32(p + soa_off));
+	if (load_be32(p + opt_off) != 0x8000)
+		FAIL("OPT record flags changed\n");
+
+	/* The SOA's MINIMUM caps it */
+	len = make_response(p, 300, 3600, 60);
+	if (dns_age_ttls(p, len, 0) != 60)
+		FAIL("SOA MINIMUM not used\n");
+
+	/* Never below zero, and "negative" TTLs are zero */
+	len = make_response(p, 0x80000001, 50, 600);
+	if (dns_age_ttls(p, len, 100) != 0)
+		FAIL("Expired TTL not zero\n");
+	if (load_be32(p + a_off) || load_be32(p + soa_off))
+		FAIL("TTLs aged to %u and %u\n", load_be32(p + a_off), load_be32(p + soa_off));
+
+	/* Capped at a day */
+	len = make_response(p, 0x7fffffff, 0x7fffffff, 0x7fffffff);
+	if (dns_age_ttls(p, len, 0) != CACHE_MAX_TTL)
+		FAIL("TTL not capped\n");
+
+	for (i = 12; i < len; i++) {
+		make_response(p, 300, 3600, 600);
+		if (dns_age_ttls(p, i, 0) != -1)
+			FAIL("Parsed a response truncated to %d bytes\n", i);
+	}
+}
+
+static int udp_socket(struct sockaddr_in *sin, socklen_t *sinlen)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	*sinlen = sizeof(*sin);
+	if (fd < 0 || bind(fd, (void *)sin, *sinlen) ||
+	    getsockname(fd, (void *)sin, sinlen))
+		FAIL("Failed to open UDP socket: %s\n", strerror(errno));
+	return fd;
+}
+
+static void test_reply(struct openconnect_info *vpninfo, int client_fd,
+		       struct sockaddr_in *client, socklen_t clientlen)
+{
+	unsigned char p[DNS_MAX_PKT], buf[DNS_MAX_PKT];
+	struct dns_waiter w;
+	int len, ret;
+
+	memset(&w, 0, sizeof(w));
+	memcpy(&w.addr, client, clientlen);
+	w.addrlen = clientlen;
+	w.id = 0x5678;
+	w.rd = 1;
+	w.maxlen = 512;
+	w.qlen = sizeof(qname) + 4;
+	make_query(buf, 1, 0, 0);
+	memcpy(w.q, buf + 12, w.qlen);
+
+	/* Our own ID and the name in lower case, as it was cached */
+	len = make_response(p, 300, 3600, 600);
+	store_be16(p, 0x1111);
+	p[13] = 'w';
+	dns_send_reply(vpninfo, &w, p, len);
+	ret = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (ret != len || load_be16(buf) != 0x5678 || (buf[2] & 0x02))
+		FAIL("Bad reply of %d bytes\n", ret);
+	if (memcmp(buf + 12, qname, sizeof(qname)))
+		FAIL("Reply doesn't have the client's question\n");
+
+	/* Too big: just the header and the question, with TC set */
+	memset(p + len, 0, 600 - len);
+	store_be16(p + len - 2, 600 - len);
+	dns_send_reply(vpninfo, &w, p, 600);
+	ret = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (ret != 12 + w.qlen)
+		FAIL("Truncated reply is %d bytes, expected %d\n", ret, 12 + w.qlen);
+	if (!(buf[2] & 0x02) || load_be16(buf + 4) != 1 || load_be16(buf + 6) ||
+	    load_be16(buf + 8) || load_be16(buf + 10))
+		FAIL("Truncated reply has the wrong header\n");
+
+	/* Unless the client said it could take it */
+	len = make_response(p, 300, 3600, 600);
+	store_be16(p + len - 2, 600 - len);
+	w.maxlen = 1232;
+	dns_send_reply(vpninfo, &w, p, 600);
+	ret = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (ret != 600 || (buf[2] & 0x02))
+		FAIL("Reply of 600 bytes was %d\n", ret);
+}
+
+static void test_clients(struct openconnect_info *vpninfo, struct sockaddr_in *client,
+			 socklen_t clientlen)
+{
+	struct dns_proxy *dp = vpninfo->dns_proxy;
+	struct sockaddr_storage from;
+	struct sockaddr_in *sin = (void *)&from;
+	unsigned char p[512];
+	int len;
+
+	len = make_query(p, 1, 0, 0);
+
+	/* Someone else on the VPN */
+	memset(&from, 0, sizeof(from));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(5353);
+	inet_pton(AF_INET, "10.1.0.9", &sin->sin_addr);
+	dns_client_query(vpninfo, p, len, &from, sizeof(*sin));
+	if (dp->misses || dp->queries)
+		FAIL("Answered a query from another host\n");
+
+	/* This host, through its VPN address, and through loopback */
+	inet_pton(AF_INET, "10.1.0.2", &sin->sin_addr);
+	dns_client_query(vpninfo, p, len, &from, sizeof(*sin));
+	if (dp->misses != 1 || !dp->queries)
+		FAIL("Query from the VPN address not answered\n");
+
+	memcpy(&from, client, clientlen);
+	dns_client_query(vpninfo, p, len, &from, clientlen);
+	if (dp->misses != 2 || dp->queries->nr_waiters != 2)
+		FAIL("Query from loopback not answered\n");
+
+	/* Some other address family */
+	memset(&from, 0, sizeof(from));
+	from.ss_family = AF_UNIX;
+	dns_client_query(vpninfo, p, len, &from, sizeof(from));
+	if (dp->misses != 2)
+		FAIL("Answered a query from AF_UNIX\n");
+}
+
+int main(void)
+{
+	struct openconnect_info *vpninfo = calloc(1, sizeof(*vpninfo));
+	struct sockaddr_in client, sin;
+	socklen_t clientlen, sinlen;
+	int client_fd;
+
+	vpninfo->progress = progress;
+	vpninfo->ip_info.addr = "10.1.0.2";
+	vpninfo->ip_info.dns[0] = "192.0.2.53";
+	vpninfo->dns_proxy_listen = "";
+	vpninfo->dns_proxy = calloc(1, sizeof(struct dns_proxy));
+	vpninfo->dns_proxy->up_family = AF_INET;
+
+	test_skip_name();
+	test_question();
+	test_opt();
+	test_ttls();
+
+	vpninfo->dns_fd = udp_socket(&sin, &sinlen);
+	vpninfo->dns_up_fd = udp_socket(&sin, &sinlen);
+	client_fd = udp_socket(&client, &clientlen);
+	test_reply(vpninfo, client_fd, &client, clientlen);
+	test_clients(vpninfo, &client, clientlen);
+
+	while (vpninfo->dns_proxy->queries)
+		query_free(vpninfo->dns_proxy, vpninfo->dns_proxy->queries);
+	free(vpninfo->dns_proxy);
+	close(vpninfo->dns_fd);
+	close(vpninfo->dns_up_fd);
+	close(client_fd);
+	free(vpninfo);
+	return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../icmp.c"
+
+#define FAIL(...) do { printf(__VA_ARGS__); exit(1); } while (0)
+
+static void progress(void *cbdata, int level, const char *fmt, ...)
+{
+}
+
+static struct pkt *make_pkt(int v6, int len)
+{
+	struct pkt *pkt = calloc(1, sizeof(*pkt) + len);
+	unsigned char *p = pkt->data;
+	int i;
+
+	pkt->len = len;
+	for (i = 0; i < len; i++)
+		p[i] = i;
+
+	if (v6) {
+		p[0] = 0x60;
+		p[1] = p[2] = p[3] = 0;
+		store_be16(p + 4, len - 40);
+		p[6] = 17; /* UDP */
+		p[7] = 64;
+		memset(p + 8, 0, 16);
+		p[8] = 0xfd; p[23] = 1;		/* fd00::1 */
+		memset(p + 24, 0, 16);
+		p[24] = 0x20; p[25] = 0x01; p[39] = 2;	/* 2001::2 */
+	} else {
+		p[0] = 0x45;
+		p[1] = 0;
+		store_be16(p + 2, len);
+		store_be16(p + 6, 0x4000); /* DF */
+		p[8] = 64;
+		p[9] = 17; /* UDP */
+		store_be32(p + 12, 0x0a000001); /* 10.0.0.1 */
+		store_be32(p + 16, 0xc0000202); /* 192.0.2.2 */
+		store_be16(p + 10, 0);
+		store_be16(p + 10, ntohs(csum((uint16_t *)p, 10)));
+	}
+	return pkt;
+}
+
+/* Sum of @len bytes, padded with a zero byte if the length is odd */
+static uint32_t sum_bytes(const unsigned char *p, int len)
+{
+	unsigned char buf[2048];
+
+	memcpy(buf, p, len);
+	buf[len] = 0;
+	return csum_partial((uint16_t *)buf, (len + 1) / 2);
+}
+
+static void reset(struct openconnect_info *vpninfo)
+{
+	struct pkt *pkt;
+
+	while ((pkt = dequeue_packet(&vpninfo->incoming_queue)))
+		free(pkt);
+	vpninfo->icmp_ratelimit_time = 0;
+	vpninfo->icmp_ratelimit_count = 0;
+}
+
+/* The one reply queued to the tun device, checked as far as is common
+ * to all the ICMP errors we send. */
+static unsigned char *check_reply4(struct openconnect_info *vpninfo, struct pkt *orig,
+				   int type, int code)
+{
+	struct pkt *pkt = vpninfo->incoming_queue.head;
+	unsigned char *p;
+	int quote;
+
+	if (!pkt || vpninfo->incoming_queue.count != 1)
+		FAIL("Expected one ICMP reply, got %d\n", vpninfo->incoming_queue.count);
+
+	p = pkt->data;
+	quote = MIN(orig->len, 576 - 28);
+	if (pkt->len != 28 + quote || load_be16(p + 2) != pkt->len)
+		FAIL("ICMP reply length %d, expected %d\n", pkt->len, 28 + quote);
+	if (p[0] != 0x45 || p[9] != 1)
+		FAIL("Bad IPv4 header on ICMP reply\n");
+	if (csum((uint16_t *)p, 10))
+		FAIL("Bad IPv4 header checksum on ICMP reply\n");
+	if (memcmp(p + 12, orig->data + 16, 4) || memcmp(p + 16, orig->data + 12, 4))
+		FAIL("ICMP reply addresses not swapped\n");
+	if (csum_finish(sum_bytes(p + 20, 8 + quote)))
+		FAIL("Bad ICMP checksum\n");
+	if (p[20] != type || p[21] != code)
+		FAIL("ICMP type %d code %d, expected %d/%d\n", p[20], p[21], type, code);
+	if (memcmp(p + 28, orig->data, quote))
+		FAIL("ICMP reply doesn't quote the original packet\n");
+	return p;
+}
+
+static unsigned char *check_reply6(struct openconnect_info *vpninfo, struct pkt *orig,
+				   int type, int code)
+{
+	struct pkt *pkt = vpninfo->incoming_queue.head;
+	unsigned char *p;
+	uint32_t sum;
+	int quote;
+
+	if (!pkt || vpninfo->incoming_queue.count != 1)
+		FAIL("Expected one ICMPv6 reply, got %d\n", vpninfo->incoming_queue.count);
+
+	p = pkt->data;
+	quote = MIN(orig->len, 1280 - 48);
+	if (pkt->len != 48 + quote || load_be16(p + 4) != 8 + quote)
+		FAIL("ICMPv6 reply length %d, expected %d\n", pkt->len, 48 + quote);
+	if (pkt->len > 1280)
+		FAIL("ICMPv6 reply exceeds minimum MTU\n");
+	if (p[0] != 0x60 || p[6] != 58)
+		FAIL("Bad IPv6 header on ICMPv6 reply\n");
+	if (memcmp(p + 8, orig->data + 24, 16) || memcmp(p + 24, orig->data + 8, 16))
+		FAIL("ICMPv6 reply addresses not swapped\n");
+
+	sum = csum_partial((uint16_t *)(p + 8), 16);
+	sum += 58 + 8 + quote;
+	sum += sum_bytes(p + 40, 8 + quote);
+	if (csum_finish(sum))
+		FAIL("Bad ICMPv6 checksum\n");
+	if (p[40] != type || p[41] != code)
+		FAIL("ICMPv6 type %d code %d, expected %d/%d\n", p[40], p[41], type, code);
+	if (memcmp(p + 48, orig->data, quote))
+		FAIL("ICMPv6 reply doesn't quote the original packet\n");
+	return p;
+}
+
+int main(void)
+{
+	struct openconnect_info *vpninfo = calloc(1, sizeof(*vpninfo));
+	struct pkt *pkt;
+	unsigned char *p;
+	int i, sent;
+	time_t start;
+
+	vpninfo->progress = progress;
+	init_pkt_queue(&vpninfo->incoming_queue);
+	init_pkt_queue(&vpninfo->free_queue);
+
+	/* IPv4 with DF: Fragmentation Needed, with the MTU, quoting as much
+	 * as fits in 576 bytes. */
+	pkt = make_pkt(0, 1500);
+	if (icmp_pkt_too_big(vpninfo, pkt, 1400) != 1)
+		FAIL("IPv4 packet with DF not dropped\n");
+	p = check_reply4(vpninfo, pkt, 3, 4);
+	if (load_be16(p + 26) != 1400 || load_be16(p + 24))
+		FAIL("Wrong next-hop MTU %d in ICMP reply\n", load_be16(p + 26));
+	reset(vpninfo);
+
+	/* A short one is quoted whole, odd length and all */
+	free(pkt);
+	pkt = make_pkt(0, 61);
+	icmp_pkt_too_big(vpninfo, pkt, 40);
+	check_reply4(vpninfo, pkt, 3, 4);
+	reset(vpninfo);
+
+	/* Without DF, it's let through and nothing is sent */
+	store_be16(pkt->data + 6, 0);
+	if (icmp_pkt_too_big(vpninfo, pkt, 40) != 0 || vpninfo->incoming_queue.count)
+		FAIL("IPv4 packet without DF not passed through\n");
+	free(pkt);
+
+	/* Never an ICMP error about an ICMP error */
+	pkt = make_pkt(0, 1500);
+	pkt->data[9] = 1;
+	pkt->data[20] = 3;
+	if (icmp_pkt_too_big(vpninfo, pkt, 1400) != 1 || vpninfo->incoming_queue.count)
+		FAIL("Replied to an ICMP error\n");
+	free(pkt);
+
+	/* IPv6: Packet Too Big, truncated to fit in 1280 bytes */
+	pkt = make_pkt(1, 1500);
+	if (icmp_pkt_too_big(vpninfo, pkt, 1400) != 1)
+		FAIL("IPv6 packet not dropped\n");
+	p = check_reply6(vpninfo, pkt, 2, 0);
+	if (load_be32(p + 44) != 1400)
+		FAIL("Wrong MTU %d in ICMPv6 reply\n", load_be32(p + 44));
+	reset(vpninfo);
+
+	/* Never below the IPv6 minimum MTU, which is let through instead */
+	icmp_pkt_too_big(vpninfo, pkt, 1000);
+	p = check_reply6(vpninfo, pkt, 2, 0);
+	if (load_be32(p + 44) != 1280)
+		FAIL("MTU %d below 1280 in ICMPv6 reply\n", load_be32(p + 44));
+	reset(vpninfo);
+	free(pkt);
+	pkt = make_pkt(1, 1280);
+	if (icmp_pkt_too_big(vpninfo, pkt, 1000) != 0 || vpninfo->incoming_queue.count)
+		FAIL("IPv6 packet within minimum MTU not passed through\n");
+	free(pkt);
+
+	pkt = make_pkt(1, 1500);
+	pkt->data[6] = 58;
+	pkt->data[40] = 1; /* Destination unreachable */
+	if (icmp_pkt_too_big(vpninfo, pkt, 1400) != 1 || vpninfo->incoming_queue.count)
+		FAIL("Replied to an ICMPv6 error\n");
+	pkt->data[40] = 128; /* Echo request is fine */
+	icmp_pkt_too_big(vpninfo, pkt, 1400);
+	check_reply6(vpninfo, pkt, 2, 0);
+	reset(vpninfo);
+	free(pkt);
+
+	/* Administratively prohibited */
+	pkt = make_pkt(0, 100);
+	icmp_prohibited(vpninfo, pkt);
+	check_reply4(vpninfo, pkt, 3, 13);
+	reset(vpninfo);
+
+	store_be16(pkt->data + 6, 0x2000 | 10); /* Not the first fragment */
+	icmp_prohibited(vpninfo, pkt);
+	store_be16(pkt->data + 6, 0);
+	pkt->data[16] = 239; /* Multicast */
+	icmp_prohibited(vpninfo, pkt);
+	if (vpninfo->incoming_queue.count)
+		FAIL("Replied to a fragment or multicast packet\n");
+	free(pkt);
+
+	/* Odd lengths are quoted exactly, and padded for the checksum */
+	pkt = make_pkt(1, 101);
+	icmp_prohibited(vpninfo, pkt);
+	check_reply6(vpninfo, pkt, 1, 1);
+	reset(vpninfo);
+	pkt->data[24] = 0xff; /* Multicast */
+	icmp_prohibited(vpninfo, pkt);
+	if (vpninfo->incoming_queue.count)
+		FAIL("Replied to an IPv6 multicast packet\n");
+	free(pkt);
+
+	/* No more than ICMP_RATELIMIT a second. Try again if the second
+	 * changes under us. */
+	pkt = make_pkt(0, 100);
+	do {
+		reset(vpninfo);
+		start = time(NULL);
+		for (i = 0; i < ICMP_RATELIMIT * 2; i++)
+			icmp_prohibited(vpninfo, pkt);
+		sent = vpninfo->incoming_queue.count;
+	} while (time(NULL) != start);
+	if (sent != ICMP_RATELIMIT)
+		FAIL("Sent %d ICMP errors in a second, expected %d\n", sent, ICMP_RATELIMIT);
+	reset(vpninfo);
+	free(pkt);
+
+	free(vpninfo);
+	return 0;
+}
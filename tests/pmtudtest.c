@@ -0,0 +1,280 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../pmtud.c"
+
+#define FAIL(...) do { printf(__VA_ARGS__); exit(1); } while (0)
+
+/* The simulated path. Probes up to path_mtu get through. */
+static int path_mtu;
+static int sent[64], nr_sent;
+static int max_sent, min_sent;
+/* Whether other packets are being received over UDP meanwhile */
+static int other_traffic;
+/* Probes larger than this can't be sent at all */
+static int max_send = 65536;
+/* The next this many can't be sent because the socket buffer is full */
+static int busy;
+
+static void progress(void *cbdata, int level, const char *fmt, ...)
+{
+}
+
+int os_set_tun_mtu(struct openconnect_info *vpninfo, int mtu)
+{
+	return 0;
+}
+
+int openconnect_random(void *bytes, int len)
+{
+	memset(bytes, 0x5a, len);
+	return 0;
+}
+
+int ka_check_deadline(int *timeout, time_t now, time_t due)
+{
+	if (now >= due)
+		return 1;
+	if (*timeout > (due - now) * 1000)
+		*timeout = (due - now) * 1000;
+	return 0;
+}
+
+static int send_probe(struct openconnect_info *vpninfo, int len)
+{
+	if (len > max_send)
+		return -EMSGSIZE;
+	if (busy) {
+		busy--;
+		return -EAGAIN;
+	}
+	if (nr_sent == sizeof(sent) / sizeof(sent[0]))
+		FAIL("Too many probes outstanding\n");
+	sent[nr_sent++] = len;
+	if (len > max_sent)
+		max_sent = len;
+	if (len < min_sent)
+		min_sent = len;
+	return 0;
+}
+
+static struct vpn_proto proto = {
+	.udp_send_mtu_probe = send_probe,
+};
+
+/* Run the mainloop, answering the probes which fit and letting the
+ * probe timer expire for the rest, until it has nothing more to do. */
+static void run(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int i, timeout, loops = 0;
+
+	max_sent = 0;
+	min_sent = 65536;
+
+	while (p->state != PMTUD_DISABLED) {
+		if (++loops > 100)
+			FAIL("MTU detection did not converge\n");
+
+		nr_sent = 0;
+		timeout = 10000;
+		pmtud_mainloop(vpninfo, &timeout);
+		if (!nr_sent && p->state == PMTUD_COMPLETE && !p->probe_size)
+			break;
+
+		if (other_traffic)
+			vpninfo->dtls_times.last_rx = time(NULL);
+		/* Once a larger one in a burst is answered, replies to the
+		 * smaller ones are of no interest and aren't recognised. */
+		for (i = 0; i < nr_sent; i++) {
+			if (sent[i] <= path_mtu &&
+			    !pmtud_probe_acked(vpninfo, sent[i]) && !i)
+				FAIL("Reply to %d byte probe not recognised\n", sent[i]);
+		}
+		p->last_probe -= PMTUD_PROBE_TIMER;
+	}
+}
+
+static void check_mtu(struct openconnect_info *vpninfo, int lo, int hi)
+{
+	if (vpninfo->ip_info.mtu < lo || vpninfo->ip_info.mtu > hi)
+		FAIL("MTU %d, expected %d-%d\n", vpninfo->ip_info.mtu, lo, hi);
+}
+
+/* Found within PMTUD_GRANULARITY of the path MTU, without ever exceeding it */
+static void check_found(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->pmtud.state != PMTUD_COMPLETE)
+		FAIL("MTU detection state %d, expected complete\n", vpninfo->pmtud.state);
+	check_mtu(vpninfo, path_mtu - PMTUD_GRANULARITY + 1, path_mtu);
+}
+
+static void start(struct openconnect_info *vpninfo, int mtu)
+{
+	memset(&vpninfo->pmtud, 0, sizeof(vpninfo->pmtud));
+	vpninfo->ip_info.mtu = mtu;
+	pmtud_start(vpninfo);
+}
+
+int main(void)
+{
+	struct openconnect_info *vpninfo = calloc(1, sizeof(*vpninfo));
+	struct sockaddr_in sin;
+	int timeout;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	vpninfo->progress = progress;
+	vpninfo->proto = &proto;
+	vpninfo->tun_fd = -1;
+	vpninfo->uid = getuid();
+	vpninfo->dtls_addr = (void *)&sin;
+	vpninfo->dtls_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (vpninfo->dtls_fd < 0)
+		FAIL("Failed to create UDP socket\n");
+
+	/* Starts conservatively while UDP is being set up */
+	vpninfo->ip_info.mtu = 1400;
+	vpninfo->dtls_state = DTLS_SLEEPING;
+	pmtud_tun_setup(vpninfo);
+	check_mtu(vpninfo, PMTUD_CONSERVATIVE, PMTUD_CONSERVATIVE);
+
+	/* Back to the negotiated MTU if UDP doesn't come up in time */
+	timeout = 60000;
+	pmtud_udp_fallback(vpninfo, &timeout);
+	check_mtu(vpninfo, PMTUD_CONSERVATIVE, PMTUD_CONSERVATIVE);
+	if (timeout > PMTUD_UDP_TIMEOUT * 1000)
+		FAIL("Timeout %d not set for UDP fallback\n", timeout);
+	vpninfo->pmtud.clamped -= PMTUD_UDP_TIMEOUT;
+	pmtud_udp_fallback(vpninfo, &timeout);
+	check_mtu(vpninfo, 1400, 1400);
+
+	/* ... or straight away if it's disabled */
+	vpninfo->ip_info.mtu = 1400;
+	pmtud_tun_setup(vpninfo);
+	check_mtu(vpninfo, PMTUD_CONSERVATIVE, PMTUD_CONSERVATIVE);
+	vpninfo->dtls_state = DTLS_DISABLED;
+	pmtud_udp_fallback(vpninfo, &timeout);
+	check_mtu(vpninfo, 1400, 1400);
+	vpninfo->dtls_state = DTLS_SLEEPING;
+
+	/* ... but not if we couldn't raise it again later */
+	vpninfo->ip_info.mtu = 1400;
+	vpninfo->pmtud.max = 0;
+	vpninfo->use_tun_script = 1;
+	pmtud_tun_setup(vpninfo);
+	check_mtu(vpninfo, 1400, 1400);
+	vpninfo->use_tun_script = 0;
+
+	/* The whole path works; the first burst finds it */
+	path_mtu = 1500;
+	start(vpninfo, 1400);
+	run(vpninfo);
+	check_mtu(vpninfo, 1400, 1400);
+	if (vpninfo->pmtud.state != PMTUD_COMPLETE)
+		FAIL("MTU detection not complete\n");
+	if (min_sent < 576 || max_sent != 1400)
+		FAIL("Probes of %d-%d bytes, outside 576-1400\n", min_sent, max_sent);
+
+	/* Somewhere in the middle, bisecting between the burst sizes */
+	path_mtu = 1337;
+	start(vpninfo, 1400);
+	run(vpninfo);
+	check_found(vpninfo);
+	if (min_sent < 576 || max_sent > 1400)
+		FAIL("Probes of %d-%d bytes, outside 576-1400\n", min_sent, max_sent);
+
+	/* Just above base, below all but the smallest size in the burst */
+	path_mtu = 600;
+	start(vpninfo, 1400);
+	run(vpninfo);
+	check_found(vpninfo);
+
+	/* With IPv6 in the tunnel, nothing below 1280 is tried */
+	vpninfo->ip_info.addr6 = "fd00::1";
+	path_mtu = 1300;
+	start(vpninfo, 1400);
+	run(vpninfo);
+	check_found(vpninfo);
+	if (min_sent < 1280)
+		FAIL("Probe of %d bytes with IPv6\n", min_sent);
+	vpninfo->ip_info.addr6 = NULL;
+
+	/* Nothing answers: give up and use the negotiated MTU */
+	path_mtu = 0;
+	start(vpninfo, 1400);
+	run(vpninfo);
+	check_mtu(vpninfo, 1400, 1400);
+
+	/* The path MTU shrinks after detection. While other packets are
+	 * still getting through, the failure to confirm the current MTU
+	 * means we're black-holing, so drop to base and search again. */
+	path_mtu = 1500;
+	start(vpninfo, 1400);
+	run(vpninfo);
+	check_mtu(vpninfo, 1400, 1400);
+	path_mtu = 1000;
+	other_traffic = 1;
+	vpninfo->pmtud.confirm_due = 0;
+	run(vpninfo);
+	check_found(vpninfo);
+	if (max_sent != 1400)
+		FAIL("Current MTU was not confirmed\n");
+
+	/* If nothing at all is getting through, it's for DPD to deal with */
+	path_mtu = 0;
+	other_traffic = 0;
+	vpninfo->pmtud.confirm_due = 0;
+	vpninfo->dtls_times.last_rx = 0;
+	run(vpninfo);
+	check_mtu(vpninfo, 1000 - PMTUD_GRANULARITY + 1, 1000);
+	if (vpninfo->pmtud.state != PMTUD_COMPLETE)
+		FAIL("MTU detection state %d after losing the path\n", vpninfo->pmtud.state);
+
+	/* And when it grows again, we notice in time */
+	path_mtu = 1500;
+	vpninfo->pmtud.raise_due = 0;
+	run(vpninfo);
+	check_mtu(vpninfo, 1400, 1400);
+
+	/* A full socket buffer isn't taken to mean the probe is too large */
+	busy = PMTUD_MAX_PROBES * 2;
+	vpninfo->pmtud.confirm_due = 0;
+	run(vpninfo);
+	check_mtu(vpninfo, 1400, 1400);
+	if (busy)
+		FAIL("Probe not retried after the socket buffer was full\n");
+
+	/* But one which can't be sent at all is */
+	max_send = 1200;
+	other_traffic = 1;
+	vpninfo->pmtud.confirm_due = 0;
+	run(vpninfo);
+	check_mtu(vpninfo, 1200 - PMTUD_GRANULARITY + 1, 1200);
+	max_send = 65536;
+	other_traffic = 0;
+
+	close(vpninfo->dtls_fd);
+	free(vpninfo);
+	return 0;
+}
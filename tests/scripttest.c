@@ -0,0 +1,112 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../textbuf.c"
+#include "../script.c"
+
+#define FAIL(...) do { printf(__VA_ARGS__); exit(1); } while (0)
+
+static void progress(void *cbdata, int level, const char *fmt, ...)
+{
+}
+
+/* Not MD5, but it changes when the input does, which is all that matters */
+int openconnect_md5(unsigned char *result, void *data, int len)
+{
+	unsigned char *p = data;
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < MD5_SIZE; i++) {
+		int j;
+
+		for (j = 0; j < len; j++)
+			h = (h ^ p[j]) * 16777619U;
+		result[i] = h >> 24;
+		h ^= i;
+	}
+	return 0;
+}
+
+char *openconnect_utf8_to_legacy(struct openconnect_info *vpninfo, const char *utf8)
+{
+	return (char *)utf8;
+}
+
+const char *dnsproxy_addr(struct openconnect_info *vpninfo)
+{
+	return "127.0.0.1";
+}
+
+int netcfg_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	return 0;
+}
+
+/* The script fails if it runs at all, so we can tell */
+static void check_script(struct openconnect_info *vpninfo, const char *reason, int runs)
+{
+	int ret = script_config_tun(vpninfo, reason);
+
+	if (runs && ret != -EIO)
+		FAIL("Script not run for %s\n", reason);
+	if (!runs && ret)
+		FAIL("Script run for %s (%d)\n", reason, ret);
+}
+
+int main(void)
+{
+	struct openconnect_info *vpninfo = calloc(1, sizeof(*vpninfo));
+
+	vpninfo->progress = progress;
+	vpninfo->vpnc_script = "exit 3";
+	vpninfo->ip_info.addr = "10.9.0.2";
+	vpninfo->ip_info.netmask = "255.255.255.0";
+	vpninfo->ip_info.dns[0] = "10.9.0.53";
+
+	/* MTU detection starts with a conservative MTU before the tun
+	 * device is set up, and raises it later */
+	vpninfo->pmtud.max = 1400;
+	vpninfo->ip_info.mtu = 1280;
+	check_script(vpninfo, "connect", 1);
+	vpninfo->ip_info.mtu = 1360;
+
+	/* Reconnecting gets the same configuration, and MTU detection
+	 * starts again from the negotiated MTU */
+	vpninfo->pmtud.max = 0;
+	vpninfo->ip_info.mtu = 1400;
+	check_script(vpninfo, "reconnect", 0);
+
+	/* Always for the other reasons */
+	check_script(vpninfo, "attempt-reconnect", 1);
+
+	/* A different configuration does need the script */
+	vpninfo->ip_info.dns[0] = "10.9.0.54";
+	check_script(vpninfo, "reconnect", 1);
+	check_script(vpninfo, "reconnect", 0);
+	vpninfo->ip_info.mtu = 1300;
+	check_script(vpninfo, "reconnect", 1);
+
+	free(vpninfo);
+	return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../socks.c"
+
+/* Each has its own static now_ms() */
+#define now_ms ustack_now_ms
+#include "../ustack.c"
+#undef now_ms
+#define now_ms dnsproxy_now_ms
+#include "../dnsproxy.c"
+#undef now_ms
+
+#define FAIL(...) do { printf(__VA_ARGS__); exit(1); } while (0)
+
+int openconnect_random(void *bytes, int len)
+{
+	memset(bytes, 0, len);
+	return 0;
+}
+
+static int client_fd;
+
+static void new_conn(struct socks_conn *c, int http)
+{
+	int fds[2];
+
+	if (c->fd)
+		close(c->fd);
+	if (client_fd)
+		close(client_fd);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		FAIL("socketpair: %s\n", strerror(errno));
+
+	memset(c, 0, sizeof(*c));
+	c->fd = fds[0];
+	c->http = http;
+	client_fd = fds[1];
+}
+
+static void set_buf(struct socks_conn *c, const void *data, int len)
+{
+	memcpy(c->buf, data, len);
+	c->buflen = len;
+}
+
+static void add_buf(struct socks_conn *c, const void *data, int len)
+{
+	memcpy(c->buf + c->buflen, data, len);
+	c->buflen += len;
+}
+
+/* What the proxy has sent back to the client */
+static void check_sent(const void *expected, int len)
+{
+	unsigned char buf[64];
+	int ret = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+	if (ret != len || memcmp(buf, expected, len))
+		FAIL("Client got %d bytes, expected %d\n", ret, len);
+}
+
+static void check_parsed(struct socks_conn *c, int ret, const char *host, int port)
+{
+	if (ret != 1)
+		FAIL("Request for %s not parsed (%d)\n", host, ret);
+	if (strcmp(c->host, host) || c->port != port)
+		FAIL("Parsed %s port %d, expected %s port %d\n",
+		     c->host, c->port, host, port);
+}
+
+static void test_listen(void)
+{
+	static const struct {
+		const char *str, *host, *port;
+	} good[] = {
+		{ "1080", "127.0.0.1", "1080" },
+		{ "0.0.0.0:1080", "0.0.0.0", "1080" },
+		{ "[::1]:8080", "::1", "8080" },
+		{ "localhost:65535", "localhost", "65535" },
+	};
+	static const char *bad[] = {
+		"", "0", "65536", "1080x", "host:", "[::1]8080", "[::1", "::1:0",
+	};
+	char *host, *port;
+	int i;
+
+	for (i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+		if (socks_parse_listen(good[i].str, &host, &port))
+			FAIL("Failed to parse '%s'\n", good[i].str);
+		if (strcmp(host, good[i].host) || strcmp(port, good[i].port))
+			FAIL("Parsed '%s' as %s port %s\n", good[i].str, host, port);
+		free(host);
+		free(port);
+	}
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		host = port = NULL;
+		if (socks_parse_listen(bad[i], &host, &port) != -EINVAL || host)
+			FAIL("Parsed bad listen address '%s'\n", bad[i]);
+	}
+}
+
+static void test_socks5(struct socks_conn *c)
+{
+	static const unsigned char req4[] = { 5, 1, 0, 1, 192, 0, 2, 1, 0x01, 0xbb };
+	static const unsigned char req6[] = { 5, 1, 0, 4, 0x20, 0x01, 0x0d, 0xb8,
+					      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 22 };
+	static const unsigned char reqname[] = { 5, 1, 0, 3, 11, 'e', 'x', 'a', 'm', 'p',
+						 'l', 'e', '.', 'c', 'o', 'm', 0, 80 };
+	unsigned char req[10];
+
+	/* The greeting and the request can arrive in pieces */
+	new_conn(c, 0);
+	set_buf(c, "\x05\x02", 2);
+	if (socks5_parse(NULL, c))
+		FAIL("Parsed a partial greeting\n");
+	add_buf(c, "\x02\x00", 2);
+	if (socks5_parse(NULL, c) || !c->greeted || c->buflen)
+		FAIL("Greeting not consumed\n");
+	check_sent("\x05\x00", 2);
+	add_buf(c, req4, 6);
+	if (socks5_parse(NULL, c))
+		FAIL("Parsed a partial request\n");
+	add_buf(c, req4 + 6, sizeof(req4) - 6);
+	check_parsed(c, socks5_parse(NULL, c), "192.0.2.1", 443);
+	if (c->buflen)
+		FAIL("Request not consumed\n");
+
+	/* Or all at once, with the client's first data behind them */
+	new_conn(c, 0);
+	set_buf(c, "\x05\x01\x00", 3);
+	add_buf(c, reqname, sizeof(reqname));
+	add_buf(c, "GET", 3);
+	check_parsed(c, socks5_parse(NULL, c), "example.com", 80);
+	if (c->buflen != 3 || memcmp(c->buf, "GET", 3))
+		FAIL("Data after the request lost\n");
+
+	new_conn(c, 0);
+	c->greeted = 1;
+	set_buf(c, req6, sizeof(req6));
+	check_parsed(c, socks5_parse(NULL, c), "2001:db8::1", 22);
+
+	/* Nothing but username/password authentication */
+	new_conn(c, 0);
+	set_buf(c, "\x05\x01\x02", 3);
+	if (socks5_parse(NULL, c) != -EPERM)
+		FAIL("Accepted a client without 'no authentication'\n");
+	check_sent("\x05\xff", 2);
+
+	new_conn(c, 0);
+	c->greeted = 1;
+	memcpy(req, req4, sizeof(req));
+	req[0] = 4;
+	set_buf(c, req, sizeof(req));
+	if (socks5_parse(NULL, c) != -EINVAL)
+		FAIL("Accepted SOCKS version 4\n");
+
+	/* BIND */
+	req[0] = 5;
+	req[1] = 2;
+	set_buf(c, req, sizeof(req));
+	if (socks5_parse(NULL, c) != -EOPNOTSUPP)
+		FAIL("Accepted BIND\n");
+
+	req[1] = 1;
+	req[3] = 5;
+	set_buf(c, req, sizeof(req));
+	if (socks5_parse(NULL, c) != -EADDRNOTAVAIL)
+		FAIL("Accepted address type 5\n");
+}
+
+static int http_req(struct socks_conn *c, const char *req)
+{
+	new_conn(c, 1);
+	set_buf(c, req, strlen(req));
+	return http_parse(NULL, c);
+}
+
+static void test_http(struct socks_conn *c)
+{
+	static const char *bad[] = {
+		"CONNECT example.com HTTP/1.1\r\n\r\n",
+		"CONNECT example.com:0 HTTP/1.1\r\n\r\n",
+		"CONNECT example.com:65536 HTTP/1.1\r\n\r\n",
+		"CONNECT example.com:443x HTTP/1.1\r\n\r\n",
+		"CONNECT [2001:db8::1:443 HTTP/1.1\r\n\r\n",
+		"CONNECT example.com:443\r\n\r\n",
+	};
+	const char *req = "CONNECT example.com:443 HTTP/1.1\r\n"
+		"Host: example.com:443\r\n\r\n";
+	int i;
+
+	check_parsed(c, http_req(c, req), "example.com", 443);
+	if (c->buflen)
+		FAIL("HTTP request not consumed\n");
+
+	check_parsed(c, http_req(c, "CONNECT [2001:db8::1]:8443 HTTP/1.1\r\n\r\n\x16\x03"),
+		     "2001:db8::1", 8443);
+	if (c->buflen != 2 || memcmp(c->buf, "\x16\x03", 2))
+		FAIL("Data after the HTTP request lost\n");
+
+	/* Waiting for the rest of the headers */
+	if (http_req(c, "CONNECT example.com:443 HTTP/1.1\r\nHost: example.com\r\n"))
+		FAIL("Parsed a partial HTTP request\n");
+	add_buf(c, "\r\n", 2);
+	check_parsed(c, http_parse(NULL, c), "example.com", 443);
+
+	if (http_req(c, "GET http://example.com/ HTTP/1.1\r\n\r\n") != -EOPNOTSUPP)
+		FAIL("Accepted GET\n");
+
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+		if (http_req(c, bad[i]) != -EINVAL)
+			FAIL("Accepted bad request '%s'\n", bad[i]);
+
+	/* Headers which fill the buffer without ending */
+	new_conn(c, 1);
+	memset(c->buf, 'x', sizeof(c->buf));
+	c->buflen = sizeof(c->buf);
+	if (http_parse(NULL, c) != -EINVAL)
+		FAIL("Accepted a request which overflowed the buffer\n");
+}
+
+/* A response to "www.example.com" from @id, with a CNAME and then @rr */
+static int dns_response(unsigned char *p, uint16_t id, int rcode,
+			const unsigned char *rr, int rrlen)
+{
+	static const unsigned char question[] = {
+		3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+		0, DNS_A, 0, 1,
+	};
+	static const unsigned char cname[] = {
+		0xc0, 12, 0, 5, 0, 1, 0, 0, 0, 60, 0, 2, 0xc0, 16,
+	};
+	int len = 12;
+
+	memset(p, 0, 12);
+	store_be16(p, id);
+	store_be16(p + 2, 0x8180 | rcode);
+	store_be16(p + 4, 1);
+	store_be16(p + 6, rr ? 2 : 1);
+	memcpy(p + len, question, sizeof(question));
+	len += sizeof(question);
+	memcpy(p + len, cname, sizeof(cname));
+	len += sizeof(cname);
+	if (rr) {
+		memcpy(p + len, rr, rrlen);
+		len += rrlen;
+	}
+	return len;
+}
+
+static void test_dns(void)
+{
+	/* example.com A 192.0.2.80, named by a pointer to it in the question */
+	static const unsigned char a[] = {
+		0xc0, 16, 0, DNS_A, 0, 1, 0, 0, 0, 60, 0, 4, 192, 0, 2, 80,
+	};
+	static const unsigned char aaaa[] = {
+		0xc0, 16, 0, DNS_AAAA, 0, 1, 0, 0, 0, 60, 0, 16,
+		0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x50,
+	};
+	/* Wrong length for an A record */
+	static const unsigned char a_long[] = {
+		0xc0, 16, 0, DNS_A, 0, 1, 0, 0, 0, 60, 0, 5, 192, 0, 2, 80, 0,
+	};
+	struct socks_conn *c = calloc(1, sizeof(*c));
+	unsigned char p[512], addr[16];
+	int len, i;
+
+	c->dns_id = 0x1234;
+	c->dns_type = DNS_A;
+
+	len = dns_response(p, 0x1234, 0, a, sizeof(a));
+	if (dns_parse(c, p, len, addr) != 1 || memcmp(addr, a + 12, 4))
+		FAIL("A record not found\n");
+
+	/* Anything shorter is truncated, and must not be read past its end */
+	for (i = 0; i < len; i++)
+		if (dns_parse(c, p, i, addr) != (i < 12 ? 0 : -EIO))
+			FAIL("Truncated response of %d bytes not rejected\n", i);
+
+	/* Someone else's response */
+	c->dns_id = 0x4321;
+	if (dns_parse(c, p, len, addr))
+		FAIL("Response with the wrong ID accepted\n");
+	c->dns_id = 0x1234;
+	p[2] &= ~0x80;
+	if (dns_parse(c, p, len, addr))
+		FAIL("Query taken as a response\n");
+
+	len = dns_response(p, 0x1234, 3, NULL, 0);
+	if (dns_parse(c, p, len, addr) != -ENOENT)
+		FAIL("NXDOMAIN not reported\n");
+	len = dns_response(p, 0x1234, 2, NULL, 0);
+	if (dns_parse(c, p, len, addr) != -EIO)
+		FAIL("SERVFAIL not reported\n");
+
+	len = dns_response(p, 0x1234, 0, aaaa, sizeof(aaaa));
+	if (dns_parse(c, p, len, addr) != -ENODATA)
+		FAIL("AAAA record taken for an A record\n");
+	c->dns_type = DNS_AAAA;
+	if (dns_parse(c, p, len, addr) != 1 || memcmp(addr, aaaa + 12, 16))
+		FAIL("AAAA record not found\n");
+
+	c->dns_type = DNS_A;
+	len = dns_response(p, 0x1234, 0, a_long, sizeof(a_long));
+	if (dns_parse(c, p, len, addr) != -ENODATA)
+		FAIL("A record of the wrong length accepted\n");
+
+	free(c);
+}
+
+int main(void)
+{
+	struct socks_conn *c = calloc(1, sizeof(*c));
+
+	test_listen();
+	test_socks5(c);
+	test_http(c);
+	test_dns();
+
+	close(c->fd);
+	close(client_fd);
+	free(c);
+	return 0;
+}
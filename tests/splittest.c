@@ -0,0 +1,339 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../icmp.c"
+#include "../split.c"
+
+#define FAIL(...) do { printf(__VA_ARGS__); exit(1); } while (0)
+
+static void progress(void *cbdata, int level, const char *fmt, ...)
+{
+}
+
+static void init_trie(struct lpm_trie *t, int bits)
+{
+	memset(t, 0, sizeof(*t));
+	t->root = -1;
+	t->bits = bits;
+}
+
+static void add(struct lpm_trie *t, const char *str, int verdict)
+{
+	uint32_t key[4];
+	int plen;
+
+	if (parse_prefix(str, key, &plen) != (t->bits == 32 ? AF_INET : AF_INET6))
+		FAIL("Failed to parse '%s'\n", str);
+	if (lpm_insert(t, key, plen, verdict))
+		FAIL("Failed to insert '%s'\n", str);
+}
+
+static void check(struct lpm_trie *t, const char *addr, int expected)
+{
+	uint32_t key[4];
+	int plen, verdict;
+
+	if (parse_prefix(addr, key, &plen) < 0)
+		FAIL("Failed to parse '%s'\n", addr);
+	verdict = lpm_lookup(t, key);
+	if (verdict != expected)
+		FAIL("Lookup of %s gave %d, expected %d\n", addr, verdict, expected);
+}
+
+static void check_parse(const char *str, int family, int plen)
+{
+	uint32_t key[4];
+	int len = -1, ret;
+
+	ret = parse_prefix(str, key, &len);
+	if (ret != family || (family > 0 && len != plen))
+		FAIL("Parsing '%s' gave %d/%d, expected %d/%d\n",
+		     str, ret, len, family, plen);
+}
+
+/* Nested includes and excludes, inserted in the given order */
+static void test_nested(const int *order)
+{
+	static const char *prefixes[] = {
+		"10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24", "10.1.2.128/25",
+		"10.1.2.200", "0.0.0.0/1",
+	};
+	static const int verdicts[] = {
+		SPLIT_INCLUDE, SPLIT_EXCLUDE, SPLIT_INCLUDE, SPLIT_EXCLUDE,
+		SPLIT_INCLUDE, SPLIT_EXCLUDE,
+	};
+	struct lpm_trie t;
+	int i;
+
+	init_trie(&t, 32);
+	for (i = 0; i < 6; i++)
+		add(&t, prefixes[order[i]], verdicts[order[i]]);
+
+	check(&t, "10.200.0.1", SPLIT_INCLUDE);
+	check(&t, "10.1.200.1", SPLIT_EXCLUDE);
+	check(&t, "10.1.2.1", SPLIT_INCLUDE);
+	check(&t, "10.1.2.127", SPLIT_INCLUDE);
+	check(&t, "10.1.2.128", SPLIT_EXCLUDE);
+	check(&t, "10.1.2.200", SPLIT_INCLUDE);
+	check(&t, "10.1.2.201", SPLIT_EXCLUDE);
+	check(&t, "11.0.0.1", SPLIT_EXCLUDE);
+	check(&t, "128.0.0.1", SPLIT_NONE);
+	lpm_free(&t);
+}
+
+/* A simple PRNG, so that the results don't depend on the platform */
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+#define NR_RANDOM 200
+
+/* Compare against a linear search of many random, overlapping prefixes */
+static void test_random(int bits)
+{
+	static uint32_t keys[NR_RANDOM][4];
+	static int plens[NR_RANDOM], verdicts[NR_RANDOM];
+	struct lpm_trie t;
+	uint32_t key[4];
+	int i, j, n;
+
+	init_trie(&t, bits);
+	for (i = 0; i < NR_RANDOM; i++) {
+		/* Mostly in a small region, so that they overlap */
+		for (j = 0; j < 4; j++)
+			keys[i][j] = j * 32 < bits ? rnd() : 0;
+		keys[i][0] = (keys[i][0] & 0x00ffffff) | 0x0a000000;
+		plens[i] = 8 + rnd() % (bits - 7);
+		verdicts[i] = 1 + rnd() % 2;
+		if (lpm_insert(&t, keys[i], plens[i], verdicts[i]))
+			FAIL("Failed to insert random prefix\n");
+	}
+
+	for (n = 0; n < 10000; n++) {
+		int best = -1, expected = SPLIT_NONE;
+
+		/* Often close to one of the prefixes, so that it matches */
+		i = rnd() % NR_RANDOM;
+		for (j = 0; j < 4; j++)
+			key[j] = keys[i][j];
+		j = rnd() % bits;
+		if (rnd() & 1)
+			key[j / 32] ^= 1U << (31 - j % 32);
+
+		for (i = 0; i < NR_RANDOM; i++) {
+			if (!prefix_match(keys[i], key, plens[i]))
+				continue;
+			if (plens[i] > best) {
+				best = plens[i];
+				expected = verdicts[i];
+			} else if (plens[i] == best && verdicts[i] == SPLIT_EXCLUDE) {
+				expected = SPLIT_EXCLUDE;
+			}
+		}
+		if (lpm_lookup(&t, key) != expected)
+			FAIL("Random IPv%d lookup %d gave %d, expected %d\n",
+			     bits == 32 ? 4 : 6, n, lpm_lookup(&t, key), expected);
+	}
+	lpm_free(&t);
+}
+
+static struct pkt *make_pkt(const char *src, const char *dst)
+{
+	struct pkt *pkt = calloc(1, sizeof(*pkt) + 60);
+
+	if (strchr(dst, ':')) {
+		pkt->len = 60;
+		pkt->data[0] = 0x60;
+		pkt->data[6] = 17;
+		inet_pton(AF_INET6, src, pkt->data + 8);
+		inet_pton(AF_INET6, dst, pkt->data + 24);
+	} else {
+		pkt->len = 40;
+		pkt->data[0] = 0x45;
+		pkt->data[9] = 17;
+		inet_pton(AF_INET, src, pkt->data + 12);
+		inet_pton(AF_INET, dst, pkt->data + 16);
+	}
+	return pkt;
+}
+
+static void check_drop(struct openconnect_info *vpninfo, const char *dst, int drop)
+{
+	struct pkt *pkt = make_pkt(strchr(dst, ':') ? "fd00::1" : "10.0.0.1", dst);
+	uint64_t filtered = vpninfo->stats.tx_filtered_pkts;
+
+	if (split_filter_drop(vpninfo, pkt) != drop)
+		FAIL("Packet to %s %s\n", dst, drop ? "not dropped" : "dropped");
+	if (vpninfo->stats.tx_filtered_pkts != filtered + drop)
+		FAIL("Filtered packet count not updated for %s\n", dst);
+	if (vpninfo->incoming_queue.count != drop)
+		FAIL("%d ICMP errors for packet to %s\n", vpninfo->incoming_queue.count, dst);
+	free(pkt);
+
+	while ((pkt = dequeue_packet(&vpninfo->incoming_queue)))
+		free(pkt);
+	vpninfo->icmp_ratelimit_count = 0;
+}
+
+static void check_routed(struct openconnect_info *vpninfo, const char *addr, int routed)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (void *)&ss;
+	struct sockaddr_in6 *sin6 = (void *)&ss;
+
+	memset(&ss, 0, sizeof(ss));
+	if (strchr(addr, ':')) {
+		sin6->sin6_family = AF_INET6;
+		inet_pton(AF_INET6, addr, &sin6->sin6_addr);
+	} else {
+		sin->sin_family = AF_INET;
+		inet_pton(AF_INET, addr, &sin->sin_addr);
+	}
+	if (split_routes_addr(vpninfo, (void *)&ss) != routed)
+		FAIL("%s %s through the VPN\n", addr, routed ? "not routed" : "routed");
+}
+
+int main(void)
+{
+	static const int orders[][6] = {
+		{ 0, 1, 2, 3, 4, 5 },
+		{ 5, 4, 3, 2, 1, 0 },
+		{ 2, 4, 0, 5, 3, 1 },
+		{ 3, 0, 4, 1, 5, 2 },
+	};
+	struct openconnect_info *vpninfo = calloc(1, sizeof(*vpninfo));
+	struct oc_split_include inc[3], exc[2];
+	struct lpm_trie t;
+	int i;
+
+	check_parse("10.0.0.0/8", AF_INET, 8);
+	check_parse("10.0.0.0/255.255.0.0", AF_INET, 16);
+	check_parse("10.1.2.3", AF_INET, 32);
+	check_parse("0.0.0.0/0", AF_INET, 0);
+	check_parse("2001:db8::/32", AF_INET6, 32);
+	check_parse("2001:db8::1", AF_INET6, 128);
+	check_parse("10.0.0.0/255.0.255.0", -EINVAL, 0);
+	check_parse("10.0.0.0/33", -EINVAL, 0);
+	check_parse("2001:db8::/129", -EINVAL, 0);
+	check_parse("10.0.0.0/", -EINVAL, 0);
+	check_parse("banana", -EINVAL, 0);
+
+	for (i = 0; i < sizeof(orders) / sizeof(orders[0]); i++)
+		test_nested(orders[i]);
+
+	/* The same prefix both included and excluded is excluded,
+	 * whichever comes first. */
+	init_trie(&t, 32);
+	add(&t, "192.168.0.0/16", SPLIT_INCLUDE);
+	add(&t, "192.168.0.0/16", SPLIT_EXCLUDE);
+	add(&t, "172.16.0.0/12", SPLIT_EXCLUDE);
+	add(&t, "172.16.0.0/12", SPLIT_INCLUDE);
+	check(&t, "192.168.1.1", SPLIT_EXCLUDE);
+	check(&t, "172.17.1.1", SPLIT_EXCLUDE);
+	lpm_free(&t);
+
+	init_trie(&t, 128);
+	add(&t, "2001:db8::/32", SPLIT_INCLUDE);
+	add(&t, "2001:db8:1::/48", SPLIT_EXCLUDE);
+	add(&t, "2001:db8:1:2::/64", SPLIT_INCLUDE);
+	add(&t, "2001:db8:1:2::5", SPLIT_EXCLUDE);
+	check(&t, "2001:db8:ffff::1", SPLIT_INCLUDE);
+	check(&t, "2001:db8:1:ffff::1", SPLIT_EXCLUDE);
+	check(&t, "2001:db8:1:2::1", SPLIT_INCLUDE);
+	check(&t, "2001:db8:1:2::5", SPLIT_EXCLUDE);
+	check(&t, "2001:db9::1", SPLIT_NONE);
+	lpm_free(&t);
+
+	test_random(32);
+	test_random(128);
+
+	/* The whole filter, as built from the IP configuration */
+	vpninfo->progress = progress;
+	init_pkt_queue(&vpninfo->incoming_queue);
+	init_pkt_queue(&vpninfo->free_queue);
+
+	inc[0].route = "10.0.0.0/255.0.0.0";
+	inc[0].next = &inc[1];
+	inc[1].route = "172.16.0.0/12";
+	inc[1].next = NULL;
+	exc[0].route = "10.99.0.0/16";
+	exc[0].next = NULL;
+	vpninfo->ip_info.split_includes = inc;
+	vpninfo->ip_info.split_excludes = exc;
+	vpninfo->ip_info.addr = "192.168.100.5";
+	vpninfo->ip_info.netmask = "255.255.255.0";
+	vpninfo->ip_info.dns[0] = "192.0.2.53";
+
+	/* Nothing unless asked for */
+	if (split_filter_build(vpninfo) || vpninfo->split_filter)
+		FAIL("Split filter built without enforcement\n");
+
+	vpninfo->enforce_split = 1;
+	if (split_filter_build(vpninfo) || !vpninfo->split_filter)
+		FAIL("Failed to build split filter\n");
+
+	check_drop(vpninfo, "10.1.2.3", 0);
+	check_drop(vpninfo, "172.31.0.1", 0);
+	check_drop(vpninfo, "192.168.100.1", 0);
+	check_drop(vpninfo, "192.0.2.53", 0);
+	check_drop(vpninfo, "10.99.0.1", 1);
+	check_drop(vpninfo, "192.0.2.54", 1);
+	check_drop(vpninfo, "8.8.8.8", 1);
+	/* No IPv6 split includes, so IPv6 isn't filtered */
+	check_drop(vpninfo, "2001:db8::1", 0);
+
+	/* With an IPv6 include, it is */
+	inc[1].next = &inc[2];
+	inc[2].route = "2001:db8::/32";
+	inc[2].next = NULL;
+	if (split_filter_build(vpninfo) || !vpninfo->split_filter)
+		FAIL("Failed to rebuild split filter\n");
+	check_drop(vpninfo, "2001:db8::1", 0);
+	check_drop(vpninfo, "2001:db9::1", 1);
+	check_drop(vpninfo, "10.1.2.3", 0);
+
+	/* Whether the routes would send a gateway address through the VPN */
+	check_routed(vpninfo, "10.1.2.3", 1);
+	check_routed(vpninfo, "10.99.0.1", 0);
+	check_routed(vpninfo, "192.168.100.1", 1);
+	check_routed(vpninfo, "8.8.8.8", 0);
+	/* Not without an IPv6 address in the VPN */
+	check_routed(vpninfo, "2001:db8::1", 0);
+	vpninfo->ip_info.addr6 = "fd00::1";
+	check_routed(vpninfo, "2001:db8::1", 1);
+	check_routed(vpninfo, "2001:db9::1", 0);
+	/* No IPv4 includes means a default route, less the excludes */
+	inc[0].next = inc[1].next = NULL;
+	inc[0].route = "2001:db8::/32";
+	check_routed(vpninfo, "8.8.8.8", 1);
+	check_routed(vpninfo, "10.99.0.1", 0);
+	exc[0].route = "0.0.0.0/0";
+	check_routed(vpninfo, "8.8.8.8", 0);
+
+	split_filter_free(vpninfo);
+	free(vpninfo);
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../ustack.c"
+
+#define FAIL(...) do { printf(__VA_ARGS__); exit(1); } while (0)
+
+int openconnect_random(void *bytes, int len)
+{
+	memset(bytes, 0, len);
+	return 0;
+}
+
+static void check_ooo(struct ustack_sock *s, int nr, const uint32_t *ranges)
+{
+	int i;
+
+	if (s->nr_ooo != nr)
+		FAIL("%d out-of-order ranges, expected %d\n", s->nr_ooo, nr);
+	for (i = 0; i < nr; i++)
+		if (s->ooo[i].start != ranges[2 * i] || s->ooo[i].end != ranges[2 * i + 1])
+			FAIL("Out-of-order range %d is %u-%u, expected %u-%u\n", i,
+			     s->ooo[i].start, s->ooo[i].end, ranges[2 * i], ranges[2 * i + 1]);
+}
+
+static void test_opts(void)
+{
+	static const unsigned char syn_opts[] = {
+		2, 4, 0x04, 0xb0,	/* MSS 1200 */
+		1, 3, 3, 7,		/* NOP, window scale 7 */
+		1, 1, 4, 2,		/* NOP, NOP, SACK permitted */
+	};
+	static const unsigned char big_wscale[] = { 3, 3, 20, 0 };
+	static const unsigned char overrun[] = { 1, 2, 8, 0x05, 0x00 };
+	struct ustack_sock s;
+
+	memset(&s, 0, sizeof(s));
+	s.mss = 1460;
+	tcp_parse_opts(&s, syn_opts, sizeof(syn_opts));
+	if (s.mss != 1200 || s.snd_wscale != 7 || s.rcv_wscale != USTACK_WSCALE || !s.sack_ok)
+		FAIL("Parsed MSS %d wscale %d/%d SACK %d\n", s.mss, s.snd_wscale,
+		     s.rcv_wscale, s.sack_ok);
+
+	/* Without an MSS option the peer's is 536 (RFC879), and without
+	 * window scaling neither side scales. */
+	memset(&s, 0, sizeof(s));
+	s.mss = 1460;
+	tcp_parse_opts(&s, NULL, 0);
+	if (s.mss != 536 || s.snd_wscale || s.rcv_wscale || s.sack_ok)
+		FAIL("No options gave MSS %d wscale %d/%d SACK %d\n", s.mss,
+		     s.snd_wscale, s.rcv_wscale, s.sack_ok);
+
+	/* RFC7323 §2.3 */
+	memset(&s, 0, sizeof(s));
+	s.mss = 1460;
+	tcp_parse_opts(&s, big_wscale, sizeof(big_wscale));
+	if (s.snd_wscale != 14)
+		FAIL("Window scale %d not capped at 14\n", s.snd_wscale);
+
+	/* An option which claims to run past the end is ignored */
+	memset(&s, 0, sizeof(s));
+	s.mss = 1460;
+	tcp_parse_opts(&s, overrun, 3);
+	if (s.mss != 536)
+		FAIL("Truncated option parsed as MSS %d\n", s.mss);
+}
+
+static void test_ooo(void)
+{
+	static const uint32_t two[] = { 1100, 1200, 1300, 1400 };
+	static const uint32_t one[] = { 1100, 1400 };
+	static const uint32_t late[] = { 1500, 1600 };
+	unsigned char data[300], out[600];
+	struct ustack_sock s;
+	int i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i;
+
+	memset(&s, 0, sizeof(s));
+	if (ubuf_init(&s.rcv))
+		FAIL("No memory\n");
+	/* Wrap around the end of the ring */
+	s.rcv.head = USTACK_BUFSIZE - 200;
+	s.rcv_nxt = 1000;
+
+	tcp_queue_ooo(&s, 1100, data + 100, 100);
+	tcp_queue_ooo(&s, 1300, data + 300 - 100, 100);
+	check_ooo(&s, 2, two);
+	if (s.ooo_recent != 1300)
+		FAIL("Most recent segment %u, expected 1300\n", s.ooo_recent);
+
+	/* Filling the gap between them makes one range */
+	tcp_queue_ooo(&s, 1200, data + 200, 100);
+	check_ooo(&s, 1, one);
+
+	/* Which is all taken in once the first hole is filled */
+	tcp_queue_ooo(&s, 1500, data, 100);
+	ubuf_put(&s.rcv, data, 100);
+	s.rcv_nxt += 100;
+	tcp_merge_ooo(&s);
+	check_ooo(&s, 1, late);
+	if (s.rcv_nxt != 1400 || s.rcv.len != 400)
+		FAIL("rcv_nxt %u len %d after merging, expected 1400/400\n",
+		     s.rcv_nxt, s.rcv.len);
+	ubuf_peek(&s.rcv, 0, out, 400);
+	if (memcmp(out, data, 200) || memcmp(out + 200, data + 200, 100) ||
+	    memcmp(out + 300, data + 200, 100))
+		FAIL("Wrong data after merging\n");
+
+	free(s.rcv.data);
+}
+
+/* Feed a segment to an established connection */
+static void tcp_segment(struct openconnect_info *vpninfo, struct ustack_sock *s,
+			uint32_t seq, const unsigned char *data, int len)
+{
+	unsigned char th[20 + 1400];
+
+	memset(th, 0, 20);
+	store_be32(th + 4, seq);
+	store_be32(th + 8, s->snd_una);
+	th[12] = 5 << 4;
+	th[13] = UTCP_ACK;
+	store_be16(th + 14, 65535);
+	memcpy(th + 20, data, len);
+	tcp_input(vpninfo, s, th, 20 + len);
+}
+
+static void test_window(void)
+{
+	struct openconnect_info *vpninfo = calloc(1, sizeof(*vpninfo));
+	struct ustack us;
+	struct ustack_sock s;
+	unsigned char data[1400];
+	struct pkt *pkt;
+
+	memset(data, 0x5a, sizeof(data));
+	memset(&us, 0, sizeof(us));
+	vpninfo->ustack = &us;
+	vpninfo->max_qlen = 10;
+	init_pkt_queue(&vpninfo->outgoing_queue);
+	init_pkt_queue(&vpninfo->free_queue);
+
+	memset(&s, 0, sizeof(s));
+	s.proto = IPPROTO_TCP;
+	s.family = AF_INET;
+	s.state = UTCP_ESTABLISHED;
+	s.mss = 1400;
+	if (ubuf_init(&s.rcv) || ubuf_init(&s.snd))
+		FAIL("No memory\n");
+	s.rcv.head = 1000;
+	s.rcv_nxt = 5000;
+
+	/* Far beyond the window, where the offset into the buffer would
+	 * overflow an int. It must be ACKed and dropped. */
+	tcp_segment(vpninfo, &s, s.rcv_nxt + 0x7fffff00, data, sizeof(data));
+	if (s.nr_ooo)
+		FAIL("Segment far beyond the window was queued\n");
+	if (vpninfo->outgoing_queue.count != 1)
+		FAIL("Segment beyond the window not ACKed\n");
+
+	/* Just past the end of the window */
+	tcp_segment(vpninfo, &s, s.rcv_nxt + USTACK_BUFSIZE - 1000, data, sizeof(data));
+	if (s.nr_ooo)
+		FAIL("Segment overlapping the end of the window was queued\n");
+
+	/* But one which ends right at the end of it is kept */
+	tcp_segment(vpninfo, &s, s.rcv_nxt + USTACK_BUFSIZE - sizeof(data), data, sizeof(data));
+	if (s.nr_ooo != 1 || s.ooo[0].end != s.rcv_nxt + USTACK_BUFSIZE)
+		FAIL("Segment at the end of the window not queued\n");
+
+	/* The window shrinks as the application leaves data unread */
+	s.nr_ooo = 0;
+	s.rcv.len = 100000;
+	tcp_segment(vpninfo, &s, s.rcv_nxt + USTACK_BUFSIZE - 100000 - 100, data, sizeof(data));
+	if (s.nr_ooo)
+		FAIL("Segment beyond the reduced window was queued\n");
+
+	while ((pkt = dequeue_packet(&vpninfo->outgoing_queue)))
+		free(pkt);
+	free(s.rcv.data);
+	free(s.snd.data);
+	free(vpninfo);
+}
+
+int main(void)
+{
+	test_opts();
+	test_ooo();
+	test_window();
+	return 0;
+}
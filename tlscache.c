@@ -0,0 +1,437 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/stat.h>
+#endif
+
+/* A full TLS handshake costs a round trip or two more than resuming a
+ * previous session, and if we have a client certificate it has to sign
+ * something with it, which is slow with a TPM or smartcard. So keep the
+ * sessions we've had, for reconnecting, and for the next time we run if
+ * the user gives us a file to keep them in.
+ *
+ * They are kept as the TLS library serialises them, under a hash of the
+ * server's name and port and of our client certificate, so that we never
+ * offer a session made with one certificate when we've been told to use
+ * another. The server may refuse to resume them at any time, and then we
+ * just get a full handshake as before.
+ *
+ * Anyone who can read a session can resume it as us, so the file is
+ * created readable only by its owner. It is a cache, and anything in it
+ * which doesn't make sense is ignored.
+ *
+ * Early data goes out before the server has shown us its certificate,
+ * to whoever has the session. So it's only sent with sessions which we
+ * made ourselves, to a server we've checked in this process; not with
+ * those from the file, which another instance may have accepted. */
+
+#define TLS_SESSION_TTL		(8 * 3600)	/* seconds */
+#define TLS_SESSION_KEYLEN	(SHA256_SIZE * 2)
+
+struct tls_session {
+	struct tls_session *next;
+	char key[TLS_SESSION_KEYLEN + 1];
+	time_t expires;
+	unsigned char *data;
+	int len;
+	int checked;
+};
+
+static int session_key(struct openconnect_info *vpninfo, char *key)
+{
+	struct oc_text_buf *buf;
+	unsigned char sha[SHA256_SIZE];
+	char md5[MD5_SIZE * 2 + 1];
+	int ret;
+
+	if (!vpninfo->hostname)
+		return -EINVAL;
+
+	if (!vpninfo->certinfo[0].cert || openconnect_local_cert_md5(vpninfo, md5))
+		md5[0] = 0;
+
+	buf = buf_alloc();
+	buf_append(buf, "%s:%d %s", vpninfo->hostname, vpninfo->port, md5);
+	ret = buf_error(buf);
+	if (!ret)
+		ret = openconnect_sha256(sha, buf->data, buf->pos);
+	buf_truncate(buf);
+	if (!ret) {
+		buf_append_hex(buf, sha, sizeof(sha));
+		ret = buf_error(buf);
+	}
+	if (!ret)
+		memcpy(key, buf->data, TLS_SESSION_KEYLEN + 1);
+	buf_free(buf);
+	return ret;
+}
+
+static struct tls_session *find_session(struct openconnect_info *vpninfo,
+					const char *key)
+{
+	struct tls_session *s;
+
+	for (s = vpninfo->tls_sessions; s; s = s->next) {
+		if (!strcmp(s->key, key))
+			return s;
+	}
+	return NULL;
+}
+
+static void drop_session(struct openconnect_info *vpninfo, struct tls_session *s)
+{
+	struct tls_session **p;
+
+	for (p = &vpninfo->tls_sessions; *p; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	}
+	free(s->data);
+	free(s);
+}
+
+/* Anything in the file which we don't already have ourselves,
+ * except for @skip */
+static void load_sessions(struct openconnect_info *vpninfo, const char *skip)
+{
+	char *line = NULL;
+	size_t linelen = 0;
+	time_t now = time(NULL);
+	FILE *f;
+
+	if (!vpninfo->tls_session_file)
+		return;
+
+	f = openconnect_fopen_utf8(vpninfo, vpninfo->tls_session_file, "r");
+	if (!f)
+		return;
+
+	while (getline(&line, &linelen, f) > 0) {
+		struct tls_session *s;
+		char *p, *q;
+		long long expires;
+		int len;
+
+		p = strchr(line, ' ');
+		if (!p || p - line != TLS_SESSION_KEYLEN)
+			continue;
+		*p++ = 0;
+		expires = strtoll(p, &q, 10);
+		if (q == p || *q != ' ' || expires <= now)
+			continue;
+		p = q + 1;
+		q = p + strcspn(p, "\r\n");
+		*q = 0;
+
+		if ((skip && !strcmp(line, skip)) || find_session(vpninfo, line))
+			continue;
+
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			break;
+		s->data = openconnect_base64_decode(&len, p);
+		if (!s->data || !len) {
+			free(s->data);
+			free(s);
+			continue;
+		}
+		s->len = len;
+		s->expires = expires;
+		memcpy(s->key, line, sizeof(s->key));
+		s->next = vpninfo->tls_sessions;
+		vpninfo->tls_sessions = s;
+	}
+	free(line);
+	fclose(f);
+}
+
+#ifdef _WIN32
+static wchar_t *utf8_to_wide(const char *str)
+{
+	int nr_chars = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	wchar_t *str_w;
+
+	if (!nr_chars) {
+		errno = EINVAL;
+		return NULL;
+	}
+	str_w = malloc(nr_chars * sizeof(wchar_t));
+	if (!str_w) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	MultiByteToWideChar(CP_UTF8, 0, str, -1, str_w, nr_chars);
+	return str_w;
+}
+
+/* Unlike POSIX rename(), Windows' won't replace an existing file */
+static int replace_file(struct openconnect_info *vpninfo, const char *from,
+			const char *to)
+{
+	wchar_t *from_w = utf8_to_wide(from);
+	wchar_t *to_w = utf8_to_wide(to);
+	int ret = -1;
+
+	if (from_w && to_w) {
+		if (MoveFileExW(from_w, to_w, MOVEFILE_REPLACE_EXISTING |
+				MOVEFILE_WRITE_THROUGH))
+			ret = 0;
+		else
+			errno = EACCES;
+	}
+	free(from_w);
+	free(to_w);
+	return ret;
+}
+
+static void remove_file(struct openconnect_info *vpninfo, const char *fname)
+{
+	wchar_t *fname_w = utf8_to_wide(fname);
+
+	if (fname_w)
+		_wunlink(fname_w);
+	free(fname_w);
+}
+
+#define fsync _commit
+#else
+static int replace_file(struct openconnect_info *vpninfo, const char *from,
+			const char *to)
+{
+	char *legacy_from = openconnect_utf8_to_legacy(vpninfo, from);
+	char *legacy_to = openconnect_utf8_to_legacy(vpninfo, to);
+	int ret = rename(legacy_from, legacy_to);
+
+	if (legacy_from != from)
+		free(legacy_from);
+	if (legacy_to != to)
+		free(legacy_to);
+	return ret;
+}
+
+static void remove_file(struct openconnect_info *vpninfo, const char *fname)
+{
+	char *legacy_fname = openconnect_utf8_to_legacy(vpninfo, fname);
+
+	unlink(legacy_fname);
+	if (legacy_fname != fname)
+		free(legacy_fname);
+}
+#endif
+
+static void store_sessions(struct openconnect_info *vpninfo, const char *skip)
+{
+	struct oc_text_buf *buf;
+	struct tls_session *s;
+	time_t now = time(NULL);
+	char *tmpname = NULL;
+	uint32_t rnd;
+	int fd;
+
+	if (!vpninfo->tls_session_file)
+		return;
+
+	/* Keep what any other instance has added since we last looked */
+	load_sessions(vpninfo, skip);
+
+	buf = buf_alloc();
+	for (s = vpninfo->tls_sessions; s; s = s->next) {
+		if (s->expires <= now)
+			continue;
+		buf_append(buf, "%s %lld ", s->key, (long long)s->expires);
+		buf_append_base64(buf, s->data, s->len, 0);
+		buf_append(buf, "\n");
+	}
+	if (buf_error(buf))
+		goto out;
+
+	/* Write a new file and rename it over the old, so that another
+	 * instance reading it, or a crash while we write, never sees half
+	 * a cache. It lives in the same directory, to be renamed within
+	 * one filesystem. */
+	if (openconnect_random(&rnd, sizeof(rnd)) ||
+	    asprintf(&tmpname, "%s.%08x", vpninfo->tls_session_file, rnd) < 0) {
+		tmpname = NULL;
+		goto out;
+	}
+	fd = openconnect_open_utf8(vpninfo, tmpname,
+				   O_WRONLY|O_CLOEXEC|O_CREAT|O_EXCL|O_BINARY);
+	if (fd < 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open TLS session cache %s: %s\n"),
+			     tmpname, strerror(errno));
+		goto out;
+	}
+#ifndef _WIN32
+	if (fchmod(fd, 0600)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to make TLS session cache %s private: %s\n"),
+			     tmpname, strerror(errno));
+		goto fail;
+	}
+#endif
+	if (write(fd, buf->data, buf->pos) != buf->pos || fsync(fd)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to write TLS session cache %s: %s\n"),
+			     tmpname, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	if (replace_file(vpninfo, tmpname, vpninfo->tls_session_file)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to replace TLS session cache %s: %s\n"),
+			     vpninfo->tls_session_file, strerror(errno));
+		goto fail;
+	}
+	goto out;
+
+ fail:
+	if (fd >= 0)
+		close(fd);
+	remove_file(vpninfo, tmpname);
+ out:
+	free(tmpname);
+	buf_free(buf);
+}
+
+/* The session to offer the server we're about to connect to, if any.
+ * It's ours until the next call to tls_session_save(). */
+const unsigned char *tls_session_find(struct openconnect_info *vpninfo, int *len,
+				      int *checked)
+{
+	char key[TLS_SESSION_KEYLEN + 1];
+	struct tls_session *s;
+
+	if (session_key(vpninfo, key))
+		return NULL;
+
+	if (!vpninfo->tls_sessions_loaded) {
+		load_sessions(vpninfo, NULL);
+		vpninfo->tls_sessions_loaded = 1;
+	}
+
+	s = find_session(vpninfo, key);
+	if (!s)
+		return NULL;
+
+	if (s->expires <= time(NULL)) {
+		drop_session(vpninfo, s);
+		return NULL;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Offering previous TLS session to %s\n"), vpninfo->hostname);
+	*len = s->len;
+	if (checked)
+		*checked = s->checked;
+	return s->data;
+}
+
+void tls_session_save(struct openconnect_info *vpninfo, const void *data, int len)
+{
+	char key[TLS_SESSION_KEYLEN + 1];
+	struct tls_session *s;
+	unsigned char *copy;
+
+	if (len <= 0 || session_key(vpninfo, key))
+		return;
+
+	s = find_session(vpninfo, key);
+	if (s && s->len == len && !memcmp(s->data, data, len)) {
+		s->checked = 1;
+		return;
+	}
+
+	copy = malloc(len);
+	if (!copy)
+		return;
+	memcpy(copy, data, len);
+
+	if (!s) {
+		s = calloc(1, sizeof(*s));
+		if (!s) {
+			free(copy);
+			return;
+		}
+		memcpy(s->key, key, sizeof(s->key));
+		s->next = vpninfo->tls_sessions;
+		vpninfo->tls_sessions = s;
+	}
+	free(s->data);
+	s->data = copy;
+	s->len = len;
+	s->checked = 1;
+	s->expires = time(NULL) + TLS_SESSION_TTL;
+
+	store_sessions(vpninfo, NULL);
+}
+
+/* The server didn't like it, or it was made without the client cert */
+void tls_session_forget(struct openconnect_info *vpninfo)
+{
+	char key[TLS_SESSION_KEYLEN + 1];
+	struct tls_session *s;
+
+	if (session_key(vpninfo, key))
+		return;
+
+	s = find_session(vpninfo, key);
+	if (!s)
+		return;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Forgetting TLS session for %s\n"), vpninfo->hostname);
+	drop_session(vpninfo, s);
+	store_sessions(vpninfo, key);
+}
+
+void free_tls_sessions(struct openconnect_info *vpninfo)
+{
+	struct tls_session *s;
+
+	while ((s = vpninfo->tls_sessions)) {
+		vpninfo->tls_sessions = s->next;
+		free(s->data);
+		free(s);
+	}
+}
+
+int openconnect_set_tls_session_cache(struct openconnect_info *vpninfo,
+				      const char *fname)
+{
+	UTF8CHECK(fname);
+
+	STRDUP(vpninfo->tls_session_file, fname);
+	vpninfo->tls_sessions_loaded = 0;
+	return 0;
+}
@@ -585,6 +585,13 @@ int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	return 0;
 }
 
+/* The MTU is configured by vpnc-script-win.js; we can't change it under
+ * the script's feet. Oversized packets get ICMP errors instead. */
+int os_set_tun_mtu(struct openconnect_info *vpninfo, int mtu)
+{
+	return -EOPNOTSUPP;
+}
+
 int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
 	DWORD pkt_size = 0;
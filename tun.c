@@ -175,6 +175,11 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 
 	return tun_fd;
 }
+
+int os_set_tun_mtu(struct openconnect_info *vpninfo, int mtu)
+{
+	return -EOPNOTSUPP;
+}
 #elif defined(__native_client__)
 
 intptr_t os_setup_tun(struct openconnect_info *vpninfo)
@@ -184,6 +189,11 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 	return -EOPNOTSUPP;
 }
 
+int os_set_tun_mtu(struct openconnect_info *vpninfo, int mtu)
+{
+	return -EOPNOTSUPP;
+}
+
 #else /* !__sun__ && !__native_client__ */
 
 /* MTU setting code for both Linux and BSD systems */
@@ -195,10 +205,10 @@ static void ifreq_set_ifname(struct openconnect_info *vpninfo, struct ifreq *ifr
 		free(ifname);
 }
 
-static int set_tun_mtu(struct openconnect_info *vpninfo)
+int os_set_tun_mtu(struct openconnect_info *vpninfo, int mtu)
 {
 	struct ifreq ifr;
-	int net_fd;
+	int net_fd, ret = 0;
 
 	net_fd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (net_fd < 0) {
@@ -208,13 +218,15 @@ static int set_tun_mtu(struct openconnect_info *vpninfo)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifreq_set_ifname(vpninfo, &ifr);
-	ifr.ifr_mtu = vpninfo->ip_info.mtu;
+	ifr.ifr_mtu = mtu;
 
-	if (ioctl(net_fd, SIOCSIFMTU, &ifr) < 0)
+	if (ioctl(net_fd, SIOCSIFMTU, &ifr) < 0) {
+		ret = -errno;
 		vpn_perror(vpninfo, _("SIOCSIFMTU"));
+	}
 
 	close(net_fd);
-	return 0;
+	return ret;
 }
 
 #ifdef IFF_TUN /* Linux */
@@ -264,7 +276,7 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 		vpninfo->ifname = strdup(ifr.ifr_name);
 
 	/* Ancient vpnc-scripts might not get this right */
-	set_tun_mtu(vpninfo);
+	os_set_tun_mtu(vpninfo, vpninfo->ip_info.mtu);
 
 	return tun_fd;
 }
@@ -441,7 +453,7 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 #endif
 
 	/* Ancient vpnc-scripts might not get this right */
-	set_tun_mtu(vpninfo);
+	os_set_tun_mtu(vpninfo, vpninfo->ip_info.mtu);
 
 	return tun_fd;
 }
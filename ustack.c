@@ -0,0 +1,1112 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 agent
+ *
+ * Author: agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A minimal userspace TCP/IP stack, so that the tunnel's traffic can be
+ * terminated within this process (see socks.c) instead of being passed
+ * to a tun device. Packets come in from vpninfo->incoming_queue and go
+ * out on vpninfo->outgoing_queue, just as they would for tun_mainloop().
+ *
+ * It only ever makes outbound connections, using the address that the
+ * VPN server assigned to us. There is no IP fragment reassembly, which
+ * over a VPN tunnel with a known MTU is not much of a loss. Segments which
+ * arrive out of order are kept, and reported with SACK so that the peer
+ * only has to fill in the holes. We don't act on SACK from the peer
+ * though; when we're the sender, it's go-back-N after a timeout. */
+
+#define USTACK_BUFSIZE	(256 * 1024)
+#define USTACK_WSCALE	3	/* So USTACK_BUFSIZE fits in a 16-bit window */
+#define USTACK_UDPQ_LEN	8
+#define USTACK_MAX_OOO	8	/* Ranges received out of order */
+
+#define RTO_INITIAL	1000
+#define RTO_MIN		200
+#define RTO_MAX		60000
+#define SYN_RETRIES	5
+#define MAX_RETRIES	8
+
+#define UTCP_FIN	0x01
+#define UTCP_SYN	0x02
+#define UTCP_RST	0x04
+#define UTCP_PSH	0x08
+#define UTCP_ACK	0x10
+
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LE(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define SEQ_GE(a, b) ((int32_t)((a) - (b)) >= 0)
+
+enum {
+	UTCP_SYN_SENT,
+	UTCP_ESTABLISHED,
+	UTCP_CLOSED,
+};
+
+/* Ring buffer of USTACK_BUFSIZE bytes */
+struct ubuf {
+	unsigned char *data;
+	int head, len;
+};
+
+struct ustack_sock {
+	struct ustack_sock *next;
+	int proto, family;
+	unsigned char laddr[16], raddr[16];
+	uint16_t lport, rport;
+
+	/* TCP */
+	int state, error;
+	uint32_t iss, snd_una, snd_nxt, snd_max, snd_wnd;
+	uint32_t rcv_nxt, rcv_adv;
+	int snd_wscale, rcv_wscale;
+	int mss, cwnd, ssthresh, dupacks;
+	int in_recovery;
+	uint32_t recover;
+	int fin_queued, fin_acked, fin_rcvd;
+	int ack_pending, rexmit, probe, orphan;
+	int retries, rto, srtt, rttvar;
+	int rtt_timing;
+	uint32_t rtt_seq;
+	long long rtt_start, rto_due;
+	struct ubuf snd, rcv;
+	struct {
+		uint32_t start, end;
+	} ooo[USTACK_MAX_OOO];
+	int nr_ooo;
+	uint32_t ooo_recent;
+	int sack_ok;
+
+	/* UDP */
+	struct pkt_q udpq;
+};
+
+struct ustack {
+	struct ustack_sock *socks;
+	unsigned char addr4[4], addr6[16];
+	int have_addr4, have_addr6;
+	uint16_t next_port;
+	uint16_t ip_id;
+};
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+static int ubuf_init(struct ubuf *b)
+{
+	b->data = malloc(USTACK_BUFSIZE);
+	b->head = b->len = 0;
+	return b->data ? 0 : -ENOMEM;
+}
+
+/* Store data @off bytes beyond the end of what's there, if it fits */
+static int ubuf_put_at(struct ubuf *b, uint32_t off, const void *buf, int len)
+{
+	uint32_t space = USTACK_BUFSIZE - b->len;
+	int pos, first;
+
+	if (len < 0 || off > space || (uint32_t)len > space - off)
+		return 0;
+
+	pos = (b->head + b->len + off) % USTACK_BUFSIZE;
+	first = MIN(len, USTACK_BUFSIZE - pos);
+	memcpy(b->data + pos, buf, first);
+	memcpy(b->data, (const unsigned char *)buf + first, len - first);
+	return len;
+}
+
+static int ubuf_put(struct ubuf *b, const void *buf, int len)
+{
+	int n = MIN(len, USTACK_BUFSIZE - b->len);
+
+	ubuf_put_at(b, 0, buf, n);
+	b->len += n;
+	return n;
+}
+
+static void ubuf_peek(const struct ubuf *b, int off, void *buf, int len)
+{
+	int start = (b->head + off) % USTACK_BUFSIZE;
+	int first = MIN(len, USTACK_BUFSIZE - start);
+
+	memcpy(buf, b->data + start, first);
+	memcpy((unsigned char *)buf + first, b->data, len - first);
+}
+
+static void ubuf_drop(struct ubuf *b, int len)
+{
+	b->head = (b->head + len) % USTACK_BUFSIZE;
+	b->len -= len;
+}
+
+static int addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+/* Allocate a packet and fill in the IP header for @s, leaving @l4len
+ * bytes for the TCP or UDP header and payload. */
+static struct pkt *ustack_alloc(struct openconnect_info *vpninfo, struct ustack_sock *s,
+				int l4len, unsigned char **l4)
+{
+	int hdrlen = s->family == AF_INET6 ? 40 : 20;
+	/* One spare byte, for padding an odd length to checksum it */
+	struct pkt *pkt = alloc_pkt(vpninfo, hdrlen + l4len + 1 + vpninfo->pkt_trailer);
+	unsigned char *p;
+
+	if (!pkt)
+		return NULL;
+
+	pkt->len = hdrlen + l4len;
+	pkt->next = NULL;
+	p = pkt->data;
+	memset(p, 0, hdrlen);
+
+	if (s->family == AF_INET6) {
+		p[0] = 0x60;
+		store_be16(p + 4, l4len);
+		p[6] = s->proto;
+		p[7] = 64; /* Hop limit */
+		memcpy(p + 8, s->laddr, 16);
+		memcpy(p + 24, s->raddr, 16);
+	} else {
+		p[0] = 0x45;
+		store_be16(p + 2, hdrlen + l4len);
+		store_be16(p + 4, vpninfo->ustack->ip_id++);
+		p[6] = 0x40; /* DF */
+		p[8] = 64; /* TTL */
+		p[9] = s->proto;
+		memcpy(p + 12, s->laddr, 4);
+		memcpy(p + 16, s->raddr, 4);
+		store_be16(p + 10, ntohs(csum((uint16_t *)p, 10)));
+	}
+
+	*l4 = p + hdrlen;
+	return pkt;
+}
+
+/* TCP and UDP checksums cover a pseudo-header (RFC793, RFC8200 §8.1) */
+static uint16_t l4_csum(struct ustack_sock *s, unsigned char *l4, int len)
+{
+	int words = addr_len(s->family) / 2;
+	uint32_t sum;
+
+	sum = csum_partial((uint16_t *)s->laddr, words);
+	sum += csum_partial((uint16_t *)s->raddr, words);
+	sum += s->proto + len;
+
+	if (len & 1)
+		l4[len] = 0;
+	sum += csum_partial((uint16_t *)l4, (len + 1) / 2);
+
+	return csum_finish(sum);
+}
+
+static void ustack_queue(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	vpninfo->stats.tx_pkts++;
+	vpninfo->stats.tx_bytes += pkt->len;
+	queue_packet(&vpninfo->outgoing_queue, pkt);
+}
+
+static int rcv_window(struct ustack_sock *s)
+{
+	int space = USTACK_BUFSIZE - s->rcv.len;
+
+	return MIN(space >> s->rcv_wscale, 65535);
+}
+
+static int tcp_send(struct openconnect_info *vpninfo, struct ustack_sock *s,
+		    uint32_t seq, int flags, int off, int len)
+{
+	int optlen = 0, nr_sack = 0, i;
+	unsigned char *th, *opt;
+	struct pkt *pkt;
+
+	if (flags & UTCP_SYN)
+		optlen = 12;
+	else if (!len && (flags & UTCP_ACK) && s->sack_ok && s->nr_ooo) {
+		/* Only on bare ACKs, so as not to eat into the MSS */
+		nr_sack = MIN(s->nr_ooo, 3);
+		optlen = 4 + 8 * nr_sack;
+	}
+
+	if (vpninfo->outgoing_queue.count >= vpninfo->max_qlen)
+		return -EAGAIN;
+
+	pkt = ustack_alloc(vpninfo, s, 20 + optlen + len, &th);
+	if (!pkt)
+		return -ENOMEM;
+
+	store_be16(th, s->lport);
+	store_be16(th + 2, s->rport);
+	store_be32(th + 4, seq);
+	store_be32(th + 8, (flags & UTCP_ACK) ? s->rcv_nxt : 0);
+	th[12] = (5 + optlen / 4) << 4;
+	th[13] = flags;
+	/* The window in a SYN is never scaled */
+	if (flags & UTCP_SYN)
+		store_be16(th + 14, MIN(USTACK_BUFSIZE, 65535));
+	else
+		store_be16(th + 14, rcv_window(s));
+	th[16] = th[17] = th[18] = th[19] = 0;
+
+	opt = th + 20;
+	if (flags & UTCP_SYN) {
+		/* MSS, NOP and window scale, NOP NOP and SACK permitted */
+		opt[0] = 2;
+		opt[1] = 4;
+		store_be16(opt + 2, s->mss);
+		opt[4] = 1;
+		opt[5] = 3;
+		opt[6] = 3;
+		opt[7] = USTACK_WSCALE;
+		opt[8] = opt[9] = 1;
+		opt[10] = 4;
+		opt[11] = 2;
+	} else if (nr_sack) {
+		int first = 0;
+
+		/* The block with the latest segment goes first (RFC2018 §4) */
+		for (i = 0; i < s->nr_ooo; i++)
+			if (SEQ_GE(s->ooo_recent, s->ooo[i].start) &&
+			    SEQ_LT(s->ooo_recent, s->ooo[i].end))
+				first = i;
+
+		opt[0] = opt[1] = 1;
+		opt[2] = 5;
+		opt[3] = 2 + 8 * nr_sack;
+		opt += 4;
+		for (i = 0; i < nr_sack; i++) {
+			int idx = !i ? first : (i <= first ? i - 1 : i);
+
+			store_be32(opt, s->ooo[idx].start);
+			store_be32(opt + 4, s->ooo[idx].end);
+			opt += 8;
+		}
+	}
+	if (len)
+		ubuf_peek(&s->snd, off, th + 20 + optlen, len);
+
+	store_be16(th + 16, ntohs(l4_csum(s, th, 20 + optlen + len)));
+
+	if (flags & UTCP_ACK) {
+		s->ack_pending = 0;
+		s->rcv_adv = s->rcv_nxt + (rcv_window(s) << s->rcv_wscale);
+	}
+
+	ustack_queue(vpninfo, pkt);
+	return 0;
+}
+
+static void tcp_error(struct ustack_sock *s, int err)
+{
+	s->error = err;
+	s->state = UTCP_CLOSED;
+	s->rto_due = 0;
+}
+
+static void tcp_output(struct openconnect_info *vpninfo, struct ustack_sock *s)
+{
+	long long now = now_ms();
+
+	if (s->state == UTCP_SYN_SENT) {
+		if (s->snd_nxt == s->iss && !tcp_send(vpninfo, s, s->iss, UTCP_SYN, 0, 0)) {
+			s->snd_nxt = s->snd_max = s->iss + 1;
+			s->rto_due = now + s->rto;
+		}
+		return;
+	}
+	if (s->state != UTCP_ESTABLISHED)
+		return;
+
+	/* Fast retransmit of the first unacknowledged segment */
+	if (s->rexmit) {
+		int n = MIN(s->snd.len, s->mss);
+		int flags = UTCP_ACK;
+
+		if (n == s->snd.len && s->snd_max - s->snd_una > s->snd.len)
+			flags |= UTCP_FIN;
+		if (tcp_send(vpninfo, s, s->snd_una, flags, 0, n))
+			return;
+		s->rexmit = 0;
+		s->rtt_timing = 0;
+	}
+
+	while (1) {
+		uint32_t inflight = s->snd_nxt - s->snd_una;
+		int sent = MIN(inflight, s->snd.len);
+		int unsent = s->snd.len - sent;
+		/* Limited transmit (RFC3042) keeps the duplicate ACKs coming */
+		uint32_t wnd = MIN(s->snd_wnd, (uint32_t)s->cwnd +
+				   (s->in_recovery ? 0 : MIN(s->dupacks, 2) * s->mss));
+		int avail = wnd > inflight ? MIN(wnd - inflight, USTACK_BUFSIZE) : 0;
+		int flags = UTCP_ACK;
+		int n;
+
+		/* Probe a zero window with a single byte */
+		if (s->probe && !avail && !inflight)
+			avail = 1;
+
+		n = MIN(unsent, MIN(avail, s->mss));
+		if (s->fin_queued && n == unsent && inflight <= s->snd.len)
+			flags |= UTCP_FIN;
+		if (!n && !(flags & UTCP_FIN))
+			break;
+		if (n && n == unsent)
+			flags |= UTCP_PSH;
+
+		if (tcp_send(vpninfo, s, s->snd_nxt, flags, sent, n))
+			break;
+
+		if (!s->rtt_timing) {
+			s->rtt_timing = 1;
+			s->rtt_seq = s->snd_nxt;
+			s->rtt_start = now;
+		}
+		s->snd_nxt += n + !!(flags & UTCP_FIN);
+		if (SEQ_GT(s->snd_nxt, s->snd_max))
+			s->snd_max = s->snd_nxt;
+		s->probe = 0;
+	}
+
+	if (s->ack_pending)
+		tcp_send(vpninfo, s, s->snd_max, UTCP_ACK, 0, 0);
+
+	/* Retransmit timer while anything is in flight, and persist timer
+	 * while there's data (or a FIN) which we haven't sent. */
+	if (!s->rto_due && (s->snd_max != s->snd_una ||
+			    s->snd.len || (s->fin_queued && !s->fin_acked)))
+		s->rto_due = now + s->rto;
+	else if (s->rto_due && s->snd_max == s->snd_una &&
+		 !s->snd.len && (!s->fin_queued || s->fin_acked))
+		s->rto_due = 0;
+}
+
+static void tcp_rtt_sample(struct ustack_sock *s, int rtt)
+{
+	/* RFC6298 */
+	if (!s->srtt && !s->rttvar) {
+		s->srtt = rtt;
+		s->rttvar = rtt / 2;
+	} else {
+		s->rttvar = (3 * s->rttvar + abs(s->srtt - rtt)) / 4;
+		s->srtt = (7 * s->srtt + rtt) / 8;
+	}
+	s->rto = s->srtt + MAX(4 * s->rttvar, 10);
+	s->rto = MAX(RTO_MIN, MIN(RTO_MAX, s->rto));
+}
+
+static void tcp_timer(struct openconnect_info *vpninfo, struct ustack_sock *s, long long now)
+{
+	uint32_t inflight = s->snd_max - s->snd_una;
+
+	if (!s->rto_due || now < s->rto_due)
+		return;
+
+	s->rto_due = 0;
+
+	/* A window probe isn't a retry; the peer can stay busy for ever */
+	if (inflight &&
+	    ++s->retries > (s->state == UTCP_SYN_SENT ? SYN_RETRIES : MAX_RETRIES)) {
+		if (s->state == UTCP_ESTABLISHED)
+			tcp_send(vpninfo, s, s->snd_max, UTCP_RST, 0, 0);
+		tcp_error(s, ETIMEDOUT);
+		return;
+	}
+
+	s->rto = MIN(s->rto * 2, RTO_MAX);
+	s->rtt_timing = 0;
+	s->dupacks = 0;
+	s->in_recovery = 0;
+
+	if (s->state == UTCP_SYN_SENT) {
+		s->snd_nxt = s->iss;
+	} else if (inflight) {
+		/* Go back to the start, as slowly as we started */
+		s->ssthresh = MAX(inflight / 2, 2 * s->mss);
+		s->cwnd = s->mss;
+		s->snd_nxt = s->snd_una;
+	} else {
+		s->probe = 1;
+	}
+}
+
+static void tcp_parse_opts(struct ustack_sock *s, const unsigned char *opt, int len)
+{
+	int peer_mss = 536, wscale = -1;
+
+	while (len > 0) {
+		if (opt[0] == 0)
+			break;
+		if (opt[0] == 1) {
+			opt++;
+			len--;
+			continue;
+		}
+		if (len < 2 || opt[1] < 2 || opt[1] > len)
+			break;
+		if (opt[0] == 2 && opt[1] == 4)
+			peer_mss = load_be16(opt + 2);
+		else if (opt[0] == 3 && opt[1] == 3)
+			wscale = MIN(opt[2], 14);
+		else if (opt[0] == 4 && opt[1] == 2)
+			s->sack_ok = 1;
+		len -= opt[1];
+		opt += opt[1];
+	}
+
+	s->mss = MIN(s->mss, peer_mss);
+	if (wscale >= 0) {
+		s->snd_wscale = wscale;
+		s->rcv_wscale = USTACK_WSCALE;
+	}
+}
+
+static void tcp_reset_reply(struct openconnect_info *vpninfo, int family,
+			    const unsigned char *src, const unsigned char *dst,
+			    unsigned char *th, int len)
+{
+	struct ustack_sock tmp;
+	int flags = th[13];
+	uint32_t seq = 0;
+
+	if (len < 20 || (flags & UTCP_RST))
+		return;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.proto = IPPROTO_TCP;
+	tmp.family = family;
+	memcpy(tmp.laddr, dst, addr_len(family));
+	memcpy(tmp.raddr, src, addr_len(family));
+	tmp.lport = load_be16(th + 2);
+	tmp.rport = load_be16(th);
+
+	/* RFC793 §3.4 */
+	if (flags & UTCP_ACK) {
+		seq = load_be32(th + 8);
+		flags = UTCP_RST;
+	} else {
+		tmp.rcv_nxt = load_be32(th + 4) + len - (th[12] >> 4) * 4 +
+			!!(flags & UTCP_SYN) + !!(flags & UTCP_FIN);
+		flags = UTCP_RST | UTCP_ACK;
+	}
+	tcp_send(vpninfo, &tmp, seq, flags, 0, 0);
+}
+
+/* Keep data which arrived ahead of a gap, in its place in the buffer */
+static void tcp_queue_ooo(struct ustack_sock *s, uint32_t seq,
+			  const unsigned char *data, int len)
+{
+	uint32_t start = seq, end = seq + len;
+	int i, j;
+
+	if (!len || !ubuf_put_at(&s->rcv, seq - s->rcv_nxt, data, len))
+		return;
+
+	s->ooo_recent = seq;
+
+	/* Merge with any ranges which it overlaps or touches */
+	for (i = 0; i < s->nr_ooo && SEQ_LT(s->ooo[i].end, start); i++)
+		;
+	for (j = i; j < s->nr_ooo && SEQ_LE(s->ooo[j].start, end); j++) {
+		if (SEQ_LT(s->ooo[j].start, start))
+			start = s->ooo[j].start;
+		if (SEQ_GT(s->ooo[j].end, end))
+			end = s->ooo[j].end;
+	}
+
+	/* If there's no room to track it, it'll just be sent again */
+	if (i == j && s->nr_ooo == USTACK_MAX_OOO)
+		return;
+
+	memmove(&s->ooo[i + 1], &s->ooo[j], (s->nr_ooo - j) * sizeof(s->ooo[0]));
+	s->ooo[i].start = start;
+	s->ooo[i].end = end;
+	s->nr_ooo += 1 - (j - i);
+}
+
+/* Take in whatever the last in-order segment has made contiguous */
+static void tcp_merge_ooo(struct ustack_sock *s)
+{
+	while (s->nr_ooo && SEQ_LE(s->ooo[0].start, s->rcv_nxt)) {
+		if (SEQ_GT(s->ooo[0].end, s->rcv_nxt)) {
+			s->rcv.len += s->ooo[0].end - s->rcv_nxt;
+			s->rcv_nxt = s->ooo[0].end;
+		}
+		s->nr_ooo--;
+		memmove(&s->ooo[0], &s->ooo[1], s->nr_ooo * sizeof(s->ooo[0]));
+	}
+}
+
+static void tcp_input(struct openconnect_info *vpninfo, struct ustack_sock *s,
+		      unsigned char *th, int len)
+{
+	uint32_t seq = load_be32(th + 4), ack = load_be32(th + 8);
+	int hlen = (th[12] >> 4) * 4, flags = th[13];
+	uint32_t win = load_be16(th + 14);
+	unsigned char *data = th + hlen;
+	int dlen = len - hlen;
+	long long now = now_ms();
+
+	if (hlen < 20 || hlen > len)
+		return;
+
+	if (s->state == UTCP_SYN_SENT) {
+		/* Probably a connection on this port from before we were
+		 * restarted. Reset it, so our next SYN can get through. */
+		if ((flags & UTCP_ACK) && ack != s->iss + 1) {
+			tcp_reset_reply(vpninfo, s->family, s->raddr, s->laddr, th, len);
+			return;
+		}
+		if (flags & UTCP_RST) {
+			if (flags & UTCP_ACK)
+				tcp_error(s, ECONNREFUSED);
+			return;
+		}
+		/* We don't do simultaneous open */
+		if ((flags & (UTCP_SYN | UTCP_ACK)) != (UTCP_SYN | UTCP_ACK))
+			return;
+
+		tcp_parse_opts(s, th + 20, hlen - 20);
+		s->rcv_nxt = seq + 1;
+		s->snd_una = ack;
+		s->snd_wnd = win;
+		s->state = UTCP_ESTABLISHED;
+		s->retries = 0;
+		s->rto_due = 0;
+		if (s->rtt_timing)
+			tcp_rtt_sample(s, now - s->rtt_start);
+		s->rtt_timing = 0;
+		/* RFC6928 */
+		s->cwnd = 10 * s->mss;
+		s->ack_pending = 1;
+		return;
+	}
+
+	if (s->state == UTCP_CLOSED) {
+		/* If our last ACK got lost, the peer will send its FIN again */
+		if (!s->error && (flags & UTCP_FIN))
+			tcp_send(vpninfo, s, s->snd_max, UTCP_ACK, 0, 0);
+		return;
+	}
+
+	if (flags & UTCP_RST) {
+		if (SEQ_GE(seq, s->rcv_nxt) &&
+		    SEQ_LT(seq, s->rcv_nxt + MAX(USTACK_BUFSIZE - s->rcv.len, 1)))
+			tcp_error(s, ECONNRESET);
+		return;
+	}
+	if (flags & UTCP_SYN) {
+		/* Retransmitted SYN-ACK; our ACK must have been lost */
+		s->ack_pending = 1;
+		return;
+	}
+	if (!(flags & UTCP_ACK))
+		return;
+
+	/* After going back to retransmit, an ACK can be beyond snd_nxt */
+	if (SEQ_GT(ack, s->snd_una) && SEQ_LE(ack, s->snd_max)) {
+		uint32_t acked = ack - s->snd_una;
+
+		if (acked > s->snd.len) {
+			s->fin_acked = 1;
+			acked = s->snd.len;
+		}
+		ubuf_drop(&s->snd, acked);
+		s->snd_una = ack;
+		if (SEQ_LT(s->snd_nxt, ack))
+			s->snd_nxt = ack;
+		s->dupacks = 0;
+		s->retries = 0;
+
+		if (s->rtt_timing && SEQ_GT(ack, s->rtt_seq)) {
+			tcp_rtt_sample(s, now - s->rtt_start);
+			s->rtt_timing = 0;
+		}
+
+		if (s->in_recovery) {
+			/* NewReno (RFC6582): a partial ACK means the next
+			 * segment was lost too. */
+			if (SEQ_LT(ack, s->recover))
+				s->rexmit = 1;
+			else
+				s->in_recovery = 0;
+		} else {
+			/* Slow start, then congestion avoidance */
+			if (s->cwnd < s->ssthresh)
+				s->cwnd += MIN((int)acked, s->mss);
+			else
+				s->cwnd += MAX(s->mss * s->mss / s->cwnd, 1);
+			s->cwnd = MIN(s->cwnd, USTACK_BUFSIZE);
+		}
+
+		s->rto_due = s->snd_max == s->snd_una ? 0 : now + s->rto;
+	} else if (ack == s->snd_una && !dlen && !(flags & UTCP_FIN) &&
+		   s->snd_max != s->snd_una) {
+		/* Not insisting on an unchanged window, as RFC5681 would;
+		 * the peer's window grows while it's autotuning, and its
+		 * duplicate ACKs would never be counted. */
+		if (++s->dupacks == 3 && !s->in_recovery) {
+			uint32_t inflight = s->snd_max - s->snd_una;
+
+			s->ssthresh = MAX(inflight / 2, 2 * s->mss);
+			s->cwnd = s->ssthresh;
+			s->rexmit = 1;
+			s->in_recovery = 1;
+			s->recover = s->snd_max;
+		}
+	}
+	if (SEQ_GE(ack, s->snd_una))
+		s->snd_wnd = win << s->snd_wscale;
+
+	/* Window probes and keepalives are sent below rcv_nxt. If our window
+	 * update was lost, answering them is the only way the peer hears of
+	 * it (RFC793 §3.9). */
+	if (!dlen && !(flags & UTCP_FIN) && SEQ_LT(seq, s->rcv_nxt)) {
+		tcp_send(vpninfo, s, s->snd_max, UTCP_ACK, 0, 0);
+		goto out;
+	}
+
+	if (dlen || (flags & UTCP_FIN)) {
+		uint32_t old = s->rcv_nxt - seq, end = seq + dlen;
+		int had_ooo = s->nr_ooo;
+		int n;
+
+		/* The peer counts duplicate ACKs to detect loss, so they can't
+		 * wait to be merged with the others (RFC5681 §4.2). Neither
+		 * should the ACK for a segment which fills a gap. Anything
+		 * beyond the window we offered is not acceptable (RFC793
+		 * §3.3), and is just ACKed. */
+		if (SEQ_GT(seq, s->rcv_nxt)) {
+			if (end - s->rcv_nxt <= (uint32_t)(USTACK_BUFSIZE - s->rcv.len))
+				tcp_queue_ooo(s, seq, data, dlen);
+			tcp_send(vpninfo, s, s->snd_max, UTCP_ACK, 0, 0);
+			goto out;
+		}
+		if (old > (uint32_t)dlen ||
+		    (old == dlen && (!(flags & UTCP_FIN) || s->fin_rcvd))) {
+			tcp_send(vpninfo, s, s->snd_max, UTCP_ACK, 0, 0);
+			goto out;
+		}
+
+		data += old;
+		dlen -= old;
+		n = ubuf_put(&s->rcv, data, dlen);
+		s->rcv_nxt += n;
+		tcp_merge_ooo(s);
+		if ((flags & UTCP_FIN) && n == dlen && s->rcv_nxt == end && !s->fin_rcvd) {
+			s->fin_rcvd = 1;
+			s->rcv_nxt++;
+		}
+		if (had_ooo)
+			tcp_send(vpninfo, s, s->snd_max, UTCP_ACK, 0, 0);
+		else
+			s->ack_pending = 1;
+	}
+
+ out:
+	if (s->fin_acked && s->fin_rcvd)
+		s->state = UTCP_CLOSED;
+}
+
+static void udp_input(struct openconnect_info *vpninfo, struct ustack_sock *s,
+		      struct pkt *pkt, unsigned char *uh, int len)
+{
+	if (len < 8 || s->udpq.count >= USTACK_UDPQ_LEN) {
+		free_pkt(vpninfo, pkt);
+		return;
+	}
+
+	memmove(pkt->data, uh + 8, len - 8);
+	pkt->len = len - 8;
+	queue_packet(&s->udpq, pkt);
+}
+
+/* Consumes @pkt, which came from the VPN */
+void ustack_input(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	struct ustack *us = vpninfo->ustack;
+	unsigned char *p = pkt->data, *src, *dst, *l4;
+	struct ustack_sock *s;
+	int family, proto, len;
+
+	if (pkt->len >= 20 && (p[0] >> 4) == 4) {
+		int hdrlen = (p[0] & 0xf) * 4;
+
+		len = load_be16(p + 2);
+		/* No fragments; no reassembly */
+		if (hdrlen < 20 || len < hdrlen || len > pkt->len ||
+		    (load_be16(p + 6) & 0x3fff) || !us->have_addr4 ||
+		    memcmp(p + 16, us->addr4, 4))
+			goto drop;
+		family = AF_INET;
+		proto = p[9];
+		src = p + 12;
+		dst = p + 16;
+		l4 = p + hdrlen;
+		len -= hdrlen;
+	} else if (pkt->len >= 40 && (p[0] >> 4) == 6) {
+		len = load_be16(p + 4);
+		/* No extension headers either */
+		if (len + 40 > pkt->len || !us->have_addr6 ||
+		    memcmp(p + 24, us->addr6, 16))
+			goto drop;
+		family = AF_INET6;
+		proto = p[6];
+		src = p + 8;
+		dst = p + 24;
+		l4 = p + 40;
+	} else
+		goto drop;
+
+	if ((proto != IPPROTO_TCP && proto != IPPROTO_UDP) || len < 8)
+		goto drop;
+
+	for (s = us->socks; s; s = s->next) {
+		if (s->proto == proto && s->family == family &&
+		    s->lport == load_be16(l4 + 2) && s->rport == load_be16(l4) &&
+		    !memcmp(s->raddr, src, addr_len(family)))
+			break;
+	}
+
+	if (!s) {
+		if (proto == IPPROTO_TCP)
+			tcp_reset_reply(vpninfo, family, src, dst, l4, len);
+		goto drop;
+	}
+
+	if (proto == IPPROTO_UDP) {
+		udp_input(vpninfo, s, pkt, l4, len);
+		return;
+	}
+
+	tcp_input(vpninfo, s, l4, len);
+ drop:
+	free_pkt(vpninfo, pkt);
+}
+
+static uint16_t ustack_port(struct ustack *us, int proto)
+{
+	struct ustack_sock *s;
+
+	/* Ephemeral ports (RFC6335), skipping any which are in use */
+ again:
+	if (us->next_port < 49152)
+		us->next_port = 49152;
+	for (s = us->socks; s; s = s->next) {
+		if (s->proto == proto && s->lport == us->next_port) {
+			us->next_port++;
+			goto again;
+		}
+	}
+	return us->next_port++;
+}
+
+static int ustack_new(struct openconnect_info *vpninfo, int proto, int family,
+		      const void *addr, int port, struct ustack_sock **ret)
+{
+	struct ustack *us = vpninfo->ustack;
+	struct ustack_sock *s;
+
+	if (family == AF_INET6 ? !us->have_addr6 : !us->have_addr4)
+		return -EADDRNOTAVAIL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->proto = proto;
+	s->family = family;
+	memcpy(s->laddr, family == AF_INET6 ? us->addr6 : us->addr4, addr_len(family));
+	memcpy(s->raddr, addr, addr_len(family));
+	s->rport = port;
+	s->lport = ustack_port(us, proto);
+	init_pkt_queue(&s->udpq);
+
+	s->next = us->socks;
+	us->socks = s;
+	*ret = s;
+	return 0;
+}
+
+static void ustack_free_sock(struct openconnect_info *vpninfo, struct ustack_sock *s)
+{
+	struct ustack_sock **p;
+	struct pkt *pkt;
+
+	for (p = &vpninfo->ustack->socks; *p; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	}
+	while ((pkt = dequeue_packet(&s->udpq)))
+		free_pkt(vpninfo, pkt);
+	free(s->snd.data);
+	free(s->rcv.data);
+	free(s);
+}
+
+int ustack_tcp_connect(struct openconnect_info *vpninfo, int family,
+		       const void *addr, int port, struct ustack_sock **ret)
+{
+	struct ustack_sock *s;
+	int err;
+
+	err = ustack_new(vpninfo, IPPROTO_TCP, family, addr, port, &s);
+	if (err)
+		return err;
+
+	if (ubuf_init(&s->snd) || ubuf_init(&s->rcv)) {
+		ustack_free_sock(vpninfo, s);
+		return -ENOMEM;
+	}
+
+	openconnect_random(&s->iss, sizeof(s->iss));
+	s->snd_una = s->snd_nxt = s->snd_max = s->iss;
+	s->mss = vpninfo->ip_info.mtu - (family == AF_INET6 ? 60 : 40);
+	if (s->mss < 536)
+		s->mss = 536;
+	s->cwnd = s->mss;
+	s->ssthresh = USTACK_BUFSIZE;
+	s->rto = RTO_INITIAL;
+	s->state = UTCP_SYN_SENT;
+
+	tcp_output(vpninfo, s);
+	*ret = s;
+	return 0;
+}
+
+int ustack_udp_open(struct openconnect_info *vpninfo, int family,
+		    const void *addr, int port, struct ustack_sock **ret)
+{
+	return ustack_new(vpninfo, IPPROTO_UDP, family, addr, port, ret);
+}
+
+/* Returns a negative error, 0 while connecting, or 1 once connected */
+int ustack_connected(struct ustack_sock *s)
+{
+	if (s->error)
+		return -s->error;
+	return s->state != UTCP_SYN_SENT;
+}
+
+/* Space for ustack_send() to accept more data */
+int ustack_sndspace(struct ustack_sock *s)
+{
+	if (s->error || s->fin_queued)
+		return 0;
+	return USTACK_BUFSIZE - s->snd.len;
+}
+
+int ustack_send(struct openconnect_info *vpninfo, struct ustack_sock *s,
+		const void *buf, int len)
+{
+	unsigned char *uh;
+	struct pkt *pkt;
+
+	if (s->proto == IPPROTO_TCP) {
+		if (s->error)
+			return -s->error;
+		if (s->fin_queued)
+			return -EPIPE;
+		/* It goes out from ustack_mainloop() */
+		return ubuf_put(&s->snd, buf, len) ? : -EAGAIN;
+	}
+
+	if (vpninfo->outgoing_queue.count >= vpninfo->max_qlen)
+		return -EAGAIN;
+
+	pkt = ustack_alloc(vpninfo, s, 8 + len, &uh);
+	if (!pkt)
+		return -ENOMEM;
+
+	store_be16(uh, s->lport);
+	store_be16(uh + 2, s->rport);
+	store_be16(uh + 4, 8 + len);
+	store_be16(uh + 6, 0);
+	memcpy(uh + 8, buf, len);
+	store_be16(uh + 6, ntohs(l4_csum(s, uh, 8 + len)) ? : 0xffff);
+
+	ustack_queue(vpninfo, pkt);
+	return len;
+}
+
+/* Returns the number of bytes read, 0 at the end of the stream, or a
+ * negative error (-EAGAIN if there's nothing yet). */
+int ustack_recv(struct openconnect_info *vpninfo, struct ustack_sock *s,
+		void *buf, int len)
+{
+	struct pkt *pkt;
+	int n;
+
+	if (s->proto == IPPROTO_UDP) {
+		pkt = dequeue_packet(&s->udpq);
+		if (!pkt)
+			return -EAGAIN;
+		n = MIN(len, pkt->len);
+		memcpy(buf, pkt->data, n);
+		free_pkt(vpninfo, pkt);
+		return n;
+	}
+
+	if (!s->rcv.len) {
+		if (s->error)
+			return -s->error;
+		return s->fin_rcvd ? 0 : -EAGAIN;
+	}
+
+	n = MIN(len, s->rcv.len);
+	ubuf_peek(&s->rcv, 0, buf, n);
+	ubuf_drop(&s->rcv, n);
+
+	/* Tell the peer if the window has opened up significantly */
+	if (s->state == UTCP_ESTABLISHED && !s->fin_rcvd &&
+	    SEQ_GE(s->rcv_nxt + (rcv_window(s) << s->rcv_wscale),
+		   s->rcv_adv + MIN(USTACK_BUFSIZE / 4, 2 * s->mss)))
+		s->ack_pending = 1;
+
+	return n;
+}
+
+/* Send a FIN after whatever is still queued */
+void ustack_shutdown(struct ustack_sock *s)
+{
+	if (s->proto == IPPROTO_TCP)
+		s->fin_queued = 1;
+}
+
+/* Close gracefully. The socket lives on until its FIN is acknowledged */
+void ustack_close(struct openconnect_info *vpninfo, struct ustack_sock *s)
+{
+	if (s->proto == IPPROTO_TCP && s->state == UTCP_ESTABLISHED && !s->fin_acked) {
+		s->fin_queued = 1;
+		s->orphan = 1;
+		return;
+	}
+	ustack_free_sock(vpninfo, s);
+}
+
+void ustack_abort(struct openconnect_info *vpninfo, struct ustack_sock *s)
+{
+	if (s->proto == IPPROTO_TCP && s->state == UTCP_ESTABLISHED)
+		tcp_send(vpninfo, s, s->snd_max, UTCP_RST | UTCP_ACK, 0, 0);
+	ustack_free_sock(vpninfo, s);
+}
+
+/* Run TCP timers and send whatever can be sent. Returns 1 if anything
+ * was sent, and reduces *timeout to when the next timer expires. */
+int ustack_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct ustack_sock *s, *next;
+	int queued = vpninfo->outgoing_queue.count;
+	long long now = now_ms();
+
+	for (s = vpninfo->ustack->socks; s; s = next) {
+		next = s->next;
+
+		if (s->proto != IPPROTO_TCP)
+			continue;
+
+		tcp_timer(vpninfo, s, now);
+		tcp_output(vpninfo, s);
+
+		if (s->orphan && (s->fin_acked || s->state == UTCP_CLOSED)) {
+			ustack_free_sock(vpninfo, s);
+			continue;
+		}
+
+		if (s->rto_due) {
+			long long due = s->rto_due - now;
+
+			if (due < *timeout)
+				*timeout = due > 0 ? due : 0;
+		}
+	}
+
+	return vpninfo->outgoing_queue.count != queued;
+}
+
+int ustack_init(struct openconnect_info *vpninfo)
+{
+	struct ustack *us;
+	char buf[INET6_ADDRSTRLEN];
+	const char *addr6 = vpninfo->ip_info.addr6;
+
+	if (vpninfo->ustack)
+		return 0;
+
+	us = calloc(1, sizeof(*us));
+	if (!us)
+		return -ENOMEM;
+
+	if (vpninfo->ip_info.addr &&
+	    inet_pton(AF_INET, vpninfo->ip_info.addr, us->addr4) > 0)
+		us->have_addr4 = 1;
+
+	/* If there's no addr6, netmask6 is the address with a prefix length */
+	if (!addr6 && vpninfo->ip_info.netmask6) {
+		const char *slash = strchr(vpninfo->ip_info.netmask6, '/');
+		int len = slash ? slash - vpninfo->ip_info.netmask6 : (int)strlen(vpninfo->ip_info.netmask6);
+
+		if (len < sizeof(buf)) {
+			memcpy(buf, vpninfo->ip_info.netmask6, len);
+			buf[len] = 0;
+			addr6 = buf;
+		}
+	}
+	if (addr6 && inet_pton(AF_INET6, addr6, us->addr6) > 0)
+		us->have_addr6 = 1;
+
+	if (!us->have_addr4 && !us->have_addr6) {
+		free(us);
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("No IP address for userspace network stack\n"));
+		return -EADDRNOTAVAIL;
+	}
+
+	openconnect_random(&us->next_port, sizeof(us->next_port));
+	us->next_port = 49152 + us->next_port % 16384;
+	openconnect_random(&us->ip_id, sizeof(us->ip_id));
+	vpninfo->ustack = us;
+	return 0;
+}
+
+void ustack_free(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->ustack)
+		return;
+
+	while (vpninfo->ustack->socks)
+		ustack_free_sock(vpninfo, vpninfo->ustack->socks);
+	free(vpninfo->ustack);
+	vpninfo->ustack = NULL;
+}
@@ -406,9 +406,15 @@ static inline int process_ring(struct openconnect_info *vpninfo, int tx, uint64_
 					     (void *) &this->virtio.h,
 					     this->len + sizeof(this->virtio.h));
 
-			/* If the incoming queue fill up, pretend we can't see any more
+			/* If it's too big for the tunnel or outside the split includes,
+			 * an ICMP error goes back instead.
+			 * If the incoming queue fill up, pretend we can't see any more
 			 * by contracting our idea of 'used_idx' back to *this* one. */
-			if (queue_packet(&vpninfo->outgoing_queue, this) >= vpninfo->max_qlen)
+			if ((this->len > vpninfo->ip_info.mtu &&
+			     icmp_pkt_too_big(vpninfo, this, vpninfo->ip_info.mtu)) ||
+			    (vpninfo->split_filter && split_filter_drop(vpninfo, this)))
+				free_pkt(vpninfo, this);
+			else if (queue_packet(&vpninfo->outgoing_queue, this) >= vpninfo->max_qlen)
 				used_idx = ring->seen_used + 1;
 
 			did_work = 1;
@@ -448,7 +454,7 @@ static inline int process_ring(struct openconnect_info *vpninfo, int tx, uint64_
 			}
 			memset(&this->virtio.h, 0, sizeof(this->virtio.h));
 		} else {
-			int len = vpninfo->ip_info.mtu;
+			int len = MAX(vpninfo->ip_info.mtu, vpninfo->tun_mtu);
 			this = alloc_pkt(vpninfo, len + vpninfo->pkt_trailer);
 			if (!this)
 				break;
@@ -60,6 +60,19 @@ static char *fetch_and_trim(xmlNode *node)
 	return p;
 }
 
+static void add_candidate(struct gw_candidate **gws, int *nr, const char *url, int tier)
+{
+	struct gw_candidate *new = realloc(*gws, (*nr + 1) * sizeof(*new));
+
+	if (!new)
+		return;
+	*gws = new;
+	new[*nr].url = strdup(url);
+	new[*nr].tier = tier;
+	if (new[*nr].url)
+		(*nr)++;
+}
+
 int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 {
 	int i;
@@ -67,7 +80,9 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 	char *xmlfile;
 	unsigned char sha1[SHA1_SIZE];
 	xmlDocPtr xml_doc;
-	xmlNode *xml_node, *xml_node2;
+	xmlNode *xml_node, *xml_node2, *xml_node3;
+	struct gw_candidate *gws = NULL;
+	int nr_gws = 0;
 
 	if (!vpninfo->xmlconfig)
 		return 0;
@@ -136,8 +151,25 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 							    !openconnect_parse_url(vpninfo, content)) {
 								printf(_("Host \"%s\" has address \"%s\"\n"),
 								       host, content);
+								if (vpninfo->probe_gw)
+									add_candidate(&gws, &nr_gws, content, 0);
 							}
 							free(content);
+						} else if (match && vpninfo->probe_gw &&
+							   !strcmp((char *)xml_node2->name, "BackupServerList")) {
+							for (xml_node3 = xml_node2->children; xml_node3;
+							     xml_node3 = xml_node3->next) {
+								char *content;
+
+								if (xml_node3->type != XML_ELEMENT_NODE ||
+								    strcmp((char *)xml_node3->name, "HostAddress"))
+									continue;
+
+								content = fetch_and_trim(xml_node3);
+								if (content)
+									add_candidate(&gws, &nr_gws, content, 1);
+								free(content);
+							}
 						} else if (match &&
 							   !strcmp((char *)xml_node2->name, "UserGroup")) {
 							char *content = fetch_and_trim(xml_node2);
@@ -157,6 +189,17 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 	}
 	xmlFreeDoc(xml_doc);
 
+	/* The backups are only for when the primary doesn't answer. The
+	 * library probes them, when it's asked to connect. */
+	if (vpninfo->hostname && nr_gws > 1) {
+		vpninfo->gw_candidates = gws;
+		vpninfo->nr_gw_candidates = nr_gws;
+	} else {
+		for (i = 0; i < nr_gws; i++)
+			free((char *)gws[i].url);
+		free(gws);
+	}
+
 	if (!vpninfo->hostname) {
 		fprintf(stderr, _("Host \"%s\" not listed in config; treating as raw hostname\n"),
 			host);